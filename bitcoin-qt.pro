@@ -163,6 +163,7 @@ HEADERS += src/qt/bitcoingui.h \
     src/util.h \
     src/hash.h \
     src/uint256.h \
+    src/arith_uint256.h \
     src/serialize.h \
     src/main.h \
     src/net.h \
@@ -217,6 +218,8 @@ HEADERS += src/qt/bitcoingui.h \
     src/ui_interface.h \
     src/qt/rpcconsole.h \
     src/scrypt.h \
+    src/secp256k1.h \
+    src/sha256.h \
     src/version.h \
     src/netbase.h \
     src/clientversion.h \
@@ -298,6 +301,8 @@ SOURCES += src/qt/bitcoin.cpp \
     src/qt/paymentserver.cpp \
     src/qt/rpcconsole.cpp \
     src/scrypt.cpp \
+    src/secp256k1.cpp \
+    src/sha256.cpp \
     src/noui.cpp \
     src/leveldb.cpp \
     src/txdb.cpp \
@@ -345,6 +350,17 @@ gccsse2.output = $$PWD/build/${QMAKE_FILE_BASE}.o
 gccsse2.commands = $(CXX) -c $(CXXFLAGS) $(INCPATH) -o ${QMAKE_FILE_OUT} ${QMAKE_FILE_NAME} -msse2 -mstackrealign
 QMAKE_EXTRA_COMPILERS += gccsse2
 SOURCES_SSE2 += src/scrypt-sse2.cpp
+SOURCES_SSE2 += src/sha256-sse2.cpp
+}
+
+contains(USE_AVX2, 1) {
+DEFINES += USE_AVX2
+gccavx2.input  = SOURCES_AVX2
+gccavx2.output = $$PWD/build/${QMAKE_FILE_BASE}.o
+gccavx2.commands = $(CXX) -c $(CXXFLAGS) $(INCPATH) -o ${QMAKE_FILE_OUT} ${QMAKE_FILE_NAME} -mavx2 -mstackrealign
+QMAKE_EXTRA_COMPILERS += gccavx2
+SOURCES_AVX2 += src/scrypt-avx2.cpp
+SOURCES_AVX2 += src/sha256-avx2.cpp
 }
 
 # Todo: Remove this line when switching to Qt5, as that option was removed
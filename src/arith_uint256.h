@@ -0,0 +1,250 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_ARITH_UINT256_H
+#define BITCOIN_ARITH_UINT256_H
+
+#include "uint256.h"
+
+#include <stdexcept>
+
+/** Errors thrown by arith_uint256 */
+class uint_error : public std::runtime_error
+{
+public:
+    explicit uint_error(const std::string& str) : std::runtime_error(str) {}
+};
+
+/** 256-bit unsigned integer with the multiply, divide and compact ("nBits")
+ * conversions needed for proof-of-work targets and chain work.
+ * Unlike CBigNum it lives entirely on the stack and never calls into OpenSSL,
+ * so it is cheap enough to use on every block index entry.
+ */
+class arith_uint256 : public uint256
+{
+public:
+    arith_uint256()
+    {
+    }
+
+    arith_uint256(const basetype& b) : uint256(b)
+    {
+    }
+
+    arith_uint256(uint64 b) : uint256(b)
+    {
+    }
+
+    arith_uint256& operator=(const basetype& b)
+    {
+        uint256::operator=(b);
+        return *this;
+    }
+
+    arith_uint256& operator=(uint64 b)
+    {
+        uint256::operator=(b);
+        return *this;
+    }
+
+    arith_uint256& operator*=(uint32_t b32)
+    {
+        uint64 carry = 0;
+        for (int i = 0; i < WIDTH; i++)
+        {
+            uint64 n = carry + (uint64)b32 * pn[i];
+            pn[i] = n & 0xffffffff;
+            carry = n >> 32;
+        }
+        return *this;
+    }
+
+    arith_uint256& operator*=(const arith_uint256& b)
+    {
+        arith_uint256 a;
+        for (int j = 0; j < WIDTH; j++)
+        {
+            uint64 carry = 0;
+            for (int i = 0; i + j < WIDTH; i++)
+            {
+                uint64 n = carry + a.pn[i + j] + (uint64)pn[j] * b.pn[i];
+                a.pn[i + j] = n & 0xffffffff;
+                carry = n >> 32;
+            }
+        }
+        *this = a;
+        return *this;
+    }
+
+    arith_uint256& operator/=(const arith_uint256& b)
+    {
+        // Long division on 32-bit digits (Knuth, TAOCP vol. 2, 4.3.1,
+        // algorithm D). Block work divides by a target of 200+ bits, so the
+        // quotient is only a couple of digits and the outer loop runs once
+        // or twice instead of once per quotient bit.
+        int n = WIDTH;
+        while (n > 0 && b.pn[n - 1] == 0)
+            n--;
+        if (n == 0)
+            throw uint_error("arith_uint256 : division by zero");
+        int m = WIDTH;
+        while (m > 0 && pn[m - 1] == 0)
+            m--;
+        if (m < n)
+        {
+            *this = 0;
+            return *this;
+        }
+
+        uint32_t q[WIDTH] = {};
+        if (n == 1)
+        {
+            uint64 rem = 0;
+            for (int j = m - 1; j >= 0; j--)
+            {
+                uint64 cur = (rem << 32) | pn[j];
+                q[j] = (uint32_t)(cur / b.pn[0]);
+                rem = cur % b.pn[0];
+            }
+        }
+        else
+        {
+            // Normalize so the top divisor digit has its high bit set
+            int s = 0;
+            while (!(b.pn[n - 1] & (0x80000000U >> s)))
+                s++;
+            uint32_t vn[WIDTH];
+            uint32_t un[WIDTH + 1];
+            for (int i = n - 1; i > 0; i--)
+                vn[i] = (b.pn[i] << s) | (s ? b.pn[i - 1] >> (32 - s) : 0);
+            vn[0] = b.pn[0] << s;
+            un[m] = s ? pn[m - 1] >> (32 - s) : 0;
+            for (int i = m - 1; i > 0; i--)
+                un[i] = (pn[i] << s) | (s ? pn[i - 1] >> (32 - s) : 0);
+            un[0] = pn[0] << s;
+
+            for (int j = m - n; j >= 0; j--)
+            {
+                // Estimate the quotient digit from the top two digits, then correct it
+                uint64 num = ((uint64)un[j + n] << 32) | un[j + n - 1];
+                uint64 qhat = num / vn[n - 1];
+                uint64 rhat = num % vn[n - 1];
+                while (qhat >> 32 || qhat * vn[n - 2] > ((rhat << 32) | un[j + n - 2]))
+                {
+                    qhat--;
+                    rhat += vn[n - 1];
+                    if (rhat >> 32)
+                        break;
+                }
+
+                // Multiply and subtract
+                int64 borrow = 0;
+                int64 t;
+                for (int i = 0; i < n; i++)
+                {
+                    uint64 p = qhat * vn[i];
+                    t = (int64)un[i + j] - borrow - (int64)(p & 0xffffffff);
+                    un[i + j] = (uint32_t)t;
+                    borrow = (int64)(p >> 32) - (t >> 32);
+                }
+                t = (int64)un[j + n] - borrow;
+                un[j + n] = (uint32_t)t;
+
+                q[j] = (uint32_t)qhat;
+                if (t < 0)
+                {
+                    // Estimate was one too large, add the divisor back
+                    q[j]--;
+                    uint64 carry = 0;
+                    for (int i = 0; i < n; i++)
+                    {
+                        uint64 sum = (uint64)un[i + j] + vn[i] + carry;
+                        un[i + j] = (uint32_t)sum;
+                        carry = sum >> 32;
+                    }
+                    un[j + n] += (uint32_t)carry;
+                }
+            }
+        }
+
+        for (int i = 0; i < WIDTH; i++)
+            pn[i] = q[i];
+        return *this;
+    }
+
+    /** Position of the highest set bit plus one, or zero if the value is zero */
+    unsigned int bits() const
+    {
+        for (int pos = WIDTH - 1; pos >= 0; pos--)
+        {
+            if (pn[pos])
+            {
+                for (int nbits = 31; nbits > 0; nbits--)
+                {
+                    if (pn[pos] & (1U << nbits))
+                        return 32 * pos + nbits + 1;
+                }
+                return 32 * pos + 1;
+            }
+        }
+        return 0;
+    }
+
+    /** The "compact" format is a representation of a whole number N using an
+     * unsigned 32-bit number similar to a floating point format: the most
+     * significant 8 bits are the unsigned exponent of base 256, the next bit
+     * is the sign and the lower 23 bits are the mantissa.
+     * This is the same encoding CBigNum::SetCompact understands, except that
+     * a negative or out-of-range value is reported through the flags instead
+     * of being representable.
+     */
+    arith_uint256& SetCompact(unsigned int nCompact, bool *pfNegative = NULL, bool *pfOverflow = NULL)
+    {
+        int nSize = nCompact >> 24;
+        uint32_t nWord = nCompact & 0x007fffff;
+        if (nSize <= 3)
+        {
+            nWord >>= 8 * (3 - nSize);
+            *this = nWord;
+        }
+        else
+        {
+            *this = nWord;
+            *this <<= 8 * (nSize - 3);
+        }
+        if (pfNegative)
+            *pfNegative = nWord != 0 && (nCompact & 0x00800000) != 0;
+        if (pfOverflow)
+            *pfOverflow = nWord != 0 && ((nSize > 34) ||
+                                         (nWord > 0xff && nSize > 33) ||
+                                         (nWord > 0xffff && nSize > 32));
+        return *this;
+    }
+
+    unsigned int GetCompact(bool fNegative = false) const
+    {
+        int nSize = (bits() + 7) / 8;
+        unsigned int nCompact = 0;
+        if (nSize <= 3)
+            nCompact = Get64() << 8 * (3 - nSize);
+        else
+            nCompact = (*this >> 8 * (nSize - 3)).Get64();
+        // The 0x00800000 bit denotes the sign.
+        // Thus, if it is already set, divide the mantissa by 256 and increase the exponent.
+        if (nCompact & 0x00800000)
+        {
+            nCompact >>= 8;
+            nSize++;
+        }
+        nCompact |= nSize << 24;
+        nCompact |= (fNegative && (nCompact & 0x007fffff) ? 0x00800000 : 0);
+        return nCompact;
+    }
+};
+
+inline const arith_uint256 operator*(const arith_uint256& a, uint32_t b)             { return arith_uint256(a) *= b; }
+inline const arith_uint256 operator*(const arith_uint256& a, const arith_uint256& b) { return arith_uint256(a) *= b; }
+inline const arith_uint256 operator/(const arith_uint256& a, const arith_uint256& b) { return arith_uint256(a) /= b; }
+
+#endif
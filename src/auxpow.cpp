@@ -34,7 +34,124 @@ CAuxPow::CAuxPow(const CTransaction& txIn) : mMerkleTx(txIn)
     nChainIndex = 0;
 }
 
+void CAuxPow::SetParentBlock(const CBlock& parent)
+{
+    mMerkleTx = CMerkleTx(parent.vtx[0]);
+    mMerkleTx.hashBlock = parent.GetHash();
+    mMerkleTx.nIndex = 0;
+    mMerkleTx.vMerkleBranch = parent.GetMerkleBranch(0);
+    vParentBlockHeader.nVersion = parent.nVersion;
+    vParentBlockHeader.hashPrevBlock = parent.hashPrevBlock;
+    vParentBlockHeader.hashMerkleRoot = parent.hashMerkleRoot;
+    vParentBlockHeader.nTime = parent.nTime;
+    vParentBlockHeader.nBits = parent.nBits;
+    vParentBlockHeader.nNonce = parent.nNonce;
+}
+
+/** Successful CAuxPow::Check results, so that blocks read from disk again,
+ * or relayed to us twice, skip the merkle branches and coinbase scans.
+ * Entries are keyed by aux block hash and parent header hash, and a hit
+ * also needs the same parent coinbase, branches and chain id.
+ */
+class CAuxPowCache
+{
+private:
+    typedef std::pair<uint256, uint256> key_type;
+    struct CEntry
+    {
+        uint256 hashCoinbase;
+        std::vector<uint256> vMerkleBranch;
+        std::vector<uint256> vChainMerkleBranch;
+        int nChainIndex;
+        int nChainID;
+    };
+    std::map<key_type, CEntry> mapValid;
+    CCriticalSection cs;
+    uint64 nHits;
+    uint64 nMisses;
+
+public:
+    CAuxPowCache()
+    {
+        nHits = 0;
+        nMisses = 0;
+    }
+
+    bool Get(const CAuxPow& auxpow, const key_type& key, const uint256& hashCoinbase, int nChainID)
+    {
+        LOCK(cs);
+        std::map<key_type, CEntry>::const_iterator mi = mapValid.find(key);
+        if (mi != mapValid.end() &&
+            mi->second.hashCoinbase == hashCoinbase &&
+            mi->second.vMerkleBranch == auxpow.mMerkleTx.vMerkleBranch &&
+            mi->second.vChainMerkleBranch == auxpow.vChainMerkleBranch &&
+            mi->second.nChainIndex == auxpow.nChainIndex &&
+            mi->second.nChainID == nChainID &&
+            auxpow.mMerkleTx.nIndex == 0)
+        {
+            nHits++;
+            return true;
+        }
+        nMisses++;
+        return false;
+    }
+
+    void Set(const CAuxPow& auxpow, const key_type& key, const uint256& hashCoinbase, int nChainID)
+    {
+        // An entry is a few hundred bytes with its branches; 10,000 of them
+        // covers more than a month of blocks
+        int64 nMaxCacheSize = GetArg("-maxauxpowcachesize", 10000);
+        if (nMaxCacheSize <= 0) return;
+
+        LOCK(cs);
+
+        while (static_cast<int64>(mapValid.size()) >= nMaxCacheSize)
+        {
+            // Evict a random entry, like the signature cache does
+            std::map<key_type, CEntry>::iterator it =
+                mapValid.lower_bound(key_type(GetRandHash(), 0));
+            if (it == mapValid.end())
+                it = mapValid.begin();
+            mapValid.erase(it);
+        }
+
+        CEntry& entry = mapValid[key];
+        entry.hashCoinbase = hashCoinbase;
+        entry.vMerkleBranch = auxpow.mMerkleTx.vMerkleBranch;
+        entry.vChainMerkleBranch = auxpow.vChainMerkleBranch;
+        entry.nChainIndex = auxpow.nChainIndex;
+        entry.nChainID = nChainID;
+    }
+
+    void GetStats(uint64& nHitsRet, uint64& nMissesRet, uint64& nEntriesRet)
+    {
+        LOCK(cs);
+        nHitsRet = nHits;
+        nMissesRet = nMisses;
+        nEntriesRet = mapValid.size();
+    }
+};
+
+static CAuxPowCache auxPowCache;
+
+void GetAuxPowCacheStats(uint64& nHits, uint64& nMisses, uint64& nEntries)
+{
+    auxPowCache.GetStats(nHits, nMisses, nEntries);
+}
+
 bool CAuxPow::Check(uint256 hashAuxBlock, int nChainID) const
+{
+    std::pair<uint256, uint256> key(hashAuxBlock, vParentBlockHeader.GetHash());
+    uint256 hashCoinbase = mMerkleTx.GetHash();
+    if (auxPowCache.Get(*this, key, hashCoinbase, nChainID))
+        return true;
+    if (!CheckUncached(hashAuxBlock, hashCoinbase, nChainID))
+        return false;
+    auxPowCache.Set(*this, key, hashCoinbase, nChainID);
+    return true;
+}
+
+bool CAuxPow::CheckUncached(const uint256& hashAuxBlock, const uint256& hashCoinbase, int nChainID) const
 {
     if (mMerkleTx.nIndex != 0)
         return error("AuxPow is not a generate");
@@ -51,7 +168,7 @@ bool CAuxPow::Check(uint256 hashAuxBlock, int nChainID) const
     std::reverse(vchRootHash.begin(), vchRootHash.end()); // correct endian
 
     // Check that we are in the parent block merkle tree
-    if (CBlock::CheckMerkleBranch(mMerkleTx.GetHash(), mMerkleTx.vMerkleBranch, mMerkleTx.nIndex) != vParentBlockHeader.hashMerkleRoot)
+    if (CBlock::CheckMerkleBranch(hashCoinbase, mMerkleTx.vMerkleBranch, mMerkleTx.nIndex) != vParentBlockHeader.hashMerkleRoot)
         return error("Aux POW merkle root incorrect");
 
     const CScript script = mMerkleTx.vin[0].scriptSig;
@@ -104,6 +221,28 @@ bool CAuxPow::Check(uint256 hashAuxBlock, int nChainID) const
     int nNonce;
     memcpy(&nNonce, &pc[4], 4);
 
+    if (nChainIndex != GetAuxChainSlot(nChainID, nNonce, nSize))
+        return error("Aux POW wrong index");
+
+    return true;
+}
+
+uint256 CAuxPow::GetPoWHash(int algo) const
+{
+    if ( CBlockHeader::BLOCK_ALGO_SCRYPT == algo )
+    {
+        uint256 thash;
+        scrypt_1024_1_1_256(BEGIN(vParentBlockHeader.nVersion), BEGIN(thash));
+        return thash;
+    }
+    else
+    {
+        return vParentBlockHeader.GetHash();
+    }
+}
+
+int GetAuxChainSlot(int nChainID, int nNonce, int nSize)
+{
     // Choose a pseudo-random slot in the chain merkle tree
     // but have it be fixed for a size/nonce/chain combination.
     //
@@ -115,30 +254,173 @@ bool CAuxPow::Check(uint256 hashAuxBlock, int nChainID) const
     rand += nChainID;
     rand = rand * 1103515245 + 12345;
 
-    if (nChainIndex != (rand % nSize))
-        return error("Aux POW wrong index");
+    // nSize is a power of two no larger than 2^30, so the slot fits an int
+    return (int)(rand % (unsigned int)nSize);
+}
+
+bool CAuxMerkleTree::Build(const map<int, uint256>& mapChainsIn)
+{
+    mapChains = mapChainsIn;
+    nSize = 0;
+    nNonce = 0;
+    vTree.clear();
+    if (mapChains.empty())
+        return false;
 
+    // Grow the tree until some nonce spreads the chains over distinct slots.
+    // Doubling the size leaves at least half the slots free, so a few
+    // hundred nonces are plenty once the tree is large enough.
+    unsigned int nDepth = 0;
+    while ((1U << nDepth) < mapChains.size())
+        nDepth++;
+    for (; nDepth <= MAX_DEPTH && IsNull(); nDepth++)
+    {
+        for (int nTry = 0; nTry < 1000; nTry++)
+        {
+            set<int> setSlots;
+            BOOST_FOREACH(const PAIRTYPE(int, uint256)& item, mapChains)
+                if (!setSlots.insert(GetAuxChainSlot(item.first, nTry, 1 << nDepth)).second)
+                    break;
+            if (setSlots.size() == mapChains.size())
+            {
+                nSize = 1 << nDepth;
+                nNonce = nTry;
+                break;
+            }
+        }
+    }
+    if (IsNull())
+        return error("CAuxMerkleTree::Build() : no slot assignment for %"PRIszu" chains", mapChains.size());
+
+    // Leaves first, then each level up to the root, like CBlock::vMerkleTree.
+    // Unused slots hold zero.
+    vTree.assign(nSize, 0);
+    BOOST_FOREACH(const PAIRTYPE(int, uint256)& item, mapChains)
+        vTree[GetAuxChainSlot(item.first, nNonce, nSize)] = item.second;
+    int j = 0;
+    for (int nLevelSize = nSize; nLevelSize > 1; nLevelSize /= 2)
+    {
+        for (int i = 0; i < nLevelSize; i += 2)
+            vTree.push_back(Hash(BEGIN(vTree[j+i]),  END(vTree[j+i]),
+                                 BEGIN(vTree[j+i+1]), END(vTree[j+i+1])));
+        j += nLevelSize;
+    }
     return true;
 }
 
-uint256 CAuxPow::GetPoWHash(int algo) const
+vector<uint256> CAuxMerkleTree::GetMerkleBranch(int nChainID) const
 {
-    if ( CBlockHeader::BLOCK_ALGO_SCRYPT == algo )
+    vector<uint256> vMerkleBranch;
+    int nIndex = GetAuxChainSlot(nChainID, nNonce, nSize);
+    int j = 0;
+    for (int nLevelSize = nSize; nLevelSize > 1; nLevelSize /= 2)
     {
-        uint256 thash;
-        scrypt_1024_1_1_256(BEGIN(vParentBlockHeader.nVersion), BEGIN(thash));
-        return thash;
+        vMerkleBranch.push_back(vTree[j + (nIndex^1)]);
+        nIndex >>= 1;
+        j += nLevelSize;
     }
-    else
+    return vMerkleBranch;
+}
+
+vector<unsigned char> CAuxMerkleTree::GetCoinbaseCommitment() const
+{
+    uint256 hashRoot = GetRoot();
+    vector<unsigned char> vch(hashRoot.begin(), hashRoot.end());
+    std::reverse(vch.begin(), vch.end());
+    vch.insert(vch.end(), BEGIN(nSize), END(nSize));
+    vch.insert(vch.end(), BEGIN(nNonce), END(nNonce));
+    return vch;
+}
+
+CAuxChainRegistry auxChains;
+
+void CAuxChainRegistry::SetChain(int nChainID, const uint256& hash)
+{
+    LOCK(cs);
+    mapChains[nChainID] = hash;
+}
+
+bool CAuxChainRegistry::RemoveChain(int nChainID)
+{
+    LOCK(cs);
+    return mapChains.erase(nChainID) > 0;
+}
+
+map<int, uint256> CAuxChainRegistry::GetChains() const
+{
+    LOCK(cs);
+    return mapChains;
+}
+
+bool CAuxChainRegistry::IsEmpty() const
+{
+    LOCK(cs);
+    return mapChains.empty();
+}
+
+CAuxMerkleTree CAuxChainRegistry::CreateTree(const map<int, uint256>& mapExtra) const
+{
+    map<int, uint256> mapTreeChains = GetChains();
+    BOOST_FOREACH(const PAIRTYPE(int, uint256)& item, mapExtra)
+        mapTreeChains[item.first] = item.second;
+
+    CAuxMerkleTree tree;
+    tree.Build(mapTreeChains);
+    return tree;
+}
+
+void CAuxChainRegistry::AddRecentTree(const CAuxMerkleTree& tree)
+{
+    if (tree.IsNull())
+        return;
+    LOCK(cs);
+    uint256 hashRoot = tree.GetRoot();
+    if (mapTrees.count(hashRoot))
+        return;
+    mapTrees[hashRoot] = tree;
+    listTrees.push_back(hashRoot);
+    if (listTrees.size() > MAX_RECENT_TREES)
     {
-        return vParentBlockHeader.GetHash();
+        mapTrees.erase(listTrees.front());
+        listTrees.pop_front();
     }
 }
 
+bool CAuxChainRegistry::SetChainMerkleBranch(CAuxPow& auxpow, int nChainID) const
+{
+    if (auxpow.mMerkleTx.vin.empty())
+        return false;
+
+    // Find the chain merkle root after the merged mining header
+    const CScript& script = auxpow.mMerkleTx.vin[0].scriptSig;
+    CScript::const_iterator pc =
+        std::search(script.begin(), script.end(), UBEGIN(pchMergedMiningHeader), UEND(pchMergedMiningHeader));
+    if (script.end() - pc < (int)sizeof(pchMergedMiningHeader) + 32)
+        return false;
+    pc += sizeof(pchMergedMiningHeader);
+    vector<unsigned char> vchRootHash(pc, pc + 32);
+    std::reverse(vchRootHash.begin(), vchRootHash.end());
+    uint256 hashRoot(vchRootHash);
+
+    LOCK(cs);
+    map<uint256, CAuxMerkleTree>::const_iterator mi = mapTrees.find(hashRoot);
+    if (mi == mapTrees.end() || !mi->second.mapChains.count(nChainID))
+        return false;
+    const CAuxMerkleTree& tree = mi->second;
+    auxpow.vChainMerkleBranch = tree.GetMerkleBranch(nChainID);
+    auxpow.nChainIndex = GetAuxChainSlot(nChainID, tree.nNonce, tree.nSize);
+    return true;
+}
+
+void AddMergedMiningHeader(vector<unsigned char>& vchAux)
+{
+    vchAux.insert(vchAux.begin(), UBEGIN(pchMergedMiningHeader), UEND(pchMergedMiningHeader));
+}
+
 CScript MakeCoinbaseWithAux(unsigned int nBits, unsigned int nExtraNonce, vector<unsigned char>& vchAux)
 {
-    vector<unsigned char> vchAuxWithHeader(UBEGIN(pchMergedMiningHeader), UEND(pchMergedMiningHeader));
-    vchAuxWithHeader.insert(vchAuxWithHeader.end(), vchAux.begin(), vchAux.end());
+    vector<unsigned char> vchAuxWithHeader(vchAux);
+    AddMergedMiningHeader(vchAuxWithHeader);
 
     // Push OP_2 just in case we want versioning later
     return CScript() << nBits << nExtraNonce << OP_2 << vchAuxWithHeader;
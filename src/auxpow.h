@@ -1,15 +1,15 @@
-// Copyright (c) 2009-2010 Satoshi Nakamoto
-// Distributed under the MIT/X11 software license, see the accompanying
-// file license.txt or http://www.opensource.org/licenses/mit-license.php.
-#ifndef BITCOIN_AUXPOW_H
-#define BITCOIN_AUXPOW_H
-
-#include "main.h"
-
-class CParentBlockHeader
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_AUXPOW_H
+#define BITCOIN_AUXPOW_H
+
+#include "main.h"
+
+class CParentBlockHeader
 {
 public:
-    // header
+    // header
     static const int CURRENT_VERSION=2;
     int nVersion;
     uint256 hashPrevBlock;
@@ -17,8 +17,8 @@ public:
     unsigned int nTime;
     unsigned int nBits;
     unsigned int nNonce;
-
-    CParentBlockHeader()
+
+    CParentBlockHeader()
     {
         SetNull();
     }
@@ -32,116 +32,203 @@ public:
         READWRITE(nTime);
         READWRITE(nBits);
         READWRITE(nNonce);
-    )
+    )
 
     void SetNull()
     {
-        nVersion = CParentBlockHeader::CURRENT_VERSION;
+        nVersion = CParentBlockHeader::CURRENT_VERSION;
         hashPrevBlock = 0;
         hashMerkleRoot = 0;
         nTime = 0;
         nBits = 0;
         nNonce = 0;
-    }
+    }
 
     bool IsNull() const
     {
-        return (nTime == 0);
+        return (nTime == 0);
     }
 
     uint256 GetHash() const
     {
-        return Hash(BEGIN(nVersion), END(nNonce));
+        return Hash(BEGIN(nVersion), END(nNonce));
     }
-};
-
-
-class CAuxPow
-{
-public:
-    CMerkleTx mMerkleTx;
-    // Merkle branch with root vchAux
-    // root must be present inside the coinbase
-    std::vector<uint256> vChainMerkleBranch;
-    // Index of chain in chains merkle tree
-    int nChainIndex;
-    CParentBlockHeader vParentBlockHeader;
-
-    CAuxPow();
-    CAuxPow(const CTransaction& txIn);
-    
-    bool Check(uint256 hashAuxBlock, int nChainID) const;
-    
+};
+
+
+class CAuxPow
+{
+public:
+    CMerkleTx mMerkleTx;
+    // Merkle branch with root vchAux
+    // root must be present inside the coinbase
+    std::vector<uint256> vChainMerkleBranch;
+    // Index of chain in chains merkle tree
+    int nChainIndex;
+    CParentBlockHeader vParentBlockHeader;
+
+    CAuxPow();
+    CAuxPow(const CTransaction& txIn);
+
+    // Take the coinbase and header of a solved parent block
+    void SetParentBlock(const CBlock& parent);
+    
+    // Results are cached, see CAuxPowCache
+    bool Check(uint256 hashAuxBlock, int nChainID) const;
+    bool CheckUncached(const uint256& hashAuxBlock, const uint256& hashCoinbase, int nChainID) const;
+    
     bool IsNull() const
     {
-        return vParentBlockHeader.IsNull();
+        return vParentBlockHeader.IsNull();
+    }
+
+    uint256 GetParentBlockHash()
+    {
+        return vParentBlockHeader.GetHash();
     }
-
-    uint256 GetParentBlockHash()
-    {
-        return vParentBlockHeader.GetHash();
-    }
-
-    uint256 GetPoWHash(int algo) const;
-    
-    void print() const
-    {
-        printf("CAuxPow(version = %d, hash=%s, hashPrevBlock=%s, hashMerkleRoot=%s, nTime=%u, nBits=%08x, nNonce=%u)\n", 
-            vParentBlockHeader.nVersion, vParentBlockHeader.GetHash().ToString().c_str(),
-            vParentBlockHeader.hashPrevBlock.ToString().c_str(),
-            vParentBlockHeader.hashMerkleRoot.ToString().c_str(),
-            vParentBlockHeader.nTime, vParentBlockHeader.nBits, vParentBlockHeader.nNonce
-            );
-    }
-
-    IMPLEMENT_SERIALIZE
-    (
-        READWRITE(mMerkleTx);
-        READWRITE(vChainMerkleBranch);
-        READWRITE(nChainIndex);
-        READWRITE(vParentBlockHeader);
-    )
-
-};
-
-template <typename Stream>
-int ReadWriteAuxPow(Stream& s, const boost::shared_ptr<CAuxPow>& auxpow, int nType, int nVersion, CSerActionGetSerializeSize ser_action)
-{
-    if (nVersion & (1 << 8))
-    {
-        return ::GetSerializeSize(*auxpow, nType, nVersion);
-    }
-    return 0;
-}
-
-template <typename Stream>
-int ReadWriteAuxPow(Stream& s, const boost::shared_ptr<CAuxPow>& auxpow, int nType, int nVersion, CSerActionSerialize ser_action)
-{
-    if (nVersion & (1 << 8))
-    {
-        return SerReadWrite(s, *auxpow, nType, nVersion, ser_action);
-    }
-    return 0;
-}
-
-template <typename Stream>
-int ReadWriteAuxPow(Stream& s, boost::shared_ptr<CAuxPow>& auxpow, int nType, int nVersion, CSerActionUnserialize ser_action)
-{
-    if (nVersion & (1 << 8))
-    {
-        auxpow.reset(new CAuxPow());
-        return SerReadWrite(s, *auxpow, nType, nVersion, ser_action);
-    }
-    else
-    {
-        auxpow.reset();
-        return 0;
-    }
-}
-
-extern void RemoveMergedMiningHeader(std::vector<unsigned char>& vchAux);
-extern CScript MakeCoinbaseWithAux(unsigned int nBits, unsigned int nExtraNonce, std::vector<unsigned char>& vchAux);
-extern void IncrementExtraNonceWithAux(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce, int64& nPrevTime, std::vector<unsigned char>& vchAux);
-#endif
-
-
+
+    uint256 GetPoWHash(int algo) const;
+    
+    void print() const
+    {
+        printf("CAuxPow(version = %d, hash=%s, hashPrevBlock=%s, hashMerkleRoot=%s, nTime=%u, nBits=%08x, nNonce=%u)\n", 
+            vParentBlockHeader.nVersion, vParentBlockHeader.GetHash().ToString().c_str(),
+            vParentBlockHeader.hashPrevBlock.ToString().c_str(),
+            vParentBlockHeader.hashMerkleRoot.ToString().c_str(),
+            vParentBlockHeader.nTime, vParentBlockHeader.nBits, vParentBlockHeader.nNonce
+            );
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(mMerkleTx);
+        READWRITE(vChainMerkleBranch);
+        READWRITE(nChainIndex);
+        READWRITE(vParentBlockHeader);
+    )
+
+};
+
+template <typename Stream>
+int ReadWriteAuxPow(Stream& s, const boost::shared_ptr<CAuxPow>& auxpow, int nType, int nVersion, CSerActionGetSerializeSize ser_action)
+{
+    if (nVersion & (1 << 8))
+    {
+        return ::GetSerializeSize(*auxpow, nType, nVersion);
+    }
+    return 0;
+}
+
+template <typename Stream>
+int ReadWriteAuxPow(Stream& s, const boost::shared_ptr<CAuxPow>& auxpow, int nType, int nVersion, CSerActionSerialize ser_action)
+{
+    if (nVersion & (1 << 8))
+    {
+        return SerReadWrite(s, *auxpow, nType, nVersion, ser_action);
+    }
+    return 0;
+}
+
+template <typename Stream>
+int ReadWriteAuxPow(Stream& s, boost::shared_ptr<CAuxPow>& auxpow, int nType, int nVersion, CSerActionUnserialize ser_action)
+{
+    if (nVersion & (1 << 8))
+    {
+        auxpow.reset(new CAuxPow());
+        return SerReadWrite(s, *auxpow, nType, nVersion, ser_action);
+    }
+    else
+    {
+        auxpow.reset();
+        return 0;
+    }
+}
+
+/** Hits, misses and size of the cache of successful CAuxPow::Check results */
+void GetAuxPowCacheStats(uint64& nHits, uint64& nMisses, uint64& nEntries);
+
+/** Slot of a chain in a chain merkle tree of nSize leaves, as CAuxPow::Check expects it */
+int GetAuxChainSlot(int nChainID, int nNonce, int nSize);
+
+/** Chain merkle tree committing to the block hashes of several aux chains.
+ * The coinbase of a parent block carries its root, size and nonce, and each
+ * chain proves its block hash with the branch to its slot.
+ */
+class CAuxMerkleTree
+{
+public:
+    // Longest chain merkle branch CAuxPow::Check accepts
+    static const unsigned int MAX_DEPTH = 30;
+
+    int nSize;
+    int nNonce;
+    std::map<int, uint256> mapChains;
+    // memory only
+    std::vector<uint256> vTree;
+
+    CAuxMerkleTree()
+    {
+        nSize = 0;
+        nNonce = 0;
+    }
+
+    // Pick the smallest tree and a nonce that give every chain its own slot
+    bool Build(const std::map<int, uint256>& mapChainsIn);
+
+    bool IsNull() const
+    {
+        return nSize == 0;
+    }
+
+    uint256 GetRoot() const
+    {
+        return vTree.empty() ? 0 : vTree.back();
+    }
+
+    std::vector<uint256> GetMerkleBranch(int nChainID) const;
+
+    // Root, size and nonce in the layout the parent coinbase carries after
+    // the merged mining header
+    std::vector<unsigned char> GetCoinbaseCommitment() const;
+};
+
+/** Aux chains this node is the merged mining parent of. Mining code builds
+ * its coinbase from CreateTree, and keeps the trees of work handed out or
+ * solved with AddRecentTree, so proofs can be made once a parent is found.
+ */
+class CAuxChainRegistry
+{
+private:
+    // Trees kept for SetChainMerkleBranch
+    static const unsigned int MAX_RECENT_TREES = 64;
+
+    mutable CCriticalSection cs;
+    std::map<int, uint256> mapChains;
+    std::map<uint256, CAuxMerkleTree> mapTrees;
+    std::list<uint256> listTrees;
+
+public:
+    // Register a chain or refresh its block hash
+    void SetChain(int nChainID, const uint256& hash);
+    bool RemoveChain(int nChainID);
+    std::map<int, uint256> GetChains() const;
+    bool IsEmpty() const;
+
+    // Tree over the registered chains plus mapExtra, which overrides them
+    CAuxMerkleTree CreateTree(const std::map<int, uint256>& mapExtra = std::map<int, uint256>()) const;
+    void AddRecentTree(const CAuxMerkleTree& tree);
+
+    // Complete the merged mining proof of nChainID from an auxpow whose parent
+    // coinbase commits to one of the recent trees
+    bool SetChainMerkleBranch(CAuxPow& auxpow, int nChainID) const;
+};
+
+extern CAuxChainRegistry auxChains;
+
+extern void RemoveMergedMiningHeader(std::vector<unsigned char>& vchAux);
+extern void AddMergedMiningHeader(std::vector<unsigned char>& vchAux);
+extern CScript MakeCoinbaseWithAux(unsigned int nBits, unsigned int nExtraNonce, std::vector<unsigned char>& vchAux);
+extern void IncrementExtraNonceWithAux(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce, int64& nPrevTime, std::vector<unsigned char>& vchAux);
+#endif
+
+
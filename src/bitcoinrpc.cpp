@@ -36,6 +36,7 @@ static std::string strRPCUserColonPass;
 static asio::io_service* rpc_io_service = NULL;
 static ssl::context* rpc_ssl_context = NULL;
 static boost::thread_group* rpc_worker_group = NULL;
+static CSemaphore* semRPCWait = NULL;
 
 static inline unsigned short GetDefaultRPCPort()
 {
@@ -250,7 +251,7 @@ static const CRPCCommand vRPCCommands[] =
     { "getworkex",              &getworkex,              true,      false,      true },
     { "listaccounts",           &listaccounts,           false,     false,      true },
     { "settxfee",               &settxfee,               false,     false,      true },
-    { "getblocktemplate",       &getblocktemplate,       true,      false,      false },
+    { "getblocktemplate",       &getblocktemplate,       true,      true,       false },
     { "submitblock",            &submitblock,            false,     false,      false },
     { "setmininput",            &setmininput,            false,     false,      false },
     { "listsinceblock",         &listsinceblock,         false,     false,      true },
@@ -263,12 +264,17 @@ static const CRPCCommand vRPCCommands[] =
     { "signrawtransaction",     &signrawtransaction,     false,     false,      false },
     { "sendrawtransaction",     &sendrawtransaction,     false,     false,      false },
     { "gettxoutsetinfo",        &gettxoutsetinfo,        true,      false,      false },
+    { "getsigcacheinfo",        &getsigcacheinfo,        true,      true,       false },
     { "gettxout",               &gettxout,               true,      false,      false },
     { "lockunspent",            &lockunspent,            false,     false,      true },
     { "listlockunspent",        &listlockunspent,        false,     false,      true },
     { "verifychain",            &verifychain,            true,      false,      false },
-    { "getauxblock",                &getauxblock,    true,      false,      true },
+    { "getauxblock",                &getauxblock,    true,      true,       true },
+    { "setauxchain",            &setauxchain,            true,      true,       false },
+    { "getauxchainproof",       &getauxchainproof,       true,      false,      false },
     { "getadlist",            &getadlist,            false,      false,      false },
+    { "listsmalldata",        &listsmalldata,        false,      true,       false },
+    { "waitsmalldata",        &waitsmalldata,        true,       true,       false },
 };
 
 CRPCTable::CRPCTable()
@@ -846,6 +852,7 @@ void StartRPCThreads()
         return;
     }
 
+    semRPCWait = new CSemaphore(std::max((int)GetArg("-rpcthreads", 4) - 1, 0));
     rpc_worker_group = new boost::thread_group();
     for (int i = 0; i < GetArg("-rpcthreads", 4); i++)
         rpc_worker_group->create_thread(boost::bind(&asio::io_service::run, rpc_io_service));
@@ -858,10 +865,20 @@ void StopRPCThreads()
     rpc_io_service->stop();
     rpc_worker_group->join_all();
     delete rpc_worker_group; rpc_worker_group = NULL;
+    delete semRPCWait; semRPCWait = NULL;
     delete rpc_ssl_context; rpc_ssl_context = NULL;
     delete rpc_io_service; rpc_io_service = NULL;
 }
 
+bool TryAcquireRPCWaitSlot(CSemaphoreGrant& grant)
+{
+    if (semRPCWait == NULL)
+        return false;
+    CSemaphoreGrant grantNew(*semRPCWait, true);
+    grantNew.MoveTo(grant);
+    return grant;
+}
+
 class JSONRequest
 {
 public:
@@ -1179,7 +1196,18 @@ Array RPCConvertValues(const std::string &strMethod, const std::vector<std::stri
     if (strMethod == "listaccounts"           && n > 0) ConvertTo<boost::int64_t>(params[0]);
     if (strMethod == "walletpassphrase"       && n > 1) ConvertTo<boost::int64_t>(params[1]);
     if (strMethod == "getblocktemplate"       && n > 0) ConvertTo<Object>(params[0]);
+    if (strMethod == "getauxblock"            && n > 1 && strParams[1].substr(0, 1) == "{") ConvertTo<Object>(params[1]);
+    if (strMethod == "setauxchain"            && n > 0) ConvertTo<boost::int64_t>(params[0]);
+    if (strMethod == "getauxchainproof"       && n > 1) ConvertTo<boost::int64_t>(params[1]);
     if (strMethod == "listsinceblock"         && n > 1) ConvertTo<boost::int64_t>(params[1]);
+    if (strMethod == "getadlist"              && n > 0) ConvertTo<boost::int64_t>(params[0]);
+    if (strMethod == "listsmalldata"          && n > 0) ConvertTo<boost::int64_t>(params[0]);
+    if (strMethod == "listsmalldata"          && n > 1) ConvertTo<boost::int64_t>(params[1]);
+    if (strMethod == "listsmalldata"          && n > 3) ConvertTo<boost::int64_t>(params[3]);
+    if (strMethod == "listsmalldata"          && n > 4) ConvertTo<boost::int64_t>(params[4]);
+    if (strMethod == "waitsmalldata"          && n > 0) ConvertTo<boost::int64_t>(params[0]);
+    if (strMethod == "waitsmalldata"          && n > 1) ConvertTo<boost::int64_t>(params[1]);
+    if (strMethod == "waitsmalldata"          && n > 2) ConvertTo<boost::int64_t>(params[2]);
     if (strMethod == "sendmany"               && n > 1) ConvertTo<Object>(params[1]);
     if (strMethod == "sendmany"               && n > 2) ConvertTo<boost::int64_t>(params[2]);
     if (strMethod == "addmultisigaddress"     && n > 0) ConvertTo<boost::int64_t>(params[0]);
@@ -12,6 +12,7 @@
 
 class CBlockIndex;
 class CReserveKey;
+class CSemaphoreGrant;
 
 #include "json/json_spirit_reader_template.h"
 #include "json/json_spirit_writer_template.h"
@@ -72,6 +73,11 @@ void StartRPCThreads();
 void StopRPCThreads();
 int CommandLineRPC(int argc, char *argv[]);
 
+/** Take one of the -rpcthreads minus one slots for calls that wait for an event
+ * (long polling, waitsmalldata), so there is always a worker left for ordinary
+ * requests. Returns false when all are taken; the call should not wait then. */
+bool TryAcquireRPCWaitSlot(CSemaphoreGrant& grant);
+
 /** Convert parameter values for RPC call from strings to command-specific JSON objects. */
 json_spirit::Array RPCConvertValues(const std::string &strMethod, const std::vector<std::string> &strParams);
 
@@ -127,6 +133,7 @@ extern const CRPCTable tableRPC;
 
 extern void InitRPCMining();
 extern void ShutdownRPCMining();
+extern void InterruptRPCMining();
 
 extern int64 nWalletUnlockTime;
 extern int64 AmountFromValue(const json_spirit::Value& value);
@@ -156,6 +163,8 @@ extern json_spirit::Value getwork(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getblocktemplate(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value submitblock(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getauxblock(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value setauxchain(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getauxchainproof(const json_spirit::Array& params, bool fHelp);
     
 extern json_spirit::Value getnewaddress(const json_spirit::Array& params, bool fHelp); // in rpcwallet.cpp
 extern json_spirit::Value getaccountaddress(const json_spirit::Array& params, bool fHelp);
@@ -207,9 +216,12 @@ extern json_spirit::Value getrawmempool(const json_spirit::Array& params, bool f
 extern json_spirit::Value getblockhash(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getblock(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value gettxoutsetinfo(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getsigcacheinfo(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value gettxout(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value verifychain(const json_spirit::Array& params, bool fHelp);
 
 extern json_spirit::Value getadlist(const json_spirit::Array& params, bool fHelp); // in rpcdump.cpp
+extern json_spirit::Value listsmalldata(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value waitsmalldata(const json_spirit::Array& params, bool fHelp);
 
 #endif
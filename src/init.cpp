@@ -11,6 +11,7 @@
 #include "util.h"
 #include "ui_interface.h"
 #include "smalldata.h"
+#include "sha256.h"
 
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
@@ -109,13 +110,14 @@ void Shutdown()
 
     RenameThread("bitcoin-shutoff");
     nTransactionsUpdated++;
+    InterruptRPCMining();
+    smallDataEvents.Interrupt();
     StopRPCThreads();
     ShutdownRPCMining();
     if (pwalletMain)
         bitdb.Flush(false);
     GenerateBitcoins(false, NULL);
     StopNode();
-    adManager.save();
     {
         LOCK(cs_main);
         if (pwalletMain)
@@ -124,6 +126,7 @@ void Shutdown()
             pblocktree->Flush();
         if (pcoinsTip)
             pcoinsTip->Flush();
+        adManager.save();
         delete pcoinsTip; pcoinsTip = NULL;
         delete pcoinsdbview; pcoinsdbview = NULL;
         delete pblocktree; pblocktree = NULL;
@@ -380,9 +383,16 @@ std::string HelpMessage()
         "  -checkblocks=<n>       " + _("How many blocks to check at startup (default: 288, 0 = all)") + "\n" +
         "  -checklevel=<n>        " + _("How thorough the block verification is (0-4, default: 3)") + "\n" +
         "  -txindex               " + _("Maintain a full transaction index (default: 0)") + "\n" +
+        "  -smalldataindex        " + _("Maintain an index of smalldata messages by height and type (default: 0)") + "\n" +
+        "  -maxads=<n>            " + _("Rank the <n> best ads (default: 15)") + "\n" +
+        "  -paranoidblockread     " + _("Re-check proof of work of every block read from disk (default: 0)") + "\n" +
+        "  -maxauxpowcachesize=<n> " + _("Keep at most <n> verified merged mining proofs in memory (default: 10000)") + "\n" +
+        "  -maxsigcachesize=<n>   " + _("Limit the cache of verified signatures to <n> megabytes (default: 8, at most 1024; larger values count signatures)") + "\n" +
         "  -loadblock=<file>      " + _("Imports blocks from external blk000??.dat file") + "\n" +
         "  -reindex               " + _("Rebuild block chain index from current blk000??.dat files") + "\n" +
         "  -par=<n>               " + _("Set the number of script verification threads (up to 16, 0 = auto, <0 = leave that many cores free, default: 0)") + "\n" +
+        "  -powthreads=<n>        " + _("Set the number of threads hashing the proof of work of received blocks ahead of validation (up to 16, 0 = none, default: 1)") + "\n" +
+        "  -prefetchthreads=<n>   " + _("Set the number of threads reading the inputs of a block from the coin database ahead of validation (up to 16, 0 = none, default: 4)") + "\n" +
 
         "\n" + _("Block creation options:") + "\n" +
         "  -blockminsize=<n>      "   + _("Set minimum block size in bytes (default: 0)") + "\n" +
@@ -433,7 +443,8 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
         printf("Reindexing finished\n");
         // To avoid ending up in a situation without genesis block, re-try initializing (no-op if reindexing worked):
         InitBlockIndex();
-        adManager.load();
+        if (adManager.load())
+            adManager.catchUp();
     }
 
     // hardcoded $DATADIR/bootstrap.dat
@@ -586,6 +597,8 @@ bool AppInit2(boost::thread_group& threadGroup)
 
     fDebug = GetBoolArg("-debug");
     fBenchmark = GetBoolArg("-benchmark");
+    fParanoidBlockRead = GetBoolArg("-paranoidblockread");
+    nMaxAds = std::max((int64)1, GetArg("-maxads", 15));
 
     // -par=0 means autodetect, but nScriptCheckThreads==0 means no concurrency
     nScriptCheckThreads = GetArg("-par", 0);
@@ -596,6 +609,19 @@ bool AppInit2(boost::thread_group& threadGroup)
     else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
         nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
 
+    nPoWThreads = GetArg("-powthreads", 1);
+    if (nPoWThreads < 0)
+        nPoWThreads = 0;
+    else if (nPoWThreads > MAX_POW_THREADS)
+        nPoWThreads = MAX_POW_THREADS;
+
+    // Disk-bound rather than CPU-bound, so not tied to the number of cores
+    nPrefetchThreads = GetArg("-prefetchthreads", 4);
+    if (nPrefetchThreads < 0)
+        nPrefetchThreads = 0;
+    else if (nPrefetchThreads > MAX_PREFETCH_THREADS)
+        nPrefetchThreads = MAX_PREFETCH_THREADS;
+
     // -debug implies fDebug*
     if (fDebug)
         fDebugNet = true;
@@ -693,12 +719,30 @@ bool AppInit2(boost::thread_group& threadGroup)
     if (fDaemon)
         fprintf(stdout, "Fusioncoin server starting\n");
 
+    // Before the script check threads, which look signatures up without locking
+    if (GetArg("-maxsigcachesize", DEFAULT_MAX_SIGCACHE_SIZE) > MAX_MAX_SIGCACHE_SIZE)
+        printf("-maxsigcachesize is above %"PRI64d" megabytes, taking it as a number of signatures\n", MAX_MAX_SIGCACHE_SIZE);
+    InitSignatureCache();
+    printf("Using %"PRI64u" MiB for the signature cache\n", GetMaxSignatureCacheSize() >> 20);
+
     if (nScriptCheckThreads) {
         printf("Using %u threads for script verification\n", nScriptCheckThreads);
         for (int i=0; i<nScriptCheckThreads-1; i++)
             threadGroup.create_thread(&ThreadScriptCheck);
     }
 
+    if (nPoWThreads) {
+        printf("Using %u threads for proof of work pre-verification\n", nPoWThreads);
+        for (int i=0; i<nPoWThreads; i++)
+            threadGroup.create_thread(&ThreadPoWPipeline);
+    }
+
+    if (nPrefetchThreads) {
+        printf("Using %u threads for coins prefetch\n", nPrefetchThreads);
+        for (int i=0; i<nPrefetchThreads; i++)
+            threadGroup.create_thread(&ThreadCoinsPrefetch);
+    }
+
     int64 nStart;
 
     // ********************************************************* Step 5: verify wallet database integrity
@@ -852,6 +896,14 @@ bool AppInit2(boost::thread_group& threadGroup)
 #if defined(USE_SSE2)
     scrypt_detect_sse2(cpuid_edx);
 #endif
+#if defined(USE_AVX2)
+    scrypt_detect_avx2();
+#endif
+#if defined(USE_SSE2)
+    sha256d_detect(cpuid_edx);
+#elif defined(USE_AVX2)
+    sha256d_detect(0);
+#endif
 
     fReindex = GetBoolArg("-reindex");
 
@@ -892,7 +944,7 @@ bool AppInit2(boost::thread_group& threadGroup)
     nTotalCache -= nBlockTreeDBCache;
     size_t nCoinDBCache = nTotalCache / 2; // use half of the remaining cache for coindb cache
     nTotalCache -= nCoinDBCache;
-    nCoinCacheSize = nTotalCache / 300; // coins in memory require around 300 bytes
+    nCoinCacheUsage = nTotalCache; // the rest for coins in memory, flushed when they use more
 
     bool fLoaded = false;
     while (!fLoaded) {
@@ -950,6 +1002,12 @@ bool AppInit2(boost::thread_group& threadGroup)
                     break;
                 }
 
+                // Check for changed -smalldataindex state
+                if (fSmallDataIndex != GetBoolArg("-smalldataindex", false)) {
+                    strLoadError = _("You need to rebuild the database using -reindex to change -smalldataindex");
+                    break;
+                }
+
                 uiInterface.InitMessage(_("Verifying blocks..."));
                 if (!VerifyDB(GetArg("-checklevel", 3),
                               GetArg( "-checkblocks", 288))) {
@@ -1146,7 +1204,8 @@ bool AppInit2(boost::thread_group& threadGroup)
            addrman.size(), GetTimeMillis() - nStart);
 
     // ********************************************************* Step 10.1: load extra data
-    adManager.load();
+    if (adManager.load())
+        threadGroup.create_thread(&ThreadAdCatchUp);
 
     // ********************************************************* Step 11: start node
 
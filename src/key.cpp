@@ -7,6 +7,7 @@
 #include <openssl/obj_mac.h>
 
 #include "key.h"
+#include "secp256k1.h"
 
 
 // anonymous namespace with local implementation code (OpenSSL interaction)
@@ -341,6 +342,16 @@ bool CKey::SignCompact(const uint256 &hash, std::vector<unsigned char>& vchSig)
 }
 
 bool CPubKey::Verify(const uint256 &hash, const std::vector<unsigned char>& vchSig) const {
+    if (!IsValid())
+        return false;
+    // 1 = good, 0 = bad sig, -1 = encoding left to OpenSSL
+    int ret = secp256k1_ecdsa_verify(hash.begin(), vchSig.empty() ? NULL : &vchSig[0], vchSig.size(), begin(), size());
+    if (ret >= 0)
+        return ret == 1;
+    return VerifyOpenSSL(hash, vchSig);
+}
+
+bool CPubKey::VerifyOpenSSL(const uint256 &hash, const std::vector<unsigned char>& vchSig) const {
     if (!IsValid())
         return false;
     CECKey key;
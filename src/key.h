@@ -152,6 +152,10 @@ public:
     // If this public key is not fully valid, the return value will be false.
     bool Verify(const uint256 &hash, const std::vector<unsigned char>& vchSig) const;
 
+    // Verify a DER signature with OpenSSL only, which Verify falls back to for
+    // encodings its own secp256k1 code does not handle.
+    bool VerifyOpenSSL(const uint256 &hash, const std::vector<unsigned char>& vchSig) const;
+
     // Verify a compact signature (~65 bytes).
     // See CKey::SignCompact.
     bool VerifyCompact(const uint256 &hash, const std::vector<unsigned char>& vchSig) const;
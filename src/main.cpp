@@ -15,6 +15,7 @@
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include "smalldata.h"
+#include "sha256.h"
 
 using namespace std;
 using namespace boost;
@@ -30,11 +31,13 @@ CCriticalSection cs_main;
 
 CTxMemPool mempool;
 unsigned int nTransactionsUpdated = 0;
+CWaitableCriticalSection csBestBlock;
+boost::condition_variable cvBlockChange;
 
 map<uint256, CBlockIndex*> mapBlockIndex;
 uint256 hashGenesisBlock("000000002f557a52416c69deec7fb6038fc8587c870fa2af17489ba296b7bcff");
 
-static CBigNum bnProofOfWorkLimits[2] = { CBigNum(~uint256(0) >> 32), CBigNum(~uint256(0) >> 20) };
+static arith_uint256 bnProofOfWorkLimits[2] = { arith_uint256(~uint256(0) >> 32), arith_uint256(~uint256(0) >> 20) };
 
 CBlockIndex* pindexGenesisBlock = NULL;
 int nBestHeight = -1;
@@ -45,11 +48,16 @@ CBlockIndex* pindexBest = NULL;
 set<CBlockIndex*, CBlockIndexWorkComparator> setBlockIndexValid; // may contain all CBlockIndex*'s that have validness >=BLOCK_VALID_TRANSACTIONS, and must contain those who aren't failed
 int64 nTimeBestReceived = 0;
 int nScriptCheckThreads = 0;
+int nPoWThreads = 0;
+int nPrefetchThreads = 0;
 bool fImporting = false;
 bool fReindex = false;
 bool fBenchmark = false;
 bool fTxIndex = false;
-unsigned int nCoinCacheSize = 5000;
+size_t nCoinCacheUsage = 5000 * 300;
+bool fParanoidBlockRead = false;
+uint64 nBlockReadPoWSkipped = 0;
+CCriticalSection cs_nBlockReadPoWSkipped;
 
 /** Fees smaller than this (in satoshi) are considered zero fee (for transaction creation) */
 int64 CTransaction::nMinTxFee = 100000;
@@ -71,6 +79,8 @@ const string strMessageMagic = "Fusioncoin Signed Message:\n";
 
 double dHashesPerSec = 0.0;
 int64 nHPSTimerStart = 0;
+double dHashesPerSecScrypt = 0.0;
+int64 nHPSTimerStartScrypt = 0;
 
 // Settings
 int64 nTransactionFee = 0;
@@ -175,7 +185,7 @@ bool CCoinsView::SetCoins(const uint256 &txid, const CCoins &coins) { return fal
 bool CCoinsView::HaveCoins(const uint256 &txid) { return false; }
 CBlockIndex *CCoinsView::GetBestBlock() { return NULL; }
 bool CCoinsView::SetBestBlock(CBlockIndex *pindex) { return false; }
-bool CCoinsView::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) { return false; }
+bool CCoinsView::BatchWrite(const CCoinsMap &mapCoins, CBlockIndex *pindex) { return false; }
 bool CCoinsView::GetStats(CCoinsStats &stats) { return false; }
 
 
@@ -186,43 +196,102 @@ bool CCoinsViewBacked::HaveCoins(const uint256 &txid) { return base->HaveCoins(t
 CBlockIndex *CCoinsViewBacked::GetBestBlock() { return base->GetBestBlock(); }
 bool CCoinsViewBacked::SetBestBlock(CBlockIndex *pindex) { return base->SetBestBlock(pindex); }
 void CCoinsViewBacked::SetBackend(CCoinsView &viewIn) { base = &viewIn; }
-bool CCoinsViewBacked::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) { return base->BatchWrite(mapCoins, pindex); }
+CCoinsView *CCoinsViewBacked::GetBackend() { return base; }
+bool CCoinsViewBacked::BatchWrite(const CCoinsMap &mapCoins, CBlockIndex *pindex) { return base->BatchWrite(mapCoins, pindex); }
 bool CCoinsViewBacked::GetStats(CCoinsStats &stats) { return base->GetStats(stats); }
 
-CCoinsViewCache::CCoinsViewCache(CCoinsView &baseIn, bool fDummy) : CCoinsViewBacked(baseIn), pindexTip(NULL) { }
+CCoinsKeyHasher::CCoinsKeyHasher() {
+    RAND_bytes((unsigned char*)&nSalt0, sizeof(nSalt0));
+    RAND_bytes((unsigned char*)&nSalt1, sizeof(nSalt1));
+}
+
+size_t CCoinsKeyHasher::operator()(const uint256 &txid) const {
+    // txids are uniformly distributed already; mixing in the salt keeps
+    // peers from grinding ones that collide in this particular cache
+    uint64 a, b;
+    memcpy(&a, txid.begin(), 8);
+    memcpy(&b, txid.begin() + 8, 8);
+    uint64 h = ((a ^ nSalt0) * 0x9E3779B97F4A7C15ULL) ^ (b ^ nSalt1);
+    h ^= h >> 31;
+    h *= 0xBF58476D1CE4E5B9ULL;
+    h ^= h >> 29;
+    return (size_t)h;
+}
+
+CCoinsViewCache::CCoinsViewCache(CCoinsView &baseIn, bool fDummy) : CCoinsViewBacked(baseIn), pindexTip(NULL), cachedCoinsUsage(0) { }
+
+void CCoinsViewCache::SetUsage(CCoinsCacheEntry &entry) {
+    cachedCoinsUsage -= entry.nUsage;
+    entry.nUsage = entry.coins.DynamicMemoryUsage();
+    cachedCoinsUsage += entry.nUsage;
+}
+
+void CCoinsViewCache::AccountModified() {
+    BOOST_FOREACH(CCoinsCacheEntry *pentry, vModified)
+        SetUsage(*pentry);
+    vModified.clear();
+}
 
 bool CCoinsViewCache::GetCoins(const uint256 &txid, CCoins &coins) {
-    if (cacheCoins.count(txid)) {
-        coins = cacheCoins[txid];
-        return true;
-    }
-    if (base->GetCoins(txid, coins)) {
-        cacheCoins[txid] = coins;
-        return true;
-    }
-    return false;
+    CCoinsMap::iterator it = FetchCoins(txid);
+    if (it == cacheCoins.end())
+        return false;
+    coins = it->second.coins;
+    return true;
 }
 
-std::map<uint256,CCoins>::iterator CCoinsViewCache::FetchCoins(const uint256 &txid) {
-    std::map<uint256,CCoins>::iterator it = cacheCoins.lower_bound(txid);
-    if (it != cacheCoins.end() && it->first == txid)
+CCoinsMap::iterator CCoinsViewCache::FetchCoins(const uint256 &txid) {
+    CCoinsMap::iterator it = cacheCoins.find(txid);
+    if (it != cacheCoins.end())
         return it;
     CCoins tmp;
     if (!base->GetCoins(txid,tmp))
         return cacheCoins.end();
-    std::map<uint256,CCoins>::iterator ret = cacheCoins.insert(it, std::make_pair(txid, CCoins()));
-    tmp.swap(ret->second);
+    CCoinsMap::iterator ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry())).first;
+    tmp.swap(ret->second.coins);
+    SetUsage(ret->second);
     return ret;
 }
 
 CCoins &CCoinsViewCache::GetCoins(const uint256 &txid) {
-    std::map<uint256,CCoins>::iterator it = FetchCoins(txid);
+    CCoinsMap::iterator it = FetchCoins(txid);
+    assert(it != cacheCoins.end());
+    it->second.nFlags |= CCoinsCacheEntry::DIRTY;
+    vModified.push_back(&it->second);
+    return it->second.coins;
+}
+
+const CCoins &CCoinsViewCache::AccessCoins(const uint256 &txid) {
+    CCoinsMap::iterator it = FetchCoins(txid);
     assert(it != cacheCoins.end());
-    return it->second;
+    return it->second.coins;
+}
+
+bool CCoinsViewCache::HaveCoinsInCache(const uint256 &txid) {
+    return cacheCoins.count(txid) != 0;
+}
+
+void CCoinsViewCache::WarmCoins(const uint256 &txid, CCoins &coins) {
+    std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry()));
+    if (!ret.second)
+        return;
+    coins.swap(ret.first->second.coins);
+    SetUsage(ret.first->second);
 }
 
 bool CCoinsViewCache::SetCoins(const uint256 &txid, const CCoins &coins) {
-    cacheCoins[txid] = coins;
+    return SetCoins(txid, coins, false);
+}
+
+bool CCoinsViewCache::SetCoins(const uint256 &txid, const CCoins &coins, bool fFresh) {
+    std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry()));
+    CCoinsCacheEntry &entry = ret.first->second;
+    // An entry already here keeps its flags: it may stand for coins below
+    if (ret.second && fFresh)
+        entry.nFlags |= CCoinsCacheEntry::FRESH;
+    entry.nFlags |= CCoinsCacheEntry::DIRTY;
+    entry.coins = coins;
+    SetUsage(entry);
     return true;
 }
 
@@ -241,17 +310,43 @@ bool CCoinsViewCache::SetBestBlock(CBlockIndex *pindex) {
     return true;
 }
 
-bool CCoinsViewCache::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) {
-    for (std::map<uint256, CCoins>::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++)
-        cacheCoins[it->first] = it->second;
+bool CCoinsViewCache::BatchWrite(const CCoinsMap &mapCoins, CBlockIndex *pindex) {
+    // Entries may be erased below
+    AccountModified();
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+        if (!(it->second.nFlags & CCoinsCacheEntry::DIRTY))
+            continue;
+        bool fPruned = it->second.coins.IsPruned();
+        CCoinsMap::iterator itUs = cacheCoins.find(it->first);
+        if (itUs == cacheCoins.end()) {
+            // Created and spent above us: nothing to pass on
+            if ((it->second.nFlags & CCoinsCacheEntry::FRESH) && fPruned)
+                continue;
+            CCoinsCacheEntry &entry = cacheCoins[it->first];
+            entry.coins = it->second.coins;
+            entry.nFlags = it->second.nFlags;
+            SetUsage(entry);
+        } else if ((itUs->second.nFlags & CCoinsCacheEntry::FRESH) && fPruned) {
+            // Spent before the view below ever saw it
+            cachedCoinsUsage -= itUs->second.nUsage;
+            cacheCoins.erase(itUs);
+        } else {
+            itUs->second.coins = it->second.coins;
+            itUs->second.nFlags |= CCoinsCacheEntry::DIRTY;
+            SetUsage(itUs->second);
+        }
+    }
     pindexTip = pindex;
     return true;
 }
 
 bool CCoinsViewCache::Flush() {
     bool fOk = base->BatchWrite(cacheCoins, pindexTip);
-    if (fOk)
+    if (fOk) {
         cacheCoins.clear();
+        vModified.clear();
+        cachedCoinsUsage = 0;
+    }
     return fOk;
 }
 
@@ -259,6 +354,14 @@ unsigned int CCoinsViewCache::GetCacheSize() {
     return cacheCoins.size();
 }
 
+size_t CCoinsViewCache::DynamicMemoryUsage() {
+    AccountModified();
+    // Each entry is a node with a next pointer and a stored hash, plus the bucket array
+    return cachedCoinsUsage +
+           cacheCoins.size() * (sizeof(CCoinsMap::value_type) + 2 * sizeof(void*)) +
+           cacheCoins.bucket_count() * sizeof(void*);
+}
+
 /** CCoinsView that brings transactions from a memorypool into view.
     It does not check for spendings by memory pool transactions. */
 CCoinsViewMemPool::CCoinsViewMemPool(CCoinsView &baseIn, CTxMemPool &mempoolIn) : CCoinsViewBacked(baseIn), mempool(mempoolIn) { }
@@ -815,6 +918,15 @@ bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckIn
         addUnchecked(hash, tx);
     }
 
+    // Tell smalldata subscribers, with the message parsed by addUnchecked
+    std::vector<CSmallDataEvent> vEvents(1);
+    if (getSmallData(hash, vEvents[0].strMessage, vEvents[0].fBroadcast))
+    {
+        vEvents[0].nKind = SMALLDATA_EVENT_MEMPOOL;
+        vEvents[0].txid = hash;
+        smallDataEvents.Push(vEvents);
+    }
+
     ///// are we sure this is ok when loading transactions or restoring block txes
     // If updated, erase old tx from wallet
     if (ptxOld)
@@ -841,8 +953,16 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTransaction &tx)
         mapTx[hash] = tx;
         for (unsigned int i = 0; i < tx.vin.size(); i++)
             mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
+        CTxMemPoolEntry& entry = mapEntry[hash];
+        entry = CTxMemPoolEntry(&mapTx[hash]);
+        entry.fSmallData = GetTxMessage(tx, entry.strSmallData, entry.fSmallDataBroadcast);
+        markDependersStale(hash);
         nTransactionsUpdated++;
     }
+    {
+        boost::unique_lock<boost::mutex> lock(csBestBlock);
+        cvBlockChange.notify_all();
+    }
     return true;
 }
 
@@ -864,7 +984,14 @@ bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
         {
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
                 mapNextTx.erase(txin.prevout);
+            map<uint256, CTxMemPoolEntry>::iterator mi = mapEntry.find(hash);
+            if (mi != mapEntry.end())
+            {
+                removeFromIndexes(hash, mi->second);
+                mapEntry.erase(mi);
+            }
             mapTx.erase(hash);
+            markDependersStale(hash);
             nTransactionsUpdated++;
         }
     }
@@ -886,14 +1013,157 @@ bool CTxMemPool::removeConflicts(const CTransaction &tx)
     return true;
 }
 
+bool CTxMemPool::getSmallData(const uint256& hash, std::string& strMessage, bool& fBroadcast)
+{
+    LOCK(cs);
+    map<uint256, CTxMemPoolEntry>::const_iterator mi = mapEntry.find(hash);
+    if (mi == mapEntry.end() || !mi->second.fSmallData)
+        return false;
+    strMessage = mi->second.strSmallData;
+    fBroadcast = mi->second.fSmallDataBroadcast;
+    return true;
+}
+
 void CTxMemPool::clear()
 {
     LOCK(cs);
     mapTx.clear();
     mapNextTx.clear();
+    mapEntry.clear();
+    mapByFee.clear();
+    mapByPriority.clear();
     ++nTransactionsUpdated;
 }
 
+void CTxMemPool::markDependersStale(const uint256& hash)
+{
+    LOCK(cs);
+    for (map<COutPoint, CInPoint>::iterator it = mapNextTx.lower_bound(COutPoint(hash, 0));
+         it != mapNextTx.end() && it->first.hash == hash; ++it)
+    {
+        uint256 hashDepender = it->second.ptx->GetHash();
+        map<uint256, CTxMemPoolEntry>::iterator mi = mapEntry.find(hashDepender);
+        if (mi != mapEntry.end())
+        {
+            removeFromIndexes(hashDepender, mi->second);
+            mi->second.fStale = true;
+        }
+    }
+}
+
+void CTxMemPool::addToIndexes(const uint256& hash, CTxMemPoolEntry& entry)
+{
+    entry.dIndexedPriority = entry.GetPriority(nPriorityHeight);
+    mapByFee[make_pair(entry.GetFeePerKb(), hash)] = &entry;
+    mapByPriority[make_pair(entry.dIndexedPriority, hash)] = &entry;
+    entry.fIndexed = true;
+}
+
+void CTxMemPool::removeFromIndexes(const uint256& hash, CTxMemPoolEntry& entry)
+{
+    if (!entry.fIndexed)
+        return;
+    mapByFee.erase(make_pair(entry.GetFeePerKb(), hash));
+    mapByPriority.erase(make_pair(entry.dIndexedPriority, hash));
+    entry.fIndexed = false;
+}
+
+void CTxMemPool::refreshEntries(CCoinsViewCache& view, int nHeight)
+{
+    LOCK(cs);
+
+    // Priorities grow at different rates per entry, so their order changes
+    // with every block; re-key that index once per height
+    if (nHeight != nPriorityHeight)
+    {
+        nPriorityHeight = nHeight;
+        mapByPriority.clear();
+        for (map<uint256, CTxMemPoolEntry>::iterator mi = mapEntry.begin(); mi != mapEntry.end(); ++mi)
+        {
+            CTxMemPoolEntry& entry = mi->second;
+            if (!entry.fIndexed)
+                continue;
+            entry.dIndexedPriority = entry.GetPriority(nPriorityHeight);
+            mapByPriority[make_pair(entry.dIndexedPriority, mi->first)] = &entry;
+        }
+    }
+
+    for (map<uint256, CTxMemPoolEntry>::iterator mi = mapEntry.begin(); mi != mapEntry.end(); ++mi)
+    {
+        CTxMemPoolEntry& entry = mi->second;
+        if (!entry.fStale)
+            continue;
+        const CTransaction& tx = *entry.ptx;
+        if (tx.IsCoinBase())
+            continue;
+
+        entry.nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+        entry.nLegacySigOps = tx.GetLegacySigOpCount();
+        entry.nP2SHSigOps = 0;
+        entry.nValueInChain = 0;
+        entry.dValueHeight = 0;
+        entry.vDependsOn.clear();
+
+        int64 nTotalIn = 0;
+        bool fMissingInputs = false;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        {
+            // Read prev transaction
+            if (!view.HaveCoins(txin.prevout.hash))
+            {
+                // This should never happen; all transactions in the memory
+                // pool should connect to either transactions in the chain
+                // or other transactions in the memory pool.
+                map<uint256, CTransaction>::const_iterator itParent = mapTx.find(txin.prevout.hash);
+                if (itParent == mapTx.end())
+                {
+                    printf("ERROR: mempool transaction missing input\n");
+                    if (fDebug) assert("mempool transaction missing input" == 0);
+                    fMissingInputs = true;
+                    break;
+                }
+
+                // Has to wait for dependencies
+                if (std::find(entry.vDependsOn.begin(), entry.vDependsOn.end(), txin.prevout.hash) == entry.vDependsOn.end())
+                    entry.vDependsOn.push_back(txin.prevout.hash);
+                const CTxOut& txoutParent = itParent->second.vout[txin.prevout.n];
+                if (txoutParent.scriptPubKey.IsPayToScriptHash())
+                    entry.nP2SHSigOps += txoutParent.scriptPubKey.GetSigOpCount(txin.scriptSig);
+                nTotalIn += txoutParent.nValue;
+                continue;
+            }
+            const CCoins &coins = view.AccessCoins(txin.prevout.hash);
+            if (!coins.IsAvailable(txin.prevout.n))
+            {
+                fMissingInputs = true;
+                break;
+            }
+            const CTxOut& txoutPrev = coins.vout[txin.prevout.n];
+            if (txoutPrev.scriptPubKey.IsPayToScriptHash())
+                entry.nP2SHSigOps += txoutPrev.scriptPubKey.GetSigOpCount(txin.scriptSig);
+
+            int64 nValueIn = txoutPrev.nValue;
+            nTotalIn += nValueIn;
+            entry.nValueInChain += nValueIn;
+            entry.dValueHeight += (double)nValueIn * coins.nHeight;
+        }
+
+        // Entries with missing inputs stay stale and are looked at again next time
+        if (fMissingInputs)
+            continue;
+
+        // Scripts were checked when the transaction entered the pool; what can
+        // change since is the maturity of coinbase inputs, after a reorg
+        CValidationState state;
+        if (entry.vDependsOn.empty() && !tx.CheckInputs(state, view, false))
+            continue;
+
+        entry.nFee = nTotalIn - tx.GetValueOut();
+        entry.fStale = false;
+        addToIndexes(mi->first, entry);
+    }
+}
+
 void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
 {
     vtxid.clear();
@@ -1060,10 +1330,46 @@ CBlockIndex* FindBlockByHeight(int nHeight)
     return pblockindex;
 }
 
+bool ReadBlockAuxPow(const CBlockIndex* pindex, boost::shared_ptr<CAuxPow>& auxpow)
+{
+    auxpow.reset(new CAuxPow());
+    if (pblocktree->ReadAuxPow(pindex->GetBlockHash(), *auxpow))
+        return true;
+
+    // Blocks accepted before the auxpow store existed: take it from the
+    // block data once, and keep it for next time
+    CBlock block;
+    if (!(pindex->nStatus & BLOCK_HAVE_DATA) || !block.ReadFromDisk(pindex) || !block.isAuxBlock())
+    {
+        auxpow.reset();
+        return error("ReadBlockAuxPow() : no auxpow for %s", pindex->GetBlockHash().ToString().c_str());
+    }
+    auxpow = block.auxpow;
+    if (!pblocktree->WriteAuxPow(pindex->GetBlockHash(), *auxpow))
+        printf("ReadBlockAuxPow() : failed to store auxpow for %s\n", pindex->GetBlockHash().ToString().c_str());
+    return true;
+}
+
+bool ReadBlockHeader(const CBlockIndex* pindex, CBlockHeader& header)
+{
+    header = pindex->GetBlockHeader();
+    if (header.nVersion & CBlockHeader::VERSION_AUX)
+        return ReadBlockAuxPow(pindex, header.auxpow);
+    return true;
+}
+
 bool CBlock::ReadFromDisk(const CBlockIndex* pindex)
 {
-    if (!ReadFromDisk(pindex->GetBlockPos()))
+    // Block data is only written after the header passed CheckBlock, and the
+    // hash check below catches data that does not belong to this index entry
+    bool fCheckPOW = fParanoidBlockRead || !(pindex->nStatus & BLOCK_HAVE_DATA);
+    if (!ReadFromDisk(pindex->GetBlockPos(), fCheckPOW))
         return false;
+    if (!fCheckPOW)
+    {
+        LOCK(cs_nBlockReadPoWSkipped);
+        nBlockReadPoWSkipped++;
+    }
     if (GetHash() != pindex->GetBlockHash())
         return error("CBlock::ReadFromDisk() : GetHash() doesn't match index");
     return true;
@@ -1110,45 +1416,70 @@ static const int64 nInterval = nTargetTimespan / nTargetSpacing;
 // minimum work required was nBase
 //
 #if 0
-unsigned int ComputeMinWork(unsigned int nBase, int64 nTime)
+unsigned int ComputeMinWork(unsigned int nBase, int64 nTime, int algo)
 {
     // Testnet has min-difficulty blocks
     // after nTargetSpacing*2 time between blocks:
     if (fTestNet && nTime > nTargetSpacing*2)
-        return bnProofOfWorkLimit.GetCompact();
+        return bnProofOfWorkLimits[algo].GetCompact();
 
-    CBigNum bnResult;
+    arith_uint256 bnResult;
     bnResult.SetCompact(nBase);
-    while (nTime > 0 && bnResult < bnProofOfWorkLimit)
+    while (nTime > 0 && bnResult < bnProofOfWorkLimits[algo])
     {
         // Maximum 400% adjustment...
         bnResult *= 4;
         // ... in best-case exactly 4-times-normal target time
         nTime -= nTargetTimespan*4;
     }
-    if (bnResult > bnProofOfWorkLimit)
-        bnResult = bnProofOfWorkLimit;
+    if (bnResult > bnProofOfWorkLimits[algo])
+        bnResult = bnProofOfWorkLimits[algo];
     return bnResult.GetCompact();
 }
 #endif
 
+// Last block of the given algo at or before pindex, or the genesis block if there is none
 const CBlockIndex* GetLastBlockIndex(const CBlockIndex* pindex, int algo)
 {
-    while (pindex && pindex->pprev && ( CBlockHeader::GetBlockAlgo(pindex->nVersion) != algo))
+    if (pindex == NULL || pindex->GetAlgo() == algo)
+        return pindex;
+    if (pindex->pprevAlgo[algo])
+        return pindex->pprevAlgo[algo];
+    if (pindexGenesisBlock)
+        return pindexGenesisBlock;
+    while (pindex->pprev)
         pindex = pindex->pprev;
     return pindex;
 }
 
 const CBlockIndex* GetLastBlockIndexForAlgo(const CBlockIndex* pindex, int algo)
 {
-    for (;;)
-    {
-        if (!pindex)
-            return NULL;
-        if (CBlockHeader::GetBlockAlgo(pindex->nVersion) == algo)
-            return pindex;
-        pindex = pindex->pprev;
-    }
+    if (pindex == NULL || pindex->GetAlgo() == algo)
+        return pindex;
+    return pindex->pprevAlgo[algo];
+}
+
+// Compact form of a * m / d where the product is wider than 256 bits. The compact
+// form only keeps the top bytes, so it follows from the quotient shifted right
+// by 64 bits, which fits; d must be below 2^64 and the quotient at least 2^88.
+static unsigned int GetWideQuotientCompact(const arith_uint256& a, uint64 m, uint64 d, bool fNegative)
+{
+    arith_uint256 bnM = m, bnD = d;
+    arith_uint256 aHigh = a >> 128;
+    arith_uint256 aLow = a;
+    aLow -= aHigh << 128;
+
+    // a * m = aHigh * m * 2^128 + aLow * m, divided as two long division steps
+    arith_uint256 pHigh = aHigh * bnM;
+    arith_uint256 qHigh = pHigh / bnD;
+    arith_uint256 pLow = pHigh;
+    pLow -= qHigh * bnD;
+    pLow <<= 128;
+    pLow += aLow * bnM;
+
+    arith_uint256 q = qHigh << 64;
+    q += (pLow / bnD) >> 64;
+    return q.GetCompact(fNegative) + (8 << 24);
 }
 
 unsigned int static GetNextWorkRequired(const CBlockIndex* pindexLast, const CBlockHeader *pblock, int algo)
@@ -1169,38 +1500,64 @@ unsigned int static GetNextWorkRequired(const CBlockIndex* pindexLast, const CBl
 
     // ppcoin: target change every block
     // ppcoin: retarget with exponential moving toward target spacing
-    CBigNum bnNew;
+    arith_uint256 bnNew;
     bnNew.SetCompact(pindexPrev->nBits);
 
-    bnNew *= ((nInterval - 1) * nTargetSpacing + nActualSpacing + nActualSpacing);
-    bnNew /= ((nInterval + 1) * nTargetSpacing);
+    // The multiplier goes negative when the last block is timestamped far
+    // enough before its predecessor; carry the sign separately so the
+    // resulting compact target stays what the signed CBigNum math produced.
+    int64 nMultiplier = (nInterval - 1) * nTargetSpacing + nActualSpacing + nActualSpacing;
+    bool fNegative = nMultiplier < 0;
+    arith_uint256 bnMultiplier = (uint64)(fNegative ? -nMultiplier : nMultiplier);
+
+    // A product wider than 256 bits is at least 2^255, which after the divide
+    // below is still far above either limit. CBigNum clamped it when positive
+    // and returned the negative target as is, which no block can meet; both
+    // are kept, the latter worked out without the full product.
+    unsigned int nCompact;
+    if (bnNew.bits() + bnMultiplier.bits() > 256)
+    {
+        if (fNegative)
+            nCompact = GetWideQuotientCompact(bnNew, bnMultiplier.Get64(), (nInterval + 1) * nTargetSpacing, true);
+        else
+            nCompact = bnProofOfWorkLimits[algo].GetCompact();
+    }
+    else
+    {
+        bnNew *= bnMultiplier;
+        bnNew /= arith_uint256((nInterval + 1) * nTargetSpacing);
 
-    if (bnNew > bnProofOfWorkLimits[algo])
-        bnNew = bnProofOfWorkLimits[algo];
+        if (!fNegative && bnNew > bnProofOfWorkLimits[algo])
+            bnNew = bnProofOfWorkLimits[algo];
+        nCompact = bnNew.GetCompact(fNegative);
+    }
 
     /// debug print
     printf("GetNextWorkRequired RETARGET\n");
     //printf("nTargetTimespan = %"PRI64d"    nActualTimespan = %"PRI64d"\n", nTargetTimespan, nActualTimespan);
-    printf("Before: %08x  %s\n", pindexPrev->nBits, CBigNum().SetCompact(pindexPrev->nBits).getuint256().ToString().c_str());
-    printf("After:  %08x  %s\n", bnNew.GetCompact(), bnNew.getuint256().ToString().c_str());
+    printf("Before: %08x  %s\n", pindexPrev->nBits, arith_uint256().SetCompact(pindexPrev->nBits).ToString().c_str());
+    printf("After:  %08x  %s\n", nCompact, arith_uint256().SetCompact(nCompact).ToString().c_str());
 
-    return bnNew.GetCompact();
+    return nCompact;
 }
 
 bool CheckProofOfWork(uint256 hash, unsigned int nBits, int algo)
 {
-    CBigNum bnTarget = CBigNum().SetCompact(nBits);
+    bool fNegative;
+    bool fOverflow;
+    arith_uint256 bnTarget;
+    bnTarget.SetCompact(nBits, &fNegative, &fOverflow);
 
     // Check range
-    if (bnTarget <= 0 || bnTarget > bnProofOfWorkLimits[algo])
+    if (fNegative || fOverflow || bnTarget == 0 || bnTarget > bnProofOfWorkLimits[algo])
         return false;
         //return error("CheckProofOfWork() : nBits below minimum work");
 
     // Check proof of work matches claimed amount
-    if (hash > bnTarget.getuint256())
+    if (hash > bnTarget)
     {
         printf("hash %s\n", hash.ToString().c_str());
-        printf("target %s\n", bnTarget.getuint256().ToString().c_str());
+        printf("target %s\n", bnTarget.ToString().c_str());
         return false;
     }
         //return error("CheckProofOfWork() : hash doesn't match nBits");
@@ -1244,7 +1601,7 @@ void static InvalidChainFound(CBlockIndex* pindexNew)
     printf("InvalidChainFound:  current best=%s  height=%d  log2_work=%.8g  date=%s\n",
       hashBestChain.ToString().c_str(), nBestHeight, log(nBestChainWork.getdouble())/log(2.0),
       DateTimeStrFormat("%Y-%m-%d %H:%M:%S", pindexBest->GetBlockTime()).c_str());
-    if (pindexBest && nBestInvalidWork > nBestChainWork + (pindexBest->GetBlockWork() * 6).getuint256())
+    if (pindexBest && nBestInvalidWork > nBestChainWork + pindexBest->GetBlockWork() * 6)
         printf("InvalidChainFound: Warning: Displayed transactions may not be correct! You may need to upgrade, or other nodes may need to upgrade.\n");
 }
 
@@ -1332,7 +1689,7 @@ void CBlockHeader::UpdateTime(const CBlockIndex* pindexPrev)
 
 const CTxOut &CTransaction::GetOutputFor(const CTxIn& input, CCoinsViewCache& view)
 {
-    const CCoins &coins = view.GetCoins(input.prevout.hash);
+    const CCoins &coins = view.AccessCoins(input.prevout.hash);
     assert(coins.IsAvailable(input.prevout.n));
     return coins.vout[input.prevout.n];
 }
@@ -1376,8 +1733,8 @@ void CTransaction::UpdateCoins(CValidationState &state, CCoinsViewCache &inputs,
         }
     }
 
-    // add outputs
-    assert(inputs.SetCoins(txhash, CCoins(*this, nHeight)));
+    // add outputs; ConnectBlock refuses to overwrite unspent ones (BIP30), so they are fresh
+    assert(inputs.SetCoins(txhash, CCoins(*this, nHeight), true));
 }
 
 bool CTransaction::HaveInputs(CCoinsViewCache &inputs) const
@@ -1393,7 +1750,7 @@ bool CTransaction::HaveInputs(CCoinsViewCache &inputs) const
         // then check whether the actual outputs are available
         for (unsigned int i = 0; i < vin.size(); i++) {
             const COutPoint &prevout = vin[i].prevout;
-            const CCoins &coins = inputs.GetCoins(prevout.hash);
+            const CCoins &coins = inputs.AccessCoins(prevout.hash);
             if (!coins.IsAvailable(prevout.n))
                 return false;
         }
@@ -1403,7 +1760,7 @@ bool CTransaction::HaveInputs(CCoinsViewCache &inputs) const
 
 bool CScriptCheck::operator()() const {
     const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
-    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType))
+    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType, pSigHashes.get()))
         return error("CScriptCheck() : %s VerifySignature failed", ptxTo->GetHash().ToString().c_str());
     return true;
 }
@@ -1433,7 +1790,7 @@ bool CTransaction::CheckInputs(CValidationState &state, CCoinsViewCache &inputs,
         for (unsigned int i = 0; i < vin.size(); i++)
         {
             const COutPoint &prevout = vin[i].prevout;
-            const CCoins &coins = inputs.GetCoins(prevout.hash);
+            const CCoins &coins = inputs.AccessCoins(prevout.hash);
 
             // If prev is coinbase, check that it's matured
             if (coins.IsCoinBase()) {
@@ -1467,12 +1824,14 @@ bool CTransaction::CheckInputs(CValidationState &state, CCoinsViewCache &inputs,
         // before the last block chain checkpoint. This is safe because block merkle hashes are
         // still computed and checked, and any change will be caught at the next checkpoint.
         if (fScriptChecks) {
+            // Hash the parts of the transaction common to all its signatures once
+            boost::shared_ptr<const CSignatureHashContext> pSigHashes(new CSignatureHashContext(*this));
             for (unsigned int i = 0; i < vin.size(); i++) {
                 const COutPoint &prevout = vin[i].prevout;
-                const CCoins &coins = inputs.GetCoins(prevout.hash);
+                const CCoins &coins = inputs.AccessCoins(prevout.hash);
 
                 // Verify signature
-                CScriptCheck check(coins, *this, i, flags, 0);
+                CScriptCheck check(coins, *this, i, flags, 0, pSigHashes);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -1480,7 +1839,7 @@ bool CTransaction::CheckInputs(CValidationState &state, CCoinsViewCache &inputs,
                     if (flags & SCRIPT_VERIFY_STRICTENC) {
                         // For now, check whether the failure was caused by non-canonical
                         // encodings or not; if so, don't trigger DoS protection.
-                        CScriptCheck check(coins, *this, i, flags & (~SCRIPT_VERIFY_STRICTENC), 0);
+                        CScriptCheck check(coins, *this, i, flags & (~SCRIPT_VERIFY_STRICTENC), 0, pSigHashes);
                         if (check())
                             return state.Invalid();
                     }
@@ -1617,7 +1976,87 @@ void ThreadScriptCheck() {
     scriptcheckqueue.Thread();
 }
 
-bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsViewCache &view, bool fJustCheck)
+/** Read of the coins of one transaction from the coin database, for the prefetch queue */
+class CCoinsPrefetch
+{
+private:
+    CCoinsView *pview;
+    uint256 txid;
+    CCoins *pcoins;
+
+public:
+    CCoinsPrefetch() : pview(NULL), pcoins(NULL) {}
+    CCoinsPrefetch(CCoinsView *pviewIn, const uint256 &txidIn, CCoins *pcoinsIn) : pview(pviewIn), txid(txidIn), pcoins(pcoinsIn) {}
+
+    bool operator()() {
+        // Missing coins are left pruned
+        pview->GetCoins(txid, *pcoins);
+        return true;
+    }
+
+    void swap(CCoinsPrefetch &check) {
+        std::swap(pview, check.pview);
+        std::swap(txid, check.txid);
+        std::swap(pcoins, check.pcoins);
+    }
+};
+
+// Small batches: every item is a random read
+static CCheckQueue<CCoinsPrefetch> prefetchqueue(4);
+
+void ThreadCoinsPrefetch() {
+    RenameThread("bitcoin-prefetch");
+    prefetchqueue.Thread();
+}
+
+void PrefetchBlockCoins(const CBlock& block)
+{
+    if (nPrefetchThreads == 0)
+        return;
+
+    int64 nStart = GetTimeMicros();
+    // Inputs pcoinsTip would have to read one at a time, except those
+    // created earlier in the block itself
+    set<uint256> setCreated, setWanted;
+    vector<uint256> vTxid;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+        if (!tx.IsCoinBase()) {
+            BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+                const uint256 &hash = txin.prevout.hash;
+                if (!setCreated.count(hash) && setWanted.insert(hash).second && !pcoinsTip->HaveCoinsInCache(hash))
+                    vTxid.push_back(hash);
+            }
+        }
+        setCreated.insert(tx.GetHash());
+    }
+    if (vTxid.empty())
+        return;
+
+    // The coin database below pcoinsTip is safe to read from several threads,
+    // and nothing writes to it while cs_main is held
+    CCoinsView *pview = pcoinsTip->GetBackend();
+    vector<CCoins> vCoins(vTxid.size());
+    vector<CCoinsPrefetch> vPrefetch;
+    vPrefetch.reserve(vTxid.size());
+    for (unsigned int i = 0; i < vTxid.size(); i++)
+        vPrefetch.push_back(CCoinsPrefetch(pview, vTxid[i], &vCoins[i]));
+    CCheckQueueControl<CCoinsPrefetch> control(&prefetchqueue);
+    control.Add(vPrefetch);
+    control.Wait();
+
+    unsigned int nFound = 0;
+    for (unsigned int i = 0; i < vTxid.size(); i++) {
+        if (!vCoins[i].IsPruned()) {
+            pcoinsTip->WarmCoins(vTxid[i], vCoins[i]);
+            nFound++;
+        }
+    }
+    if (fBenchmark)
+        printf("- Prefetch %u of %"PRIszu" inputs: %.2fms\n", nFound, vTxid.size(), 0.001 * (GetTimeMicros() - nStart));
+}
+
+bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsViewCache &view, bool fJustCheck, CBlockUndo *pblockundo,
+                          std::vector<std::pair<CSmallDataKey, CSmallDataIndexEntry> > *pvSmallData)
 {
     // Check it again in case a previous version let a bad block in
     if (!CheckBlock(state, !fJustCheck, !fJustCheck))
@@ -1652,7 +2091,7 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
     if (fEnforceBIP30) {
         for (unsigned int i=0; i<vtx.size(); i++) {
             uint256 hash = GetTxHash(i);
-            if (view.HaveCoins(hash) && !view.GetCoins(hash).IsPruned())
+            if (view.HaveCoins(hash) && !view.AccessCoins(hash).IsPruned())
                 return state.DoS(100, error("ConnectBlock() : tried to overwrite transaction"));
         }
     }
@@ -1675,6 +2114,7 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
     CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(vtx.size()));
     std::vector<std::pair<uint256, CDiskTxPos> > vPos;
     vPos.reserve(vtx.size());
+    std::vector<std::pair<CSmallDataKey, CSmallDataIndexEntry> > vSmallData;
     for (unsigned int i=0; i<vtx.size(); i++)
     {
         const CTransaction &tx = vtx[i];
@@ -1684,6 +2124,7 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
         if (nSigOps > MAX_BLOCK_SIGOPS)
             return state.DoS(100, error("ConnectBlock() : too many sigops"));
 
+        int64 nTxFee = 0;
         if (!tx.IsCoinBase())
         {
             if (!tx.HaveInputs(view))
@@ -1699,7 +2140,8 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
                      return state.DoS(100, error("ConnectBlock() : too many sigops"));
             }
 
-            nFees += tx.GetValueIn(view)-tx.GetValueOut();
+            nTxFee = tx.GetValueIn(view)-tx.GetValueOut();
+            nFees += nTxFee;
 
             std::vector<CScriptCheck> vChecks;
             if (!tx.CheckInputs(state, view, fScriptChecks, flags, nScriptCheckThreads ? &vChecks : NULL))
@@ -1713,6 +2155,8 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
             blockundo.vtxundo.push_back(txundo);
 
         vPos.push_back(std::make_pair(GetTxHash(i), pos));
+        if (fSmallDataIndex)
+            GetTxSmallDataEntries(tx, GetTxHash(i), pindex->nHeight, pos, nTxFee, vSmallData);
         pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
     }
 
@@ -1768,9 +2212,15 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
         if (!pblocktree->WriteTxIndex(vPos))
             return state.Abort(_("Failed to write transaction index"));
 
+    if (pvSmallData)
+        pvSmallData->insert(pvSmallData->end(), vSmallData.begin(), vSmallData.end());
+
     // add this block to the view's block chain
     assert(view.SetBestBlock(pindex));
 
+    if (pblockundo)
+        pblockundo->vtxundo.swap(blockundo.vtxundo);
+
     // Watch for transactions paying to me
     for (unsigned int i=0; i<vtx.size(); i++)
         SyncWithWallets(GetTxHash(i), vtx[i], this, true);
@@ -1817,6 +2267,9 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
 
     // Disconnect shorter branch
     vector<CTransaction> vResurrect;
+    vector<uint256> vDisconnectedCoinbase;
+    vector<CSmallDataEvent> vSmallDataEvents;
+    vector<unsigned int> vSmallDataErase;
     BOOST_FOREACH(CBlockIndex* pindex, vDisconnect) {
         CBlock block;
         if (!block.ReadFromDisk(pindex))
@@ -1827,22 +2280,33 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
         if (fBenchmark)
             printf("- Disconnect: %.2fms\n", (GetTimeMicros() - nStart) * 0.001);
 
+        // The block's smalldata is dropped from the index once the longer branch
+        // is connected. Not done in DisconnectBlock, which VerifyDB also uses.
+        if (fSmallDataIndex)
+            vSmallDataErase.push_back(pindex->nHeight);
+        GetBlockSmallDataEvents(block, pindex, SMALLDATA_EVENT_DISCONNECT, vSmallDataEvents);
+
         // Queue memory transactions to resurrect.
         // We only do this for blocks after the last checkpoint (reorganisation before that
         // point should only happen with -reindex/-loadblock, or a misbehaving peer.
         BOOST_FOREACH(const CTransaction& tx, block.vtx)
             if (!tx.IsCoinBase() && pindex->nHeight > Checkpoints::GetTotalBlocksEstimate())
                 vResurrect.push_back(tx);
+        vDisconnectedCoinbase.push_back(block.vtx[0].GetHash());
     }
 
     // Connect longer branch
     vector<CTransaction> vDelete;
+    vector<CAdTx> vAds;
+    vector<pair<CSmallDataKey, CSmallDataIndexEntry> > vSmallDataWrite;
     BOOST_FOREACH(CBlockIndex *pindex, vConnect) {
         CBlock block;
         if (!block.ReadFromDisk(pindex))
             return state.Abort(_("Failed to read block"));
+        PrefetchBlockCoins(block);
         int64 nStart = GetTimeMicros();
-        if (!block.ConnectBlock(state, pindex, view)) {
+        CBlockUndo blockundo;
+        if (!block.ConnectBlock(state, pindex, view, false, fAdEnabled ? &blockundo : NULL, &vSmallDataWrite)) {
             if (state.IsInvalid()) {
                 InvalidChainFound(pindexNew);
                 InvalidBlockFound(pindex);
@@ -1855,6 +2319,12 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
         // Queue memory transactions to delete
         BOOST_FOREACH(const CTransaction& tx, block.vtx)
             vDelete.push_back(tx);
+        // Before they leave the pool, which has their smalldata parsed already
+        GetBlockSmallDataEvents(block, pindex, SMALLDATA_EVENT_CONNECT, vSmallDataEvents);
+
+        // Ads, with fees from the outputs this block spent
+        if (fAdEnabled)
+            GetBlockAds(block, blockundo, pindex->nHeight, vAds);
     }
 
     // Flush changes to global coin state
@@ -1865,9 +2335,15 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
     if (fBenchmark)
         printf("- Flush %i transactions: %.2fms (%.4fms/tx)\n", nModified, 0.001 * nTime, 0.001 * nTime / nModified);
 
+    // Replace the smalldata of the shorter branch with that of the longer one, now that
+    // all of it connected; a branch that failed leaves the index as it was
+    if (fSmallDataIndex && !pblocktree->UpdateSmallDataIndex(vSmallDataErase, vSmallDataWrite))
+        return state.Abort(_("Failed to write smalldata index"));
+
     // Make sure it's successfully written to disk before changing memory structure
     bool fIsInitialDownload = IsInitialBlockDownload();
-    if (!fIsInitialDownload || pcoinsTip->GetCacheSize() > nCoinCacheSize) {
+    bool fFlushed = false;
+    if (!fIsInitialDownload || pcoinsTip->DynamicMemoryUsage() > nCoinCacheUsage) {
         // Typical CCoins structures on disk are around 100 bytes in size.
         // Pushing a new one to the database can cause it to be written
         // twice (once in the log, and once in the tables). This is already
@@ -1879,6 +2355,7 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
         pblocktree->Sync();
         if (!pcoinsTip->Flush())
             return state.Abort(_("Failed to write to coin database"));
+        fFlushed = true;
     }
 
     // At this point, all changes have been done to the database.
@@ -1902,12 +2379,28 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
             mempool.remove(tx, true);
     }
 
+    // Memory transactions spending the coinbase of a disconnected block lost
+    // that input; have CreateNewBlock look at them again
+    BOOST_FOREACH(const uint256& hash, vDisconnectedCoinbase)
+        mempool.markDependersStale(hash);
+
     // Delete redundant memory transactions that are in the connected branch
     BOOST_FOREACH(CTransaction& tx, vDelete) {
         mempool.remove(tx);
         mempool.removeConflicts(tx);
     }
 
+    smallDataEvents.Push(vSmallDataEvents);
+
+    if (fAdEnabled) {
+        BOOST_FOREACH(CBlockIndex* pindex, vDisconnect)
+            adManager.disconnectBlockAds(pindex);
+        adManager.processBlockAds(vAds, pindexNew);
+        // Keep ad.dat at the block the coin database was flushed to, for a restart to resume from
+        if (fFlushed)
+            adManager.save();
+    }
+
     // Update best block in wallet (so we can detect restored wallets)
     if ((pindexNew->nHeight % 20160) == 0 || (!fIsInitialDownload && (pindexNew->nHeight % 144) == 0))
     {
@@ -1923,6 +2416,10 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
     nBestChainWork = pindexNew->nChainWork;
     nTimeBestReceived = GetTime();
     nTransactionsUpdated++;
+    {
+        boost::unique_lock<boost::mutex> lock(csBestBlock);
+        cvBlockChange.notify_all();
+    }
     printf("SetBestChain: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f\n",
       hashBestChain.ToString().c_str(), nBestHeight, log(nBestChainWork.getdouble())/log(2.0), (unsigned long)pindexNew->nChainTx,
       DateTimeStrFormat("%Y-%m-%d %H:%M:%S", pindexBest->GetBlockTime()).c_str(),
@@ -1978,7 +2475,9 @@ bool CBlock::AddToBlockIndex(CValidationState &state, const CDiskBlockPos &pos)
         pindexNew->nHeight = pindexNew->pprev->nHeight + 1;
     }
     pindexNew->nTx = vtx.size();
-    pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + pindexNew->GetBlockWork().getuint256();
+    uint256 nBlockWork = pindexNew->GetBlockWork();
+    pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + nBlockWork;
+    pindexNew->BuildAlgoChain(nBlockWork);
     pindexNew->nChainTx = (pindexNew->pprev ? pindexNew->pprev->nChainTx : 0) + pindexNew->nTx;
     pindexNew->nFile = pos.nFile;
     pindexNew->nDataPos = pos.nPos;
@@ -1986,6 +2485,10 @@ bool CBlock::AddToBlockIndex(CValidationState &state, const CDiskBlockPos &pos)
     pindexNew->nStatus = BLOCK_VALID_TRANSACTIONS | BLOCK_HAVE_DATA;
     setBlockIndexValid.insert(pindexNew);
 
+    // Keep the auxpow next to the index entry, so headers can be served and
+    // checked without reading the block
+    if (isAuxBlock() && !pblocktree->WriteAuxPow(hash, *auxpow))
+        return state.Abort(_("Failed to write auxpow"));
     if (!pblocktree->WriteBlockIndex(CDiskBlockIndex(pindexNew)))
         return state.Abort(_("Failed to write block index"));
 
@@ -2103,6 +2606,278 @@ bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigne
     return true;
 }
 
+/** Scrypt proof of work hashes of received block headers, computed ahead of
+ * CheckBlock.
+ *
+ * The network thread hands over messages of blocks we requested as soon as
+ * they are complete, once their header passes the checks that need no
+ * hashing, and worker threads hash their headers while the message handler is
+ * still busy with earlier blocks. A header whose hash fails is scored by
+ * CheckBlock like any other proof of work failure. Results are kept by the
+ * double-SHA256 of the hashed header: the block hash for plain scrypt blocks,
+ * the parent block hash for merge-mined ones. CheckBlock finds them in ProcessBlock and again
+ * in ConnectBlock, and hashes inline anything the workers didn't get to.
+ */
+class CPoWPipeline
+{
+private:
+    static const unsigned int MAX_QUEUED = 2048;
+    static const unsigned int MAX_HASHES = 8192;
+    static const unsigned int MAX_REQUESTED = 4096;
+
+    boost::mutex mutex;
+    // Workers wait on this for headers, lookups for a header being hashed
+    boost::condition_variable condWorker;
+    boost::condition_variable condDone;
+
+    // Headers waiting for a worker
+    std::deque<std::pair<uint256, std::vector<char> > > queue;
+    // Keys of queued headers, and of those a worker is hashing
+    std::set<uint256> setQueued;
+    std::set<uint256> setHashing;
+
+    // Computed hashes, with their keys oldest first for eviction
+    std::map<uint256, uint256> mapHashes;
+    std::deque<uint256> vKeys;
+
+    // Blocks we sent a getdata for and haven't received, oldest first for eviction
+    std::set<uint256> setRequested;
+    std::deque<uint256> vRequested;
+
+    uint64 nHits;
+    uint64 nMisses;
+
+    // Hash meter
+    int64 nMeterStart;
+    uint64 nMeterHashes;
+    double dHashesPerSec;
+
+    // requires lock on mutex
+    void Store(const uint256& key, const uint256& hashPoW)
+    {
+        if (!mapHashes.insert(make_pair(key, hashPoW)).second)
+            return;
+        vKeys.push_back(key);
+        while (vKeys.size() > MAX_HASHES)
+        {
+            mapHashes.erase(vKeys.front());
+            vKeys.pop_front();
+        }
+    }
+
+public:
+    CPoWPipeline() : nHits(0), nMisses(0), nMeterStart(0), nMeterHashes(0), dHashesPerSec(0) {}
+
+    // Only blocks we asked for get hashed ahead, so a peer can't have the
+    // workers hash blocks nobody requested
+    void Request(const uint256& hash)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (!setRequested.insert(hash).second)
+            return;
+        vRequested.push_back(hash);
+        while (vRequested.size() > MAX_REQUESTED)
+        {
+            setRequested.erase(vRequested.front());
+            vRequested.pop_front();
+        }
+    }
+
+    bool TakeRequested(const uint256& hash)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        // Left in vRequested, which only bounds the set
+        return setRequested.erase(hash) > 0;
+    }
+
+    void Queue(const char* pheader)
+    {
+        uint256 key = Hash(pheader, pheader + 80);
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (queue.size() >= MAX_QUEUED || setQueued.count(key) || mapHashes.count(key))
+                return;
+            queue.push_back(make_pair(key, std::vector<char>(pheader, pheader + 80)));
+            setQueued.insert(key);
+        }
+        condWorker.notify_one();
+    }
+
+    uint256 GetHash(const char* pheader)
+    {
+        uint256 key = Hash(pheader, pheader + 80);
+        {
+            boost::this_thread::disable_interruption di;
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (setHashing.count(key))
+                condDone.wait(lock);
+            std::map<uint256, uint256>::const_iterator mi = mapHashes.find(key);
+            if (mi != mapHashes.end())
+            {
+                nHits++;
+                return mi->second;
+            }
+            nMisses++;
+
+            // Not started yet, so it's quicker to do it here
+            if (setQueued.erase(key))
+                for (std::deque<std::pair<uint256, std::vector<char> > >::iterator it = queue.begin(); it != queue.end(); ++it)
+                    if (it->first == key)
+                    {
+                        queue.erase(it);
+                        break;
+                    }
+        }
+
+        uint256 hashPoW;
+        scrypt_1024_1_1_256(pheader, BEGIN(hashPoW));
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            Store(key, hashPoW);
+        }
+        return hashPoW;
+    }
+
+    void Thread()
+    {
+        std::vector<uint256> vBatchKeys;
+        std::vector<char> vInputs;
+        std::vector<uint256> vHashes;
+        loop
+        {
+            // Take as many headers as the multi-hash kernel does in one pass
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (queue.empty())
+                    condWorker.wait(lock);
+                vBatchKeys.clear();
+                vInputs.clear();
+                while (!queue.empty() && vBatchKeys.size() < scrypt_multi_ways)
+                {
+                    vBatchKeys.push_back(queue.front().first);
+                    vInputs.insert(vInputs.end(), queue.front().second.begin(), queue.front().second.end());
+                    setHashing.insert(queue.front().first);
+                    queue.pop_front();
+                }
+            }
+
+            vHashes.resize(vBatchKeys.size());
+            scrypt_1024_1_1_256_multi(&vInputs[0], BEGIN(vHashes[0]), vBatchKeys.size());
+
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                for (unsigned int i = 0; i < vBatchKeys.size(); i++)
+                {
+                    Store(vBatchKeys[i], vHashes[i]);
+                    setHashing.erase(vBatchKeys[i]);
+                    setQueued.erase(vBatchKeys[i]);
+                }
+
+                int64 nNow = GetTimeMillis();
+                if (nMeterStart == 0)
+                    nMeterStart = nNow;
+                nMeterHashes += vBatchKeys.size();
+                if (nNow - nMeterStart > 10000)
+                {
+                    dHashesPerSec = 1000.0 * nMeterHashes / (nNow - nMeterStart);
+                    nMeterStart = nNow;
+                    nMeterHashes = 0;
+                    // Only worth logging while blocks come in faster than they are validated
+                    if (!queue.empty())
+                        printf("PoW pipeline: %"PRIszu" headers queued, %.1f hashes/s\n", queue.size() + setHashing.size(), dHashesPerSec);
+                }
+            }
+            condDone.notify_all();
+        }
+    }
+
+    void GetStats(uint64& nDepth, double& dRate, uint64& nHitsOut, uint64& nMissesOut)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        nDepth = queue.size() + setHashing.size();
+        // The meter only moves while there is work
+        dRate = (GetTimeMillis() - nMeterStart > 20000) ? 0 : dHashesPerSec;
+        nHitsOut = nHits;
+        nMissesOut = nMisses;
+    }
+};
+
+static CPoWPipeline powPipeline;
+
+void ThreadPoWPipeline()
+{
+    RenameThread("bitcoin-powhash");
+    powPipeline.Thread();
+}
+
+// Merge-mined blocks are parsed only this far to find the parent header; one
+// with a longer auxpow is hashed when it is checked
+static const unsigned int MAX_QUEUED_HEADER_SIZE = 8192;
+
+void RequestBlockPoW(const uint256& hash)
+{
+    if (nPoWThreads > 0)
+        powPipeline.Request(hash);
+}
+
+void QueueBlockPoW(CNode* pfrom, const CDataStream& vRecv)
+{
+    // Blocks received while importing are ignored, and a peer that has
+    // misbehaved gets no work done ahead for it
+    if (nPoWThreads == 0 || fImporting || fReindex || pfrom->HasMisbehaved())
+        return;
+    if (vRecv.size() < 80 || vRecv.size() > MAX_BLOCK_SIZE)
+        return;
+    int nVersion;
+    memcpy(&nVersion, &vRecv[0], sizeof(nVersion));
+    if (!(nVersion & CBlockHeader::VERSION_SCRYPT))
+        return;
+    if (!powPipeline.TakeRequested(Hash(&vRecv[0], &vRecv[0] + 80)))
+        return;
+
+    // Parse a copy of the start of the message, leaving the message to ProcessMessage,
+    // which also reports malformed blocks. Merge-mined blocks are parsed up to the
+    // parent header at the end of the auxpow, which carries their proof of work.
+    CBlockHeader header;
+    try
+    {
+        CDataStream ss(vRecv.begin(), vRecv.begin() + std::min((unsigned int)vRecv.size(), MAX_QUEUED_HEADER_SIZE), SER_NETWORK, PROTOCOL_VERSION);
+        ss >> header;
+    }
+    catch (std::exception&)
+    {
+        // Longer than the copy, or malformed
+        return;
+    }
+
+    // Headers CheckBlock would turn down without hashing aren't worth a worker
+    if (header.GetBlockTime() > GetAdjustedTime() + 2 * 60 * 60)
+        return;
+    bool fNegative, fOverflow;
+    arith_uint256 bnTarget;
+    bnTarget.SetCompact(header.nBits, &fNegative, &fOverflow);
+    if (fNegative || fOverflow || bnTarget == 0 || bnTarget > bnProofOfWorkLimits[CBlockHeader::BLOCK_ALGO_SCRYPT])
+        return;
+
+    if (!(nVersion & CBlockHeader::VERSION_AUX))
+        powPipeline.Queue(&vRecv[0]);
+    else if (header.auxpow)
+        powPipeline.Queue(BEGIN(header.auxpow->vParentBlockHeader.nVersion));
+}
+
+void GetPoWPipelineStats(uint64& nDepth, double& dHashesPerSec, uint64& nHits, uint64& nMisses)
+{
+    powPipeline.GetStats(nDepth, dHashesPerSec, nHits, nMisses);
+}
+
+uint256 CBlock::GetPipelinedPoWHash() const
+{
+    if (GetAlgo() != CBlockHeader::BLOCK_ALGO_SCRYPT)
+        return GetPoWHash();
+    if (isAuxBlock())
+        return powPipeline.GetHash(BEGIN(auxpow->vParentBlockHeader.nVersion));
+    return powPipeline.GetHash(BEGIN(nVersion));
+}
 
 bool CBlock::CheckBlock(CValidationState &state, bool fCheckPOW, bool fCheckMerkleRoot) const
 {
@@ -2136,7 +2911,7 @@ bool CBlock::CheckBlock(CValidationState &state, bool fCheckPOW, bool fCheckMerk
     if ( fCheckPOW && isAuxBlock() && !auxpow.get()->Check(GetHash(), chainid))
         return state.DoS(50, error("CheckProofOfWork() : AUX POW is not valid"));
     
-    if (fCheckPOW && !CheckProofOfWork(GetPoWHash(), nBits, GetAlgo()))
+    if (fCheckPOW && !CheckProofOfWork(GetPipelinedPoWHash(), nBits, GetAlgo()))
         return state.DoS(50, error("CheckBlock() : proof of work failed"));
 
     // Check timestamp
@@ -2318,10 +3093,10 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
         #if 0
         if ( pcheckpoint->nVersion == pblock->nVersion )
         {
-            CBigNum bnNewBlock;
+            arith_uint256 bnNewBlock;
             bnNewBlock.SetCompact(pblock->nBits);
-            CBigNum bnRequired;
-            bnRequired.SetCompact(ComputeMinWork(pcheckpoint->nBits, deltaTime));
+            arith_uint256 bnRequired;
+            bnRequired.SetCompact(ComputeMinWork(pcheckpoint->nBits, deltaTime, pblock->GetAlgo()));
             if (bnNewBlock > bnRequired)
             {
                 return state.DoS(100, error("ProcessBlock() : block with too little proof-of-work"));
@@ -2352,8 +3127,6 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
     if (!pblock->AcceptBlock(state, dbp))
         return error("ProcessBlock() : AcceptBlock FAILED");
 
-    adManager.processBlock(pblock);
-
     // Recursively process any orphan blocks that depended on this one
     vector<uint256> vWorkQueue;
     vWorkQueue.push_back(hash);
@@ -2632,7 +3405,9 @@ bool static LoadBlockIndexDB()
     BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
     {
         CBlockIndex* pindex = item.second;
-        pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + pindex->GetBlockWork().getuint256();
+        uint256 nBlockWork = pindex->GetBlockWork();
+        pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + nBlockWork;
+        pindex->BuildAlgoChain(nBlockWork);
         pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0) + pindex->nTx;
         if ((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS && !(pindex->nStatus & BLOCK_FAILED_MASK))
             setBlockIndexValid.insert(pindex);
@@ -2658,6 +3433,10 @@ bool static LoadBlockIndexDB()
     pblocktree->ReadFlag("txindex", fTxIndex);
     printf("LoadBlockIndexDB(): transaction index %s\n", fTxIndex ? "enabled" : "disabled");
 
+    // Check whether we have a smalldata index
+    pblocktree->ReadFlag("smalldataindex", fSmallDataIndex);
+    printf("LoadBlockIndexDB(): smalldata index %s\n", fSmallDataIndex ? "enabled" : "disabled");
+
     // Load hashBestChain pointer to end of best chain
     pindexBest = pcoinsTip->GetBestBlock();
     if (pindexBest == NULL)
@@ -2680,6 +3459,42 @@ bool static LoadBlockIndexDB()
     return true;
 }
 
+// Check the proof of work of plain (not merged-mined) scrypt blocks from their index
+// entries, hashing several headers per pass of the multi-hash kernel
+static bool CheckScryptProofOfWorkBatch(const vector<CBlockIndex*>& vIndex)
+{
+    if (vIndex.empty())
+        return true;
+
+    vector<char> vInputs(80 * vIndex.size());
+    vector<uint256> vHash(vIndex.size());
+    for (unsigned int i = 0; i < vIndex.size(); i++)
+    {
+        CBlockHeader header = vIndex[i]->GetBlockHeader();
+        memcpy(&vInputs[80 * i], BEGIN(header.nVersion), 80);
+    }
+    scrypt_1024_1_1_256_multi(&vInputs[0], BEGIN(vHash[0]), vIndex.size());
+
+    for (unsigned int i = 0; i < vIndex.size(); i++)
+        if (!CheckProofOfWork(vHash[i], vIndex[i]->nBits, CBlockHeader::BLOCK_ALGO_SCRYPT))
+            return error("CheckScryptProofOfWorkBatch() : proof of work failed at %d, hash=%s", vIndex[i]->nHeight, vIndex[i]->GetBlockHash().ToString().c_str());
+    return true;
+}
+
+// Check the auxpow and proof of work of a merged-mined block from the auxpow store
+static bool CheckAuxProofOfWork(CBlockIndex* pindex)
+{
+    boost::shared_ptr<CAuxPow> auxpow;
+    if (!ReadBlockAuxPow(pindex, auxpow))
+        return false;
+    int chainid = fTestNet ? GetDefaultPort() : 0;
+    if (!auxpow->Check(pindex->GetBlockHash(), chainid))
+        return error("CheckAuxProofOfWork() : AUX POW is not valid at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
+    if (!CheckProofOfWork(auxpow->GetPoWHash(pindex->GetAlgo()), pindex->nBits, pindex->GetAlgo()))
+        return error("CheckAuxProofOfWork() : proof of work failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
+    return true;
+}
+
 bool VerifyDB(int nCheckLevel, int nCheckDepth)
 {
     if (pindexBest == NULL || pindexBest->pprev == NULL)
@@ -2697,6 +3512,33 @@ bool VerifyDB(int nCheckLevel, int nCheckDepth)
     CBlockIndex* pindexFailure = NULL;
     int nGoodTransactions = 0;
     CValidationState state;
+    // Scrypt dominates the cost of check level 1, so check the proof of work of plain
+    // scrypt blocks in batches up front. Merged-mined blocks are checked from the
+    // auxpow store along the way.
+    set<CBlockIndex*> setPoWChecked;
+    if (nCheckLevel >= 1)
+    {
+        vector<CBlockIndex*> vBatch;
+        for (CBlockIndex* pindex = pindexBest; pindex && pindex->pprev && pindex->nHeight >= nBestHeight-nCheckDepth; pindex = pindex->pprev)
+        {
+            if (pindex->nVersion & CBlockHeader::VERSION_AUX)
+            {
+                if (!CheckAuxProofOfWork(pindex))
+                    return error("VerifyDB() : *** found bad block proof of work");
+                setPoWChecked.insert(pindex);
+            }
+            else if (pindex->nVersion & CBlockHeader::VERSION_SCRYPT)
+                vBatch.push_back(pindex);
+            if (vBatch.size() == 256 || !pindex->pprev->pprev || pindex->nHeight == nBestHeight-nCheckDepth)
+            {
+                boost::this_thread::interruption_point();
+                if (!CheckScryptProofOfWorkBatch(vBatch))
+                    return error("VerifyDB() : *** found bad block proof of work");
+                setPoWChecked.insert(vBatch.begin(), vBatch.end());
+                vBatch.clear();
+            }
+        }
+    }
     for (CBlockIndex* pindex = pindexBest; pindex && pindex->pprev; pindex = pindex->pprev)
     {
         boost::this_thread::interruption_point();
@@ -2707,7 +3549,7 @@ bool VerifyDB(int nCheckLevel, int nCheckDepth)
         if (!block.ReadFromDisk(pindex))
             return error("VerifyDB() : *** block.ReadFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
         // check level 1: verify block validity
-        if (nCheckLevel >= 1 && !block.CheckBlock(state))
+        if (nCheckLevel >= 1 && !block.CheckBlock(state, !setPoWChecked.count(pindex)))
             return error("VerifyDB() : *** found bad block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
         // check level 2: verify undo validity
         if (nCheckLevel >= 2 && pindex) {
@@ -2719,7 +3561,7 @@ bool VerifyDB(int nCheckLevel, int nCheckDepth)
             }
         }
         // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
-        if (nCheckLevel >= 3 && pindex == pindexState && (coins.GetCacheSize() + pcoinsTip->GetCacheSize()) <= 2*nCoinCacheSize + 32000) {
+        if (nCheckLevel >= 3 && pindex == pindexState && coins.DynamicMemoryUsage() + pcoinsTip->DynamicMemoryUsage() <= nCoinCacheUsage) {
             bool fClean = true;
             if (!block.DisconnectBlock(state, pindex, coins, &fClean))
                 return error("VerifyDB() : *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
@@ -2798,6 +3640,9 @@ bool InitBlockIndex() {
         fTxIndex = true;
     
     pblocktree->WriteFlag("txindex", fTxIndex);
+    // Use the provided setting for -smalldataindex in the new database
+    fSmallDataIndex = GetBoolArg("-smalldataindex", false);
+    pblocktree->WriteFlag("smalldataindex", fSmallDataIndex);
     printf("Initializing databases...\n");
 
     // Only add the genesis block if not reindexing (in which case we reuse the one already on disk)
@@ -3057,7 +3902,7 @@ string GetWarnings(string strFor)
     }
 
     // Longer invalid proof-of-work chain
-    if (pindexBest && nBestInvalidWork > nBestChainWork + (pindexBest->GetBlockWork() * 6).getuint256())
+    if (pindexBest && nBestInvalidWork > nBestChainWork + pindexBest->GetBlockWork() * 6)
     {
         nPriority = 2000;
         strStatusBar = strRPC = _("Warning: Displayed transactions may not be correct! You may need to upgrade, or other nodes may need to upgrade.");
@@ -3596,7 +4441,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         printf("getheaders %d to %s\n", (pindex ? pindex->nHeight : -1), hashStop.ToString().c_str());
         for (; pindex; pindex = pindex->pnext)
         {
-            vHeaders.push_back(pindex->GetBlockHeader());
+            CBlockHeader header;
+            if (!ReadBlockHeader(pindex, header))
+                break;
+            vHeaders.push_back(header);
             if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
                 break;
         }
@@ -4137,6 +4985,8 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             {
                 if (fDebugNet)
                     printf("sending getdata: %s\n", inv.ToString().c_str());
+                if (inv.type == MSG_BLOCK)
+                    RequestBlockPoW(inv.hash);
                 vGetData.push_back(inv);
                 if (vGetData.size() >= 1000)
                 {
@@ -4213,9 +5063,45 @@ void SHA256Transform(void* pstate, void* pinput, const void* pinit)
 // between calls, but periodically or if nNonce is 0xffff0000 or above,
 // the block is rebuilt and nNonce starts over at zero.
 //
+// With a SIMD kernel, nonces go through in batches of sha256d_scan_ways
+// and only a candidate is hashed again with the scalar transform, to fill
+// phash1 and phash for the caller.
+//
 unsigned int static ScanHash_CryptoPP(char* pmidstate, char* pdata, char* phash1, char* phash, unsigned int& nHashesDone)
 {
     unsigned int& nNonce = *(unsigned int*)(pdata + 12);
+    if (sha256d_scan != NULL)
+    {
+        const unsigned int nWays = sha256d_scan_ways;
+        uint32_t hash7[SHA256D_SCAN_MAX_WAYS];
+        for (;;)
+        {
+            unsigned int nFirst = nNonce + 1;
+            nNonce = nFirst;
+            unsigned int nMask = sha256d_scan((const uint32_t*)pmidstate, (const uint32_t*)pdata, hash7);
+            if (nMask != 0)
+            {
+                unsigned int nLane = 0;
+                while (!(nMask & (1 << nLane)))
+                    nLane++;
+                nNonce = nFirst + nLane;
+                SHA256Transform(phash1, pdata, pmidstate);
+                SHA256Transform(phash, phash1, pSHA256InitState);
+                return nNonce;
+            }
+            nNonce = nFirst + nWays - 1;
+
+            // The batch ended within nWays past a multiple of 0x10000
+            if ((nNonce & 0xffff) < nWays)
+            {
+                nHashesDone = 0xffff+1;
+                return (unsigned int) -1;
+            }
+            if ((nNonce & 0xfff) < nWays)
+                boost::this_thread::interruption_point();
+        }
+    }
+
     for (;;)
     {
         // Crypto++ SHA256
@@ -4241,36 +5127,11 @@ unsigned int static ScanHash_CryptoPP(char* pmidstate, char* pdata, char* phash1
     }
 }
 
-// Some explaining would be appreciated
-class COrphan
-{
-public:
-    CTransaction* ptx;
-    set<uint256> setDependsOn;
-    double dPriority;
-    double dFeePerKb;
-
-    COrphan(CTransaction* ptxIn)
-    {
-        ptx = ptxIn;
-        dPriority = dFeePerKb = 0;
-    }
-
-    void print() const
-    {
-        printf("COrphan(hash=%s, dPriority=%.1f, dFeePerKb=%.1f)\n",
-               ptx->GetHash().ToString().c_str(), dPriority, dFeePerKb);
-        BOOST_FOREACH(uint256 hash, setDependsOn)
-            printf("   setDependsOn %s\n", hash.ToString().c_str());
-    }
-};
-
-
 uint64 nLastBlockTx = 0;
 uint64 nLastBlockSize = 0;
 
 // We want to sort transactions by priority and fee, so:
-typedef boost::tuple<double, double, CTransaction*> TxPriority;
+typedef boost::tuple<double, double, const CTxMemPoolEntry*> TxPriority;
 class TxPriorityCompare
 {
     bool byFee;
@@ -4337,82 +5198,21 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, int algo)
         CBlockIndex* pindexPrev = pindexBest;
         CCoinsViewCache view(*pcoinsTip, true);
 
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-        bool fPrintPriority = GetBoolArg("-printpriority");
+        // Bring the cached per-transaction data and the pool's fee and priority
+        // indexes up to date; only transactions added since the last call or
+        // whose inputs moved need coins lookups
+        mempool.refreshEntries(view, pindexPrev->nHeight);
 
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
-        {
-            CTransaction& tx = (*mi).second;
-            if (tx.IsCoinBase() || !tx.IsFinal())
-                continue;
-
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            int64 nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-            {
-                // Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        printf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].vout[txin.prevout.n].nValue;
-                    continue;
-                }
-                const CCoins &coins = view.GetCoins(txin.prevout.hash);
-
-                int64 nValueIn = coins.vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = pindexPrev->nHeight - coins.nHeight + 1;
-
-                dPriority += (double)nValueIn * nConf;
-            }
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority /= nTxSize;
+        bool fPrintPriority = GetBoolArg("-printpriority");
 
-            // This is a more accurate fee-per-kilobyte than is used by the client code, because the
-            // client code rounds up the size to the nearest 1K. That's good, because it gives an
-            // incentive to create smaller transactions.
-            double dFeePerKb =  double(nTotalIn-tx.GetValueOut()) / (double(nTxSize)/1000.0);
-
-            if (porphan)
-            {
-                porphan->dPriority = dPriority;
-                porphan->dFeePerKb = dFeePerKb;
-            }
-            else
-                vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &(*mi).second));
-        }
+        // Walk the priority index and then the fee index from the top. Entries
+        // are already checked against the chain, so only the block limits are
+        // applied here. Transactions spending other pool transactions wait until
+        // all of those are in the block, and then compete in vecReady.
+        set<const CTxMemPoolEntry*> setDone, setWaiting;
+        set<uint256> setInBlock;
+        map<uint256, vector<const CTxMemPoolEntry*> > mapDependers;
+        vector<TxPriority> vecReady;
 
         // Collect transactions into block
         uint64 nBlockSize = 1000;
@@ -4421,25 +5221,70 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, int algo)
         bool fSortedByFee = (nBlockPrioritySize <= 0);
 
         TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+        CTxMemPoolIndex::const_reverse_iterator itPriority = mempool.mapByPriority.rbegin();
+        CTxMemPoolIndex::const_reverse_iterator itFee = mempool.mapByFee.rbegin();
 
-        while (!vecPriority.empty())
+        for (;;)
         {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            double dFeePerKb = vecPriority.front().get<1>();
-            CTransaction& tx = *(vecPriority.front().get<2>());
+            // Next entry of the index in use that was not looked at yet
+            CTxMemPoolIndex::const_reverse_iterator& it = fSortedByFee ? itFee : itPriority;
+            CTxMemPoolIndex::const_reverse_iterator itEnd = fSortedByFee ? mempool.mapByFee.rend() : mempool.mapByPriority.rend();
+            while (it != itEnd && (setDone.count(it->second) || setWaiting.count(it->second)))
+                ++it;
+
+            const CTxMemPoolEntry* pentry = NULL;
+            double dPriority = 0, dFeePerKb = 0;
+            if (it != itEnd)
+            {
+                pentry = it->second;
+                dPriority = pentry->dIndexedPriority;
+                dFeePerKb = pentry->GetFeePerKb();
+            }
+            if (!vecReady.empty() && (pentry == NULL || comparer(TxPriority(dPriority, dFeePerKb, pentry), vecReady.front())))
+            {
+                dPriority = vecReady.front().get<0>();
+                dFeePerKb = vecReady.front().get<1>();
+                pentry = vecReady.front().get<2>();
+                std::pop_heap(vecReady.begin(), vecReady.end(), comparer);
+                vecReady.pop_back();
+            }
+            else if (pentry != NULL)
+                ++it;
+            else
+                break;
+            // A waiting entry that became ready may also come up in the index
+            if (!setDone.insert(pentry).second)
+                continue;
+            const CTransaction& tx = *pentry->ptx;
+            uint256 hash = tx.GetHash();
 
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
+            if (!tx.IsFinal())
+                continue;
+
+            // Has to wait for dependencies
+            bool fWaiting = false;
+            BOOST_FOREACH(const uint256& hashParent, pentry->vDependsOn)
+            {
+                if (!setInBlock.count(hashParent))
+                {
+                    mapDependers[hashParent].push_back(pentry);
+                    fWaiting = true;
+                }
+            }
+            if (fWaiting)
+            {
+                setDone.erase(pentry);
+                setWaiting.insert(pentry);
+                continue;
+            }
 
             // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+            unsigned int nTxSize = pentry->nTxSize;
             if (nBlockSize + nTxSize >= nBlockMaxSize)
                 continue;
 
             // Legacy limits on sigOps:
-            unsigned int nTxSigOps = tx.GetLegacySigOpCount();
+            unsigned int nTxSigOps = pentry->nLegacySigOps;
             if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
                 continue;
 
@@ -4454,25 +5299,14 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, int algo)
             {
                 fSortedByFee = true;
                 comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                std::make_heap(vecReady.begin(), vecReady.end(), comparer);
             }
 
-            if (!tx.HaveInputs(view))
-                continue;
-
-            int64 nTxFees = tx.GetValueIn(view)-tx.GetValueOut();
-
-            nTxSigOps += tx.GetP2SHSigOpCount(view);
+            nTxSigOps += pentry->nP2SHSigOps;
             if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
                 continue;
 
-            CValidationState state;
-            if (!tx.CheckInputs(state, view, true, SCRIPT_VERIFY_P2SH))
-                continue;
-
-            CTxUndo txundo;
-            uint256 hash = tx.GetHash();
-            tx.UpdateCoins(state, view, txundo, pindexPrev->nHeight+1, hash);
+            int64 nTxFees = pentry->nFee;
 
             // Added
             pblock->vtx.push_back(tx);
@@ -4482,6 +5316,7 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, int algo)
             ++nBlockTx;
             nBlockSigOps += nTxSigOps;
             nFees += nTxFees;
+            setInBlock.insert(hash);
 
             if (fPrintPriority)
             {
@@ -4489,21 +5324,23 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, int algo)
                        dPriority, dFeePerKb, tx.GetHash().ToString().c_str());
             }
 
-            // Add transactions that depend on this one to the priority queue
-            if (mapDependers.count(hash))
+            // Transactions that depend on this one compete once all their inputs are in
+            map<uint256, vector<const CTxMemPoolEntry*> >::iterator mi = mapDependers.find(hash);
+            if (mi != mapDependers.end())
             {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
+                BOOST_FOREACH(const CTxMemPoolEntry* pentryDepender, mi->second)
                 {
-                    if (!porphan->setDependsOn.empty())
+                    bool fReady = true;
+                    BOOST_FOREACH(const uint256& hashParent, pentryDepender->vDependsOn)
+                        if (!setInBlock.count(hashParent))
+                            fReady = false;
+                    if (fReady && setWaiting.erase(pentryDepender))
                     {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                        {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
+                        vecReady.push_back(TxPriority(pentryDepender->dIndexedPriority, pentryDepender->GetFeePerKb(), pentryDepender));
+                        std::push_heap(vecReady.begin(), vecReady.end(), comparer);
                     }
                 }
+                mapDependers.erase(mi);
             }
         }
 
@@ -4544,6 +5381,15 @@ CBlockTemplate* CreateNewBlockWithKey(CReserveKey& reservekey, int algo)
     return CreateNewBlock(scriptPubKey, algo);
 }
 
+void static SetExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int nExtraNonce)
+{
+    unsigned int nHeight = pindexPrev->nHeight+1; // Height first in coinbase required for block.version=2
+    pblock->vtx[0].vin[0].scriptSig = (CScript() << nHeight << CBigNum(nExtraNonce)) + COINBASE_FLAGS;
+    assert(pblock->vtx[0].vin[0].scriptSig.size() <= 100);
+
+    pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+}
+
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
 {
     // Update nExtraNonce
@@ -4554,11 +5400,7 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
         hashPrevBlock = pblock->hashPrevBlock;
     }
     ++nExtraNonce;
-    unsigned int nHeight = pindexPrev->nHeight+1; // Height first in coinbase required for block.version=2
-    pblock->vtx[0].vin[0].scriptSig = (CScript() << nHeight << CBigNum(nExtraNonce)) + COINBASE_FLAGS;
-    assert(pblock->vtx[0].vin[0].scriptSig.size() <= 100);
-
-    pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+    SetExtraNonce(pblock, pindexPrev, nExtraNonce);
 }
 
 
@@ -4611,8 +5453,7 @@ void FormatHashBuffers(CBlock* pblock, char* pmidstate, char* pdata, char* phash
 bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey)
 {
     uint256 hash = pblock->GetPoWHash();
-    CBigNum bnNew = CBigNum().SetCompact(pblock->nBits);
-    uint256 hashTarget = bnNew.getuint256();
+    uint256 hashTarget = arith_uint256().SetCompact(pblock->nBits);
 
     if (hash > hashTarget)
     {
@@ -4649,31 +5490,289 @@ bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey)
     return true;
 }
 
-void static LitecoinMiner(CWallet *pwallet)
+// Scrypt-hash the next batch of nonces of pblock with the multi-hash kernel.
+// midstate must have been prepared from the first 64 bytes of the current header.
+// Returns true with pblock->nNonce set to the solution if one was found,
+// otherwise advances pblock->nNonce past the batch.
+static bool ScanHashScrypt(CBlock *pblock, const scrypt_mining_midstate& midstate, const uint256& hashTarget, char *pinputs, char *scratchpad, unsigned int& nHashesDone)
+{
+    unsigned int nWays = scrypt_multi_ways;
+    uint256 vHash[SCRYPT_MULTI_MAX];
+
+    for (unsigned int i = 0; i < nWays; i++)
+    {
+        unsigned int nNonce = pblock->nNonce + i;
+        memcpy(pinputs + 80 * i, BEGIN(pblock->nVersion), 76);
+        memcpy(pinputs + 80 * i + 76, &nNonce, 4);
+    }
+    scrypt_1024_1_1_256_multi_mining(&midstate, pinputs, BEGIN(vHash[0]), nWays, scratchpad);
+    nHashesDone += nWays;
+
+    for (unsigned int i = 0; i < nWays; i++)
+    {
+        if (vHash[i] <= hashTarget)
+        {
+            pblock->nNonce += i;
+            return true;
+        }
+    }
+    pblock->nNonce += nWays;
+    return false;
+}
+
+// Block template shared by the internal miner threads of one algo.
+// Immutable once published; each thread mines its own copy of the block.
+class CMinerTemplate
+{
+public:
+    CBlockTemplate blocktemplate;
+    CBlockIndex* pindexPrev;
+    int algo;
+};
+
+// Builds the shared miner templates, one per algo, on its own thread.
+// ThreadMinerTemplates waits on cvBlockChange and rebuilds on a new tip, or on
+// memory pool changes once the templates are a minute old, so the
+// CreateNewBlock cost doesn't grow with the number of threads. On a new tip
+// the old templates are withdrawn before rebuilding: miner threads see that
+// at their next IsCurrent check and wait in Get for the new ones.
+// All templates pay to the same reserved key. Only the producer thread builds
+// with it and CheckWork keeps it, both under cs; once a block is found the tip
+// changes, and the rebuilt templates pay to a new key. A template of another
+// algo that still pays to the kept key can only produce a stale block, which
+// CheckWork rejects.
+// cs is always taken after cs_main: building a template and CheckWork take
+// cs_main and cs_wallet, and setgenerate resets the producer with both held.
+// mutex, guarding the published templates, is taken last.
+class CMinerTemplateProducer
+{
+private:
+    CCriticalSection cs;
+    CWallet* pwallet;
+    CReserveKey* preservekey;
+
+    boost::mutex mutex;
+    boost::condition_variable condTemplate;
+    boost::shared_ptr<const CMinerTemplate> pTemplate[CBlockHeader::NUM_ALGOS];
+    bool fWanted[CBlockHeader::NUM_ALGOS];
+    // CreateNewBlock failed for the algo; its threads stop as they used to
+    bool fFailed[CBlockHeader::NUM_ALGOS];
+    bool fStopped;
+
+    // What the published templates were built on; producer thread only
+    uint256 hashPrevBuilt;
+    unsigned int nTransactionsUpdatedBuilt;
+    int64 nBuilt;
+
+    // requires lock on csBestBlock
+    bool NeedsRebuild()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (fStopped)
+                return false;
+            for (int algo = 0; algo < CBlockHeader::NUM_ALGOS; algo++)
+                if (fWanted[algo] && !pTemplate[algo] && !fFailed[algo])
+                    return true;
+        }
+        return hashBestChain != hashPrevBuilt ||
+               (nTransactionsUpdated != nTransactionsUpdatedBuilt && GetTime() - nBuilt >= 60);
+    }
+
+    void Withdraw()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        for (int algo = 0; algo < CBlockHeader::NUM_ALGOS; algo++)
+            pTemplate[algo].reset();
+    }
+
+    void Rebuild()
+    {
+        LOCK2(cs_main, cs);
+        // Setgenerate may have reset us for another set of threads while we waited
+        boost::this_thread::interruption_point();
+        if (!preservekey)
+            return;
+        bool fWantedNow[CBlockHeader::NUM_ALGOS];
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            for (int algo = 0; algo < CBlockHeader::NUM_ALGOS; algo++)
+                fWantedNow[algo] = fWanted[algo];
+        }
+        boost::shared_ptr<const CMinerTemplate> pTemplateNew[CBlockHeader::NUM_ALGOS];
+        for (int algo = 0; algo < CBlockHeader::NUM_ALGOS; algo++)
+        {
+            if (!fWantedNow[algo])
+                continue;
+            boost::shared_ptr<CMinerTemplate> ptemplate(new CMinerTemplate());
+            ptemplate->pindexPrev = pindexBest;
+            ptemplate->algo = algo;
+            auto_ptr<CBlockTemplate> pblocktemplate(CreateNewBlockWithKey(*preservekey, algo));
+            if (!pblocktemplate.get())
+                continue;
+            ptemplate->blocktemplate = *pblocktemplate;
+            pTemplateNew[algo] = ptemplate;
+        }
+        hashPrevBuilt = hashBestChain;
+        nTransactionsUpdatedBuilt = nTransactionsUpdated;
+        nBuilt = GetTime();
+
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            for (int algo = 0; algo < CBlockHeader::NUM_ALGOS; algo++)
+            {
+                pTemplate[algo] = pTemplateNew[algo];
+                fFailed[algo] = fWantedNow[algo] && !pTemplateNew[algo];
+            }
+        }
+        condTemplate.notify_all();
+    }
+
+public:
+    CMinerTemplateProducer()
+    {
+        pwallet = NULL;
+        preservekey = NULL;
+        for (int algo = 0; algo < CBlockHeader::NUM_ALGOS; algo++)
+            fWanted[algo] = fFailed[algo] = false;
+        fStopped = true;
+        nTransactionsUpdatedBuilt = 0;
+        nBuilt = 0;
+    }
+
+    ~CMinerTemplateProducer()
+    {
+        delete preservekey;
+    }
+
+    // Start over for a new set of miner threads, or stop handing out work if pwalletIn is NULL
+    void Reset(CWallet* pwalletIn)
+    {
+        LOCK2(cs_main, cs);
+        delete preservekey;
+        preservekey = pwalletIn ? new CReserveKey(pwalletIn) : NULL;
+        pwallet = pwalletIn;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            for (int algo = 0; algo < CBlockHeader::NUM_ALGOS; algo++)
+            {
+                pTemplate[algo].reset();
+                fWanted[algo] = fFailed[algo] = false;
+            }
+            fStopped = !pwalletIn;
+        }
+        condTemplate.notify_all();
+    }
+
+    // Current template for algo, waiting for the producer thread if there is none.
+    // Empty if mining has been stopped or no block could be created.
+    boost::shared_ptr<const CMinerTemplate> Get(int algo)
+    {
+        bool fFirst = false;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (!fStopped && !fWanted[algo])
+                fFirst = fWanted[algo] = true;
+        }
+        if (fFirst)
+        {
+            boost::unique_lock<boost::mutex> lock(csBestBlock);
+            cvBlockChange.notify_all();
+        }
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (!fStopped && !pTemplate[algo] && !fFailed[algo])
+            condTemplate.wait(lock);
+        return pTemplate[algo];
+    }
+
+    // False once ptemplate has been withdrawn or replaced
+    bool IsCurrent(const boost::shared_ptr<const CMinerTemplate>& ptemplate)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return pTemplate[ptemplate->algo] == ptemplate;
+    }
+
+    bool CheckWork(CBlock* pblock)
+    {
+        LOCK2(cs_main, cs);
+        if (!preservekey)
+            return false;
+        return ::CheckWork(pblock, *pwallet, *preservekey);
+    }
+
+    void Thread()
+    {
+        loop
+        {
+            uint256 hashPrev;
+            {
+                boost::unique_lock<boost::mutex> lock(csBestBlock);
+                while (!NeedsRebuild())
+                {
+                    if (nTransactionsUpdated != nTransactionsUpdatedBuilt)
+                        cvBlockChange.timed_wait(lock, boost::get_system_time() + boost::posix_time::seconds(std::max(nBuilt + 60 - GetTime(), (int64)1)));
+                    else
+                        cvBlockChange.wait(lock);
+                }
+                hashPrev = hashBestChain;
+            }
+            if (hashPrev != hashPrevBuilt)
+                Withdraw();
+            Rebuild();
+        }
+    }
+};
+
+// Never destroyed before the miner threads, which are interrupted but not joined
+static CMinerTemplateProducer minerTemplates;
+
+void static ThreadMinerTemplates()
+{
+    RenameThread("bitcoin-minertpl");
+    try
+    {
+        minerTemplates.Thread();
+    }
+    catch (boost::thread_interrupted)
+    {
+        printf("miner template thread terminated\n");
+        throw;
+    }
+}
+
+void static LitecoinMiner(CWallet *pwallet, int nThread, int nThreads)
 {
     printf("LitecoinMiner started\n");
     SetThreadPriority(THREAD_PRIORITY_LOWEST);
     RenameThread("litecoin-miner");
 
-    // Each thread has its own key and counter
-    CReserveKey reservekey(pwallet);
-    unsigned int nExtraNonce = 0;
+    // The threads of an algo share its template; thread nThread of nThreads
+    // mines extranonces nThread+1, nThread+1+nThreads, ... of each template
+    boost::shared_ptr<const CMinerTemplate> ptemplate;
+    unsigned int nRound = 0;
+    std::vector<char> vInputs(80 * SCRYPT_MULTI_MAX);
+    std::vector<char> vScratchpad(SCRYPT_MULTI_SCRATCHPAD_SIZE);
 
     try { loop {
         //while (vNodes.empty())
             //MilliSleep(1000);
 
         //
-        // Create new block
+        // Copy the shared block template
         //
-        unsigned int nTransactionsUpdatedLast = nTransactionsUpdated;
-        CBlockIndex* pindexPrev = pindexBest;
-
-        auto_ptr<CBlockTemplate> pblocktemplate(CreateNewBlockWithKey(reservekey, CBlockHeader::BLOCK_ALGO_SCRYPT));
-        if (!pblocktemplate.get())
+        boost::shared_ptr<const CMinerTemplate> ptemplateNew = minerTemplates.Get(CBlockHeader::BLOCK_ALGO_SCRYPT);
+        if (!ptemplateNew)
             return;
-        CBlock *pblock = &pblocktemplate->block;
-        IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
+        if (ptemplateNew != ptemplate)
+        {
+            ptemplate = ptemplateNew;
+            nRound = 0;
+        }
+        CBlockIndex* pindexPrev = ptemplate->pindexPrev;
+        CBlock block(ptemplate->blocktemplate.block);
+        CBlock *pblock = &block;
+        SetExtraNonce(pblock, pindexPrev, nRound++ * nThreads + nThread + 1);
 
         printf("Running LitecoinMiner with %"PRIszu" transactions in block (%u bytes)\n", pblock->vtx.size(),
                ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION));
@@ -4695,56 +5794,53 @@ void static LitecoinMiner(CWallet *pwallet)
         //
         // Search
         //
-        int64 nStart = GetTime();
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        uint256 hashTarget = arith_uint256().SetCompact(pblock->nBits);
+        scrypt_mining_midstate midstate;
+        scrypt_mining_prepare(&midstate, BEGIN(pblock->nVersion));
         
         loop
         {
             unsigned int nHashesDone = 0;
 
-            uint256 thash;
             loop
             {
-                scrypt_1024_1_1_256(BEGIN(pblock->nVersion), BEGIN(thash));
-
-                if (thash <= hashTarget)
+                if (ScanHashScrypt(pblock, midstate, hashTarget, &vInputs[0], &vScratchpad[0], nHashesDone))
                 {
                     // Found a solution
                     SetThreadPriority(THREAD_PRIORITY_NORMAL);
-                    CheckWork(pblock, *pwallet, reservekey);
+                    minerTemplates.CheckWork(pblock);
                     SetThreadPriority(THREAD_PRIORITY_LOWEST);
+                    pblock->nNonce += 1;
                     break;
                 }
-                pblock->nNonce += 1;
-                nHashesDone += 1;
-                if ((pblock->nNonce & 0xFF) == 0)
+                if (nHashesDone >= 0x100)
                     break;
             }
 
             // Meter hashes/sec
             static int64 nHashCounter;
-            if (nHPSTimerStart == 0)
+            if (nHPSTimerStartScrypt == 0)
             {
-                nHPSTimerStart = GetTimeMillis();
+                nHPSTimerStartScrypt = GetTimeMillis();
                 nHashCounter = 0;
             }
             else
                 nHashCounter += nHashesDone;
-            if (GetTimeMillis() - nHPSTimerStart > 4000)
+            if (GetTimeMillis() - nHPSTimerStartScrypt > 4000)
             {
                 static CCriticalSection cs;
                 {
                     LOCK(cs);
-                    if (GetTimeMillis() - nHPSTimerStart > 4000)
+                    if (GetTimeMillis() - nHPSTimerStartScrypt > 4000)
                     {
-                        dHashesPerSec = 1000.0 * nHashCounter / (GetTimeMillis() - nHPSTimerStart);
-                        nHPSTimerStart = GetTimeMillis();
+                        dHashesPerSecScrypt = 1000.0 * nHashCounter / (GetTimeMillis() - nHPSTimerStartScrypt);
+                        nHPSTimerStartScrypt = GetTimeMillis();
                         nHashCounter = 0;
                         static int64 nLogTime;
                         if (GetTime() - nLogTime > 30 * 60)
                         {
                             nLogTime = GetTime();
-                            printf("hashmeter %6.0f khash/s\n", dHashesPerSec/1000.0);
+                            printf("hashmeter scrypt %6.1f khash/s\n", dHashesPerSecScrypt/1000.0);
                         }
                     }
                 }
@@ -4756,9 +5852,7 @@ void static LitecoinMiner(CWallet *pwallet)
                 //break;
             if (pblock->nNonce >= 0xffff0000)
                 break;
-            if (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60)
-                break;
-            if (pindexPrev != pindexBest)
+            if (!minerTemplates.IsCurrent(ptemplate))
                 break;
 
             // Update nTime every few seconds
@@ -4768,7 +5862,7 @@ void static LitecoinMiner(CWallet *pwallet)
             {
                 // Changing pblock->nTime can change work required on testnet:
                 nBlockBits = ByteReverse(pblock->nBits);
-                hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+                hashTarget = arith_uint256().SetCompact(pblock->nBits);
             }
         }
     } }
@@ -4779,48 +5873,53 @@ void static LitecoinMiner(CWallet *pwallet)
     }
 }
 
-void static LitecoinMinerAux(CWallet *pwallet)
+void static LitecoinMinerAux(CWallet *pwallet, int nThread, int nThreads)
 {
     printf("LitecoinAuxMiner started\n");
     SetThreadPriority(THREAD_PRIORITY_LOWEST);
     RenameThread("litecoin-miner");
 
-    // Each thread has its own key and counter
-    CReserveKey reservekey(pwallet);
-    unsigned int nExtraNonceAux = 0;
+    // The threads of an algo share its template; thread nThread of nThreads
+    // mines extranonces nThread+1, nThread+1+nThreads, ... in the aux block
+    boost::shared_ptr<const CMinerTemplate> ptemplate;
+    unsigned int nRound = 0;
     unsigned int nExtraNonce = 0;
+    std::vector<char> vInputs(80 * SCRYPT_MULTI_MAX);
+    std::vector<char> vScratchpad(SCRYPT_MULTI_SCRATCHPAD_SIZE);
 
     try { loop {
         //while (vNodes.empty())
             //MilliSleep(1000);
-        unsigned int nTransactionsUpdatedLast = nTransactionsUpdated;
-        CBlockIndex* pindexPrev = pindexBest;
+        boost::shared_ptr<const CMinerTemplate> ptemplateNew = minerTemplates.Get(CBlockHeader::BLOCK_ALGO_SCRYPT);
+        if (!ptemplateNew)
+            return;
+        if (ptemplateNew != ptemplate)
+        {
+            ptemplate = ptemplateNew;
+            nRound = 0;
+        }
+        CBlockIndex* pindexPrev = ptemplate->pindexPrev;
 
         //
-        // Create AuxPOW Block
+        // Copy the AuxPOW block
         //
-        auto_ptr<CBlockTemplate> pblocktemplateAux(CreateNewBlockWithKey(reservekey, CBlockHeader::BLOCK_ALGO_SCRYPT));
-        if (!pblocktemplateAux.get())
-            return;
-        CBlock *pBlockAux = &pblocktemplateAux->block;
+        CBlock blockAux(ptemplate->blocktemplate.block);
+        CBlock *pBlockAux = &blockAux;
         pBlockAux->nVersion |= CBlockHeader::VERSION_AUX;
-        IncrementExtraNonce(pBlockAux, pindexPrev, nExtraNonceAux);
+        SetExtraNonce(pBlockAux, pindexPrev, nRound++ * nThreads + nThread + 1);
 
         //
-        // Create new block
+        // Copy the parent block
         //
-        auto_ptr<CBlockTemplate> pblocktemplate(CreateNewBlockWithKey(reservekey, CBlockHeader::BLOCK_ALGO_SCRYPT));
-        if (!pblocktemplate.get())
-            return;
-        CBlock *pblock = &pblocktemplate->block;
+        CBlock block(ptemplate->blocktemplate.block);
+        CBlock *pblock = &block;
 
-       uint256 nAuxHash = pBlockAux->GetHash();
-        vector<unsigned char> vchCoinbase(nAuxHash.begin(), nAuxHash.end());
-        std::reverse(vchCoinbase.begin(), vchCoinbase.end());
-        vchCoinbase.push_back(1);
-        int temp;
-        for ( temp = 0; temp < 7; ++ temp )
-            vchCoinbase.push_back(0);
+        // Commit to our aux block along with every registered aux chain
+        int chainid = fTestNet ? GetDefaultPort() : 0;
+        map<int, uint256> mapOwnChain;
+        mapOwnChain[chainid] = pBlockAux->GetHash();
+        CAuxMerkleTree auxtree = auxChains.CreateTree(mapOwnChain);
+        vector<unsigned char> vchCoinbase = auxtree.GetCoinbaseCommitment();
 
         int64 nPrevTime = 0;
         IncrementExtraNonceWithAux(pblock, pindexPrev, nExtraNonce, nPrevTime, vchCoinbase);
@@ -4845,67 +5944,60 @@ void static LitecoinMinerAux(CWallet *pwallet)
         //
         // Search
         //
-        int64 nStart = GetTime();
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        uint256 hashTarget = arith_uint256().SetCompact(pblock->nBits);
+        scrypt_mining_midstate midstate;
+        scrypt_mining_prepare(&midstate, BEGIN(pblock->nVersion));
         
         loop
         {
             unsigned int nHashesDone = 0;
 
-            uint256 thash;
             loop
             {
-                pblock->nNonce += 1;
-                nHashesDone += 1;
-                scrypt_1024_1_1_256(BEGIN(pblock->nVersion), BEGIN(thash));
-
-                if (thash <= hashTarget)
+                if (ScanHashScrypt(pblock, midstate, hashTarget, &vInputs[0], &vScratchpad[0], nHashesDone))
                 {
-                    CMerkleTx vMerkleTx(pblock->vtx[0]);
-                    vMerkleTx.SetMerkleBranch(pblock);
                     CAuxPow* pow = new CAuxPow();
-                    pow->mMerkleTx = vMerkleTx;
-                    pow->vParentBlockHeader.nVersion = pblock->nVersion;
-                    pow->vParentBlockHeader.hashPrevBlock = pblock->hashPrevBlock;
-                    pow->vParentBlockHeader.hashMerkleRoot = pblock->hashMerkleRoot;
-                    pow->vParentBlockHeader.nTime = pblock->nTime;
-                    pow->vParentBlockHeader.nBits = pblock->nBits;
-                    pow->vParentBlockHeader.nNonce = pblock->nNonce;
+                    pow->SetParentBlock(*pblock);
+                    pow->vChainMerkleBranch = auxtree.GetMerkleBranch(chainid);
+                    pow->nChainIndex = GetAuxChainSlot(chainid, auxtree.nNonce, auxtree.nSize);
                     pBlockAux->SetAuxPow(pow);
+                    // Other aux chains can take their proofs from the auxpow of this block
+                    auxChains.AddRecentTree(auxtree);
                     // Found a solution
                     SetThreadPriority(THREAD_PRIORITY_NORMAL);
-                    CheckWork(pBlockAux, *pwallet, reservekey);
+                    minerTemplates.CheckWork(pBlockAux);
                     SetThreadPriority(THREAD_PRIORITY_LOWEST);
+                    pblock->nNonce += 1;
                     break;
                 }
-                if ((pblock->nNonce & 0xFF) == 0)
+                if (nHashesDone >= 0x100)
                     break;
             }
 
             // Meter hashes/sec
             static int64 nHashCounter;
-            if (nHPSTimerStart == 0)
+            if (nHPSTimerStartScrypt == 0)
             {
-                nHPSTimerStart = GetTimeMillis();
+                nHPSTimerStartScrypt = GetTimeMillis();
                 nHashCounter = 0;
             }
             else
                 nHashCounter += nHashesDone;
-            if (GetTimeMillis() - nHPSTimerStart > 4000)
+            if (GetTimeMillis() - nHPSTimerStartScrypt > 4000)
             {
                 static CCriticalSection cs;
                 {
                     LOCK(cs);
-                    if (GetTimeMillis() - nHPSTimerStart > 4000)
+                    if (GetTimeMillis() - nHPSTimerStartScrypt > 4000)
                     {
-                        dHashesPerSec = 1000.0 * nHashCounter / (GetTimeMillis() - nHPSTimerStart);
-                        nHPSTimerStart = GetTimeMillis();
+                        dHashesPerSecScrypt = 1000.0 * nHashCounter / (GetTimeMillis() - nHPSTimerStartScrypt);
+                        nHPSTimerStartScrypt = GetTimeMillis();
                         nHashCounter = 0;
                         static int64 nLogTime;
                         if (GetTime() - nLogTime > 30 * 60)
                         {
                             nLogTime = GetTime();
-                            printf("hashmeter %6.0f khash/s\n", dHashesPerSec/1000.0);
+                            printf("hashmeter scrypt %6.1f khash/s\n", dHashesPerSecScrypt/1000.0);
                         }
                     }
                 }
@@ -4917,9 +6009,7 @@ void static LitecoinMinerAux(CWallet *pwallet)
                 //break;
             if (pblock->nNonce >= 0xffff0000)
                 break;
-            if (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60)
-                break;
-            if (pindexPrev != pindexBest)
+            if (!minerTemplates.IsCurrent(ptemplate))
                 break;
 
             // Update nTime every few seconds
@@ -4929,7 +6019,7 @@ void static LitecoinMinerAux(CWallet *pwallet)
             //{
                 // Changing pblock->nTime can change work required on testnet:
                 //nBlockBits = ByteReverse(pblock->nBits);
-                //hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+                //hashTarget = arith_uint256().SetCompact(pblock->nBits);
             //}
         }
     } }
@@ -4940,37 +6030,37 @@ void static LitecoinMinerAux(CWallet *pwallet)
     }
 }
 
-void static BitcoinMiner(CWallet *pwallet)
+void static BitcoinMiner(CWallet *pwallet, int nThread, int nThreads)
 {
     printf("BitcoinMiner started\n");
     SetThreadPriority(THREAD_PRIORITY_LOWEST);
     RenameThread("BitcoinMiner-miner");
 
-    // Each thread has its own key and counter
-    CReserveKey reservekey(pwallet);
-    unsigned int nExtraNonce = 0;
+    // The threads of an algo share its template; thread nThread of nThreads
+    // mines extranonces nThread+1, nThread+1+nThreads, ... of each template
+    boost::shared_ptr<const CMinerTemplate> ptemplate;
+    unsigned int nRound = 0;
 
     try { loop {
         // unfinish
         //while (vNodes.empty())
             //MilliSleep(1000);
 
-        CPubKey pubkey;
-        reservekey.GetReservedKey(pubkey);
-        printf("my pubkey %s\n", HexStr(pubkey.begin(), pubkey.end()).c_str());
-        printf("my pubkey end\n");
-
         //
-        // Create new block
+        // Copy the shared block template
         //
-        unsigned int nTransactionsUpdatedLast = nTransactionsUpdated;
-        CBlockIndex* pindexPrev = pindexBest;
-
-        auto_ptr<CBlockTemplate> pblocktemplate(CreateNewBlockWithKey(reservekey, CBlockHeader::BLOCK_ALGO_SHA256));
-        if (!pblocktemplate.get())
+        boost::shared_ptr<const CMinerTemplate> ptemplateNew = minerTemplates.Get(CBlockHeader::BLOCK_ALGO_SHA256);
+        if (!ptemplateNew)
             return;
-        CBlock *pblock = &pblocktemplate->block;
-        IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
+        if (ptemplateNew != ptemplate)
+        {
+            ptemplate = ptemplateNew;
+            nRound = 0;
+        }
+        CBlockIndex* pindexPrev = ptemplate->pindexPrev;
+        CBlock block(ptemplate->blocktemplate.block);
+        CBlock *pblock = &block;
+        SetExtraNonce(pblock, pindexPrev, nRound++ * nThreads + nThread + 1);
 
         printf("Running BitcoinMiner with %"PRIszu" transactions in block (%u bytes)\n", pblock->vtx.size(),
                ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION));
@@ -4991,8 +6081,7 @@ void static BitcoinMiner(CWallet *pwallet)
         //
         // Search
         //
-        int64 nStart = GetTime();
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        uint256 hashTarget = arith_uint256().SetCompact(pblock->nBits);
         //printf("hashTarget sha256 %s\n", hashTarget.ToString().c_str());
         
         uint256 hashbuf[2];
@@ -5020,7 +6109,7 @@ void static BitcoinMiner(CWallet *pwallet)
                     assert(hash == pblock->GetHash());
 
                     SetThreadPriority(THREAD_PRIORITY_NORMAL);
-                    CheckWork(pblock, *pwalletMain, reservekey);
+                    minerTemplates.CheckWork(pblock);
                     SetThreadPriority(THREAD_PRIORITY_LOWEST);
                     break;
                 }
@@ -5035,7 +6124,7 @@ void static BitcoinMiner(CWallet *pwallet)
                 {
                     // Found a solution
                     SetThreadPriority(THREAD_PRIORITY_NORMAL);
-                    CheckWork(pblock, *pwalletMain, reservekey);
+                    minerTemplates.CheckWork(pblock);
                     SetThreadPriority(THREAD_PRIORITY_LOWEST);
                     break;
                 }
@@ -5080,9 +6169,7 @@ void static BitcoinMiner(CWallet *pwallet)
                 //break;
             if (pblock->nNonce >= 0xffff0000)
                 break;
-            if (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60)
-                break;
-            if (pindexPrev != pindexBest)
+            if (!minerTemplates.IsCurrent(ptemplate))
                 break;
 
             // Update nTime every few seconds
@@ -5092,7 +6179,7 @@ void static BitcoinMiner(CWallet *pwallet)
             {
                 // Changing pblock->nTime can change work required on testnet:
                 nBlockBits = ByteReverse(pblock->nBits);
-                hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+                hashTarget = arith_uint256().SetCompact(pblock->nBits);
             }
         }
     } }
@@ -5103,48 +6190,50 @@ void static BitcoinMiner(CWallet *pwallet)
     }
 }
 
-void static BitcoinMinerAux(CWallet *pwallet)
+void static BitcoinMinerAux(CWallet *pwallet, int nThread, int nThreads)
 {
     printf("BitcoinAuxMiner started\n");
     SetThreadPriority(THREAD_PRIORITY_LOWEST);
     RenameThread("BitcoinMiner-miner");
 
-    // Each thread has its own key and counter
-    CReserveKey reservekey(pwallet);
-    unsigned int nExtraNonceAux = 0;
+    // The threads of an algo share its template; thread nThread of nThreads
+    // mines extranonces nThread+1, nThread+1+nThreads, ... in the aux block
+    boost::shared_ptr<const CMinerTemplate> ptemplate;
+    unsigned int nRound = 0;
     unsigned int nExtraNonce = 0;
 
     try { loop {
         //while (vNodes.empty())
             //MilliSleep(1000);
-        unsigned int nTransactionsUpdatedLast = nTransactionsUpdated;
-        CBlockIndex* pindexPrev = pindexBest;
-        
+        boost::shared_ptr<const CMinerTemplate> ptemplateNew = minerTemplates.Get(CBlockHeader::BLOCK_ALGO_SHA256);
+        if (!ptemplateNew)
+            return;
+        if (ptemplateNew != ptemplate)
+        {
+            ptemplate = ptemplateNew;
+            nRound = 0;
+        }
+        CBlockIndex* pindexPrev = ptemplate->pindexPrev;
+
         //
-        // Create AuxPOW Block
+        // Copy the AuxPOW block
         //
-        auto_ptr<CBlockTemplate> pblocktemplateAux(CreateNewBlockWithKey(reservekey, CBlockHeader::BLOCK_ALGO_SHA256));
-        if (!pblocktemplateAux.get())
-            return;
-        CBlock *pBlockAux = &pblocktemplateAux->block;
+        CBlock blockAux(ptemplate->blocktemplate.block);
+        CBlock *pBlockAux = &blockAux;
         pBlockAux->nVersion |= CBlockHeader::VERSION_AUX;
-        IncrementExtraNonce(pBlockAux, pindexPrev, nExtraNonceAux);
+        SetExtraNonce(pBlockAux, pindexPrev, nRound++ * nThreads + nThread + 1);
 
         //
-        // Create parent block
+        // Copy the parent block
         //
-
-        auto_ptr<CBlockTemplate> pblocktemplate(CreateNewBlockWithKey(reservekey, CBlockHeader::BLOCK_ALGO_SHA256));
-        if (!pblocktemplate.get())
-            return;
-        CBlock *pblock = &pblocktemplate->block;
-        uint256 nAuxHash = pBlockAux->GetHash();
-        vector<unsigned char> vchCoinbase(nAuxHash.begin(), nAuxHash.end());
-        std::reverse(vchCoinbase.begin(), vchCoinbase.end());
-        vchCoinbase.push_back(1);
-        int temp;
-        for ( temp = 0; temp < 7; ++ temp )
-            vchCoinbase.push_back(0);
+        CBlock block(ptemplate->blocktemplate.block);
+        CBlock *pblock = &block;
+        // Commit to our aux block along with every registered aux chain
+        int chainid = fTestNet ? GetDefaultPort() : 0;
+        map<int, uint256> mapOwnChain;
+        mapOwnChain[chainid] = pBlockAux->GetHash();
+        CAuxMerkleTree auxtree = auxChains.CreateTree(mapOwnChain);
+        vector<unsigned char> vchCoinbase = auxtree.GetCoinbaseCommitment();
 
         int64 nPrevTime = 0;
         IncrementExtraNonceWithAux(pblock, pindexPrev, nExtraNonce, nPrevTime, vchCoinbase);
@@ -5170,8 +6259,7 @@ void static BitcoinMinerAux(CWallet *pwallet)
         //
         // Search
         //
-        int64 nStart = GetTime();
-        uint256 hashTarget = CBigNum().SetCompact(pBlockAux->nBits).getuint256();
+        uint256 hashTarget = arith_uint256().SetCompact(pBlockAux->nBits);
         //printf("hashTarget sha256 %s\n", hashTarget.ToString().c_str());
         
         uint256 hashbuf[2];
@@ -5186,20 +6274,16 @@ void static BitcoinMinerAux(CWallet *pwallet)
                 uint256 hash = Hash(BEGIN(pblock->nVersion), END(pblock->nNonce));
                 if (hash <= hashTarget)
                 {
-                    CMerkleTx vMerkleTx(pblock->vtx[0]);
-                    vMerkleTx.SetMerkleBranch(pblock);
                     CAuxPow* pow = new CAuxPow();
-                    pow->mMerkleTx = vMerkleTx;
-                    pow->vParentBlockHeader.nVersion = pblock->nVersion;
-                    pow->vParentBlockHeader.hashPrevBlock = pblock->hashPrevBlock;
-                    pow->vParentBlockHeader.hashMerkleRoot = pblock->hashMerkleRoot;
-                    pow->vParentBlockHeader.nTime = pblock->nTime;
-                    pow->vParentBlockHeader.nBits = pblock->nBits;
-                    pow->vParentBlockHeader.nNonce = pblock->nNonce;
+                    pow->SetParentBlock(*pblock);
+                    pow->vChainMerkleBranch = auxtree.GetMerkleBranch(chainid);
+                    pow->nChainIndex = GetAuxChainSlot(chainid, auxtree.nNonce, auxtree.nSize);
                     pBlockAux->SetAuxPow(pow);
+                    // Other aux chains can take their proofs from the auxpow of this block
+                    auxChains.AddRecentTree(auxtree);
                     // Found a solution
                     SetThreadPriority(THREAD_PRIORITY_NORMAL);
-                    CheckWork(pBlockAux, *pwalletMain, reservekey);
+                    minerTemplates.CheckWork(pBlockAux);
                     SetThreadPriority(THREAD_PRIORITY_LOWEST);
                     break;
                 }
@@ -5242,9 +6326,7 @@ void static BitcoinMinerAux(CWallet *pwallet)
                 //break;
             if (pblock->nNonce >= 0xffff0000)
                 break;
-            if (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60)
-                break;
-            if (pindexPrev != pindexBest)
+            if (!minerTemplates.IsCurrent(ptemplate))
                 break;
 
             // Update nTime every few seconds
@@ -5254,7 +6336,7 @@ void static BitcoinMinerAux(CWallet *pwallet)
             //{
                 // Changing pblock->nTime can change work required on testnet:
                 //nBlockBits = ByteReverse(pblock->nBits);
-                //hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+                //hashTarget = arith_uint256().SetCompact(pblock->nBits);
             //}
         }
     } }
@@ -5281,24 +6363,33 @@ void GenerateBitcoins(bool fGenerate, CWallet* pwallet)
     }
 
     if (nThreads == 0 || !fGenerate)
+    {
+        // Let threads still finishing a scan drop out at their next template request
+        minerTemplates.Reset(NULL);
         return;
+    }
+    minerTemplates.Reset(pwallet);
 
     minerThreads = new boost::thread_group();
+    minerThreads->create_thread(&ThreadMinerTemplates);
 #if 0
     if ( nThreads == 1 )
-        minerThreads->create_thread(boost::bind(&BitcoinMiner, pwallet));
+        minerThreads->create_thread(boost::bind(&BitcoinMiner, pwallet, 0, 1));
     if ( nThreads == 2 )
-        minerThreads->create_thread(boost::bind(&BitcoinMinerAux, pwallet));
+        minerThreads->create_thread(boost::bind(&BitcoinMinerAux, pwallet, 0, 1));
     if ( nThreads == 3 )
-        minerThreads->create_thread(boost::bind(&LitecoinMiner, pwallet));
+        minerThreads->create_thread(boost::bind(&LitecoinMiner, pwallet, 0, 1));
     if ( nThreads == 4 )
-        minerThreads->create_thread(boost::bind(&LitecoinMinerAux, pwallet));
+        minerThreads->create_thread(boost::bind(&LitecoinMinerAux, pwallet, 0, 1));
 #else
+    // Even threads mine sha256, odd ones scrypt; number them per algo for the extranonce split
+    int nSHA256Threads = (nThreads + 1) / 2;
+    int nScryptThreads = nThreads / 2;
     for (int i = 0; i < nThreads; i++){
         if ( i % 2 )
-            minerThreads->create_thread(boost::bind(&LitecoinMiner, pwallet));
+            minerThreads->create_thread(boost::bind(&LitecoinMiner, pwallet, i / 2, nScryptThreads));
         else
-            minerThreads->create_thread(boost::bind(&BitcoinMiner, pwallet));
+            minerThreads->create_thread(boost::bind(&BitcoinMiner, pwallet, i / 2, nSHA256Threads));
     }
 #endif
 }
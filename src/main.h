@@ -6,6 +6,7 @@
 #define BITCOIN_MAIN_H
 
 #include "bignum.h"
+#include "arith_uint256.h"
 #include "sync.h"
 #include "net.h"
 #include "script.h"
@@ -13,11 +14,17 @@
 
 #include <list>
 
+#include <boost/unordered_map.hpp>
+
 class CWallet;
 class CBlock;
+class CBlockHeader;
 class CBlockIndex;
 class CKeyItem;
 class CReserveKey;
+class CAuxPow;
+class CSmallDataKey;
+class CSmallDataIndexEntry;
 
 class CAddress;
 class CInv;
@@ -62,6 +69,10 @@ static const int COINBASE_MATURITY = 100;
 static const unsigned int LOCKTIME_THRESHOLD = 500000000; // Tue Nov  5 00:53:20 1985 UTC
 /** Maximum number of script-checking threads allowed */
 static const int MAX_SCRIPTCHECK_THREADS = 16;
+/** Maximum number of proof of work pipeline threads */
+static const int MAX_POW_THREADS = 16;
+/** Maximum number of threads reading coins ahead of block validation */
+static const int MAX_PREFETCH_THREADS = 16;
 #ifdef USE_UPNP
 static const int fHaveUPnP = true;
 #else
@@ -87,11 +98,16 @@ extern uint256 nBestInvalidWork;
 extern uint256 hashBestChain;
 extern CBlockIndex* pindexBest;
 extern unsigned int nTransactionsUpdated;
+/** Notified under csBestBlock whenever the best chain or the memory pool changes */
+extern CWaitableCriticalSection csBestBlock;
+extern boost::condition_variable cvBlockChange;
 extern uint64 nLastBlockTx;
 extern uint64 nLastBlockSize;
 extern const std::string strMessageMagic;
 extern double dHashesPerSec;
 extern int64 nHPSTimerStart;
+extern double dHashesPerSecScrypt;
+extern int64 nHPSTimerStartScrypt;
 extern int64 nTimeBestReceived;
 extern CCriticalSection cs_setpwalletRegistered;
 extern std::set<CWallet*> setpwalletRegistered;
@@ -100,8 +116,13 @@ extern bool fImporting;
 extern bool fReindex;
 extern bool fBenchmark;
 extern int nScriptCheckThreads;
+extern int nPoWThreads;
+extern int nPrefetchThreads;
 extern bool fTxIndex;
-extern unsigned int nCoinCacheSize;
+extern size_t nCoinCacheUsage;
+extern bool fParanoidBlockRead;
+extern uint64 nBlockReadPoWSkipped;
+extern CCriticalSection cs_nBlockReadPoWSkipped;
 
 // Settings
 extern int64 nTransactionFee;
@@ -152,12 +173,29 @@ bool VerifyDB(int nCheckLevel, int nCheckDepth);
 void PrintBlockTree();
 /** Find a block by height in the currently-connected chain */
 CBlockIndex* FindBlockByHeight(int nHeight);
+/** Read the auxpow of a merged-mined block from the block tree database, taking it from
+ *  the block data (and storing it) for blocks accepted before the store existed. Requires cs_main. */
+bool ReadBlockAuxPow(const CBlockIndex* pindex, boost::shared_ptr<CAuxPow>& auxpow);
+/** Header of a block index entry including the auxpow of merged-mined blocks. Requires cs_main. */
+bool ReadBlockHeader(const CBlockIndex* pindex, CBlockHeader& header);
 /** Process protocol messages received from a given node */
 bool ProcessMessages(CNode* pfrom);
 /** Send queued protocol messages to be sent to a give node */
 bool SendMessages(CNode* pto, bool fSendTrickle);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the proof of work pipeline thread */
+void ThreadPoWPipeline();
+/** Run an instance of the coins prefetch thread */
+void ThreadCoinsPrefetch();
+/** Read the inputs of a block that pcoinsTip lacks from the coin database in parallel, ahead of ConnectBlock */
+void PrefetchBlockCoins(const CBlock& block);
+/** Note a block we send a getdata for, so its header may be hashed ahead when it arrives */
+void RequestBlockPoW(const uint256& hash);
+/** Queue the header of a requested block message received from pfrom for proof of work hashing */
+void QueueBlockPoW(CNode* pfrom, const CDataStream& vRecv);
+/** Headers queued or being hashed, hash rate, and CheckBlock hits and misses of the proof of work pipeline */
+void GetPoWPipelineStats(uint64& nDepth, double& dHashesPerSec, uint64& nHits, uint64& nMisses);
 /** Run the miner threads */
 void GenerateBitcoins(bool fGenerate, CWallet* pwallet);
 /** Generate a new block, without valid proof-of-work */
@@ -172,7 +210,7 @@ bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey);
 /** Check whether a block hash satisfies the proof-of-work requirement specified by nBits */
 bool CheckProofOfWork(uint256 hash, unsigned int nBits, int algo);
 /** Calculate the minimum amount of work a received block needs, without knowing its direct parent */
-unsigned int ComputeMinWork(unsigned int nBase, int64 nTime);
+unsigned int ComputeMinWork(unsigned int nBase, int64 nTime, int algo);
 /** Get the number of active peers */
 int GetNumBlocksOfPeers();
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
@@ -1088,6 +1126,14 @@ public:
                 return false;
         return true;
     }
+
+    // heap memory held by the outputs and their scripts
+    size_t DynamicMemoryUsage() const {
+        size_t nUsage = vout.capacity() * sizeof(CTxOut);
+        BOOST_FOREACH(const CTxOut &out, vout)
+            nUsage += out.scriptPubKey.capacity();
+        return nUsage;
+    }
 };
 
 /** Closure representing one script verification
@@ -1100,12 +1146,15 @@ private:
     unsigned int nIn;
     unsigned int nFlags;
     int nHashType;
+    // Signature hashing state of the spending transaction, shared by its checks
+    boost::shared_ptr<const CSignatureHashContext> pSigHashes;
 
 public:
     CScriptCheck() {}
-    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn) :
+    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn,
+                 const boost::shared_ptr<const CSignatureHashContext>& pSigHashesIn = boost::shared_ptr<const CSignatureHashContext>()) :
         scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
-        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn) { }
+        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn), pSigHashes(pSigHashesIn) { }
 
     bool operator()() const;
 
@@ -1115,6 +1164,7 @@ public:
         std::swap(nIn, check.nIn);
         std::swap(nFlags, check.nFlags);
         std::swap(nHashType, check.nHashType);
+        pSigHashes.swap(check.pSigHashes);
     }
 };
 
@@ -1281,6 +1331,7 @@ public:
     static const int BLOCK_HEADER_LEN = 80;
     static const int BLOCK_ALGO_SHA256 = 0;
     static const int BLOCK_ALGO_SCRYPT = 1;
+    static const int NUM_ALGOS = 2;
     
     // header
     static const int VERSION_SHA256 = 2;
@@ -1422,6 +1473,9 @@ public:
         }
     }
 
+    // GetPoWHash, from the proof of work pipeline if its workers got there first
+    uint256 GetPipelinedPoWHash() const;
+
     CBlockHeader GetBlockHeader() const
     {
         CBlockHeader block;
@@ -1516,7 +1570,7 @@ public:
         return true;
     }
 
-    bool ReadFromDisk(const CDiskBlockPos &pos)
+    bool ReadFromDisk(const CDiskBlockPos &pos, bool fCheckPOW=true)
     {
         SetNull();
 
@@ -1534,6 +1588,9 @@ public:
         }
 
         // Check the header
+        if (!fCheckPOW)
+            return true;
+
         int chainid = fTestNet ? GetDefaultPort() : 0;
         if ( isAuxBlock() && !auxpow.get()->Check(GetHash(), chainid))
             return error("CBlock::ReadFromDisk() : AUX POW is not valid");
@@ -1582,10 +1639,16 @@ public:
      *  of problems. Note that in any case, coins may be modified. */
     bool DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &coins, bool *pfClean = NULL);
 
-    // Apply the effects of this block (with given index) on the UTXO set represented by coins
-    bool ConnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &coins, bool fJustCheck=false);
+    // Apply the effects of this block (with given index) on the UTXO set represented by coins.
+    // If pblockundo is provided, it receives the spent outputs, as written to the undo file.
+    // If pvSmallData is provided, it receives the block's smalldata index entries, for the
+    // caller to write once the block is on the best chain.
+    bool ConnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &coins, bool fJustCheck=false, CBlockUndo *pblockundo = NULL,
+                      std::vector<std::pair<CSmallDataKey, CSmallDataIndexEntry> > *pvSmallData = NULL);
 
-    // Read a block from disk
+    // Read a block from disk. Blocks we stored ourselves (BLOCK_HAVE_DATA) already passed
+    // the auxpow and proof-of-work checks in CheckBlock, so those are skipped unless
+    // -paranoidblockread is set.
     bool ReadFromDisk(const CBlockIndex* pindex);
 
     // Add this block to the block index, and if necessary, switch the active block chain to this
@@ -1697,6 +1760,9 @@ public:
     // (memory only) pointer to the index of the *active* successor of this block
     CBlockIndex* pnext;
 
+    // (memory only) pointers to the last predecessor of each algo, NULL if there is none
+    CBlockIndex* pprevAlgo[CBlockHeader::NUM_ALGOS];
+
     // height of the entry in the chain. The genesis block has height 0
     int nHeight;
 
@@ -1712,6 +1778,10 @@ public:
     // (memory only) Total amount of work (expected number of hashes) in the chain up to and including this block
     uint256 nChainWork;
 
+    // (memory only) Total amount of work and number of blocks of this block's algo in the chain up to and including this block
+    uint256 nAlgoChainWork;
+    unsigned int nAlgoChainBlocks;
+
     // Number of transactions in this block.
     // Note: in a potential headers-first mode, this number cannot be relied upon
     unsigned int nTx;
@@ -1735,11 +1805,15 @@ public:
         phashBlock = NULL;
         pprev = NULL;
         pnext = NULL;
+        for (int i = 0; i < CBlockHeader::NUM_ALGOS; i++)
+            pprevAlgo[i] = NULL;
         nHeight = 0;
         nFile = 0;
         nDataPos = 0;
         nUndoPos = 0;
         nChainWork = 0;
+        nAlgoChainWork = 0;
+        nAlgoChainBlocks = 0;
         nTx = 0;
         nChainTx = 0;
         nStatus = 0;
@@ -1756,11 +1830,15 @@ public:
         phashBlock = NULL;
         pprev = NULL;
         pnext = NULL;
+        for (int i = 0; i < CBlockHeader::NUM_ALGOS; i++)
+            pprevAlgo[i] = NULL;
         nHeight = 0;
         nFile = 0;
         nDataPos = 0;
         nUndoPos = 0;
         nChainWork = 0;
+        nAlgoChainWork = 0;
+        nAlgoChainBlocks = 0;
         nTx = 0;
         nChainTx = 0;
         nStatus = 0;
@@ -1790,6 +1868,8 @@ public:
         return ret;
     }
 
+    // Header without the auxpow of merged-mined blocks, which is stored apart;
+    // see ReadBlockHeader
     CBlockHeader GetBlockHeader() const
     {
         CBlockHeader block;
@@ -1808,19 +1888,46 @@ public:
         return *phashBlock;
     }
 
+    int GetAlgo() const
+    {
+        return CBlockHeader::GetBlockAlgo(nVersion);
+    }
+
+    // Fill pprevAlgo and the per-algo chain totals from pprev, whose own must already be set
+    void BuildAlgoChain(const uint256& nBlockWork)
+    {
+        for (int i = 0; i < CBlockHeader::NUM_ALGOS; i++)
+            pprevAlgo[i] = pprev ? pprev->pprevAlgo[i] : NULL;
+        if (pprev)
+            pprevAlgo[pprev->GetAlgo()] = pprev;
+
+        const CBlockIndex* pprevSame = pprevAlgo[GetAlgo()];
+        nAlgoChainWork = (pprevSame ? pprevSame->nAlgoChainWork : 0) + nBlockWork;
+        nAlgoChainBlocks = (pprevSame ? pprevSame->nAlgoChainBlocks : 0) + 1;
+    }
+
     int64 GetBlockTime() const
     {
         return (int64)nTime;
     }
 
-    CBigNum GetBlockWork() const
+    arith_uint256 GetBlockWork() const
     {
-        CBigNum bnTarget;
-        bnTarget.SetCompact(nBits);
-        if (bnTarget <= 0)
+        arith_uint256 bnTarget;
+        bool fNegative;
+        bool fOverflow;
+        bnTarget.SetCompact(nBits, &fNegative, &fOverflow);
+        if (fNegative || fOverflow || bnTarget == 0)
             return 0;
 
-        CBigNum work = (CBigNum(1)<<256) / (bnTarget+1);
+        // We need to compute 2**256 / (bnTarget+1), but we can't represent 2**256
+        // as it's too large for an arith_uint256. However, as 2**256 is at least as large
+        // as bnTarget+1, it is equal to ((2**256 - bnTarget - 1) / (bnTarget+1)) + 1,
+        // or ~bnTarget / (bnTarget+1) + 1.
+        arith_uint256 bnTargetPlusOne = bnTarget;
+        bnTargetPlusOne += 1;
+        arith_uint256 work = arith_uint256(~bnTarget) / bnTargetPlusOne;
+        work += 1;
         
         // Apply scrypt-to-SHA ratio
         // We assume that scrypt is 2^15 times harder to mine (for the same difficulty target)
@@ -1944,8 +2051,7 @@ public:
         READWRITE(nBits);
         READWRITE(nNonce);
 
-        // unfinish
-        //ReadWriteAuxPow(s, auxpow, nType, this->nVersion, ser_action);
+        // The auxpow of merged-mined blocks is stored apart, see ReadBlockAuxPow
     )
 
     uint256 GetBlockHash() const
@@ -2169,12 +2275,85 @@ public:
 
 
 
+/** What CreateNewBlock needs to know about a memory pool transaction.
+ *  Working it out takes a coins lookup for every input, so it is kept here
+ *  and only recomputed (fStale) after one of the transaction's inputs has
+ *  moved between the memory pool and the chain.
+ */
+class CTxMemPoolEntry
+{
+public:
+    CTransaction* ptx;
+    bool fStale;
+    unsigned int nTxSize;
+    unsigned int nLegacySigOps;
+    unsigned int nP2SHSigOps;
+    int64 nFee;
+    int64 nValueInChain;                 // sum of the inputs already in the chain
+    double dValueHeight;                 // sum of value * height of those inputs
+    std::vector<uint256> vDependsOn;     // memory pool transactions this one spends
+    bool fSmallData;                     // smalldata message, parsed once on entry to the pool
+    bool fSmallDataBroadcast;
+    std::string strSmallData;
+    bool fIndexed;                       // in the pool's fee and priority indexes
+    double dIndexedPriority;             // key in the priority index
+
+    CTxMemPoolEntry(CTransaction* ptxIn = NULL)
+    {
+        ptx = ptxIn;
+        fStale = true;
+        nTxSize = 0;
+        nLegacySigOps = 0;
+        nP2SHSigOps = 0;
+        nFee = 0;
+        nValueInChain = 0;
+        dValueHeight = 0;
+        fSmallData = false;
+        fSmallDataBroadcast = false;
+        fIndexed = false;
+        dIndexedPriority = 0;
+    }
+
+    // sum(valuein * age) / txsize for inclusion in the block after nHeight,
+    // counting only inputs that are already in the chain
+    double GetPriority(int nHeight) const
+    {
+        return ((double)nValueInChain * (nHeight + 1) - dValueHeight) / nTxSize;
+    }
+
+    // This is a more accurate fee-per-kilobyte than is used by the client code, because the
+    // client code rounds up the size to the nearest 1K. That's good, because it gives an
+    // incentive to create smaller transactions.
+    double GetFeePerKb() const
+    {
+        return double(nFee) / (double(nTxSize)/1000.0);
+    }
+};
+
+/** Up-to-date memory pool entries ordered by one key, ties broken by txid */
+typedef std::map<std::pair<double, uint256>, const CTxMemPoolEntry*> CTxMemPoolIndex;
+
 class CTxMemPool
 {
+private:
+    void addToIndexes(const uint256& hash, CTxMemPoolEntry& entry);
+    void removeFromIndexes(const uint256& hash, CTxMemPoolEntry& entry);
+
 public:
     mutable CCriticalSection cs;
     std::map<uint256, CTransaction> mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
+    std::map<uint256, CTxMemPoolEntry> mapEntry;
+    // Entries that are not stale, by fee per kB and by priority for the
+    // block after nPriorityHeight; maintained by refreshEntries and remove
+    CTxMemPoolIndex mapByFee;
+    CTxMemPoolIndex mapByPriority;
+    int nPriorityHeight;
+
+    CTxMemPool()
+    {
+        nPriorityHeight = -1;
+    }
 
     bool accept(CValidationState &state, CTransaction &tx, bool fCheckInputs, bool fLimitFree, bool* pfMissingInputs);
     bool addUnchecked(const uint256& hash, const CTransaction &tx);
@@ -2183,6 +2362,14 @@ public:
     void clear();
     void queryHashes(std::vector<uint256>& vtxid);
     void pruneSpent(const uint256& hash, CCoins &coins);
+    // Recompute the stale entries in mapEntry against view (the chain tip at
+    // nHeight), and re-key the priority index when nHeight changed
+    void refreshEntries(CCoinsViewCache& view, int nHeight);
+    // Transactions spending outputs of hash see that input come from a
+    // different place (memory pool or chain), or disappear
+    void markDependersStale(const uint256& hash);
+    // The smalldata message of a pool transaction; false if it is not in the pool or has none
+    bool getSmallData(const uint256& hash, std::string& strMessage, bool& fBroadcast);
 
     unsigned long size()
     {
@@ -2216,6 +2403,35 @@ struct CCoinsStats
     CCoinsStats() : nHeight(0), hashBlock(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), hashSerialized(0), nTotalAmount(0) {}
 };
 
+/** Salted hash of txids for the coins cache, so that peers cannot pick
+    transactions that all land in the same bucket */
+class CCoinsKeyHasher
+{
+private:
+    uint64 nSalt0, nSalt1;
+
+public:
+    CCoinsKeyHasher();
+    size_t operator()(const uint256 &txid) const;
+};
+
+/** An entry in the coins cache, with its state relative to the view below */
+struct CCoinsCacheEntry
+{
+    CCoins coins;
+    unsigned char nFlags;
+    size_t nUsage; // DynamicMemoryUsage() of coins when it was last accounted for
+
+    enum {
+        DIRTY = (1 << 0), // possibly different from the view below, so it must be written back
+        FRESH = (1 << 1), // the view below has no unspent outputs for it, so it need not be written back once pruned
+    };
+
+    CCoinsCacheEntry() : coins(), nFlags(0), nUsage(0) {}
+};
+
+typedef boost::unordered_map<uint256, CCoinsCacheEntry, CCoinsKeyHasher> CCoinsMap;
+
 /** Abstract view on the open txout dataset. */
 class CCoinsView
 {
@@ -2236,8 +2452,8 @@ public:
     // Modify the currently active block index
     virtual bool SetBestBlock(CBlockIndex *pindex);
 
-    // Do a bulk modification (multiple SetCoins + one SetBestBlock)
-    virtual bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    // Do a bulk modification (multiple SetCoins + one SetBestBlock) of the DIRTY entries of mapCoins
+    virtual bool BatchWrite(const CCoinsMap &mapCoins, CBlockIndex *pindex);
 
     // Calculate statistics about the unspent transaction output set
     virtual bool GetStats(CCoinsStats &stats);
@@ -2260,7 +2476,8 @@ public:
     CBlockIndex *GetBestBlock();
     bool SetBestBlock(CBlockIndex *pindex);
     void SetBackend(CCoinsView &viewIn);
-    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    CCoinsView *GetBackend();
+    bool BatchWrite(const CCoinsMap &mapCoins, CBlockIndex *pindex);
     bool GetStats(CCoinsStats &stats);
 };
 
@@ -2269,7 +2486,11 @@ class CCoinsViewCache : public CCoinsViewBacked
 {
 protected:
     CBlockIndex *pindexTip;
-    std::map<uint256,CCoins> cacheCoins;
+    CCoinsMap cacheCoins;
+    // Sum of the nUsage of the entries in cacheCoins
+    size_t cachedCoinsUsage;
+    // Entries handed out as modifiable references since their memory was last accounted for
+    std::vector<CCoinsCacheEntry*> vModified;
 
 public:
     CCoinsViewCache(CCoinsView &baseIn, bool fDummy = false);
@@ -2280,13 +2501,26 @@ public:
     bool HaveCoins(const uint256 &txid);
     CBlockIndex *GetBestBlock();
     bool SetBestBlock(CBlockIndex *pindex);
-    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    bool BatchWrite(const CCoinsMap &mapCoins, CBlockIndex *pindex);
+
+    // Set the coins of a transaction whose outputs the caller knows to be new,
+    // so a pruned entry need not be written back. Saves looking it up below.
+    bool SetCoins(const uint256 &txid, const CCoins &coins, bool fFresh);
 
     // Return a modifiable reference to a CCoins. Check HaveCoins first.
     // Many methods explicitly require a CCoinsViewCache because of this method, to reduce
-    // copying.
+    // copying. The entry is marked to be written back, so use AccessCoins to only read it.
     CCoins &GetCoins(const uint256 &txid);
 
+    // Return a reference to a CCoins, for reading. Check HaveCoins first.
+    const CCoins &AccessCoins(const uint256 &txid);
+
+    // Check whether this cache holds txid, without looking in the view below
+    bool HaveCoinsInCache(const uint256 &txid);
+
+    // Add coins read from the view below, unless the cache holds txid already
+    void WarmCoins(const uint256 &txid, CCoins &coins);
+
     // Push the modifications applied to this cache to its base.
     // Failure to call this method before destruction will cause the changes to be forgotten.
     bool Flush();
@@ -2294,8 +2528,13 @@ public:
     // Calculate the size of the cache (in number of transactions)
     unsigned int GetCacheSize();
 
+    // Calculate the memory used by the cache, in bytes
+    size_t DynamicMemoryUsage();
+
 private:
-    std::map<uint256,CCoins>::iterator FetchCoins(const uint256 &txid);
+    CCoinsMap::iterator FetchCoins(const uint256 &txid);
+    void AccountModified();
+    void SetUsage(CCoinsCacheEntry &entry);
 };
 
 /** CCoinsView that brings transactions from a memorypool into view.
@@ -645,6 +645,10 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
         if (handled < 0)
                 return false;
 
+        // start on the proof of work while earlier messages are processed
+        if (msg.complete() && msg.hdr.GetCommand() == "block")
+            QueueBlockPoW(this, msg.vRecv);
+
         pch += handled;
         nBytes -= handled;
     }
@@ -632,6 +632,7 @@ public:
     static void ClearBanned(); // needed for unit testing
     static bool IsBanned(CNetAddr ip);
     bool Misbehaving(int howmuch); // 1 == a little, 100 == a lot
+    bool HasMisbehaved() const { return nMisbehavior > 0; }
     void copyStats(CNodeStats &stats);
 };
 
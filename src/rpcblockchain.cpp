@@ -250,6 +250,29 @@ Value gettxoutsetinfo(const Array& params, bool fHelp)
     return ret;
 }
 
+Value getsigcacheinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getsigcacheinfo\n"
+            "Returns the size and hit rate of the cache of verified signatures.");
+
+    CSignatureCacheStats stats;
+    GetSignatureCacheStats(stats);
+
+    Object ret;
+    ret.push_back(Pair("bytes", (boost::int64_t)stats.nBytes));
+    ret.push_back(Pair("capacity", (boost::int64_t)stats.nCapacity));
+    ret.push_back(Pair("entries", (boost::int64_t)stats.nEntries));
+    ret.push_back(Pair("lookups", (boost::int64_t)stats.nLookups));
+    ret.push_back(Pair("hits", (boost::int64_t)stats.nHits));
+    ret.push_back(Pair("hitrate", stats.nLookups ? (double)stats.nHits / stats.nLookups : 0.0));
+    ret.push_back(Pair("inserts", (boost::int64_t)stats.nInserts));
+    ret.push_back(Pair("evictions", (boost::int64_t)stats.nEvictions));
+    ret.push_back(Pair("readretries", (boost::int64_t)stats.nRetries));
+    return ret;
+}
+
 Value gettxout(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() < 2 || params.size() > 3)
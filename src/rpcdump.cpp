@@ -7,6 +7,7 @@
 #include "ui_interface.h"
 #include "base58.h"
 #include "smalldata.h"
+#include "txdb.h"
 
 #include <boost/lexical_cast.hpp>
 
@@ -98,14 +99,17 @@ Value dumpprivkey(const Array& params, bool fHelp)
 
 json_spirit::Value getadlist(const json_spirit::Array& params, bool fHelp)
 {
-    if (fHelp || params.size() != 0)
+    if (fHelp || params.size() > 1)
         throw runtime_error(
-            "getadlist\n"
-            "Return the list of advertisemet.");
+            "getadlist [count]\n"
+            "Return the list of advertisemet, at most [count] (default: -maxads) of the best ones.");
+
+    int nCount = nMaxAds;
+    if (params.size() > 0)
+        nCount = params[0].get_int();
 
-    adManager.load();
     std::vector<CAdTx> adTxList;
-    adManager.getAdList(adTxList);
+    adManager.getAdList(adTxList, nCount);
     
     Array txs;
     for ( int i = 0; i < adTxList.size(); ++ i )
@@ -125,3 +129,141 @@ json_spirit::Value getadlist(const json_spirit::Array& params, bool fHelp)
     return txs;
 }
 
+// Messages returned by one listsmalldata call, each read from the block files
+static const int nListSmallDataMaxCount = 1000;
+
+// Runs without cs_main: the index is read through LevelDB and the payloads
+// from block files, which are only appended to
+json_spirit::Value listsmalldata(const json_spirit::Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 5)
+        throw runtime_error(
+            "listsmalldata <fromheight> [toheight] [type] [count=100] [skip=0]\n"
+            "Returns up to [count] smalldata messages from blocks <fromheight> to [toheight], in chain order,\n"
+            "skipping the first [skip]. [type] is \"plaintext\", \"broadcast\" or \"all\" (default).\n"
+            "[count] is at most 1000. Requires -smalldataindex.");
+
+    if (!fSmallDataIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Smalldata index not enabled, restart with -smalldataindex -reindex");
+
+    int nFromHeight = params[0].get_int();
+    int nToHeight;
+    {
+        LOCK(cs_main);
+        nToHeight = nBestHeight;
+    }
+    if (params.size() > 1)
+        nToHeight = params[1].get_int();
+    if (nFromHeight < 0 || nToHeight < nFromHeight)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid height range");
+
+    int nType = SMALLDATA_TYPE_NULL;
+    if (params.size() > 2)
+    {
+        std::string strType = params[2].get_str();
+        if (strType == "plaintext")
+            nType = SMALLDATA_TYPE_PLAINTEXT;
+        else if (strType == "broadcast")
+            nType = SMALLDATA_TYPE_BROADCAST;
+        else if (strType != "all")
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid type");
+    }
+
+    int nCount = 100;
+    if (params.size() > 3)
+        nCount = params[3].get_int();
+    int nSkip = 0;
+    if (params.size() > 4)
+        nSkip = params[4].get_int();
+    if (nCount < 0 || nSkip < 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative count or skip");
+    if (nCount > nListSmallDataMaxCount)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("Count above %d", nListSmallDataMaxCount));
+
+    std::vector<std::pair<CSmallDataKey, CSmallDataIndexEntry> > vEntries;
+    if (!pblocktree->ReadSmallDataIndex(nFromHeight, nToHeight, nType, nSkip, nCount, vEntries, true))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Error reading smalldata index");
+
+    Array ret;
+    for (unsigned int i = 0; i < vEntries.size(); i++)
+    {
+        const CSmallDataKey& key = vEntries[i].first;
+        const CSmallDataIndexEntry& entry = vEntries[i].second;
+        std::string strMessage;
+        if (!entry.ReadPayload(strMessage))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Error reading smalldata from disk");
+
+        Object obj;
+        obj.push_back(Pair("height", (int)key.nHeight));
+        obj.push_back(Pair("type", key.nType == SMALLDATA_TYPE_BROADCAST ? "broadcast" : "plaintext"));
+        obj.push_back(Pair("txid", key.txid.GetHex()));
+        obj.push_back(Pair("vout", (int)key.nOut));
+        obj.push_back(Pair("fee", ValueFromAmount(entry.nFee)));
+        obj.push_back(Pair("message", strMessage));
+        ret.push_back(obj);
+    }
+
+    return ret;
+}
+
+// Waiting calls share the RPC wait slots with long polling in getblocktemplate
+// and getauxblock, so there is always a worker left for ordinary requests
+static const int64 nWaitSmallDataMaxTimeout = 3600;
+
+json_spirit::Value waitsmalldata(const json_spirit::Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 3)
+        throw runtime_error(
+            "waitsmalldata [sequence=0] [timeout=60] [count=1000]\n"
+            "Returns up to [count] smalldata events from [sequence] on, waiting up to [timeout] seconds\n"
+            "(at most " + strprintf("%"PRI64d, nWaitSmallDataMaxTimeout) + ") for one if there are none yet. When all but one RPC thread\n"
+            "are waiting already, here or in long polling, it returns at once.\n"
+            "An event is a message entering the memory pool (\"mempool\"),\n"
+            "or its block being connected to or disconnected from the main chain (\"connect\", \"disconnect\").\n"
+            "Pass the returned sequence to the next call. Only the latest " + strprintf("%u", CSmallDataEvents::MAX_EVENTS) + " events are kept;\n"
+            "a gap between [sequence] and the first event's sequence means some were missed.");
+
+    int64 nSequence = 0;
+    if (params.size() > 0)
+        nSequence = params[0].get_int64();
+    int64 nTimeout = 60;
+    if (params.size() > 1)
+        nTimeout = params[1].get_int64();
+    int nCount = 1000;
+    if (params.size() > 2)
+        nCount = params[2].get_int();
+    if (nSequence < 0 || nTimeout < 0 || nCount < 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative sequence, timeout or count");
+
+    nTimeout = std::min(nTimeout, nWaitSmallDataMaxTimeout);
+
+    CSemaphoreGrant grant;
+    if (!TryAcquireRPCWaitSlot(grant))
+        nTimeout = 0;
+
+    std::vector<CSmallDataEvent> vEvents;
+    uint64 nNext = smallDataEvents.Wait(nSequence, nTimeout * 1000, nCount, vEvents);
+
+    static const char* pszKinds[] = { "mempool", "connect", "disconnect" };
+    Array events;
+    BOOST_FOREACH(const CSmallDataEvent& event, vEvents)
+    {
+        Object obj;
+        obj.push_back(Pair("sequence", (boost::int64_t)event.nSequence));
+        obj.push_back(Pair("event", pszKinds[event.nKind]));
+        obj.push_back(Pair("txid", event.txid.GetHex()));
+        obj.push_back(Pair("type", event.fBroadcast ? "broadcast" : "plaintext"));
+        obj.push_back(Pair("message", event.strMessage));
+        if (event.nKind != SMALLDATA_EVENT_MEMPOOL)
+        {
+            obj.push_back(Pair("blockhash", event.hashBlock.GetHex()));
+            obj.push_back(Pair("height", event.nHeight));
+        }
+        events.push_back(obj);
+    }
+
+    Object ret;
+    ret.push_back(Pair("sequence", (boost::int64_t)nNext));
+    ret.push_back(Pair("events", events));
+    return ret;
+}
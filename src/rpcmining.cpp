@@ -16,7 +16,7 @@ using namespace std;
 // If 'height' is nonnegative, compute the estimate at the time when a given block was found.
 Value GetNetworkHashPS(int lookup, int height, int algo) {
     //printf("GetNetworkHashPS algo=%d\n", algo);
-    CBlockIndex *pb = pindexBest;
+    const CBlockIndex *pb = pindexBest;
 
     if (height >= 0 && height < nBestHeight)
         pb = FindBlockByHeight(height);
@@ -24,50 +24,45 @@ Value GetNetworkHashPS(int lookup, int height, int algo) {
     if (pb == NULL || !pb->nHeight)
         return 0;
 
-    while ( CBlockHeader::GetBlockAlgo(pb->nVersion) != algo)
-    {
-        pb = pb->pprev;
-        if ( NULL == pb )
-            return 0;
-    }
+    pb = GetLastBlockIndexForAlgo(pb, algo);
+    if ( NULL == pb )
+        return 0;
 
     // If lookup is -1, then use blocks since last difficulty change.
     if (lookup <= 0)
         lookup = pb->nHeight % 2016 + 1;
 
     // If lookup is larger than chain, then set it to chain length.
-    if (lookup > pb->nHeight)
-        lookup = pb->nHeight;
+    if (lookup >= (int)pb->nAlgoChainBlocks)
+        lookup = pb->nAlgoChainBlocks - 1;
+    if (lookup <= 0)
+        return 0;
 
-    CBlockIndex *pb0 = pb;
+    // The work of the window comes from the cumulative per-algo chain work of
+    // its two ends. Its min and max time still take a walk over all 'lookup'
+    // blocks, as block times are not monotonic.
+    const CBlockIndex *pb0 = pb;
     int64 minTime = pb0->GetBlockTime();
     int64 maxTime = minTime;
-    int i;
-    uint256 workDiff(0);
-    for (i = 0; i < lookup; ) {
-        pb0 = pb0->pprev;
-        if ( NULL == pb0 )
-            break;
+    for (int i = 0; i < lookup; i++) {
+        pb0 = pb0->pprevAlgo[algo];
 
-        if ( CBlockHeader::GetBlockAlgo(pb0->nVersion) == algo)
-        {
-            int64 time = pb0->GetBlockTime();
-            minTime = std::min(time, minTime);
-            maxTime = std::max(time, maxTime);
-            i++;
-            workDiff = workDiff + pb0->GetBlockWork().getuint256();
-        }
+        int64 time = pb0->GetBlockTime();
+        minTime = std::min(time, minTime);
+        maxTime = std::max(time, maxTime);
     }
-    //printf("GetNetworkHashPS lookup=%d\n", i);
 
     // In case there's a situation where minTime == maxTime, we don't want a divide by zero exception.
     if (minTime == maxTime)
         return 0;
 
+    // Work of the 'lookup' blocks before pb, pb0 included
+    const CBlockIndex *pbBefore = pb0->pprevAlgo[algo];
+    uint256 workDiff = pb->pprevAlgo[algo]->nAlgoChainWork - (pbBefore ? pbBefore->nAlgoChainWork : 0);
+
     if ( algo == CBlockHeader::BLOCK_ALGO_SCRYPT )
         workDiff >>= 15;
 
-    //uint256 workDiff = pb->nChainWork - pb0->nChainWork;
     int64 timeDiff = maxTime - minTime;
 
     return (boost::int64_t)(workDiff.getdouble() / timeDiff);
@@ -117,6 +112,207 @@ Value getnetworkhashps_scrypt(const Array& params, bool fHelp)
 // Allocated in InitRPCMining, free'd in ShutdownRPCMining
 static CReserveKey* pMiningKey = NULL;
 
+// Long polling (BIP 22): a miner passes back the longpollid of the work it
+// has and the call is held until that work is outdated. A new tip ends the
+// wait at once; a memory pool change only once the call has been held for
+// nLongPollMempoolDelay seconds, so a stream of transactions doesn't turn
+// long polling back into polling. The wait holds no locks, and a call that
+// gets no RPC wait slot returns immediately.
+static const int64 nLongPollMempoolDelay = 60;
+static const int64 nLongPollDefaultTimeout = 120;
+static const int64 nLongPollMaxTimeout = 3600;
+static bool fLongPollInterrupt = false; // guarded by csBestBlock
+
+static std::string GetLongPollId(const CBlockIndex* pindexPrev, unsigned int nTransactionsUpdatedAt)
+{
+    return pindexPrev->GetBlockHash().GetHex() + strprintf("%u", nTransactionsUpdatedAt);
+}
+
+static void WaitForNewWork(const std::string& strLongPollId, int64 nTimeout)
+{
+    if (strLongPollId.size() <= 64)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid longpollid");
+    uint256 hashWatched(strLongPollId.substr(0, 64));
+    unsigned int nTransactionsUpdatedWatched = atoi64(strLongPollId.substr(64));
+    if (nTimeout <= 0)
+        nTimeout = nLongPollDefaultTimeout;
+    nTimeout = std::min(nTimeout, nLongPollMaxTimeout);
+
+    CSemaphoreGrant grant;
+    if (!TryAcquireRPCWaitSlot(grant))
+        return;
+
+    boost::unique_lock<boost::mutex> lock(csBestBlock);
+    boost::system_time timeStart = boost::get_system_time();
+    boost::system_time timeMempool = timeStart + boost::posix_time::seconds(nLongPollMempoolDelay);
+    boost::system_time timeEnd = timeStart + boost::posix_time::seconds(nTimeout);
+    while (!fLongPollInterrupt && hashBestChain == hashWatched)
+    {
+        boost::system_time now = boost::get_system_time();
+        if (now >= timeEnd)
+            break;
+        if (now >= timeMempool && nTransactionsUpdated != nTransactionsUpdatedWatched)
+            break;
+        cvBlockChange.timed_wait(lock, now < timeMempool ? std::min(timeMempool, timeEnd) : timeEnd);
+    }
+}
+
+// Reads the optional {"longpollid": ..., "timeout": ...} request object and
+// waits for new work if a longpollid was given. Must be called without
+// cs_main, which the block and transaction processing that ends the wait needs.
+static void LongPollFromParams(const Object& oparam)
+{
+    const Value& lpval = find_value(oparam, "longpollid");
+    if (lpval.type() == null_type)
+        return;
+    if (lpval.type() != str_type)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid longpollid");
+    int64 nTimeout = 0;
+    const Value& timeoutval = find_value(oparam, "timeout");
+    if (timeoutval.type() == int_type)
+        nTimeout = timeoutval.get_int64();
+    else if (timeoutval.type() != null_type)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid timeout");
+    WaitForNewWork(lpval.get_str(), nTimeout);
+}
+
+// Blocks handed out by getauxblock. There is one live template per algo,
+// rebuilt when the tip changes or, at most once a minute, when the mempool
+// changes. Templates that were replaced stay available for submission until
+// the tip moves so a pool can still turn in work on an older hash.
+class CAuxBlockTemplates
+{
+private:
+    CCriticalSection cs;
+    CBlockIndex* pindexPrev;
+    std::vector<CBlockTemplate*> vTemplates;
+    std::map<uint256, CBlock*> mapBlocks;
+    CBlockTemplate* pLive[CBlockHeader::NUM_ALGOS];
+    unsigned int nTransactionsUpdatedLast[CBlockHeader::NUM_ALGOS];
+    int64 nCreated[CBlockHeader::NUM_ALGOS];
+    uint64 nRebuilds[CBlockHeader::NUM_ALGOS];
+
+    void ClearTemplates()
+    {
+        mapBlocks.clear();
+        BOOST_FOREACH(CBlockTemplate* pblocktemplate, vTemplates)
+            delete pblocktemplate;
+        vTemplates.clear();
+        for (int algo = 0; algo < CBlockHeader::NUM_ALGOS; algo++)
+            pLive[algo] = NULL;
+    }
+
+public:
+    CAuxBlockTemplates()
+    {
+        pindexPrev = NULL;
+        for (int algo = 0; algo < CBlockHeader::NUM_ALGOS; algo++)
+        {
+            pLive[algo] = NULL;
+            nTransactionsUpdatedLast[algo] = 0;
+            nCreated[algo] = 0;
+            nRebuilds[algo] = 0;
+        }
+    }
+
+    ~CAuxBlockTemplates()
+    {
+        ClearTemplates();
+    }
+
+    void Clear()
+    {
+        LOCK(cs);
+        ClearTemplates();
+        pindexPrev = NULL;
+    }
+
+    // Hash, nBits and longpollid of the live template for algo, rebuilding it first if it is stale
+    void Get(int algo, uint256& hashRet, unsigned int& nBitsRet, std::string& strLongPollIdRet)
+    {
+        LOCK(cs);
+        if (pindexPrev != pindexBest)
+        {
+            // Deallocate old blocks since they're obsolete now
+            ClearTemplates();
+            pindexPrev = pindexBest;
+        }
+
+        if (pLive[algo] == NULL ||
+            (nTransactionsUpdated != nTransactionsUpdatedLast[algo] && GetTime() - nCreated[algo] > 60))
+        {
+            nTransactionsUpdatedLast[algo] = nTransactionsUpdated;
+
+            // Create new block
+            CBlockTemplate* pblocktemplate = CreateNewBlockWithKey(*pMiningKey, algo);
+            if (!pblocktemplate)
+                throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
+            CBlock* pblock = &pblocktemplate->block;
+
+            // Update nTime
+            pblock->nTime = max(pindexPrev->GetMedianTimePast()+1, GetAdjustedTime());
+            pblock->nNonce = 0;
+
+            // Push OP_2 just in case we want versioning later
+            pblock->vtx[0].vin[0].scriptSig = CScript() << pblock->nBits << CBigNum(1) << OP_2;
+            pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+
+            // Sets the version
+            pblock->SetAuxPow(new CAuxPow());
+
+            // Save
+            vTemplates.push_back(pblocktemplate);
+            mapBlocks[pblock->GetHash()] = pblock;
+            pLive[algo] = pblocktemplate;
+            nCreated[algo] = GetTime();
+            nRebuilds[algo]++;
+        }
+
+        const CBlock& block = pLive[algo]->block;
+        hashRet = block.GetHash();
+        nBitsRet = block.nBits;
+        strLongPollIdRet = GetLongPollId(pindexPrev, nTransactionsUpdatedLast[algo]);
+    }
+
+    // Attach auxpow to the block handed out as hash and submit it
+    bool Submit(const uint256& hash, CAuxPow* pow)
+    {
+        LOCK(cs);
+        std::map<uint256, CBlock*>::iterator mi = mapBlocks.find(hash);
+        if (mi == mapBlocks.end())
+        {
+            delete pow;
+            return ::error("getauxblock() : block not found");
+        }
+
+        // Work on a copy so concurrent or failed submissions leave the saved block intact
+        CBlock block(*mi->second);
+        block.SetAuxPow(pow);
+        block.print();
+
+        return CheckWork(&block, *pwalletMain, *pMiningKey);
+    }
+
+    Array GetInfo()
+    {
+        LOCK(cs);
+        Array result;
+        int64 nNow = GetTime();
+        for (int algo = 0; algo < CBlockHeader::NUM_ALGOS; algo++)
+        {
+            Object obj;
+            obj.push_back(Pair("algo", algo));
+            obj.push_back(Pair("age", (boost::int64_t)(pLive[algo] ? nNow - nCreated[algo] : -1)));
+            obj.push_back(Pair("transactions", pLive[algo] ? (int)pLive[algo]->block.vtx.size() : 0));
+            obj.push_back(Pair("rebuilds", (boost::uint64_t)nRebuilds[algo]));
+            result.push_back(obj);
+        }
+        return result;
+    }
+};
+
+static CAuxBlockTemplates auxBlockTemplates;
+
 void InitRPCMining()
 {
     if (!pwalletMain)
@@ -131,9 +327,18 @@ void ShutdownRPCMining()
     if (!pMiningKey)
         return;
 
+    auxBlockTemplates.Clear();
     delete pMiningKey; pMiningKey = NULL;
 }
 
+// Wake up and release any long polls so the RPC threads can be stopped
+void InterruptRPCMining()
+{
+    boost::unique_lock<boost::mutex> lock(csBestBlock);
+    fLongPollInterrupt = true;
+    cvBlockChange.notify_all();
+}
+
 Value getgenerate(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -177,10 +382,19 @@ Value setgenerate(const Array& params, bool fHelp)
 
 Value gethashespersec(const Array& params, bool fHelp)
 {
-    if (fHelp || params.size() != 0)
+    if (fHelp || params.size() > 1)
         throw runtime_error(
-            "gethashespersec\n"
-            "Returns a recent hashes per second performance measurement while generating.");
+            "gethashespersec [algo]\n"
+            "Returns a recent hashes per second performance measurement while generating.\n"
+            "[algo] is sha256 or scrypt (default: -miningalgo).");
+
+    std::string strAlgo = params.size() > 0 ? params[0].get_str() : GetArg("-miningalgo", "sha256");
+    if ( 0 == strAlgo.compare("scrypt") )
+    {
+        if (GetTimeMillis() - nHPSTimerStartScrypt > 8000)
+            return (boost::int64_t)0;
+        return (boost::int64_t)dHashesPerSecScrypt;
+    }
 
     if (GetTimeMillis() - nHPSTimerStart > 8000)
         return (boost::int64_t)0;
@@ -209,9 +423,15 @@ Value getmininginfo(const Array& params, bool fHelp)
     obj.push_back(Pair("generate",      GetBoolArg("-gen")));
     obj.push_back(Pair("genproclimit",  (int)GetArg("-genproclimit", -1)));
     obj.push_back(Pair("hashespersec",  gethashespersec(params, false)));
+    Array paramsAlgo;
+    paramsAlgo.push_back("sha256");
+    obj.push_back(Pair("hashespersec_sha256", gethashespersec(paramsAlgo, false)));
+    paramsAlgo[0] = "scrypt";
+    obj.push_back(Pair("hashespersec_scrypt", gethashespersec(paramsAlgo, false)));
     obj.push_back(Pair("networkhashps", getnetworkhashps(params, false)));
     obj.push_back(Pair("pooledtx",      (uint64_t)mempool.size()));
     obj.push_back(Pair("testnet",       fTestNet));
+    obj.push_back(Pair("auxblocktemplates", auxBlockTemplates.GetInfo()));
     return obj;
 }
 
@@ -295,7 +515,7 @@ Value getworkex(const Array& params, bool fHelp)
         char phash1[64];
         FormatHashBuffers(pblock, pmidstate, pdata, phash1);
 
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        uint256 hashTarget = arith_uint256().SetCompact(pblock->nBits);
 
         CTransaction coinbaseTx = pblock->vtx[0];
         std::vector<uint256> merkle = pblock->GetMerkleBranch(0);
@@ -439,7 +659,7 @@ Value getwork(const Array& params, bool fHelp)
         char phash1[64];
         FormatHashBuffers(pblock, pmidstate, pdata, phash1);
 
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        uint256 hashTarget = arith_uint256().SetCompact(pblock->nBits);
         //printf("getwork hashTarget %s\n", hashTarget.ToString().c_str());
         //pblock->print();
 
@@ -488,7 +708,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
             "  \"version\" : block version\n"
             "  \"previousblockhash\" : hash of current highest block\n"
             "  \"transactions\" : contents of non-coinbase transactions that should be included in the next block\n"
-            "  \"coinbaseaux\" : data that should be included in coinbase\n"
+            "  \"coinbaseaux\" : data that should be included in coinbase, including the commitment to merge-mined aux chains\n"
             "  \"coinbasevalue\" : maximum allowable input to coinbase transaction, including the generation award and transaction fees\n"
             "  \"target\" : hash target\n"
             "  \"mintime\" : minimum timestamp appropriate for next block\n"
@@ -499,12 +719,15 @@ Value getblocktemplate(const Array& params, bool fHelp)
             "  \"sizelimit\" : limit of block size\n"
             "  \"bits\" : compressed target of next block\n"
             "  \"height\" : height of the next block\n"
+            "  \"longpollid\" : pass back as {\"longpollid\":<id>[,\"timeout\":<seconds>]} to wait for new work\n"
             "See https://en.bitcoin.it/wiki/BIP_0022 for full specification.");
 
     std::string strMode = "template";
+    const Object* poparam = NULL;
     if (params.size() > 0)
     {
         const Object& oparam = params[0].get_obj();
+        poparam = &oparam;
         const Value& modeval = find_value(oparam, "mode");
         if (modeval.type() == str_type)
             strMode = modeval.get_str();
@@ -519,6 +742,11 @@ Value getblocktemplate(const Array& params, bool fHelp)
     if (strMode != "template")
         throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid mode");
 
+    if (poparam)
+        LongPollFromParams(*poparam);
+
+    LOCK(cs_main);
+
     if (vNodes.empty())
         throw JSONRPCError(RPC_CLIENT_NOT_CONNECTED, "Fusioncoin is not connected!");
 
@@ -530,7 +758,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
     if ( 0 == strCmd.compare("scrypt") )
         algo = CBlockHeader::BLOCK_ALGO_SCRYPT;
 
-    // Update block
+    // Update block; the cached template is guarded by cs_main
     static unsigned int nTransactionsUpdatedLast;
     static CBlockIndex* pindexPrev;
     static int64 nStart;
@@ -602,8 +830,17 @@ Value getblocktemplate(const Array& params, bool fHelp)
 
     Object aux;
     aux.push_back(Pair("flags", HexStr(COINBASE_FLAGS.begin(), COINBASE_FLAGS.end())));
+    CAuxMerkleTree auxtree = auxChains.CreateTree();
+    if (!auxtree.IsNull())
+    {
+        // Commitment to the aux chains set with setauxchain
+        vector<unsigned char> vchAux = auxtree.GetCoinbaseCommitment();
+        AddMergedMiningHeader(vchAux);
+        aux.push_back(Pair("auxchains", HexStr(vchAux.begin(), vchAux.end())));
+        auxChains.AddRecentTree(auxtree);
+    }
 
-    uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+    uint256 hashTarget = arith_uint256().SetCompact(pblock->nBits);
 
     static Array aMutable;
     if (aMutable.empty())
@@ -628,6 +865,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
     result.push_back(Pair("curtime", (int64_t)pblock->nTime));
     result.push_back(Pair("bits", HexBits(pblock->nBits)));
     result.push_back(Pair("height", (int64_t)(pindexPrev->nHeight+1)));
+    result.push_back(Pair("longpollid", GetLongPollId(pindexPrev, nTransactionsUpdatedLast)));
 
     return result;
 }
@@ -664,27 +902,24 @@ Value getauxblock(const Array& params, bool fHelp)
     if (fHelp || (params.size() != 0 && params.size() != 1 && params.size() != 2))
         throw runtime_error(
             "getauxblock [type]\n"
+            "getauxblock <type> {\"longpollid\":<id>,\"timeout\":<seconds>}\n"
             "getauxblock [<hash> <auxpow>]\n"
             " create a new block"
             "If <hash>, <auxpow> is not specified, returns a new block hash.\n"
+            "With a longpollid from an earlier result, waits until that work is outdated or timeout expires.\n"
             "If <hash>, <auxpow> is specified, tries to solve the block based on "
             "the aux proof of work and returns true if it was successful.");
 
     //if (vNodes.empty())
         //throw JSONRPCError(-9, "Bitcoin is not connected!");
 
-    if (IsInitialBlockDownload())
-        throw JSONRPCError(-10, "Bitcoin is downloading blocks...");
-
-    //static map<uint256, CBlock*> mapNewBlock;
-    //static vector<CBlock*> vNewBlock;
-    //static CReserveKey reservekey(pwalletMain);
-
-    typedef map<uint256, pair<CBlock*, CScript> > mapNewBlock_t;
-    static mapNewBlock_t mapNewBlock;    // FIXME: thread safety
-    static vector<CBlockTemplate*> vNewBlockTemplate;
+    {
+        LOCK(cs_main);
+        if (IsInitialBlockDownload())
+            throw JSONRPCError(-10, "Bitcoin is downloading blocks...");
+    }
 
-    if (params.size() == 0 || params.size() == 1)
+    if (params.size() == 0 || params.size() == 1 || params[1].type() == obj_type)
     {
         int algo = CBlockHeader::BLOCK_ALGO_SHA256;
         if ( params.size() == 0 )
@@ -692,73 +927,30 @@ Value getauxblock(const Array& params, bool fHelp)
             std::string strCmd = GetArg("-miningalgo", "sha256");
             if ( 0 == strCmd.compare("scrypt") )
                 algo = CBlockHeader::BLOCK_ALGO_SCRYPT;
-            //printf("param 0, algo = %d\n", algo);
         }
         else
         {
             algo = atoi(params[0].get_str());
-            //printf("param %s, algo = %d\n", params[0].get_str().c_str(), algo);
             if ( CBlockHeader::BLOCK_ALGO_SHA256 != algo && CBlockHeader::BLOCK_ALGO_SCRYPT != algo )
                 return false;
         }
 
-        // Update block
-        static unsigned int nTransactionsUpdatedLast;
-        static CBlockIndex* pindexPrev;
-        static int64 nStart;
-        static CBlockTemplate* pblocktemplate;
-        
-        CBlock* pblock;
-        
-        if (pindexPrev != pindexBest ||
-            (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60) ||
-            pblocktemplate->block.GetAlgo() != algo )
-        {
-            if (pindexPrev != pindexBest)
-            {
-                // Deallocate old blocks since they're obsolete now
-                mapNewBlock.clear();
-                BOOST_FOREACH(CBlockTemplate* pblocktemplate, vNewBlockTemplate)
-                    delete pblocktemplate;
-                vNewBlockTemplate.clear();
-            }
-            nTransactionsUpdatedLast = nTransactionsUpdated;
-            pindexPrev = pindexBest;
-            nStart = GetTime();
-
-            // Create new block 
-            pblocktemplate = CreateNewBlockWithKey(*pMiningKey, algo);
-            if (!pblocktemplate)
-                throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
-            
-            pblock = &pblocktemplate->block;
-
-            // Update nTime
-            pblock->nTime = max(pindexPrev->GetMedianTimePast()+1, GetAdjustedTime());
-            pblock->nNonce = 0;
-
-            // Push OP_2 just in case we want versioning later
-            pblock->vtx[0].vin[0].scriptSig = CScript() << pblock->nBits << CBigNum(1) << OP_2;
-            pblock->hashMerkleRoot = pblock->BuildMerkleTree();
-
-            // Sets the version
-            pblock->SetAuxPow(new CAuxPow());
+        if (params.size() == 2)
+            LongPollFromParams(params[1].get_obj());
 
-            // Save
-            vNewBlockTemplate.push_back(pblocktemplate);
-            //mapNewBlock[pblock->GetHash()] = pblock;
-            mapNewBlock[pblock->GetHash()] = make_pair(pblock, pblock->vtx[0].vin[0].scriptSig);
-            //printf("block algo = %d\n", pblock->GetAlgo());
+        uint256 hash;
+        unsigned int nBits;
+        std::string strLongPollId;
+        {
+            LOCK2(cs_main, pwalletMain->cs_wallet);
+            auxBlockTemplates.Get(algo, hash, nBits, strLongPollId);
         }
-
-        pblock = &pblocktemplate->block;
-        //pblock->print();
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
-        //printf("hashTarget %s\n", hashTarget.ToString().c_str());
+        uint256 hashTarget = arith_uint256().SetCompact(nBits);
 
         Object result;
         result.push_back(Pair("target",   HexStr(BEGIN(hashTarget), END(hashTarget))));
-        result.push_back(Pair("hash", pblock->GetHash().GetHex()));
+        result.push_back(Pair("hash", hash.GetHex()));
+        result.push_back(Pair("longpollid", strLongPollId));
         if ( fTestNet )
             result.push_back(Pair("chainid", GetDefaultPort()));
         else
@@ -769,30 +961,81 @@ Value getauxblock(const Array& params, bool fHelp)
     {
         uint256 hash;
         hash.SetHex(params[0].get_str());
-        if (!mapNewBlock.count(hash))
-            return ::error("getauxblock() : block not found");
 
-        //CBlock* pblock = mapNewBlock[hash];
-        // Get saved block
-        if (!mapNewBlock.count(hash))
-            return false;
-        CBlock* pblock = mapNewBlock[hash].first;
-        
         vector<unsigned char> vchAuxPow = ParseHex(params[1].get_str());
         CDataStream ss(vchAuxPow, SER_GETHASH, PROTOCOL_VERSION);
         CAuxPow* pow = new CAuxPow();
         ss >> *pow;
-        pblock->SetAuxPow(pow);
-        pblock->print();
 
-        if (!CheckWork(pblock, *pwalletMain, *pMiningKey))
-        {
-            return false;
-        }
-        else
-        {
-            return true;
-        }
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+        return auxBlockTemplates.Submit(hash, pow);
     }
 }
 
+
+Value setauxchain(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 2)
+        throw runtime_error(
+            "setauxchain <chainid> [blockhash]\n"
+            "Merge mines aux chain <chainid> on <blockhash>, or moves it to a new <blockhash>.\n"
+            "Without <blockhash>, stops committing to <chainid>.\n"
+            "Coinbases from getblocktemplate and the internal miner commit to all chains set.");
+
+    int nChainID = params[0].get_int();
+    if (nChainID == (fTestNet ? GetDefaultPort() : 0))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Chain id is taken by this chain");
+
+    if (params.size() > 1)
+        auxChains.SetChain(nChainID, uint256(params[1].get_str()));
+    else if (!auxChains.RemoveChain(nChainID))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Chain id is not set");
+
+    Object chains;
+    map<int, uint256> mapChains = auxChains.GetChains();
+    BOOST_FOREACH(const PAIRTYPE(int, uint256)& item, mapChains)
+        chains.push_back(Pair(strprintf("%d", item.first), item.second.GetHex()));
+
+    Object result;
+    result.push_back(Pair("chains", chains));
+    CAuxMerkleTree tree = auxChains.CreateTree();
+    if (!tree.IsNull())
+    {
+        result.push_back(Pair("merklesize", tree.nSize));
+        result.push_back(Pair("merklenonce", tree.nNonce));
+        result.push_back(Pair("merkleroot", tree.GetRoot().GetHex()));
+    }
+    return result;
+}
+
+Value getauxchainproof(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 2)
+        throw runtime_error(
+            "getauxchainproof <blockhash> <chainid>\n"
+            "Returns the serialized, hex-encoded auxpow proving the block of aux chain <chainid>\n"
+            "with block <blockhash>, or with the parent block of <blockhash> if it is merged-mined.\n"
+            "Only work from recent getblocktemplate calls or the internal miner can be proven.");
+
+    uint256 hash(params[0].get_str());
+    int nChainID = params[1].get_int();
+
+    if (mapBlockIndex.count(hash) == 0)
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+
+    CBlock block;
+    if (!block.ReadFromDisk(mapBlockIndex[hash]))
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
+
+    CAuxPow auxpow;
+    if (block.isAuxBlock())
+        auxpow = *block.auxpow;
+    else
+        auxpow.SetParentBlock(block);
+    if (!auxChains.SetChainMerkleBranch(auxpow, nChainID))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Block does not commit to chain id in a recent aux merkle tree");
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << auxpow;
+    return HexStr(ss.begin(), ss.end());
+}
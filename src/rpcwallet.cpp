@@ -90,6 +90,22 @@ Value getinfo(const Array& params, bool fHelp)
     obj.push_back(Pair("difficulty_sha256",    (double)GetDifficulty(CBlockHeader::BLOCK_ALGO_SHA256)));
     obj.push_back(Pair("difficulty_scrypt",    (double)GetDifficulty(CBlockHeader::BLOCK_ALGO_SCRYPT)));
     obj.push_back(Pair("testnet",       fTestNet));
+    {
+        LOCK(cs_nBlockReadPoWSkipped);
+        obj.push_back(Pair("powreadskipped", (boost::int64_t)nBlockReadPoWSkipped));
+    }
+    uint64 nAuxPowCacheHits, nAuxPowCacheMisses, nAuxPowCacheSize;
+    GetAuxPowCacheStats(nAuxPowCacheHits, nAuxPowCacheMisses, nAuxPowCacheSize);
+    obj.push_back(Pair("auxpowcachehits", (boost::int64_t)nAuxPowCacheHits));
+    obj.push_back(Pair("auxpowcachemisses", (boost::int64_t)nAuxPowCacheMisses));
+    obj.push_back(Pair("auxpowcachesize", (boost::int64_t)nAuxPowCacheSize));
+    uint64 nPoWDepth, nPoWHits, nPoWMisses;
+    double dPoWHashesPerSec;
+    GetPoWPipelineStats(nPoWDepth, dPoWHashesPerSec, nPoWHits, nPoWMisses);
+    obj.push_back(Pair("powpipelinedepth", (boost::int64_t)nPoWDepth));
+    obj.push_back(Pair("powpipelinehashespersec", dPoWHashesPerSec));
+    obj.push_back(Pair("powpipelinehits", (boost::int64_t)nPoWHits));
+    obj.push_back(Pair("powpipelinemisses", (boost::int64_t)nPoWMisses));
     if (pwalletMain) {
         obj.push_back(Pair("keypoololdest", (boost::int64_t)pwalletMain->GetOldestKeyPoolTime()));
         obj.push_back(Pair("keypoolsize",   (int)pwalletMain->GetKeyPoolSize()));
@@ -3,7 +3,9 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 #include <boost/foreach.hpp>
-#include <boost/tuple/tuple.hpp>
+#include <boost/detail/atomic_count.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
 
 using namespace std;
 using namespace boost;
@@ -16,7 +18,8 @@ using namespace boost;
 #include "sync.h"
 #include "util.h"
 
-bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, int flags);
+bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, int flags,
+              const CSignatureHashContext* pSigHashes = NULL);
 
 
 
@@ -291,7 +294,8 @@ bool IsCanonicalSignature(const valtype &vchSig) {
     return true;
 }
 
-bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType)
+bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType,
+                const CSignatureHashContext* pSigHashes)
 {
     CAutoBN_CTX pctx;
     CScript::const_iterator pc = script.begin();
@@ -845,7 +849,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
 
                     bool fSuccess = (!fStrictEncodings || (IsCanonicalSignature(vchSig) && IsCanonicalPubKey(vchPubKey)));
                     if (fSuccess)
-                        fSuccess = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags);
+                        fSuccess = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, pSigHashes);
 
                     popstack(stack);
                     popstack(stack);
@@ -907,7 +911,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                         // Check signature
                         bool fOk = (!fStrictEncodings || (IsCanonicalSignature(vchSig) && IsCanonicalPubKey(vchPubKey)));
                         if (fOk)
-                            fOk = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags);
+                            fOk = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, pSigHashes);
 
                         if (fOk) {
                             isig++;
@@ -1026,6 +1030,96 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
     return ss.GetHash();
 }
 
+CSignatureHashContext::CSignatureHashContext(const CTransaction& txTo) : ptxTo(&txTo)
+{
+    CDataStream ssInputs(SER_GETHASH, 0), ssInputsNoSequence(SER_GETHASH, 0);
+    BOOST_FOREACH(const CTxIn& txin, txTo.vin)
+    {
+        ssInputs << txin.prevout << CScript() << txin.nSequence;
+        ssInputsNoSequence << txin.prevout << CScript() << (unsigned int)0;
+    }
+    vchInputs.assign(ssInputs.begin(), ssInputs.end());
+    vchInputsNoSequence.assign(ssInputsNoSequence.begin(), ssInputsNoSequence.end());
+    assert(vchInputs.size() == txTo.vin.size() * BLANK_INPUT_SIZE);
+
+    CDataStream ssOutputs(SER_GETHASH, 0);
+    ssOutputs << txTo.vout;
+    vchOutputs.assign(ssOutputs.begin(), ssOutputs.end());
+
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << txTo.nVersion;
+    WriteCompactSize(ss, txTo.vin.size());
+    vPrefix.reserve(txTo.vin.size());
+    for (unsigned int i = 0; i < txTo.vin.size(); i++)
+    {
+        vPrefix.push_back(ss);
+        ss.write((const char*)&vchInputs[i * BLANK_INPUT_SIZE], BLANK_INPUT_SIZE);
+    }
+}
+
+uint256 CSignatureHashContext::SignatureHash(CScript scriptCode, unsigned int nIn, int nHashType) const
+{
+    const CTransaction& txTo = *ptxTo;
+    if (nIn >= txTo.vin.size())
+    {
+        printf("ERROR: CSignatureHashContext::SignatureHash() : nIn=%d out of range\n", nIn);
+        return 1;
+    }
+    int nBaseType = nHashType & 0x1f;
+    if (nBaseType == SIGHASH_SINGLE && nIn >= txTo.vout.size())
+    {
+        printf("ERROR: CSignatureHashContext::SignatureHash() : nOut=%d out of range\n", nIn);
+        return 1;
+    }
+    bool fAnyoneCanPay = (nHashType & SIGHASH_ANYONECANPAY);
+    bool fZeroSequences = (nBaseType == SIGHASH_NONE || nBaseType == SIGHASH_SINGLE);
+    const CTxIn& txin = txTo.vin[nIn];
+
+    scriptCode.FindAndDelete(CScript(OP_CODESEPARATOR));
+
+    // Inputs, as serialized by SignatureHash's blanked copy of the transaction
+    CHashWriter ss(SER_GETHASH, 0);
+    if (fAnyoneCanPay)
+    {
+        ss << txTo.nVersion;
+        WriteCompactSize(ss, 1);
+        ss << txin.prevout << scriptCode << txin.nSequence;
+    }
+    else
+    {
+        const std::vector<unsigned char>& vch = fZeroSequences ? vchInputsNoSequence : vchInputs;
+        if (fZeroSequences)
+        {
+            ss << txTo.nVersion;
+            WriteCompactSize(ss, txTo.vin.size());
+            if (nIn > 0)
+                ss.write((const char*)&vch[0], nIn * BLANK_INPUT_SIZE);
+        }
+        else
+            ss = vPrefix[nIn];
+        ss << txin.prevout << scriptCode << txin.nSequence;
+        if (nIn + 1 < txTo.vin.size())
+            ss.write((const char*)&vch[(nIn + 1) * BLANK_INPUT_SIZE], (txTo.vin.size() - nIn - 1) * BLANK_INPUT_SIZE);
+    }
+
+    // Outputs
+    if (nBaseType == SIGHASH_NONE)
+        WriteCompactSize(ss, 0);
+    else if (nBaseType == SIGHASH_SINGLE)
+    {
+        WriteCompactSize(ss, nIn + 1);
+        CTxOut txoutNull;
+        for (unsigned int i = 0; i < nIn; i++)
+            ss << txoutNull;
+        ss << txTo.vout[nIn];
+    }
+    else
+        ss.write((const char*)&vchOutputs[0], vchOutputs.size());
+
+    ss << txTo.nLockTime << nHashType;
+    return ss.GetHash();
+}
+
 
 // Valid signature cache, to avoid doing expensive ECDSA signature checking
 // twice for every transaction (once when accepted into memory pool, and
@@ -1033,60 +1127,209 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
 
 class CSignatureCache
 {
+public:
+    static const unsigned int SHARDS = 16;
+    static const unsigned int WAYS = 4;
+
 private:
-     // sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, CPubKey> sigdata_type;
-    std::set< sigdata_type> setValid;
-    boost::shared_mutex cs_sigcache;
+    // Entries are salted hashes of (signature hash, signature, public key), so
+    // that would-be DoS attackers can neither pick colliding entries nor predict
+    // which entries get evicted. SHA256 state after the salt:
+    SHA256_CTX ctxSalted;
+
+    // The entries of one shard, in buckets of WAYS entries; free slots are 0.
+    // Lookups don't lock: writers hold cs and make nSequence odd while they
+    // change entries, and a reader copies its bucket and retries if
+    // nSequence was odd or moved meanwhile. The GCC __sync builtins order the
+    // accesses to it. vEntries is only replaced by Resize, which must not run
+    // alongside lookups.
+    class CShard
+    {
+    public:
+        boost::mutex cs;
+        volatile unsigned int nSequence;
+        std::vector<uint256> vEntries;
+        uint64 nEntries;
+        uint64 nInserts;
+        uint64 nEvictions;
+        boost::detail::atomic_count nLookups;
+        boost::detail::atomic_count nHits;
+        boost::detail::atomic_count nRetries;
+
+        CShard() : nSequence(0), nEntries(0), nInserts(0), nEvictions(0), nLookups(0), nHits(0), nRetries(0) {}
+    };
+    CShard shards[SHARDS];
+
+    // Lookups give up on a shard that keeps changing under them and wait for cs
+    static const int MAX_READ_RETRIES = 4;
+
+    static CShard& Shard(CShard* pshards, const uint256& entry)
+    {
+        return pshards[entry.Get64(0) % SHARDS];
+    }
+
+    static uint256* Bucket(CShard& shard, const uint256& entry)
+    {
+        return &shard.vEntries[(entry.Get64(0) / SHARDS) % (shard.vEntries.size() / WAYS) * WAYS];
+    }
 
 public:
-    bool
-    Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+    CSignatureCache()
     {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+        uint256 salt[2] = { GetRandHash(), GetRandHash() };
+        SHA256_Init(&ctxSalted);
+        SHA256_Update(&ctxSalted, salt, sizeof(salt));
+        Resize(GetMaxSignatureCacheSize());
+    }
 
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
-        return false;
+    uint256 GetEntry(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey) const
+    {
+        // The signature length keeps signature and public key bytes apart
+        unsigned char nSigSize[4] = { (unsigned char)vchSig.size(), (unsigned char)(vchSig.size() >> 8),
+                                      (unsigned char)(vchSig.size() >> 16), (unsigned char)(vchSig.size() >> 24) };
+        SHA256_CTX ctx = ctxSalted;
+        SHA256_Update(&ctx, hash.begin(), 32);
+        SHA256_Update(&ctx, nSigSize, sizeof(nSigSize));
+        if (!vchSig.empty())
+            SHA256_Update(&ctx, &vchSig[0], vchSig.size());
+        SHA256_Update(&ctx, pubKey.begin(), pubKey.size());
+        uint256 entry;
+        SHA256_Final(entry.begin(), &ctx);
+        return entry;
     }
 
-    void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+    bool Get(const uint256 &entry)
     {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64 nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
+        CShard& shard = Shard(shards, entry);
+        ++shard.nLookups;
+        if (shard.vEntries.empty())
+            return false;
+        const uint256* pbucket = Bucket(shard, entry);
+        uint256 bucket[WAYS];
+        bool fRead = false;
+        for (int nTry = 0; nTry < MAX_READ_RETRIES && !fRead; nTry++)
+        {
+            unsigned int nSequence = shard.nSequence;
+            __sync_synchronize();
+            if (nSequence & 1)
+            {
+                ++shard.nRetries;
+                continue;
+            }
+            memcpy(bucket, pbucket, sizeof(bucket));
+            __sync_synchronize();
+            fRead = shard.nSequence == nSequence;
+            if (!fRead)
+                ++shard.nRetries;
+        }
+        if (!fRead)
+        {
+            boost::unique_lock<boost::mutex> lock(shard.cs);
+            memcpy(bucket, pbucket, sizeof(bucket));
+        }
+        for (unsigned int i = 0; i < WAYS; i++)
+        {
+            if (bucket[i] == entry)
+            {
+                ++shard.nHits;
+                return true;
+            }
+        }
+        return false;
+    }
 
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
+    void Set(const uint256 &entry)
+    {
+        CShard& shard = Shard(shards, entry);
+        boost::unique_lock<boost::mutex> lock(shard.cs);
+        if (shard.vEntries.empty())
+            return;
+        uint256* pbucket = Bucket(shard, entry);
+        for (unsigned int i = 0; i < WAYS; i++)
+            if (pbucket[i] == entry)
+                return;
+        shard.nInserts++;
+        unsigned int nSlot = WAYS;
+        for (unsigned int i = 0; i < WAYS && nSlot == WAYS; i++)
+            if (pbucket[i] == 0)
+                nSlot = i;
+        if (nSlot < WAYS)
+            shard.nEntries++;
+        else
+        {
+            // Bucket full: evict the entry the (unpredictable) new entry points at
+            nSlot = entry.Get64(1) % WAYS;
+            shard.nEvictions++;
+        }
+        __sync_fetch_and_add(&shard.nSequence, 1);
+        pbucket[nSlot] = entry;
+        __sync_fetch_and_add(&shard.nSequence, 1);
+    }
 
-        while (static_cast<int64>(setValid.size()) > nMaxCacheSize)
+    // Empty the cache and make room for nBytes of entries. Not safe while
+    // other threads look up signatures.
+    void Resize(uint64 nBytes)
+    {
+        uint64 nBuckets = nBytes / (SHARDS * WAYS * sizeof(uint256));
+        BOOST_FOREACH(CShard& shard, shards)
         {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
+            boost::unique_lock<boost::mutex> lock(shard.cs);
+            std::vector<uint256>().swap(shard.vEntries);
+            shard.vEntries.resize(nBuckets * WAYS);
+            shard.nEntries = 0;
         }
+    }
 
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+    void GetStats(CSignatureCacheStats& stats)
+    {
+        stats = CSignatureCacheStats();
+        BOOST_FOREACH(CShard& shard, shards)
+        {
+            boost::unique_lock<boost::mutex> lock(shard.cs);
+            stats.nCapacity += shard.vEntries.size();
+            stats.nEntries += shard.nEntries;
+            stats.nInserts += shard.nInserts;
+            stats.nEvictions += shard.nEvictions;
+            stats.nLookups += (unsigned long)shard.nLookups;
+            stats.nHits += (unsigned long)shard.nHits;
+            stats.nRetries += (unsigned long)shard.nRetries;
+        }
+        stats.nBytes = stats.nCapacity * sizeof(uint256);
     }
 };
 
-bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode,
-              const CTransaction& txTo, unsigned int nIn, int nHashType, int flags)
+static CSignatureCache& GetSignatureCache()
 {
     static CSignatureCache signatureCache;
+    return signatureCache;
+}
+
+uint64 GetMaxSignatureCacheSize()
+{
+    int64 nMaxCacheSize = GetArg("-maxsigcachesize", DEFAULT_MAX_SIGCACHE_SIZE);
+    if (nMaxCacheSize < 0)
+        nMaxCacheSize = 0;
+    // The option used to count entries, and such values are above the limit
+    // in megabytes: keep room for that many entries
+    if (nMaxCacheSize > MAX_MAX_SIGCACHE_SIZE)
+        return std::min((uint64)nMaxCacheSize * sizeof(uint256), (uint64)MAX_MAX_SIGCACHE_SIZE << 20);
+    return (uint64)nMaxCacheSize << 20;
+}
+
+void InitSignatureCache()
+{
+    GetSignatureCache().Resize(GetMaxSignatureCacheSize());
+}
+
+void GetSignatureCacheStats(CSignatureCacheStats& stats)
+{
+    GetSignatureCache().GetStats(stats);
+}
+
+bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode,
+              const CTransaction& txTo, unsigned int nIn, int nHashType, int flags, const CSignatureHashContext* pSigHashes)
+{
+    CSignatureCache& signatureCache = GetSignatureCache();
 
     CPubKey pubkey(vchPubKey);
     if (!pubkey.IsValid())
@@ -1101,16 +1344,17 @@ bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubK
         return false;
     vchSig.pop_back();
 
-    uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType);
+    uint256 sighash = pSigHashes ? pSigHashes->SignatureHash(scriptCode, nIn, nHashType) : SignatureHash(scriptCode, txTo, nIn, nHashType);
 
-    if (signatureCache.Get(sighash, vchSig, pubkey))
+    uint256 entry = signatureCache.GetEntry(sighash, vchSig, pubkey);
+    if (signatureCache.Get(entry))
         return true;
 
     if (!pubkey.Verify(sighash, vchSig))
         return false;
 
     if (!(flags & SCRIPT_VERIFY_NOCACHE))
-        signatureCache.Set(sighash, vchSig, pubkey);
+        signatureCache.Set(entry);
 
     return true;
 }
@@ -1553,14 +1797,14 @@ bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, vecto
 }
 
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
-                  unsigned int flags, int nHashType)
+                  unsigned int flags, int nHashType, const CSignatureHashContext* pSigHashes)
 {
     vector<vector<unsigned char> > stack, stackCopy;
-    if (!EvalScript(stack, scriptSig, txTo, nIn, flags, nHashType))
+    if (!EvalScript(stack, scriptSig, txTo, nIn, flags, nHashType, pSigHashes))
         return false;
     if (flags & SCRIPT_VERIFY_P2SH)
         stackCopy = stack;
-    if (!EvalScript(stack, scriptPubKey, txTo, nIn, flags, nHashType))
+    if (!EvalScript(stack, scriptPubKey, txTo, nIn, flags, nHashType, pSigHashes))
         return false;
     if (stack.empty())
         return false;
@@ -1583,7 +1827,7 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
         CScript pubKey2(pubKeySerialized.begin(), pubKeySerialized.end());
         popstack(stackCopy);
 
-        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, flags, nHashType))
+        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, flags, nHashType, pSigHashes))
             return false;
         if (stackCopy.empty())
             return false;
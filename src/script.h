@@ -671,7 +671,64 @@ public:
 bool IsCanonicalPubKey(const std::vector<unsigned char> &vchPubKey);
 bool IsCanonicalSignature(const std::vector<unsigned char> &vchSig);
 
-bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
+/** Signature hashing state of one transaction, built once and shared by the
+ * checks of all its inputs. For SIGHASH_ALL the hash of everything before an
+ * input is kept, so only the input and what follows it are hashed per
+ * signature; the other modes hash the cached serializations of the blanked
+ * inputs and the outputs instead of copying the transaction. The hashes are
+ * the same as SignatureHash()'s. */
+class CSignatureHashContext
+{
+private:
+    const CTransaction *ptxTo;
+    // Hash state after nVersion, the input count and the first i inputs with
+    // their scriptSigs blanked, for each input i
+    std::vector<CHashWriter> vPrefix;
+    // All inputs with their scriptSigs blanked, with their own nSequence and
+    // with a zero nSequence, serialized back to back
+    std::vector<unsigned char> vchInputs;
+    std::vector<unsigned char> vchInputsNoSequence;
+    // The output count and all outputs
+    std::vector<unsigned char> vchOutputs;
+
+public:
+    // Serialized size of an input with a blanked scriptSig
+    static const unsigned int BLANK_INPUT_SIZE = 32 + 4 + 1 + 4;
+
+    // txTo must outlive the context
+    explicit CSignatureHashContext(const CTransaction& txTo);
+
+    uint256 SignatureHash(CScript scriptCode, unsigned int nIn, int nHashType) const;
+};
+
+/** Signature cache size (-maxsigcachesize), in megabytes. Larger values are
+ * taken as a number of entries, which the option counted before. */
+static const int64 DEFAULT_MAX_SIGCACHE_SIZE = 8;
+static const int64 MAX_MAX_SIGCACHE_SIZE = 1024;
+
+struct CSignatureCacheStats
+{
+    uint64 nBytes;
+    uint64 nCapacity;
+    uint64 nEntries;
+    uint64 nLookups;
+    uint64 nHits;
+    uint64 nInserts;
+    uint64 nEvictions;
+    // Lookups that read a bucket while it was being written, and read it again
+    uint64 nRetries;
+
+    CSignatureCacheStats() : nBytes(0), nCapacity(0), nEntries(0), nLookups(0), nHits(0), nInserts(0), nEvictions(0), nRetries(0) {}
+};
+
+/** Size of the signature cache from -maxsigcachesize, in bytes */
+uint64 GetMaxSignatureCacheSize();
+/** Empty the signature cache and resize it to -maxsigcachesize */
+void InitSignatureCache();
+void GetSignatureCacheStats(CSignatureCacheStats& stats);
+
+bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType,
+                const CSignatureHashContext* pSigHashes = NULL);
 bool Solver(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<std::vector<unsigned char> >& vSolutionsRet);
 int ScriptSigArgsExpected(txnouttype t, const std::vector<std::vector<unsigned char> >& vSolutions);
 bool IsStandard(const CScript& scriptPubKey, txnouttype& whichType);
@@ -683,7 +740,8 @@ bool ExtractDestination(const CScript& scriptPubKey, CTxDestination& addressRet)
 bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<CTxDestination>& addressRet, int& nRequiredRet);
 bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
 bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
-bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
+bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType,
+                  const CSignatureHashContext* pSigHashes = NULL);
 bool VerifyMultiSigScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, int nHashType, bool *bIsSign);
 
 // Given two sets of signatures for scriptPubKey, possibly with OP_0 placeholders,
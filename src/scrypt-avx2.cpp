@@ -0,0 +1,213 @@
+/*
+ * Copyright 2009 Colin Percival, 2011 ArtForz, 2012-2013 pooler
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * This file was originally written by Colin Percival as part of the Tarsnap
+ * online backup system.
+ */
+
+#include "scrypt.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <openssl/sha.h>
+
+#include <immintrin.h>
+
+/*
+ * Each 256-bit register carries the same row of two independent hashes,
+ * one per 128-bit lane. The salsa20/8 core is the SSE2 one widened; the
+ * lane-local shuffles keep the two hashes apart. N is the number of
+ * register sets interleaved, so a kernel hashes 2 * N inputs per call.
+ */
+template <int N>
+static inline void xor_salsa8_avx2_nway(__m256i B[N][8], int b, int bx)
+{
+	__m256i X0[N], X1[N], X2[N], X3[N];
+	__m256i T[N];
+	int i, n;
+
+	for (n = 0; n < N; n++) {
+		X0[n] = B[n][b + 0] = _mm256_xor_si256(B[n][b + 0], B[n][bx + 0]);
+		X1[n] = B[n][b + 1] = _mm256_xor_si256(B[n][b + 1], B[n][bx + 1]);
+		X2[n] = B[n][b + 2] = _mm256_xor_si256(B[n][b + 2], B[n][bx + 2]);
+		X3[n] = B[n][b + 3] = _mm256_xor_si256(B[n][b + 3], B[n][bx + 3]);
+	}
+
+	for (i = 0; i < 8; i += 2) {
+		/* Operate on "columns". */
+		for (n = 0; n < N; n++) {
+			T[n] = _mm256_add_epi32(X0[n], X3[n]);
+			X1[n] = _mm256_xor_si256(X1[n], _mm256_slli_epi32(T[n], 7));
+			X1[n] = _mm256_xor_si256(X1[n], _mm256_srli_epi32(T[n], 25));
+		}
+		for (n = 0; n < N; n++) {
+			T[n] = _mm256_add_epi32(X1[n], X0[n]);
+			X2[n] = _mm256_xor_si256(X2[n], _mm256_slli_epi32(T[n], 9));
+			X2[n] = _mm256_xor_si256(X2[n], _mm256_srli_epi32(T[n], 23));
+		}
+		for (n = 0; n < N; n++) {
+			T[n] = _mm256_add_epi32(X2[n], X1[n]);
+			X3[n] = _mm256_xor_si256(X3[n], _mm256_slli_epi32(T[n], 13));
+			X3[n] = _mm256_xor_si256(X3[n], _mm256_srli_epi32(T[n], 19));
+		}
+		for (n = 0; n < N; n++) {
+			T[n] = _mm256_add_epi32(X3[n], X2[n]);
+			X0[n] = _mm256_xor_si256(X0[n], _mm256_slli_epi32(T[n], 18));
+			X0[n] = _mm256_xor_si256(X0[n], _mm256_srli_epi32(T[n], 14));
+		}
+
+		/* Rearrange data. */
+		for (n = 0; n < N; n++) {
+			X1[n] = _mm256_shuffle_epi32(X1[n], 0x93);
+			X2[n] = _mm256_shuffle_epi32(X2[n], 0x4E);
+			X3[n] = _mm256_shuffle_epi32(X3[n], 0x39);
+		}
+
+		/* Operate on "rows". */
+		for (n = 0; n < N; n++) {
+			T[n] = _mm256_add_epi32(X0[n], X1[n]);
+			X3[n] = _mm256_xor_si256(X3[n], _mm256_slli_epi32(T[n], 7));
+			X3[n] = _mm256_xor_si256(X3[n], _mm256_srli_epi32(T[n], 25));
+		}
+		for (n = 0; n < N; n++) {
+			T[n] = _mm256_add_epi32(X3[n], X0[n]);
+			X2[n] = _mm256_xor_si256(X2[n], _mm256_slli_epi32(T[n], 9));
+			X2[n] = _mm256_xor_si256(X2[n], _mm256_srli_epi32(T[n], 23));
+		}
+		for (n = 0; n < N; n++) {
+			T[n] = _mm256_add_epi32(X2[n], X3[n]);
+			X1[n] = _mm256_xor_si256(X1[n], _mm256_slli_epi32(T[n], 13));
+			X1[n] = _mm256_xor_si256(X1[n], _mm256_srli_epi32(T[n], 19));
+		}
+		for (n = 0; n < N; n++) {
+			T[n] = _mm256_add_epi32(X1[n], X2[n]);
+			X0[n] = _mm256_xor_si256(X0[n], _mm256_slli_epi32(T[n], 18));
+			X0[n] = _mm256_xor_si256(X0[n], _mm256_srli_epi32(T[n], 14));
+		}
+
+		/* Rearrange data. */
+		for (n = 0; n < N; n++) {
+			X1[n] = _mm256_shuffle_epi32(X1[n], 0x39);
+			X2[n] = _mm256_shuffle_epi32(X2[n], 0x4E);
+			X3[n] = _mm256_shuffle_epi32(X3[n], 0x93);
+		}
+	}
+
+	for (n = 0; n < N; n++) {
+		B[n][b + 0] = _mm256_add_epi32(B[n][b + 0], X0[n]);
+		B[n][b + 1] = _mm256_add_epi32(B[n][b + 1], X1[n]);
+		B[n][b + 2] = _mm256_add_epi32(B[n][b + 2], X2[n]);
+		B[n][b + 3] = _mm256_add_epi32(B[n][b + 3], X3[n]);
+	}
+}
+
+/* Position of word w of the l-th hash (0 or 1) of a register set. */
+#define AVX2_WORD(l, w) (8 * ((w) / 4) + 4 * (l) + (w) % 4)
+
+template <int N>
+static void scrypt_core_avx2_nway(uint8_t *B, char *scratchpad)
+{
+	union {
+		__m256i i256[N][8];
+		uint32_t u32[N][64];
+	} X;
+	__m256i *V;
+	uint32_t i, j0, j1, k;
+	int n, l;
+
+	V = (__m256i *)(((uintptr_t)(scratchpad) + 63) & ~ (uintptr_t)(63));
+
+	for (n = 0; n < N; n++) {
+		for (l = 0; l < 2; l++) {
+			for (k = 0; k < 2; k++) {
+				for (i = 0; i < 16; i++) {
+					X.u32[n][AVX2_WORD(l, k * 16 + i)] = le32dec(&B[128 * (2 * n + l) + (k * 16 + (i * 5 % 16)) * 4]);
+				}
+			}
+		}
+	}
+
+	/* Each register set gets its own 256 KiB region, holding both of its hashes. */
+	for (i = 0; i < 1024; i++) {
+		for (n = 0; n < N; n++)
+			for (k = 0; k < 8; k++)
+				V[n * 8192 + i * 8 + k] = X.i256[n][k];
+		xor_salsa8_avx2_nway<N>(X.i256, 0, 4);
+		xor_salsa8_avx2_nway<N>(X.i256, 4, 0);
+	}
+	for (i = 0; i < 1024; i++) {
+		for (n = 0; n < N; n++) {
+			j0 = n * 8192 + 8 * (X.u32[n][AVX2_WORD(0, 16)] & 1023);
+			j1 = n * 8192 + 8 * (X.u32[n][AVX2_WORD(1, 16)] & 1023);
+			for (k = 0; k < 8; k++)
+				X.i256[n][k] = _mm256_xor_si256(X.i256[n][k], _mm256_blend_epi32(V[j0 + k], V[j1 + k], 0xF0));
+		}
+		xor_salsa8_avx2_nway<N>(X.i256, 0, 4);
+		xor_salsa8_avx2_nway<N>(X.i256, 4, 0);
+	}
+
+	for (n = 0; n < N; n++) {
+		for (l = 0; l < 2; l++) {
+			for (k = 0; k < 2; k++) {
+				for (i = 0; i < 16; i++) {
+					le32enc(&B[128 * (2 * n + l) + (k * 16 + (i * 5 % 16)) * 4], X.u32[n][AVX2_WORD(l, k * 16 + i)]);
+				}
+			}
+		}
+	}
+}
+
+template <int N>
+static void scrypt_1024_1_1_256_sp_avx2_nway(const char *input, char *output, char *scratchpad)
+{
+	uint8_t B[2 * N * 128];
+	int n;
+
+	for (n = 0; n < 2 * N; n++)
+		PBKDF2_SHA256((const uint8_t *)input + 80 * n, 80, (const uint8_t *)input + 80 * n, 80, 1, &B[128 * n], 128);
+	scrypt_core_avx2_nway<N>(B, scratchpad);
+	for (n = 0; n < 2 * N; n++)
+		PBKDF2_SHA256((const uint8_t *)input + 80 * n, 80, &B[128 * n], 128, 1, (uint8_t *)output + 32 * n, 32);
+}
+
+void scrypt_core_avx2_2way(uint8_t *B, char *scratchpad)
+{
+	scrypt_core_avx2_nway<1>(B, scratchpad);
+}
+
+void scrypt_core_avx2_4way(uint8_t *B, char *scratchpad)
+{
+	scrypt_core_avx2_nway<2>(B, scratchpad);
+}
+
+void scrypt_1024_1_1_256_sp_avx2_2way(const char *input, char *output, char *scratchpad)
+{
+	scrypt_1024_1_1_256_sp_avx2_nway<1>(input, output, scratchpad);
+}
+
+void scrypt_1024_1_1_256_sp_avx2_4way(const char *input, char *output, char *scratchpad)
+{
+	scrypt_1024_1_1_256_sp_avx2_nway<2>(input, output, scratchpad);
+}
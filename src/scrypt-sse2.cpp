@@ -92,9 +92,8 @@ static inline void xor_salsa8_sse2(__m128i B[4], const __m128i Bx[4])
 	B[3] = _mm_add_epi32(B[3], X3);
 }
 
-void scrypt_1024_1_1_256_sp_sse2(const char *input, int input_len, char *output, char *scratchpad)
+void scrypt_core_sse2(uint8_t *B, char *scratchpad)
 {
-	uint8_t B[128];
 	union {
 		__m128i i128[8];
 		uint32_t u32[32];
@@ -104,8 +103,6 @@ void scrypt_1024_1_1_256_sp_sse2(const char *input, int input_len, char *output,
 
 	V = (__m128i *)(((uintptr_t)(scratchpad) + 63) & ~ (uintptr_t)(63));
 
-	PBKDF2_SHA256((const uint8_t *)input, input_len, (const uint8_t *)input, input_len, 1, B, 128);
-
 	for (k = 0; k < 2; k++) {
 		for (i = 0; i < 16; i++) {
 			X.u32[k * 16 + i] = le32dec(&B[(k * 16 + (i * 5 % 16)) * 4]);
@@ -131,6 +128,191 @@ void scrypt_1024_1_1_256_sp_sse2(const char *input, int input_len, char *output,
 			le32enc(&B[(k * 16 + (i * 5 % 16)) * 4], X.u32[k * 16 + i]);
 		}
 	}
+}
+
+void scrypt_1024_1_1_256_sp_sse2(const char *input, char *output, char *scratchpad)
+{
+	uint8_t B[128];
+
+	PBKDF2_SHA256((const uint8_t *)input, 80, (const uint8_t *)input, 80, 1, B, 128);
+	scrypt_core_sse2(B, scratchpad);
+	PBKDF2_SHA256((const uint8_t *)input, 80, B, 128, 1, (uint8_t *)output, 32);
+}
+
+/*
+ * N-way interleaved variant: the salsa20/8 rounds of N independent hashes
+ * are issued side by side so that their dependency chains overlap, and the
+ * N random reads per ROMix step are in flight at the same time.
+ */
+template <int N>
+static inline void xor_salsa8_sse2_nway(__m128i B[N][8], int b, int bx)
+{
+	__m128i X0[N], X1[N], X2[N], X3[N];
+	__m128i T[N];
+	int i, n;
+
+	for (n = 0; n < N; n++) {
+		X0[n] = B[n][b + 0] = _mm_xor_si128(B[n][b + 0], B[n][bx + 0]);
+		X1[n] = B[n][b + 1] = _mm_xor_si128(B[n][b + 1], B[n][bx + 1]);
+		X2[n] = B[n][b + 2] = _mm_xor_si128(B[n][b + 2], B[n][bx + 2]);
+		X3[n] = B[n][b + 3] = _mm_xor_si128(B[n][b + 3], B[n][bx + 3]);
+	}
+
+	for (i = 0; i < 8; i += 2) {
+		/* Operate on "columns". */
+		for (n = 0; n < N; n++) {
+			T[n] = _mm_add_epi32(X0[n], X3[n]);
+			X1[n] = _mm_xor_si128(X1[n], _mm_slli_epi32(T[n], 7));
+			X1[n] = _mm_xor_si128(X1[n], _mm_srli_epi32(T[n], 25));
+		}
+		for (n = 0; n < N; n++) {
+			T[n] = _mm_add_epi32(X1[n], X0[n]);
+			X2[n] = _mm_xor_si128(X2[n], _mm_slli_epi32(T[n], 9));
+			X2[n] = _mm_xor_si128(X2[n], _mm_srli_epi32(T[n], 23));
+		}
+		for (n = 0; n < N; n++) {
+			T[n] = _mm_add_epi32(X2[n], X1[n]);
+			X3[n] = _mm_xor_si128(X3[n], _mm_slli_epi32(T[n], 13));
+			X3[n] = _mm_xor_si128(X3[n], _mm_srli_epi32(T[n], 19));
+		}
+		for (n = 0; n < N; n++) {
+			T[n] = _mm_add_epi32(X3[n], X2[n]);
+			X0[n] = _mm_xor_si128(X0[n], _mm_slli_epi32(T[n], 18));
+			X0[n] = _mm_xor_si128(X0[n], _mm_srli_epi32(T[n], 14));
+		}
+
+		/* Rearrange data. */
+		for (n = 0; n < N; n++) {
+			X1[n] = _mm_shuffle_epi32(X1[n], 0x93);
+			X2[n] = _mm_shuffle_epi32(X2[n], 0x4E);
+			X3[n] = _mm_shuffle_epi32(X3[n], 0x39);
+		}
+
+		/* Operate on "rows". */
+		for (n = 0; n < N; n++) {
+			T[n] = _mm_add_epi32(X0[n], X1[n]);
+			X3[n] = _mm_xor_si128(X3[n], _mm_slli_epi32(T[n], 7));
+			X3[n] = _mm_xor_si128(X3[n], _mm_srli_epi32(T[n], 25));
+		}
+		for (n = 0; n < N; n++) {
+			T[n] = _mm_add_epi32(X3[n], X0[n]);
+			X2[n] = _mm_xor_si128(X2[n], _mm_slli_epi32(T[n], 9));
+			X2[n] = _mm_xor_si128(X2[n], _mm_srli_epi32(T[n], 23));
+		}
+		for (n = 0; n < N; n++) {
+			T[n] = _mm_add_epi32(X2[n], X3[n]);
+			X1[n] = _mm_xor_si128(X1[n], _mm_slli_epi32(T[n], 13));
+			X1[n] = _mm_xor_si128(X1[n], _mm_srli_epi32(T[n], 19));
+		}
+		for (n = 0; n < N; n++) {
+			T[n] = _mm_add_epi32(X1[n], X2[n]);
+			X0[n] = _mm_xor_si128(X0[n], _mm_slli_epi32(T[n], 18));
+			X0[n] = _mm_xor_si128(X0[n], _mm_srli_epi32(T[n], 14));
+		}
+
+		/* Rearrange data. */
+		for (n = 0; n < N; n++) {
+			X1[n] = _mm_shuffle_epi32(X1[n], 0x39);
+			X2[n] = _mm_shuffle_epi32(X2[n], 0x4E);
+			X3[n] = _mm_shuffle_epi32(X3[n], 0x93);
+		}
+	}
+
+	for (n = 0; n < N; n++) {
+		B[n][b + 0] = _mm_add_epi32(B[n][b + 0], X0[n]);
+		B[n][b + 1] = _mm_add_epi32(B[n][b + 1], X1[n]);
+		B[n][b + 2] = _mm_add_epi32(B[n][b + 2], X2[n]);
+		B[n][b + 3] = _mm_add_epi32(B[n][b + 3], X3[n]);
+	}
+}
+
+template <int N>
+static void scrypt_core_sse2_nway(uint8_t *B, char *scratchpad)
+{
+	union {
+		__m128i i128[N][8];
+		uint32_t u32[N][32];
+	} X;
+	__m128i *V;
+	uint32_t i, j, k;
+	int n;
+
+	V = (__m128i *)(((uintptr_t)(scratchpad) + 63) & ~ (uintptr_t)(63));
+
+	for (n = 0; n < N; n++) {
+		for (k = 0; k < 2; k++) {
+			for (i = 0; i < 16; i++) {
+				X.u32[n][k * 16 + i] = le32dec(&B[128 * n + (k * 16 + (i * 5 % 16)) * 4]);
+			}
+		}
+	}
+
+	/* Each hash gets its own 128 KiB region of the scratchpad. */
+	for (i = 0; i < 1024; i++) {
+		for (n = 0; n < N; n++)
+			for (k = 0; k < 8; k++)
+				V[n * 8192 + i * 8 + k] = X.i128[n][k];
+		xor_salsa8_sse2_nway<N>(X.i128, 0, 4);
+		xor_salsa8_sse2_nway<N>(X.i128, 4, 0);
+	}
+	for (i = 0; i < 1024; i++) {
+		for (n = 0; n < N; n++) {
+			j = n * 8192 + 8 * (X.u32[n][16] & 1023);
+			for (k = 0; k < 8; k++)
+				X.i128[n][k] = _mm_xor_si128(X.i128[n][k], V[j + k]);
+		}
+		xor_salsa8_sse2_nway<N>(X.i128, 0, 4);
+		xor_salsa8_sse2_nway<N>(X.i128, 4, 0);
+	}
 
-	PBKDF2_SHA256((const uint8_t *)input, input_len, B, 128, 1, (uint8_t *)output, 32);
+	for (n = 0; n < N; n++) {
+		for (k = 0; k < 2; k++) {
+			for (i = 0; i < 16; i++) {
+				le32enc(&B[128 * n + (k * 16 + (i * 5 % 16)) * 4], X.u32[n][k * 16 + i]);
+			}
+		}
+	}
+}
+
+template <int N>
+static void scrypt_1024_1_1_256_sp_sse2_nway(const char *input, char *output, char *scratchpad)
+{
+	uint8_t B[N * 128];
+	int n;
+
+	for (n = 0; n < N; n++)
+		PBKDF2_SHA256((const uint8_t *)input + 80 * n, 80, (const uint8_t *)input + 80 * n, 80, 1, &B[128 * n], 128);
+	scrypt_core_sse2_nway<N>(B, scratchpad);
+	for (n = 0; n < N; n++)
+		PBKDF2_SHA256((const uint8_t *)input + 80 * n, 80, &B[128 * n], 128, 1, (uint8_t *)output + 32 * n, 32);
+}
+
+void scrypt_core_sse2_2way(uint8_t *B, char *scratchpad)
+{
+	scrypt_core_sse2_nway<2>(B, scratchpad);
+}
+
+void scrypt_core_sse2_3way(uint8_t *B, char *scratchpad)
+{
+	scrypt_core_sse2_nway<3>(B, scratchpad);
+}
+
+void scrypt_core_sse2_4way(uint8_t *B, char *scratchpad)
+{
+	scrypt_core_sse2_nway<4>(B, scratchpad);
+}
+
+void scrypt_1024_1_1_256_sp_sse2_2way(const char *input, char *output, char *scratchpad)
+{
+	scrypt_1024_1_1_256_sp_sse2_nway<2>(input, output, scratchpad);
+}
+
+void scrypt_1024_1_1_256_sp_sse2_3way(const char *input, char *output, char *scratchpad)
+{
+	scrypt_1024_1_1_256_sp_sse2_nway<3>(input, output, scratchpad);
+}
+
+void scrypt_1024_1_1_256_sp_sse2_4way(const char *input, char *output, char *scratchpad)
+{
+	scrypt_1024_1_1_256_sp_sse2_nway<4>(input, output, scratchpad);
 }
@@ -30,6 +30,9 @@
 #include "scrypt.h"
 #include "util.h"
 #include <stdlib.h>
+#if defined(USE_AVX2) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#endif
 #include <stdint.h>
 #include <string.h>
 #include <openssl/sha.h>
@@ -243,16 +246,13 @@ static inline void xor_salsa8(uint32_t B[16], const uint32_t Bx[16])
 	B[15] += x15;
 }
 
-void scrypt_1024_1_1_256_sp_generic(const char *input, char *output, char *scratchpad)
+void scrypt_core_generic(uint8_t *B, char *scratchpad)
 {
-	uint8_t B[128];
 	uint32_t X[32];
 	uint32_t *V;
 	uint32_t i, j, k;
 
 	V = (uint32_t *)(((uintptr_t)(scratchpad) + 63) & ~ (uintptr_t)(63));
-	
-	PBKDF2_SHA256((const uint8_t *)input, 80, (const uint8_t *)input, 80, 1, B, 128);
 
 	for (k = 0; k < 32; k++)
 		X[k] = le32dec(&B[4 * k]);
@@ -272,10 +272,30 @@ void scrypt_1024_1_1_256_sp_generic(const char *input, char *output, char *scrat
 
 	for (k = 0; k < 32; k++)
 		le32enc(&B[4 * k], X[k]);
+}
+
+void scrypt_1024_1_1_256_sp_generic(const char *input, char *output, char *scratchpad)
+{
+	uint8_t B[128];
 
+	PBKDF2_SHA256((const uint8_t *)input, 80, (const uint8_t *)input, 80, 1, B, 128);
+	scrypt_core_generic(B, scratchpad);
 	PBKDF2_SHA256((const uint8_t *)input, 80, B, 128, 1, (uint8_t *)output, 32);
 }
 
+typedef void (*scrypt_core_kernel)(uint8_t *B, char *scratchpad);
+
+#if defined(USE_SSE2) && (defined(_M_X64) || defined(__x86_64__) || defined(_M_AMD64) || (defined(MAC_OSX) && defined(__i386__)))
+static scrypt_core_kernel scrypt_core_1way = &scrypt_core_sse2;
+/* Wider SSE2 kernels spill registers and measure no faster than 2-way */
+static scrypt_core_kernel scrypt_multi = &scrypt_core_sse2_2way;
+unsigned int scrypt_multi_ways = 2;
+#else
+static scrypt_core_kernel scrypt_core_1way = &scrypt_core_generic;
+static scrypt_core_kernel scrypt_multi = &scrypt_core_generic;
+unsigned int scrypt_multi_ways = 1;
+#endif
+
 #if defined(USE_SSE2)
 #if defined(_M_X64) || defined(__x86_64__) || defined(_M_AMD64) || (defined(MAC_OSX) && defined(__i386__))
 /* Always SSE2 */
@@ -292,6 +312,9 @@ void scrypt_detect_sse2(unsigned int cpuid_edx)
     if (cpuid_edx & 1<<26)
     {
         scrypt_1024_1_1_256_sp = &scrypt_1024_1_1_256_sp_sse2;
+        scrypt_core_1way = &scrypt_core_sse2;
+        scrypt_multi = &scrypt_core_sse2_2way;
+        scrypt_multi_ways = 2;
         printf("scrypt: using scrypt-sse2 as detected.\n");
     }
     else
@@ -303,6 +326,42 @@ void scrypt_detect_sse2(unsigned int cpuid_edx)
 #endif
 #endif
 
+#if defined(USE_AVX2)
+bool scrypt_have_avx2()
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid_max(0, NULL) < 7)
+        return false;
+    /* AVX and OSXSAVE, then the OS must save the xmm and ymm registers */
+    __cpuid(1, eax, ebx, ecx, edx);
+    if ((ecx & (1<<27 | 1<<28)) != (1<<27 | 1<<28))
+        return false;
+    unsigned int xcr0, xcr0_hi;
+    __asm__ ("xgetbv" : "=a"(xcr0), "=d"(xcr0_hi) : "c"(0));
+    if ((xcr0 & 6) != 6)
+        return false;
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return (ebx & 1<<5) != 0;
+#else
+    /* No way to ask the CPU here; stay with SSE2 */
+    return false;
+#endif
+}
+
+void scrypt_detect_avx2()
+{
+    if (scrypt_have_avx2())
+    {
+        scrypt_multi = &scrypt_core_avx2_4way;
+        scrypt_multi_ways = 4;
+        printf("scrypt: using scrypt-avx2 4-way for batches.\n");
+    }
+    else
+        printf("scrypt: AVX2 unavailable, using %u-way batches.\n", scrypt_multi_ways);
+}
+#endif
+
 void scrypt_1024_1_1_256(const char *input, char *output)
 {
 	char scratchpad[SCRYPT_SCRATCHPAD_SIZE];
@@ -321,3 +380,105 @@ void scrypt_1024_1_1_256(const char *input, char *output)
         scrypt_1024_1_1_256_sp_generic(input, output, scratchpad);
 #endif
 }
+
+/*
+ * Both PBKDF2 passes of scrypt(header) use the header as the HMAC key, so the
+ * keyed HMAC state is set up once per hash and shared between them. When the
+ * caller has a midstate for the first 64 header bytes, hashing the 80-byte
+ * key only needs the final compression.
+ */
+static void
+scrypt_pbkdf2_in(const scrypt_mining_midstate *midstate, const uint8_t *input,
+    HMAC_SHA256_CTX *keyctx, uint8_t B[128])
+{
+	HMAC_SHA256_CTX PShctx, hctx;
+	SHA256_CTX ctx;
+	uint8_t khash[32];
+	uint8_t ivec[4];
+	uint32_t i;
+
+	if (midstate != NULL) {
+		memcpy(&ctx, &midstate->ctx, sizeof(SHA256_CTX));
+		SHA256_Update(&ctx, input + 64, 16);
+		SHA256_Final(khash, &ctx);
+		HMAC_SHA256_Init(keyctx, khash, 32);
+	} else
+		HMAC_SHA256_Init(keyctx, input, 80);
+
+	memcpy(&PShctx, keyctx, sizeof(HMAC_SHA256_CTX));
+	HMAC_SHA256_Update(&PShctx, input, 80);
+	for (i = 0; i < 4; i++) {
+		be32enc(ivec, i + 1);
+		memcpy(&hctx, &PShctx, sizeof(HMAC_SHA256_CTX));
+		HMAC_SHA256_Update(&hctx, ivec, 4);
+		HMAC_SHA256_Final(&B[32 * i], &hctx);
+	}
+}
+
+static void
+scrypt_pbkdf2_out(const HMAC_SHA256_CTX *keyctx, const uint8_t B[128], uint8_t *output)
+{
+	HMAC_SHA256_CTX hctx;
+	uint8_t ivec[4];
+
+	be32enc(ivec, 1);
+	memcpy(&hctx, keyctx, sizeof(HMAC_SHA256_CTX));
+	HMAC_SHA256_Update(&hctx, B, 128);
+	HMAC_SHA256_Update(&hctx, ivec, 4);
+	HMAC_SHA256_Final(output, &hctx);
+}
+
+static void
+scrypt_multi_sp(const scrypt_mining_midstate *midstate, const char *inputs, char *outputs,
+    unsigned int n, char *scratchpad)
+{
+	scrypt_core_kernel kernel = scrypt_multi;
+	unsigned int ways = scrypt_multi_ways;
+	HMAC_SHA256_CTX keyctx[SCRYPT_MULTI_MAX];
+	uint8_t B[SCRYPT_MULTI_MAX * 128];
+	unsigned int i;
+
+	while (n > 0) {
+		if (n < ways) {
+			/* Remainder, one at a time */
+			kernel = scrypt_core_1way;
+			ways = 1;
+		}
+		for (i = 0; i < ways; i++)
+			scrypt_pbkdf2_in(midstate, (const uint8_t *)inputs + 80 * i, &keyctx[i], &B[128 * i]);
+		kernel(B, scratchpad);
+		for (i = 0; i < ways; i++)
+			scrypt_pbkdf2_out(&keyctx[i], &B[128 * i], (uint8_t *)outputs + 32 * i);
+		inputs += 80 * ways;
+		outputs += 32 * ways;
+		n -= ways;
+	}
+}
+
+void scrypt_1024_1_1_256_multi_sp(const char *inputs, char *outputs, unsigned int n, char *scratchpad)
+{
+	scrypt_multi_sp(NULL, inputs, outputs, n, scratchpad);
+}
+
+void scrypt_1024_1_1_256_multi(const char *inputs, char *outputs, unsigned int n)
+{
+	char *scratchpad = (char *)malloc(SCRYPT_MULTI_SCRATCHPAD_SIZE);
+	if (scratchpad == NULL) {
+		for (; n > 0; n--, inputs += 80, outputs += 32)
+			scrypt_1024_1_1_256(inputs, outputs);
+		return;
+	}
+	scrypt_multi_sp(NULL, inputs, outputs, n, scratchpad);
+	free(scratchpad);
+}
+
+void scrypt_mining_prepare(scrypt_mining_midstate *midstate, const char *header)
+{
+	SHA256_Init(&midstate->ctx);
+	SHA256_Update(&midstate->ctx, header, 64);
+}
+
+void scrypt_1024_1_1_256_multi_mining(const scrypt_mining_midstate *midstate, const char *inputs, char *outputs, unsigned int n, char *scratchpad)
+{
+	scrypt_multi_sp(midstate, inputs, outputs, n, scratchpad);
+}
@@ -2,15 +2,52 @@
 #define SCRYPT_H
 #include <stdlib.h>
 #include <stdint.h>
+#include <openssl/sha.h>
 static const int SCRYPT_SCRATCHPAD_SIZE = 131072 + 63;
 
 void scrypt_1024_1_1_256(const char *input, char *output);
 void scrypt_1024_1_1_256_sp_generic(const char *input, char *output, char *scratchpad);
+/* ROMix over 128-byte PBKDF2 blocks, in place; N-way cores take N consecutive blocks. */
+void scrypt_core_generic(uint8_t *B, char *scratchpad);
+
+/* Scratchpad for the multi-hash API; the widest kernel hashes SCRYPT_MULTI_MAX inputs per pass. */
+static const int SCRYPT_MULTI_MAX = 4;
+static const int SCRYPT_MULTI_SCRATCHPAD_SIZE = 131072 * SCRYPT_MULTI_MAX + 63;
+
+/* Hash n consecutive 80-byte inputs into n consecutive 32-byte outputs. */
+void scrypt_1024_1_1_256_multi(const char *inputs, char *outputs, unsigned int n);
+void scrypt_1024_1_1_256_multi_sp(const char *inputs, char *outputs, unsigned int n, char *scratchpad);
+/* Inputs hashed per pass by the selected kernel; batches should be a multiple of it. */
+extern unsigned int scrypt_multi_ways;
+
+/* Mining: the first 64 header bytes stay fixed while the nonce is scanned, so their
+ * SHA256 state is computed once per template by scrypt_mining_prepare. */
+typedef struct {
+	SHA256_CTX ctx;
+} scrypt_mining_midstate;
+void scrypt_mining_prepare(scrypt_mining_midstate *midstate, const char *header);
+void scrypt_1024_1_1_256_multi_mining(const scrypt_mining_midstate *midstate, const char *inputs, char *outputs, unsigned int n, char *scratchpad);
 
 #if defined(USE_SSE2)
 extern void scrypt_detect_sse2(unsigned int cpuid_edx);
 void scrypt_1024_1_1_256_sp_sse2(const char *input, char *output, char *scratchpad);
+void scrypt_core_sse2(uint8_t *B, char *scratchpad);
+void scrypt_core_sse2_2way(uint8_t *B, char *scratchpad);
+void scrypt_core_sse2_3way(uint8_t *B, char *scratchpad);
+void scrypt_core_sse2_4way(uint8_t *B, char *scratchpad);
 extern void (*scrypt_1024_1_1_256_sp)(const char *input, char *output, char *scratchpad);
+void scrypt_1024_1_1_256_sp_sse2_2way(const char *input, char *output, char *scratchpad);
+void scrypt_1024_1_1_256_sp_sse2_3way(const char *input, char *output, char *scratchpad);
+void scrypt_1024_1_1_256_sp_sse2_4way(const char *input, char *output, char *scratchpad);
+#endif
+
+#if defined(USE_AVX2)
+bool scrypt_have_avx2();
+extern void scrypt_detect_avx2();
+void scrypt_core_avx2_2way(uint8_t *B, char *scratchpad);
+void scrypt_core_avx2_4way(uint8_t *B, char *scratchpad);
+void scrypt_1024_1_1_256_sp_avx2_2way(const char *input, char *output, char *scratchpad);
+void scrypt_1024_1_1_256_sp_avx2_4way(const char *input, char *output, char *scratchpad);
 #endif
 
 void
@@ -0,0 +1,1006 @@
+// Copyright (c) 2014 The Fusioncoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <stdint.h>
+#include <string.h>
+
+#include "secp256k1.h"
+
+// ECDSA verification specialised for secp256k1: y^2 = x^3 + 7 over the field of
+// p = 2^256 - 2^32 - 977, with a generator G of prime order n.
+//
+// Field elements and scalars are eight little-endian 32-bit limbs, so only
+// 32x32->64 bit products are needed; where the compiler has 128-bit integers
+// the 256x256 bit products use 64-bit limbs. Both are kept fully reduced,
+// which keeps comparisons trivial. The scalar inverse uses binary extended GCD.
+// u1*G + u2*Q is computed by splitting both scalars with the curve's
+// endomorphism (lambda*(x,y) = (beta*x,y)) into 128-bit halves and adding wNAF
+// digits of all four into one chain of 128 doublings. The odd multiples of G
+// are precomputed once.
+//
+// Variable time: only public data (keys, signatures, hashes) goes through here.
+
+// anonymous namespace with local implementation code
+namespace {
+
+typedef uint64_t uint64;
+
+/** Element of the field modulo p, fully reduced */
+struct CFieldElem
+{
+    uint32_t n[8];
+};
+
+/** Integer modulo the group order n, fully reduced */
+struct CScalar
+{
+    uint32_t n[8];
+};
+
+/** Point in affine coordinates */
+struct CPoint
+{
+    CFieldElem x, y;
+    bool fInfinity;
+};
+
+/** Point in Jacobian coordinates: (x/z^2, y/z^3) */
+struct CPointJ
+{
+    CFieldElem x, y, z;
+    bool fInfinity;
+};
+
+static const uint32_t P[8] = { 0xFFFFFC2F, 0xFFFFFFFE, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF };
+static const uint32_t N[8] = { 0xD0364141, 0xBFD25E8C, 0xAF48A03B, 0xBAAEDCE6, 0xFFFFFFFE, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF };
+static const uint32_t N_HALF[8] = { 0x681B20A0, 0xDFE92F46, 0x57A4501D, 0x5D576E73, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0x7FFFFFFF };
+// 2^256 - n
+static const uint32_t N_C[5] = { 0x2FC9BEBF, 0x402DA173, 0x50B75FC4, 0x45512319, 1 };
+// p - n, as a field element
+static const CFieldElem P_MINUS_N = {{ 0x2FC9BAEE, 0x402DA172, 0x50B75FC4, 0x45512319, 1, 0, 0, 0 }};
+
+static const CFieldElem GX = {{ 0x16F81798, 0x59F2815B, 0x2DCE28D9, 0x029BFCDB, 0xCE870B07, 0x55A06295, 0xF9DCBBAC, 0x79BE667E }};
+static const CFieldElem GY = {{ 0xFB10D4B8, 0x9C47D08F, 0xA6855419, 0xFD17B448, 0x0E1108A8, 0x5DA4FBFC, 0x26A3C465, 0x483ADA77 }};
+static const CFieldElem BETA = {{ 0x719501EE, 0xC1396C28, 0x12F58995, 0x9CF04975, 0xAC3434E9, 0x6E64479E, 0x657C0710, 0x7AE96A2B }};
+
+// Endomorphism split: k = r1 + r2*lambda with r1, r2 of about 128 bits
+static const CScalar MINUS_LAMBDA = {{ 0xB51283CF, 0xE0CFC810, 0x8EC739C2, 0xA880B9FC, 0x77ED9BA4, 0x5AD9E3FD, 0x3FA3CF1F, 0xAC9C52B3 }};
+static const CScalar MINUS_B1 = {{ 0x0ABFE4C3, 0x6F547FA9, 0x010E8828, 0xE4437ED6, 0, 0, 0, 0 }};
+static const CScalar MINUS_B2 = {{ 0x3DB1562C, 0xD765CDA8, 0x0774346D, 0x8A280AC5, 0xFFFFFFFE, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF }};
+static const CScalar G1 = {{ 0x45DBB031, 0xE893209A, 0x71E8CA7F, 0x3DAA8A14, 0x9284EB15, 0xE86C90E4, 0xA7D46BCD, 0x3086D221 }};
+static const CScalar G2 = {{ 0x8AC47F71, 0x1571B4AE, 0x9DF506C6, 0x221208AC, 0x0ABFE4C4, 0x6F547FA9, 0x010E8828, 0xE4437ED6 }};
+
+// wNAF windows: odd multiples of Q up to 15Q are computed per verification,
+// those of G up to 127G once
+static const int WINDOW_Q = 5;
+static const int WINDOW_G = 8;
+static const int TABLE_SIZE_Q = 1 << (WINDOW_Q - 2);
+static const int TABLE_SIZE_G = 1 << (WINDOW_G - 2);
+// Split scalars have at most 128 bits; one more digit for the final carry
+static const int WNAF_BITS = 129;
+
+#if defined(__SIZEOF_INT128__)
+typedef unsigned __int128 uint128;
+
+// 512-bit product of two 256-bit numbers, with 64-bit limbs where the
+// compiler has 128-bit products
+static inline void Mul256(uint32_t t[16], const uint32_t a[8], const uint32_t b[8])
+{
+    uint64 a64[4], b64[4];
+    for (int i = 0; i < 4; i++)
+    {
+        a64[i] = a[2 * i] | ((uint64)a[2 * i + 1] << 32);
+        b64[i] = b[2 * i] | ((uint64)b[2 * i + 1] << 32);
+    }
+    uint128 acc = 0;
+    uint64 nOverflow = 0;
+    for (int k = 0; k < 7; k++)
+    {
+        for (int i = (k < 4 ? 0 : k - 3); i <= (k < 4 ? k : 3); i++)
+        {
+            uint128 m = (uint128)a64[i] * b64[k - i];
+            acc += m;
+            nOverflow += acc < m;
+        }
+        t[2 * k] = (uint32_t)acc;
+        t[2 * k + 1] = (uint32_t)((uint64)acc >> 32);
+        acc = (acc >> 64) | ((uint128)nOverflow << 64);
+        nOverflow = 0;
+    }
+    t[14] = (uint32_t)acc;
+    t[15] = (uint32_t)((uint64)acc >> 32);
+}
+
+static inline void Sqr256(uint32_t t[16], const uint32_t a[8])
+{
+    Mul256(t, a, a);
+}
+#else
+// 512-bit product of two 256-bit numbers. Column sums of low and high product
+// halves are kept apart, so that they cannot overflow.
+static inline void Mul256(uint32_t t[16], const uint32_t a[8], const uint32_t b[8])
+{
+    uint64 lo[16], hi[16];
+    memset(lo, 0, sizeof(lo));
+    memset(hi, 0, sizeof(hi));
+    for (int i = 0; i < 8; i++)
+    {
+        for (int j = 0; j < 8; j++)
+        {
+            uint64 m = (uint64)a[i] * b[j];
+            lo[i + j] += (uint32_t)m;
+            hi[i + j] += m >> 32;
+        }
+    }
+    uint64 c = 0;
+    for (int k = 0; k < 16; k++)
+    {
+        c += lo[k] + (k ? hi[k - 1] : 0);
+        t[k] = (uint32_t)c;
+        c >>= 32;
+    }
+}
+
+static inline void Sqr256(uint32_t t[16], const uint32_t a[8])
+{
+    uint64 lo[16], hi[16];
+    memset(lo, 0, sizeof(lo));
+    memset(hi, 0, sizeof(hi));
+    for (int i = 0; i < 8; i++)
+    {
+        uint64 m = (uint64)a[i] * a[i];
+        lo[2 * i] += (uint32_t)m;
+        hi[2 * i] += m >> 32;
+        for (int j = i + 1; j < 8; j++)
+        {
+            m = (uint64)a[i] * a[j];
+            lo[i + j] += (uint64)(uint32_t)m << 1;
+            hi[i + j] += (m >> 32) << 1;
+        }
+    }
+    uint64 c = 0;
+    for (int k = 0; k < 16; k++)
+    {
+        c += lo[k] + (k ? hi[k - 1] : 0);
+        t[k] = (uint32_t)c;
+        c >>= 32;
+    }
+}
+#endif
+
+//
+// Field arithmetic modulo p. 2^256 = 2^32 + 977 (mod p), which folds the high
+// half of a product into the low half with small multiplications.
+//
+
+static inline bool FieldIsZero(const CFieldElem& a)
+{
+    return (a.n[0] | a.n[1] | a.n[2] | a.n[3] | a.n[4] | a.n[5] | a.n[6] | a.n[7]) == 0;
+}
+
+static inline bool FieldEqual(const CFieldElem& a, const CFieldElem& b)
+{
+    return memcmp(a.n, b.n, sizeof(a.n)) == 0;
+}
+
+static inline bool FieldIsOdd(const CFieldElem& a)
+{
+    return a.n[0] & 1;
+}
+
+static inline bool FieldGeP(const uint32_t t[8])
+{
+    for (int i = 7; i >= 2; i--)
+        if (t[i] != 0xFFFFFFFF)
+            return false;
+    if (t[1] != 0xFFFFFFFE)
+        return t[1] > 0xFFFFFFFE;
+    return t[0] >= 0xFFFFFC2F;
+}
+
+// t += 2^32 + 977, modulo 2^256: subtracts p from values of p or more
+static inline void FieldAddC(uint32_t t[8])
+{
+    uint64 c = (uint64)t[0] + 0x3D1;
+    t[0] = (uint32_t)c; c >>= 32;
+    c += (uint64)t[1] + 1;
+    t[1] = (uint32_t)c; c >>= 32;
+    for (int i = 2; i < 8 && c; i++)
+    {
+        c += t[i];
+        t[i] = (uint32_t)c; c >>= 32;
+    }
+}
+
+// r = r + top * 2^256, for a top below 2^35
+static inline void FieldReduceTop(CFieldElem& r, uint64 top)
+{
+    uint64 c = (uint64)r.n[0] + top * 977;
+    r.n[0] = (uint32_t)c; c >>= 32;
+    c += (uint64)r.n[1] + top;
+    r.n[1] = (uint32_t)c; c >>= 32;
+    for (int i = 2; i < 8; i++)
+    {
+        c += r.n[i];
+        r.n[i] = (uint32_t)c; c >>= 32;
+    }
+    if (c || FieldGeP(r.n))
+        FieldAddC(r.n);
+}
+
+static inline void FieldReduce(CFieldElem& r, const uint32_t t[16])
+{
+    // low + high * 977 + high * 2^32
+    uint64 c = 0;
+    for (int k = 0; k < 8; k++)
+    {
+        c += (uint64)t[k] + (uint64)t[8 + k] * 977 + (k ? t[7 + k] : 0);
+        r.n[k] = (uint32_t)c;
+        c >>= 32;
+    }
+    FieldReduceTop(r, c + t[15]);
+}
+
+static inline void FieldAdd(CFieldElem& r, const CFieldElem& a, const CFieldElem& b)
+{
+    uint64 c = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        c += (uint64)a.n[i] + b.n[i];
+        r.n[i] = (uint32_t)c;
+        c >>= 32;
+    }
+    if (c || FieldGeP(r.n))
+        FieldAddC(r.n);
+}
+
+static inline void FieldSub(CFieldElem& r, const CFieldElem& a, const CFieldElem& b)
+{
+    uint32_t borrow = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        uint64 d = (uint64)a.n[i] - b.n[i] - borrow;
+        r.n[i] = (uint32_t)d;
+        borrow = (uint32_t)(d >> 32) ? 1 : 0;
+    }
+    if (borrow)
+    {
+        uint64 c = 0;
+        for (int i = 0; i < 8; i++)
+        {
+            c += (uint64)r.n[i] + P[i];
+            r.n[i] = (uint32_t)c;
+            c >>= 32;
+        }
+    }
+}
+
+static inline void FieldNeg(CFieldElem& r, const CFieldElem& a)
+{
+    static const CFieldElem zero = {{ 0 }};
+    FieldSub(r, zero, a);
+}
+
+static inline void FieldMulInt(CFieldElem& r, const CFieldElem& a, uint32_t m)
+{
+    uint64 c = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        c += (uint64)a.n[i] * m;
+        r.n[i] = (uint32_t)c;
+        c >>= 32;
+    }
+    FieldReduceTop(r, c);
+}
+
+static inline void FieldMul(CFieldElem& r, const CFieldElem& a, const CFieldElem& b)
+{
+    uint32_t t[16];
+    Mul256(t, a.n, b.n);
+    FieldReduce(r, t);
+}
+
+static inline void FieldSqr(CFieldElem& r, const CFieldElem& a)
+{
+    uint32_t t[16];
+    Sqr256(t, a.n);
+    FieldReduce(r, t);
+}
+
+static void FieldSqrN(CFieldElem& r, const CFieldElem& a, int nTimes)
+{
+    r = a;
+    for (int i = 0; i < nTimes; i++)
+        FieldSqr(r, r);
+}
+
+// a^(2^223 - 1) and the smaller powers the exponentiations below share
+static void FieldPow223(const CFieldElem& a, CFieldElem& x2, CFieldElem& x22, CFieldElem& x223)
+{
+    CFieldElem x3, x6, x9, x11, x44, x88, x176, t;
+    FieldSqr(x2, a);         FieldMul(x2, x2, a);
+    FieldSqr(x3, x2);        FieldMul(x3, x3, a);
+    FieldSqrN(x6, x3, 3);    FieldMul(x6, x6, x3);
+    FieldSqrN(x9, x6, 3);    FieldMul(x9, x9, x3);
+    FieldSqrN(x11, x9, 2);   FieldMul(x11, x11, x2);
+    FieldSqrN(x22, x11, 11); FieldMul(x22, x22, x11);
+    FieldSqrN(x44, x22, 22); FieldMul(x44, x44, x22);
+    FieldSqrN(x88, x44, 44); FieldMul(x88, x88, x44);
+    FieldSqrN(x176, x88, 88); FieldMul(x176, x176, x88);
+    FieldSqrN(t, x176, 44);  FieldMul(t, t, x44);
+    FieldSqrN(x223, t, 3);   FieldMul(x223, x223, x3);
+}
+
+// r = a^(p-2) = 1/a
+static void FieldInv(CFieldElem& r, const CFieldElem& a)
+{
+    CFieldElem x2, x22, x223, t;
+    FieldPow223(a, x2, x22, x223);
+    FieldSqrN(t, x223, 23); FieldMul(t, t, x22);
+    FieldSqrN(t, t, 5);     FieldMul(t, t, a);
+    FieldSqrN(t, t, 3);     FieldMul(t, t, x2);
+    FieldSqrN(t, t, 2);     FieldMul(r, t, a);
+}
+
+// r = a^((p+1)/4), a square root of a if there is one
+static bool FieldSqrt(CFieldElem& r, const CFieldElem& a)
+{
+    CFieldElem x2, x22, x223, t, check;
+    FieldPow223(a, x2, x22, x223);
+    FieldSqrN(t, x223, 23); FieldMul(t, t, x22);
+    FieldSqrN(t, t, 6);     FieldMul(t, t, x2);
+    FieldSqrN(r, t, 2);
+    FieldSqr(check, r);
+    return FieldEqual(check, a);
+}
+
+// From 32 big-endian bytes; false if not below p
+static bool FieldSetBytes(CFieldElem& r, const unsigned char *b32)
+{
+    for (int i = 0; i < 8; i++)
+    {
+        const unsigned char *pb = b32 + 28 - 4 * i;
+        r.n[i] = ((uint32_t)pb[0] << 24) | ((uint32_t)pb[1] << 16) | ((uint32_t)pb[2] << 8) | pb[3];
+    }
+    return !FieldGeP(r.n);
+}
+
+//
+// Scalar arithmetic modulo n, folding with 2^256 = N_C (mod n)
+//
+
+static inline bool ScalarIsZero(const CScalar& a)
+{
+    return (a.n[0] | a.n[1] | a.n[2] | a.n[3] | a.n[4] | a.n[5] | a.n[6] | a.n[7]) == 0;
+}
+
+static inline int CompareLimbs(const uint32_t a[8], const uint32_t b[8])
+{
+    for (int i = 7; i >= 0; i--)
+        if (a[i] != b[i])
+            return a[i] < b[i] ? -1 : 1;
+    return 0;
+}
+
+// t -= n, modulo 2^256
+static inline void ScalarSubN(uint32_t t[8])
+{
+    uint64 c = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        c += (uint64)t[i] + (i < 5 ? N_C[i] : 0);
+        t[i] = (uint32_t)c;
+        c >>= 32;
+    }
+}
+
+// From 32 big-endian bytes, reduced modulo n; false if not below n
+static bool ScalarSetBytes(CScalar& r, const unsigned char *b32)
+{
+    for (int i = 0; i < 8; i++)
+    {
+        const unsigned char *pb = b32 + 28 - 4 * i;
+        r.n[i] = ((uint32_t)pb[0] << 24) | ((uint32_t)pb[1] << 16) | ((uint32_t)pb[2] << 8) | pb[3];
+    }
+    if (CompareLimbs(r.n, N) < 0)
+        return true;
+    ScalarSubN(r.n);
+    return false;
+}
+
+static inline void ScalarAdd(CScalar& r, const CScalar& a, const CScalar& b)
+{
+    uint64 c = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        c += (uint64)a.n[i] + b.n[i];
+        r.n[i] = (uint32_t)c;
+        c >>= 32;
+    }
+    if (c || CompareLimbs(r.n, N) >= 0)
+        ScalarSubN(r.n);
+}
+
+static inline void ScalarNeg(CScalar& r, const CScalar& a)
+{
+    if (ScalarIsZero(a))
+    {
+        r = a;
+        return;
+    }
+    uint32_t borrow = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        uint64 d = (uint64)N[i] - a.n[i] - borrow;
+        r.n[i] = (uint32_t)d;
+        borrow = (uint32_t)(d >> 32) ? 1 : 0;
+    }
+}
+
+static inline bool ScalarIsHigh(const CScalar& a)
+{
+    return CompareLimbs(a.n, N_HALF) > 0;
+}
+
+// r = t mod n, for t of nLen limbs (at most 16)
+static void ScalarReduce(CScalar& r, const uint32_t *t, int nLen)
+{
+    uint32_t buf[24];
+    memcpy(buf, t, nLen * sizeof(uint32_t));
+    while (nLen > 8)
+    {
+        // low 8 limbs + high limbs * N_C, one row of N_C at a time
+        int nHigh = nLen - 8;
+        int nOut = (nHigh + 5 > 8 ? nHigh + 5 : 8) + 1;
+        uint32_t out[24];
+        memcpy(out, buf, 8 * sizeof(uint32_t));
+        memset(out + 8, 0, (nOut - 8) * sizeof(uint32_t));
+        for (int i = 0; i < nHigh; i++)
+        {
+            uint64 c = 0;
+            for (int j = 0; j < 5; j++)
+            {
+                c += (uint64)out[i + j] + (uint64)buf[8 + i] * N_C[j];
+                out[i + j] = (uint32_t)c;
+                c >>= 32;
+            }
+            for (int k = i + 5; c && k < nOut; k++)
+            {
+                c += out[k];
+                out[k] = (uint32_t)c;
+                c >>= 32;
+            }
+        }
+        memcpy(buf, out, nOut * sizeof(uint32_t));
+        nLen = nOut;
+        while (nLen > 8 && buf[nLen - 1] == 0)
+            nLen--;
+    }
+    for (int i = 0; i < 8; i++)
+        r.n[i] = i < nLen ? buf[i] : 0;
+    if (CompareLimbs(r.n, N) >= 0)
+        ScalarSubN(r.n);
+}
+
+static void ScalarMul(CScalar& r, const CScalar& a, const CScalar& b)
+{
+    uint32_t t[16];
+    Mul256(t, a.n, b.n);
+    ScalarReduce(r, t, 16);
+}
+
+// a >>= 1, shifting nTop in at the top
+static inline void ShiftRight1(uint32_t a[8], uint32_t nTop)
+{
+    for (int i = 0; i < 7; i++)
+        a[i] = (a[i] >> 1) | (a[i + 1] << 31);
+    a[7] = (a[7] >> 1) | (nTop << 31);
+}
+
+// a -= b, for a >= b
+static inline void SubLimbs(uint32_t a[8], const uint32_t b[8])
+{
+    uint32_t borrow = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        uint64 d = (uint64)a[i] - b[i] - borrow;
+        a[i] = (uint32_t)d;
+        borrow = (uint32_t)(d >> 32) ? 1 : 0;
+    }
+}
+
+// x = x/2 (mod n)
+static inline void ScalarHalve(CScalar& x)
+{
+    if ((x.n[0] & 1) == 0)
+    {
+        ShiftRight1(x.n, 0);
+        return;
+    }
+    uint64 c = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        c += (uint64)x.n[i] + N[i];
+        x.n[i] = (uint32_t)c;
+        c >>= 32;
+    }
+    ShiftRight1(x.n, (uint32_t)c);
+}
+
+static inline bool IsOne(const uint32_t a[8])
+{
+    return a[0] == 1 && (a[1] | a[2] | a[3] | a[4] | a[5] | a[6] | a[7]) == 0;
+}
+
+// r = 1/a (mod n) by the binary extended Euclidean algorithm, for nonzero a.
+// It does not run in constant time, which is fine as verification handles
+// nothing secret.
+static void ScalarInv(CScalar& r, const CScalar& a)
+{
+    uint32_t u[8], v[8];
+    memcpy(u, a.n, sizeof(u));
+    memcpy(v, N, sizeof(v));
+    CScalar x1, x2, xNeg;
+    memset(&x1, 0, sizeof(x1));
+    memset(&x2, 0, sizeof(x2));
+    x1.n[0] = 1;
+    // invariants: x1 * a = u and x2 * a = v (mod n)
+    while (!IsOne(u) && !IsOne(v))
+    {
+        while ((u[0] & 1) == 0)
+        {
+            ShiftRight1(u, 0);
+            ScalarHalve(x1);
+        }
+        while ((v[0] & 1) == 0)
+        {
+            ShiftRight1(v, 0);
+            ScalarHalve(x2);
+        }
+        if (CompareLimbs(u, v) >= 0)
+        {
+            SubLimbs(u, v);
+            ScalarNeg(xNeg, x2);
+            ScalarAdd(x1, x1, xNeg);
+        }
+        else
+        {
+            SubLimbs(v, u);
+            ScalarNeg(xNeg, x1);
+            ScalarAdd(x2, x2, xNeg);
+        }
+    }
+    r = IsOne(u) ? x1 : x2;
+}
+
+// r = round(a * b / 2^384)
+static void ScalarMulShift384(CScalar& r, const CScalar& a, const CScalar& b)
+{
+    uint32_t t[16];
+    Mul256(t, a.n, b.n);
+    uint64 c = t[11] >> 31;
+    for (int i = 0; i < 8; i++)
+    {
+        c += i < 4 ? t[12 + i] : 0;
+        r.n[i] = (uint32_t)c;
+        c >>= 32;
+    }
+}
+
+// k = r1 + r2 * lambda (mod n), with r1 and r2 or their negations below 2^128
+static void ScalarSplitLambda(CScalar& r1, CScalar& r2, const CScalar& k)
+{
+    CScalar c1, c2;
+    ScalarMulShift384(c1, k, G1);
+    ScalarMulShift384(c2, k, G2);
+    ScalarMul(c1, c1, MINUS_B1);
+    ScalarMul(c2, c2, MINUS_B2);
+    ScalarAdd(r2, c1, c2);
+    ScalarMul(r1, r2, MINUS_LAMBDA);
+    ScalarAdd(r1, r1, k);
+}
+
+static inline unsigned int ScalarGetBits(const CScalar& a, int nBit, int nCount)
+{
+    if (nBit >= 256)
+        return 0;
+    uint64 v = a.n[nBit / 32];
+    if (nBit / 32 + 1 < 8)
+        v |= (uint64)a.n[nBit / 32 + 1] << 32;
+    return (unsigned int)(v >> (nBit % 32)) & ((1U << nCount) - 1);
+}
+
+// Width-w NAF of a: odd digits below 2^(w-1) in absolute value, at least
+// w-1 zeros between them. Returns the number of digits used.
+static int ScalarWNAF(int *wnaf, int nLen, const CScalar& a, int w)
+{
+    memset(wnaf, 0, nLen * sizeof(int));
+    int nCarry = 0;
+    int nLast = -1;
+    int nBit = 0;
+    while (nBit < nLen)
+    {
+        if ((int)ScalarGetBits(a, nBit, 1) == nCarry)
+        {
+            nBit++;
+            continue;
+        }
+        int nNow = w;
+        if (nNow > nLen - nBit)
+            nNow = nLen - nBit;
+        int nWord = (int)ScalarGetBits(a, nBit, nNow) + nCarry;
+        nCarry = (nWord >> (w - 1)) & 1;
+        nWord -= nCarry << w;
+        wnaf[nBit] = nWord;
+        nLast = nBit;
+        nBit += nNow;
+    }
+    return nLast + 1;
+}
+
+//
+// Group arithmetic (a = 0)
+//
+
+static void PointDouble(CPointJ& r, const CPointJ& a)
+{
+    if (a.fInfinity)
+    {
+        r.fInfinity = true;
+        return;
+    }
+    CFieldElem A, B, C, D, E, F, t;
+    FieldSqr(A, a.x);
+    FieldSqr(B, a.y);
+    FieldSqr(C, B);
+    FieldAdd(t, a.x, B);
+    FieldSqr(t, t);
+    FieldSub(t, t, A);
+    FieldSub(t, t, C);
+    FieldAdd(D, t, t);
+    FieldMulInt(E, A, 3);
+    FieldSqr(F, E);
+    CFieldElem z;
+    FieldMul(z, a.y, a.z);
+    FieldAdd(r.z, z, z);
+    FieldSub(r.x, F, D);
+    FieldSub(r.x, r.x, D);
+    FieldSub(t, D, r.x);
+    FieldMul(t, E, t);
+    FieldMulInt(C, C, 8);
+    FieldSub(r.y, t, C);
+    r.fInfinity = false;
+}
+
+// r = a + b, given U1 = a.x*b.z^2, U2 = b.x*a.z^2, S1, S2 likewise and Z = a.z*b.z
+static void PointAddFinish(CPointJ& r, const CPointJ& a, const CFieldElem& U1, const CFieldElem& U2,
+                           const CFieldElem& S1, const CFieldElem& S2, const CFieldElem& Z)
+{
+    CFieldElem H, R;
+    FieldSub(H, U2, U1);
+    FieldSub(R, S2, S1);
+    if (FieldIsZero(H))
+    {
+        if (FieldIsZero(R))
+            PointDouble(r, a);
+        else
+            r.fInfinity = true;
+        return;
+    }
+    CFieldElem HH, HHH, V, t;
+    FieldSqr(HH, H);
+    FieldMul(HHH, H, HH);
+    FieldMul(V, U1, HH);
+    FieldMul(r.z, Z, H);
+    FieldSqr(t, R);
+    FieldSub(t, t, HHH);
+    FieldSub(t, t, V);
+    FieldSub(r.x, t, V);
+    FieldSub(t, V, r.x);
+    FieldMul(t, R, t);
+    FieldMul(V, S1, HHH);
+    FieldSub(r.y, t, V);
+    r.fInfinity = false;
+}
+
+static void PointAdd(CPointJ& r, const CPointJ& a, const CPointJ& b)
+{
+    if (a.fInfinity)
+    {
+        r = b;
+        return;
+    }
+    if (b.fInfinity)
+    {
+        r = a;
+        return;
+    }
+    CFieldElem Z1Z1, Z2Z2, U1, U2, S1, S2, Z;
+    FieldSqr(Z1Z1, a.z);
+    FieldSqr(Z2Z2, b.z);
+    FieldMul(U1, a.x, Z2Z2);
+    FieldMul(U2, b.x, Z1Z1);
+    FieldMul(S1, a.y, b.z);
+    FieldMul(S1, S1, Z2Z2);
+    FieldMul(S2, b.y, a.z);
+    FieldMul(S2, S2, Z1Z1);
+    FieldMul(Z, a.z, b.z);
+    CPointJ t = a;
+    PointAddFinish(r, t, U1, U2, S1, S2, Z);
+}
+
+static void PointAddAffine(CPointJ& r, const CPointJ& a, const CPoint& b)
+{
+    if (a.fInfinity)
+    {
+        r.x = b.x;
+        r.y = b.y;
+        r.z.n[0] = 1;
+        memset(&r.z.n[1], 0, sizeof(r.z.n) - sizeof(r.z.n[0]));
+        r.fInfinity = b.fInfinity;
+        return;
+    }
+    if (b.fInfinity)
+    {
+        r = a;
+        return;
+    }
+    CFieldElem Z1Z1, U2, S2;
+    FieldSqr(Z1Z1, a.z);
+    FieldMul(U2, b.x, Z1Z1);
+    FieldMul(S2, b.y, a.z);
+    FieldMul(S2, S2, Z1Z1);
+    CPointJ t = a;
+    PointAddFinish(r, t, t.x, U2, t.y, S2, t.z);
+}
+
+static void PointToAffine(CPoint& r, const CPointJ& a)
+{
+    r.fInfinity = a.fInfinity;
+    if (a.fInfinity)
+        return;
+    CFieldElem zi, zi2, zi3;
+    FieldInv(zi, a.z);
+    FieldSqr(zi2, zi);
+    FieldMul(zi3, zi2, zi);
+    FieldMul(r.x, a.x, zi2);
+    FieldMul(r.y, a.y, zi3);
+}
+
+/** Odd multiples G, 3G, 5G, ... of the generator, and lambda times them */
+class CGeneratorTables
+{
+public:
+    CPoint pre[TABLE_SIZE_G];
+    CPoint preLambda[TABLE_SIZE_G];
+
+    CGeneratorTables()
+    {
+        CPointJ g, g2, p;
+        g.x = GX;
+        g.y = GY;
+        memset(&g.z, 0, sizeof(g.z));
+        g.z.n[0] = 1;
+        g.fInfinity = false;
+        PointDouble(g2, g);
+        p = g;
+        for (int i = 0; i < TABLE_SIZE_G; i++)
+        {
+            if (i > 0)
+                PointAdd(p, p, g2);
+            PointToAffine(pre[i], p);
+            FieldMul(preLambda[i].x, pre[i].x, BETA);
+            preLambda[i].y = pre[i].y;
+            preLambda[i].fInfinity = false;
+        }
+    }
+};
+
+// Built during static initialization; depends on nothing but the constants above
+static const CGeneratorTables generatorTables;
+
+static inline void PointNeg(CPoint& r, const CPoint& a)
+{
+    r.x = a.x;
+    FieldNeg(r.y, a.y);
+    r.fInfinity = a.fInfinity;
+}
+
+static inline void PointNeg(CPointJ& r, const CPointJ& a)
+{
+    r.x = a.x;
+    FieldNeg(r.y, a.y);
+    r.z = a.z;
+    r.fInfinity = a.fInfinity;
+}
+
+// r = na * a + ng * G
+static void PointMulAdd(CPointJ& r, const CPoint& a, const CScalar& na, const CScalar& ng)
+{
+    // Odd multiples of a, and of lambda * a
+    CPointJ preA[TABLE_SIZE_Q], preALambda[TABLE_SIZE_Q], a2;
+    preA[0].x = a.x;
+    preA[0].y = a.y;
+    memset(&preA[0].z, 0, sizeof(preA[0].z));
+    preA[0].z.n[0] = 1;
+    preA[0].fInfinity = false;
+    PointDouble(a2, preA[0]);
+    for (int i = 1; i < TABLE_SIZE_Q; i++)
+        PointAdd(preA[i], preA[i - 1], a2);
+    for (int i = 0; i < TABLE_SIZE_Q; i++)
+    {
+        preALambda[i] = preA[i];
+        FieldMul(preALambda[i].x, preA[i].x, BETA);
+    }
+
+    // Both scalars split in halves of 128 bits, negated where that makes them
+    // small; the matching points are negated instead
+    CScalar na1, na2, ng1, ng2;
+    ScalarSplitLambda(na1, na2, na);
+    ScalarSplitLambda(ng1, ng2, ng);
+    bool fNeg[4] = { ScalarIsHigh(na1), ScalarIsHigh(na2), ScalarIsHigh(ng1), ScalarIsHigh(ng2) };
+    if (fNeg[0]) ScalarNeg(na1, na1);
+    if (fNeg[1]) ScalarNeg(na2, na2);
+    if (fNeg[2]) ScalarNeg(ng1, ng1);
+    if (fNeg[3]) ScalarNeg(ng2, ng2);
+
+    int wnafA1[WNAF_BITS], wnafA2[WNAF_BITS], wnafG1[WNAF_BITS], wnafG2[WNAF_BITS];
+    int nBits = ScalarWNAF(wnafA1, WNAF_BITS, na1, WINDOW_Q);
+    int n = ScalarWNAF(wnafA2, WNAF_BITS, na2, WINDOW_Q);
+    if (n > nBits) nBits = n;
+    n = ScalarWNAF(wnafG1, WNAF_BITS, ng1, WINDOW_G);
+    if (n > nBits) nBits = n;
+    n = ScalarWNAF(wnafG2, WNAF_BITS, ng2, WINDOW_G);
+    if (n > nBits) nBits = n;
+
+    r.fInfinity = true;
+    for (int i = nBits - 1; i >= 0; i--)
+    {
+        PointDouble(r, r);
+        int d;
+        if ((d = wnafA1[i]) != 0)
+        {
+            CPointJ t = preA[(d > 0 ? d : -d) / 2];
+            if ((d < 0) != fNeg[0])
+                PointNeg(t, t);
+            PointAdd(r, r, t);
+        }
+        if ((d = wnafA2[i]) != 0)
+        {
+            CPointJ t = preALambda[(d > 0 ? d : -d) / 2];
+            if ((d < 0) != fNeg[1])
+                PointNeg(t, t);
+            PointAdd(r, r, t);
+        }
+        if ((d = wnafG1[i]) != 0)
+        {
+            CPoint t = generatorTables.pre[(d > 0 ? d : -d) / 2];
+            if ((d < 0) != fNeg[2])
+                PointNeg(t, t);
+            PointAddAffine(r, r, t);
+        }
+        if ((d = wnafG2[i]) != 0)
+        {
+            CPoint t = generatorTables.preLambda[(d > 0 ? d : -d) / 2];
+            if ((d < 0) != fNeg[3])
+                PointNeg(t, t);
+            PointAddAffine(r, r, t);
+        }
+    }
+}
+
+// Compressed or uncompressed public key on the curve
+static bool ParsePubKey(CPoint& r, const unsigned char *pubkey, unsigned int pubkeylen)
+{
+    static const CFieldElem seven = {{ 7 }};
+    CFieldElem rhs, y2;
+    if (pubkeylen == 33 && (pubkey[0] == 0x02 || pubkey[0] == 0x03))
+    {
+        if (!FieldSetBytes(r.x, pubkey + 1))
+            return false;
+        FieldSqr(rhs, r.x);
+        FieldMul(rhs, rhs, r.x);
+        FieldAdd(rhs, rhs, seven);
+        if (!FieldSqrt(r.y, rhs))
+            return false;
+        if (FieldIsOdd(r.y) != (pubkey[0] == 0x03))
+            FieldNeg(r.y, r.y);
+    }
+    else if (pubkeylen == 65 && pubkey[0] == 0x04)
+    {
+        if (!FieldSetBytes(r.x, pubkey + 1) || !FieldSetBytes(r.y, pubkey + 33))
+            return false;
+        FieldSqr(rhs, r.x);
+        FieldMul(rhs, rhs, r.x);
+        FieldAdd(rhs, rhs, seven);
+        FieldSqr(y2, r.y);
+        if (!FieldEqual(y2, rhs))
+            return false;
+    }
+    else
+        return false;
+    r.fInfinity = false;
+    return true;
+}
+
+// One strict DER INTEGER at *pp, as 32 big-endian bytes
+static bool ParseDERInteger(const unsigned char *&p, const unsigned char *pend, unsigned char out[32])
+{
+    if (pend - p < 2 || p[0] != 0x02)
+        return false;
+    unsigned int nLen = p[1];
+    p += 2;
+    if (nLen == 0 || nLen > (unsigned int)(pend - p))
+        return false;
+    // Not negative, no needless leading zero
+    if (p[0] & 0x80)
+        return false;
+    if (nLen > 1 && p[0] == 0 && !(p[1] & 0x80))
+        return false;
+    const unsigned char *pbegin = p;
+    p += nLen;
+    while (nLen > 0 && *pbegin == 0)
+    {
+        pbegin++;
+        nLen--;
+    }
+    if (nLen > 32)
+        return false;
+    memset(out, 0, 32 - nLen);
+    memcpy(out + 32 - nLen, pbegin, nLen);
+    return true;
+}
+
+static bool ParseDERSignature(unsigned char r[32], unsigned char s[32], const unsigned char *sig, unsigned int siglen)
+{
+    if (siglen < 8 || siglen > 72 || sig[0] != 0x30 || sig[1] != siglen - 2)
+        return false;
+    const unsigned char *p = sig + 2, *pend = sig + siglen;
+    return ParseDERInteger(p, pend, r) && ParseDERInteger(p, pend, s) && p == pend;
+}
+
+} // anon namespace
+
+int secp256k1_ecdsa_verify(const unsigned char *msg32, const unsigned char *sig, unsigned int siglen,
+                           const unsigned char *pubkey, unsigned int pubkeylen)
+{
+    CPoint q;
+    unsigned char r32[32], s32[32];
+    if (!ParsePubKey(q, pubkey, pubkeylen) || !ParseDERSignature(r32, s32, sig, siglen))
+        return -1;
+
+    CScalar r, s, e;
+    if (!ScalarSetBytes(r, r32) || ScalarIsZero(r) || !ScalarSetBytes(s, s32) || ScalarIsZero(s))
+        return 0;
+    ScalarSetBytes(e, msg32);
+
+    // R = (e/s)*G + (r/s)*Q
+    CScalar w, u1, u2;
+    ScalarInv(w, s);
+    ScalarMul(u1, e, w);
+    ScalarMul(u2, r, w);
+    CPointJ R;
+    PointMulAdd(R, q, u2, u1);
+    if (R.fInfinity)
+        return 0;
+
+    // R.x mod n == r, without inverting R.z: R.x/R.z^2 is r or r + n
+    CFieldElem xr, zz, t;
+    memcpy(xr.n, r.n, sizeof(xr.n));
+    FieldSqr(zz, R.z);
+    FieldMul(t, xr, zz);
+    if (FieldEqual(t, R.x))
+        return 1;
+    if (CompareLimbs(xr.n, P_MINUS_N.n) >= 0)
+        return 0;
+    uint64 c = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        c += (uint64)xr.n[i] + N[i];
+        xr.n[i] = (uint32_t)c;
+        c >>= 32;
+    }
+    FieldMul(t, xr, zz);
+    return FieldEqual(t, R.x) ? 1 : 0;
+}
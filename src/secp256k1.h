@@ -0,0 +1,19 @@
+// Copyright (c) 2014 The Fusioncoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef SECP256K1_H
+#define SECP256K1_H
+
+/** Verify an ECDSA signature over secp256k1 without OpenSSL.
+ *
+ * msg32 is the 32-byte message hash, read big-endian like OpenSSL's
+ * ECDSA_verify does. The public key must be compressed or uncompressed and on
+ * the curve, and the signature strict DER with components of at most 32 bytes.
+ *
+ * Returns 1 for a valid signature, 0 for an invalid one, and -1 for keys and
+ * signatures it does not handle (other encodings, points off the curve), which
+ * the caller should judge with OpenSSL to keep its exact behaviour. */
+int secp256k1_ecdsa_verify(const unsigned char *msg32, const unsigned char *sig, unsigned int siglen,
+                           const unsigned char *pubkey, unsigned int pubkeylen);
+
+#endif
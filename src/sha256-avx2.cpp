@@ -0,0 +1,127 @@
+// Copyright (c) 2014 The Fusioncoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+/*
+ * SHA256d nonce scanning, eight lanes in the 32-bit words of an AVX2 register.
+ * The same kernel as sha256-sse2.cpp on registers twice as wide.
+ */
+
+#include "sha256.h"
+#include <immintrin.h>
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t sha256_h[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+#define ADD(a, b)  _mm256_add_epi32(a, b)
+#define XOR(a, b)  _mm256_xor_si256(a, b)
+#define AND(a, b)  _mm256_and_si256(a, b)
+#define OR(a, b)   _mm256_or_si256(a, b)
+#define SET1(x)    _mm256_set1_epi32(x)
+#define SHR(x, n)  _mm256_srli_epi32(x, n)
+#define ROTR(x, n) OR(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+
+#define S0(x) XOR(XOR(ROTR(x, 2), ROTR(x, 13)), ROTR(x, 22))
+#define S1(x) XOR(XOR(ROTR(x, 6), ROTR(x, 11)), ROTR(x, 25))
+#define s0(x) XOR(XOR(ROTR(x, 7), ROTR(x, 18)), SHR(x, 3))
+#define s1(x) XOR(XOR(ROTR(x, 17), ROTR(x, 19)), SHR(x, 10))
+#define Ch(x, y, z)  XOR(AND(XOR(y, z), x), z)
+#define Maj(x, y, z) OR(AND(x, y), AND(z, OR(x, y)))
+
+/* One round, with the variables renamed instead of moved: the new e goes
+ * to d and the new a to h */
+#define ROUND(a, b, c, d, e, f, g, h, i) do { \
+		__m256i T1 = ADD(ADD(h, S1(e)), ADD(Ch(e, f, g), ADD(SET1(sha256_k[i]), W[i]))); \
+		d = ADD(d, T1); \
+		h = ADD(T1, ADD(S0(a), Maj(a, b, c))); \
+	} while (0)
+
+#define ROUNDS8(i) do { \
+		ROUND(a, b, c, d, e, f, g, h, i + 0); \
+		ROUND(h, a, b, c, d, e, f, g, i + 1); \
+		ROUND(g, h, a, b, c, d, e, f, i + 2); \
+		ROUND(f, g, h, a, b, c, d, e, i + 3); \
+		ROUND(e, f, g, h, a, b, c, d, i + 4); \
+		ROUND(d, e, f, g, h, a, b, c, i + 5); \
+		ROUND(c, d, e, f, g, h, a, b, i + 6); \
+		ROUND(b, c, d, e, f, g, h, a, i + 7); \
+	} while (0)
+
+static inline void sha256_expand_8way(__m256i W[64], int nWords)
+{
+	for (int i = 16; i < nWords; i++)
+		W[i] = ADD(ADD(s1(W[i - 2]), W[i - 7]), ADD(s0(W[i - 15]), W[i - 16]));
+}
+
+/* SHA256 compression of W into S, one message per lane */
+static inline void sha256_transform_8way(__m256i S[8], __m256i W[64])
+{
+	__m256i a = S[0], b = S[1], c = S[2], d = S[3], e = S[4], f = S[5], g = S[6], h = S[7];
+
+	sha256_expand_8way(W, 64);
+	for (int i = 0; i < 64; i += 8)
+		ROUNDS8(i);
+
+	S[0] = ADD(S[0], a); S[1] = ADD(S[1], b); S[2] = ADD(S[2], c); S[3] = ADD(S[3], d);
+	S[4] = ADD(S[4], e); S[5] = ADD(S[5], f); S[6] = ADD(S[6], g); S[7] = ADD(S[7], h);
+}
+
+/* Last state word of the SHA256 compression of W into S. The final h is
+ * the e of round 60, so rounds 61 to 63 aren't needed. */
+static inline __m256i sha256_transform_h7_8way(const __m256i S[8], __m256i W[64])
+{
+	__m256i a = S[0], b = S[1], c = S[2], d = S[3], e = S[4], f = S[5], g = S[6], h = S[7];
+
+	sha256_expand_8way(W, 61);
+	for (int i = 0; i < 56; i += 8)
+		ROUNDS8(i);
+	ROUND(a, b, c, d, e, f, g, h, 56);
+	ROUND(h, a, b, c, d, e, f, g, 57);
+	ROUND(g, h, a, b, c, d, e, f, 58);
+	ROUND(f, g, h, a, b, c, d, e, 59);
+	ROUND(e, f, g, h, a, b, c, d, 60);
+
+	/* After the renaming, the e of round 60 is in h */
+	return ADD(S[7], h);
+}
+
+unsigned int sha256d_scan_8way_avx2(const uint32_t *midstate, const uint32_t *data, uint32_t *hash7)
+{
+	__m256i S[8], W[64];
+	int i;
+
+	/* First hash: the second header block, nonce per lane */
+	for (i = 0; i < 8; i++)
+		S[i] = SET1(midstate[i]);
+	for (i = 0; i < 16; i++)
+		W[i] = SET1(data[i]);
+	W[3] = _mm256_set_epi32(data[3] + 7, data[3] + 6, data[3] + 5, data[3] + 4,
+	                        data[3] + 3, data[3] + 2, data[3] + 1, data[3]);
+	sha256_transform_8way(S, W);
+
+	/* Second hash of the 32-byte result, only as far as its last word */
+	for (i = 0; i < 8; i++)
+		W[i] = S[i];
+	W[8] = SET1(0x80000000);
+	for (i = 9; i < 15; i++)
+		W[i] = SET1(0);
+	W[15] = SET1(256);
+	for (i = 0; i < 8; i++)
+		S[i] = SET1(sha256_h[i]);
+	__m256i H7 = sha256_transform_h7_8way(S, W);
+
+	_mm256_storeu_si256((__m256i *)hash7, H7);
+	return _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(AND(H7, SET1(0xffff)), SET1(0))));
+}
@@ -0,0 +1,60 @@
+// Copyright (c) 2014 The Fusioncoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "sha256.h"
+#include "scrypt.h"
+#include "util.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#endif
+
+sha256d_scan_kernel sha256d_scan = NULL;
+unsigned int sha256d_scan_ways = 1;
+
+/* The scalar SHA256Transform goes through OpenSSL, which uses the x86 SHA
+ * extensions when the CPU has them. That beats the SSE2 kernel and about
+ * matches the AVX2 one, so the lanes aren't worth it there. */
+static bool sha256_have_shani()
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid_max(0, NULL) >= 7)
+    {
+        __cpuid_count(7, 0, eax, ebx, ecx, edx);
+        return (ebx & 1<<29) != 0;
+    }
+#endif
+    return false;
+}
+
+void sha256d_detect(unsigned int cpuid_edx)
+{
+    if (sha256_have_shani())
+    {
+        printf("sha256: SHA extensions available, mining with the scalar transform.\n");
+        return;
+    }
+#if defined(USE_AVX2)
+    if (scrypt_have_avx2())
+    {
+        sha256d_scan = &sha256d_scan_8way_avx2;
+        sha256d_scan_ways = 8;
+        printf("sha256: using sha256-avx2 8-way for mining.\n");
+        return;
+    }
+#endif
+#if defined(USE_SSE2)
+#if !(defined(_M_X64) || defined(__x86_64__) || defined(_M_AMD64) || (defined(MAC_OSX) && defined(__i386__)))
+    if (!(cpuid_edx & 1<<26))
+    {
+        printf("sha256: SSE2 unavailable, mining with the scalar transform.\n");
+        return;
+    }
+#endif
+    sha256d_scan = &sha256d_scan_4way_sse2;
+    sha256d_scan_ways = 4;
+    printf("sha256: using sha256-sse2 4-way for mining.\n");
+#endif
+}
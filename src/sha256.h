@@ -0,0 +1,36 @@
+// Copyright (c) 2014 The Fusioncoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef SHA256_H
+#define SHA256_H
+#include <stdint.h>
+
+/*
+ * Multi-lane SHA256d nonce scanning for the internal SHA256 miner.
+ *
+ * midstate is the SHA256 state after the first 64 header bytes, data the
+ * second message block (header bytes 64..79 plus padding), both as 32-bit
+ * words in host order as FormatHashBuffers leaves them. A kernel hashes the
+ * nonces data[3], data[3]+1, ... one per lane, and stores the last state
+ * word of each lane's SHA256d in hash7. That word is known after 61 of the
+ * 64 rounds of the second hash, so the rest is skipped. The return value
+ * has bit i set if lane i ended in 16 zero bits, the candidates
+ * ScanHash_CryptoPP hands to the miner.
+ */
+static const int SHA256D_SCAN_MAX_WAYS = 8;
+
+typedef unsigned int (*sha256d_scan_kernel)(const uint32_t *midstate, const uint32_t *data, uint32_t *hash7);
+
+/* Kernel picked by sha256d_detect, NULL if none is usable */
+extern sha256d_scan_kernel sha256d_scan;
+extern unsigned int sha256d_scan_ways;
+
+#if defined(USE_SSE2)
+unsigned int sha256d_scan_4way_sse2(const uint32_t *midstate, const uint32_t *data, uint32_t *hash7);
+#endif
+#if defined(USE_AVX2)
+unsigned int sha256d_scan_8way_avx2(const uint32_t *midstate, const uint32_t *data, uint32_t *hash7);
+#endif
+
+void sha256d_detect(unsigned int cpuid_edx);
+#endif
@@ -18,6 +18,7 @@ using namespace boost;
 #include "txdb.h"
 
 bool fAdEnabled = false;
+bool fSmallDataIndex = false;
 
 static unsigned char pchSmallDataHeader1[] = { 0xfa, 0xce, SMALLDATA_TYPE_PLAINTEXT, 0, 0} ;
 static unsigned char pchSmallDataHeader2[] = { 0xfa, 0xce, SMALLDATA_TYPE_BROADCAST, 0, 0} ;
@@ -36,39 +37,101 @@ const unsigned char *GetSmallDataHeader(int type)
     return NULL;
 }
 
-bool GetTxMessage(CTransaction &tx, std::string &msg, bool &isBroadcast)
+// Zero-value OP_RETURN outputs are where smalldata goes
+static bool IsSmallDataCandidate(const CTxOut& txout)
 {
     txnouttype whichType;
+    if ( 0 != txout.nValue )
+        return false;
+
+    return ::IsStandard(txout.scriptPubKey, whichType) && whichType == TX_NULL_DATA;
+}
+
+// Type of the smalldata in a candidate script, and where its payload starts
+static bool ParseSmallData(const CScript& script, int &type, unsigned int &nPayloadStart)
+{
+    // OP_RETURN with a single opcode or a short push is standard too
+    if ( script.size() < 2 )
+        return false;
+
+    unsigned int start = 2;
+    if ( script[1] == 0x4c )
+        start = 3;
+
+    if ( script.size() < start + 4 )
+        return false;
+
+    if ( script[start] != 0xfa || script[start + 1] != 0xce )
+        return false;
+
+    if ( script[start + 2] != SMALLDATA_TYPE_PLAINTEXT && script[start + 2] != SMALLDATA_TYPE_BROADCAST )
+        return false;
+
+    type = script[start + 2];
+    nPayloadStart = start + 4;
+    return true;
+}
+
+bool GetTxMessage(const CTransaction &tx, std::string &msg, bool &isBroadcast)
+{
     BOOST_FOREACH(const CTxOut& txout, tx.vout) {
-        if ( 0 != txout.nValue )
-            continue;
-
-        if (!::IsStandard(txout.scriptPubKey, whichType))
+        if (!IsSmallDataCandidate(txout))
             continue;
 
-        if (whichType == TX_NULL_DATA)
-        {
-            char start = 2;
-            if ( txout.scriptPubKey[1] == 0x4c )
-                start = 3;
-
-            if ( txout.scriptPubKey[start] != 0xfa || txout.scriptPubKey[start + 1] != 0xce )
-                return false;
+        int type;
+        unsigned int nPayloadStart;
+        if (!ParseSmallData(txout.scriptPubKey, type, nPayloadStart))
+            return false;
 
-            if ( txout.scriptPubKey[start + 2] == SMALLDATA_TYPE_PLAINTEXT )
-                isBroadcast = false;
-            else if ( txout.scriptPubKey[start + 2] == SMALLDATA_TYPE_BROADCAST )
-                isBroadcast = true;
-            else 
-                return false;
-
-            std::string str(txout.scriptPubKey.begin() + start + 4, txout.scriptPubKey.end());
-            msg = str;
-            return true;
-        }
+        isBroadcast = (type == SMALLDATA_TYPE_BROADCAST);
+        std::string str(txout.scriptPubKey.begin() + nPayloadStart, txout.scriptPubKey.end());
+        msg = str;
+        return true;
     }
     
     return false;
+}
+
+void GetTxSmallDataEntries(const CTransaction &tx, const uint256 &txid, unsigned int nHeight, const CDiskTxPos &pos, int64 nFee,
+                           std::vector<std::pair<CSmallDataKey, CSmallDataIndexEntry> > &vEntries)
+{
+    // Offset of the first output in the serialized transaction
+    unsigned int nOffset = sizeof(tx.nVersion) + ::GetSerializeSize(tx.vin, SER_DISK, CLIENT_VERSION) + GetSizeOfCompactSize(tx.vout.size());
+    for (unsigned int i = 0; i < tx.vout.size(); i++)
+    {
+        const CTxOut& txout = tx.vout[i];
+        int type;
+        unsigned int nPayloadStart;
+        if (IsSmallDataCandidate(txout) && ParseSmallData(txout.scriptPubKey, type, nPayloadStart))
+        {
+            CSmallDataIndexEntry entry;
+            entry.pos = pos;
+            entry.nFee = nFee;
+            entry.nPayloadOffset = nOffset + sizeof(txout.nValue) + GetSizeOfCompactSize(txout.scriptPubKey.size()) + nPayloadStart;
+            entry.nPayloadSize = txout.scriptPubKey.size() - nPayloadStart;
+            vEntries.push_back(std::make_pair(CSmallDataKey(nHeight, type, txid, i), entry));
+        }
+        nOffset += ::GetSerializeSize(txout, SER_DISK, CLIENT_VERSION);
+    }
+}
+
+bool CSmallDataIndexEntry::ReadPayload(std::string &payload) const
+{
+    CAutoFile file(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+    if (!file)
+        return error("CSmallDataIndexEntry::ReadPayload() : OpenBlockFile failed");
+    CBlockHeader header;
+    try {
+        file >> header;
+        if (fseek(file, pos.nTxOffset + nPayloadOffset, SEEK_CUR))
+            return error("CSmallDataIndexEntry::ReadPayload() : fseek failed");
+        payload.resize(nPayloadSize);
+        if (nPayloadSize > 0)
+            file.read(&payload[0], nPayloadSize);
+    } catch (std::exception &e) {
+        return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+    }
+    return true;
 }
 
 
@@ -89,79 +152,44 @@ void CAdTx::GetText()
     }
 }
 
-void CAdTx::GetFee()
+void CAdTx::SetFee(const CTxUndo& txundo)
 {
-    {
-        CCoinsViewCache &view = *pcoinsTip;
-        int64 nValueIn = 0;
-        if (!this->IsCoinBase())
-        {
-            for (unsigned int i = 0; i < vin.size(); i++)
-            {
-                if (fTxIndex)
-                {
-                    CDiskTxPos postx;
-                    if (pblocktree->ReadTxIndex(vin[i].prevout.hash, postx)) 
-                    {
-                        CTransaction txOut;
-                        CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
-                        CBlockHeader header;
-                        try {
-                            file >> header;
-                            fseek(file, postx.nTxOffset, SEEK_CUR);
-                            file >> txOut;
-                        } catch (std::exception &e) {
-                            printf("%s() : deserialize or I/O error\n", __PRETTY_FUNCTION__);
-                            return;
-                        }
-                        if (txOut.GetHash() != vin[i].prevout.hash){
-                            printf("%s() : txid mismatch\n", __PRETTY_FUNCTION__);
-                            return;
-                        }
-
-                        nValueIn += txOut.vout[vin[i].prevout.n].nValue;
-                        continue;
-                    }
-                }
-
-                CCoins coins;
-                if (view.GetCoins(vin[i].prevout.hash, coins))
-                {
-                    CBlockIndex *pindexSlow = FindBlockByHeight(coins.nHeight);
-                    if (pindexSlow) {
-                        CBlock block;
-                        if (block.ReadFromDisk(pindexSlow)) {
-                            BOOST_FOREACH(const CTransaction &tx, block.vtx) {
-                                if (tx.GetHash() == vin[i].prevout.hash) {
-                                    nValueIn += tx.vout[vin[i].prevout.n].nValue;
-                                }
-                            }
-                        }
-                    }
-                }
-            }
-        }
-        nFee = nValueIn - this->GetValueOut();
-        if ( nFee < 0 )
-            nFee = 0;
-        //printf("CAdTx %s in=%"PRI64d" out=%"PRI64d" fee=%"PRI64d"\n", this->GetHash().GetHex().c_str(), nValueIn, this->GetValueOut(), nFee);
-    }
+    int64 nValueIn = 0;
+    BOOST_FOREACH(const CTxInUndo& txinundo, txundo.vprevout)
+        nValueIn += txinundo.txout.nValue;
+    nFee = nValueIn - this->GetValueOut();
+    if ( nFee < 0 )
+        nFee = 0;
 }
 
-int64 CAdTx::GetFeeCur()
+// An ad's fee decays linearly to nothing over this many blocks
+static const int AD_DECAY_BLOCKS = 10000;
+
+static int64 GetDecayedFee(int64 nFee, int nHeight, int nAtHeight)
 {
-    int interval = nBestHeight - nHeight;
+    int interval = nAtHeight - nHeight;
     if ( interval < 0 )
         interval = 0;
 
-    interval = 10000 - interval;
+    interval = AD_DECAY_BLOCKS - interval;
     if ( interval < 0 )
         interval = 0;
 
-    return nFee * interval / 10000;
+    return nFee * interval / AD_DECAY_BLOCKS;
+}
+
+int64 CAdTx::GetFeeAt(int nAtHeight) const
+{
+    return GetDecayedFee(nFee, nHeight, nAtHeight);
+}
+
+int64 CAdTx::GetFeeCur() const
+{
+    return GetFeeAt(nBestHeight);
 }
 
 CAdManager adManager;
+unsigned int nMaxAds = 15;
 
 //
 // CAdManager
@@ -169,65 +197,148 @@ CAdManager adManager;
 CAdManager::CAdManager()
 {
     nLastHeight = 0;
+    fLoaded = false;
+    fSynced = false;
 }
 
-void CAdManager::load()
+bool CAdManager::load()
 {
-    if (fImporting || fReindex || !fAdEnabled)
-        return;
+    if (fReindex || !fAdEnabled)
+        return false;
 
-    if ( vAdList.size() == 0 )
     {
-        CAdDB adb;
-        if (!adb.Read(adManager))
-        {
-            printf("Invalid or missing ad.dat; recreating\n");
-            save();
-        }
-
-        int i;
-        for ( i = 0; i < vAdList.size(); ++ i )
-            vAdList[i].GetText();
-
-        if ( 0 == nLastHeight )
-            nLastHeight = nBestHeight - 10000;
-        if ( nLastHeight < 0 )
-            nLastHeight = 1;
-
-        printf("CAdManager::load() nLastHeight = %d, nBestHeight = %d\n", nLastHeight, nBestHeight);
-        for ( i = nLastHeight; i <= nBestHeight; ++ i )
-        {
-            CBlockIndex* pblockindex = FindBlockByHeight(i);
-            if (pblockindex) 
-            {
-                CBlock blockTmp;
-                if (!blockTmp.ReadFromDisk(pblockindex))
-                    continue;
-
-                processBlock(&blockTmp, i);
-            }
-        }
-        printf("CAdManager::load finish\n");
+        LOCK(cs);
+        if (fLoaded)
+            return false;
+        fLoaded = true;
+
+        CAdDB adb;
+        if (!adb.Read(*this))
+            printf("Invalid or missing ad.dat; recreating\n");
     }
+    printf("CAdManager::load() nLastHeight = %d, nBestHeight = %d\n", nLastHeight, nBestHeight);
+    return true;
 }
 
 void CAdManager::save()
 {
     if (fAdEnabled)
     {
+        LOCK(cs);
         CAdDB adb;
-        adb.Write(adManager);
+        adb.Write(*this);
     }
 }
 
-bool CAdManager::getAdList(std::vector<CAdTx> &adTxList, int max)
+// The block the ads are up to, on the main chain. Requires cs_main.
+CBlockIndex* CAdManager::GetLastBlock()
+{
+    if (pindexBest == NULL)
+        return NULL;
+
+    CBlockIndex* pindex = NULL;
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(lastBlockHash);
+    if (mi != mapBlockIndex.end())
+        pindex = mi->second;
+    else
+    {
+        // ad.dat from before the block hash was kept, or a new one
+        int nHeight = nLastHeight > 0 ? nLastHeight : nBestHeight - 10000;
+        pindex = FindBlockByHeight(std::min(std::max(nHeight, 0), nBestHeight));
+    }
+
+    // Back to the fork if the block was disconnected, dropping the ads of the stale branch
+    int nHeight = pindex->nHeight;
+    while (pindex->pnext == NULL && pindex != pindexBest)
+        pindex = pindex->pprev;
+    {
+        LOCK(cs);
+        lastBlockHash = pindex->GetBlockHash();
+        nLastHeight = pindex->nHeight;
+        if (pindex->nHeight < nHeight)
+        {
+            removeAds(0, pindex->nHeight);
+            rankAds();
+        }
+    }
+    return pindex;
+}
+
+void CAdManager::catchUp()
+{
+    int64 nStart = GetTimeMillis();
+    int nBlocks = 0;
+    while (true)
+    {
+        boost::this_thread::interruption_point();
+
+        CBlockIndex* pindex;
+        CDiskBlockPos pos;
+        {
+            LOCK(cs_main);
+            CBlockIndex* pindexLast = GetLastBlock();
+            if (pindexLast == NULL)
+                return;
+            if (pindexLast == pindexBest)
+            {
+                // SetBestChain holds cs_main, so no block is connected in between
+                fSynced = true;
+                break;
+            }
+            pindex = pindexLast->pnext;
+            pos = pindex->GetUndoPos();
+        }
+
+        // Read without cs_main, so the node keeps serving during the catch-up.
+        // The undo data has the outputs the block spent, for the fees.
+        CBlock block;
+        CBlockUndo blockundo;
+        bool fRead = block.ReadFromDisk(pindex) && !pos.IsNull() &&
+                     blockundo.ReadFromDisk(pos, pindex->pprev->GetBlockHash());
+
+        {
+            LOCK(cs_main);
+            // Start over from the fork if a reorganization disconnected the block meanwhile
+            if (pindex->pnext == NULL && pindex != pindexBest)
+                continue;
+            if (fRead)
+                processBlock(block, blockundo, pindex);
+            else
+            {
+                printf("CAdManager::catchUp() : failed to read block %s\n", pindex->GetBlockHash().ToString().c_str());
+                connectAds(std::vector<CAdTx>(), pindex);
+            }
+        }
+
+        if (++ nBlocks % 1000 == 0)
+            save();
+    }
+    save();
+    printf("CAdManager::catchUp() : %d blocks  %"PRI64d"ms\n", nBlocks, GetTimeMillis() - nStart);
+}
+
+void ThreadAdCatchUp()
+{
+    RenameThread("bitcoin-adcatchup");
+    adManager.catchUp();
+}
+
+bool CAdManager::getAdList(std::vector<CAdTx> &adTxList, int max) const
 {
     adTxList.clear();
 
     if (fAdEnabled)
     {
-        int size = vAdList.size() > max ? max : vAdList.size();
-        adTxList.insert(adTxList.end(), vAdList.begin(), vAdList.begin() + size);
+        boost::shared_ptr<const std::vector<CAdTx> > pList;
+        {
+            boost::unique_lock<boost::mutex> lock(mutexAdList);
+            pList = pAdList;
+        }
+        if (pList)
+        {
+            int size = (int)pList->size() > max ? max : pList->size();
+            adTxList.insert(adTxList.end(), pList->begin(), pList->begin() + size);
+        }
     }
 #if 0
     if ( adTxList.size() < 15 )
@@ -252,67 +363,211 @@ bool CAdManager::getAdList(std::vector<CAdTx> &adTxList, int max)
 }
 
 
-void CAdManager::processBlock(CBlock* pblock, int height)
+CSmallDataEvents smallDataEvents;
+
+void CSmallDataEvents::Push(std::vector<CSmallDataEvent>& vEvents)
+{
+    if (vEvents.empty())
+        return;
+
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        BOOST_FOREACH(CSmallDataEvent& event, vEvents)
+        {
+            event.nSequence = nNextSequence++;
+            deqEvents.push_back(event);
+        }
+        while (deqEvents.size() > MAX_EVENTS)
+            deqEvents.pop_front();
+    }
+    cond.notify_all();
+}
+
+uint64 CSmallDataEvents::Wait(uint64 nSequence, int64 nTimeout, unsigned int nMax, std::vector<CSmallDataEvent>& vEvents)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    boost::system_time timeout = boost::get_system_time() + boost::posix_time::milliseconds(nTimeout);
+    while ((deqEvents.empty() || deqEvents.back().nSequence < nSequence) && !fInterrupted)
+        if (!cond.timed_wait(lock, timeout))
+            break;
+
+    // Sequence numbers in deqEvents are consecutive
+    if (!deqEvents.empty() && deqEvents.back().nSequence >= nSequence)
+    {
+        uint64 nFirst = deqEvents.front().nSequence;
+        std::deque<CSmallDataEvent>::const_iterator it = deqEvents.begin() + (nSequence > nFirst ? nSequence - nFirst : 0);
+        for (; it != deqEvents.end() && vEvents.size() < nMax; ++it)
+            vEvents.push_back(*it);
+    }
+    if (!vEvents.empty())
+        return vEvents.back().nSequence + 1;
+    return std::min(nSequence, nNextSequence);
+}
+
+void CSmallDataEvents::Interrupt()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fInterrupted = true;
+    }
+    cond.notify_all();
+}
+
+void GetBlockSmallDataEvents(const CBlock& block, const CBlockIndex* pindex, int nKind, std::vector<CSmallDataEvent>& vEvents)
+{
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+    {
+        CSmallDataEvent event;
+        event.txid = tx.GetHash();
+        // Transactions that were in the pool had their message parsed on the way in
+        if (!mempool.getSmallData(event.txid, event.strMessage, event.fBroadcast) &&
+            !GetTxMessage(tx, event.strMessage, event.fBroadcast))
+            continue;
+        event.nKind = nKind;
+        event.hashBlock = pindex->GetBlockHash();
+        event.nHeight = pindex->nHeight;
+        vEvents.push_back(event);
+    }
+}
+
+void GetBlockAds(const CBlock& block, const CBlockUndo& blockundo, int height, std::vector<CAdTx>& vAds)
+{
+    // vtxundo has an entry for every transaction but the coinbase
+    for ( unsigned int i = 1; i < block.vtx.size() && i <= blockundo.vtxundo.size(); i ++ )
+    {
+        std::string msg;
+        bool isBroadcast;
+        if ( GetTxMessage(block.vtx[i], msg, isBroadcast) && isBroadcast )
+        {
+            CAdTx adTx(block.vtx[i]);
+            adTx.hashBlock = block.GetHash();
+            adTx.nHeight = height;
+            adTx.adText = msg;
+            adTx.SetFee(blockundo.vtxundo[i - 1]);
+            vAds.push_back(adTx);
+        }
+    }
+}
+
+void CAdManager::processBlock(const CBlock& block, const CBlockUndo& blockundo, const CBlockIndex* pindex)
 {
     if (!fAdEnabled)
         return;
 
-    if ( 0 == height )
-    {
-        CBlockIndex* pblockindex = mapBlockIndex[pblock->GetHash()];
-        if ( pblockindex )
-            height = pblockindex->nHeight;
-    }
-
-    if ( 0 == height )
-        return;
-
-    //printf("CAdManager::processBlock block=%s height=%d\n", pblock->GetHash().GetHex().c_str(), height);
-    for ( int i = 0; i < pblock->vtx.size(); i ++ )
-    {
-        if ( pblock->vtx[i].IsCoinBase() )
-            continue;
-
-        std::string msg;
-        bool isBroadcast;
-        if ( GetTxMessage(pblock->vtx[i], msg, isBroadcast) )
-        {
-            if ( isBroadcast )
-            {
-                CAdTx adTx(pblock->vtx[i]);
-                adTx.hashBlock = pblock->GetHash();
-                adTx.nHeight = height;
-                adTx.adText = msg;
-                adTx.GetFee();
-                //printf("CAdManager ad tx %s height=%d\n", adTx.GetHash().GetHex().c_str(), height);
-                addToList(adTx);
-            }
-        }
-    }
-
-    nLastHeight = height;
+    std::vector<CAdTx> vAds;
+    GetBlockAds(block, blockundo, pindex->nHeight, vAds);
+    connectAds(vAds, pindex);
 }
 
-void CAdManager::addToList(CAdTx &adTx)
+void CAdManager::processBlockAds(const std::vector<CAdTx>& vAds, const CBlockIndex* pindex)
 {
-    {
-        LOCK(cs);
-        int i = vAdList.size();
+    // Until then, catchUp reads these blocks itself
+    if (!fAdEnabled || !fSynced)
+        return;
 
-        while ( i > 0 )
-        {
-            if ( adTx.GetFeeCur() > vAdList[i - 1].GetFeeCur() )
-                i = i - 1;
-            else if ( adTx.GetHash() == vAdList[i - 1].GetHash() )
-                return;
-            else
-                break;
-        }
-        vAdList.insert(vAdList.begin() + i, adTx);
+    connectAds(vAds, pindex);
+}
 
-        if ( vAdList.size() > 15 )
-            vAdList.pop_back();
+void CAdManager::disconnectBlockAds(const CBlockIndex* pindex)
+{
+    if (!fAdEnabled || !fSynced)
+        return;
+
+    LOCK(cs);
+    removeAds(pindex->GetBlockHash(), -1);
+    lastBlockHash = pindex->pprev->GetBlockHash();
+    nLastHeight = pindex->pprev->nHeight;
+    rankAds();
+}
+
+void CAdManager::connectAds(const std::vector<CAdTx>& vAds, const CBlockIndex* pindex)
+{
+    LOCK(cs);
+    BOOST_FOREACH(const CAdTx& adTx, vAds)
+        addAd(adTx);
+    lastBlockHash = pindex->GetBlockHash();
+    nLastHeight = pindex->nHeight;
+
+    // Fully decayed ads can no longer rank above anything
+    std::map<uint256, CAdTx>::iterator it = mapAds.begin();
+    while (it != mapAds.end())
+    {
+        if (it->second.nHeight <= nLastHeight - AD_DECAY_BLOCKS)
+        {
+            setRanked.erase(CAdRank(it->second, it->first));
+            mapAds.erase(it++);
+        }
+        else
+            it++;
     }
+    rankAds();
+}
+
+void CAdManager::setAds(const std::vector<CAdTx>& vAds)
+{
+    LOCK(cs);
+    mapAds.clear();
+    setRanked.clear();
+    BOOST_FOREACH(CAdTx adTx, vAds)
+    {
+        adTx.GetText();
+        addAd(adTx);
+    }
+    rankAds();
+}
+
+// Requires cs
+void CAdManager::addAd(const CAdTx& adTx)
+{
+    uint256 txid = adTx.GetHash();
+    if (mapAds.insert(make_pair(txid, adTx)).second)
+        setRanked.insert(CAdRank(adTx, txid));
+}
+
+// Drop the ads of block hashBlock, or above nAboveHeight if it is not -1. Requires cs.
+void CAdManager::removeAds(const uint256& hashBlock, int nAboveHeight)
+{
+    std::map<uint256, CAdTx>::iterator it = mapAds.begin();
+    while (it != mapAds.end())
+    {
+        if (nAboveHeight == -1 ? it->second.hashBlock == hashBlock : it->second.nHeight > nAboveHeight)
+        {
+            setRanked.erase(CAdRank(it->second, it->first));
+            mapAds.erase(it++);
+        }
+        else
+            it++;
+    }
+}
+
+// Publish the best nMaxAds ads at nLastHeight. Requires cs.
+void CAdManager::rankAds()
+{
+    // A min-heap of the best so far by (decayed fee, height). Walking in fee order,
+    // once an ad's fee is below the worst decayed fee kept, none of the rest can
+    // make the list either.
+    typedef std::pair<std::pair<int64, int>, uint256> ranked;
+    std::vector<ranked> vBest;
+    BOOST_FOREACH(const CAdRank& rank, setRanked)
+    {
+        if (vBest.size() >= nMaxAds && rank.nFee < vBest.front().first.first)
+            break;
+        int64 nFeeCur = GetDecayedFee(rank.nFee, rank.nHeight, nLastHeight);
+        vBest.push_back(make_pair(make_pair(nFeeCur, rank.nHeight), rank.txid));
+        push_heap(vBest.begin(), vBest.end(), std::greater<ranked>());
+        if (vBest.size() > nMaxAds)
+        {
+            pop_heap(vBest.begin(), vBest.end(), std::greater<ranked>());
+            vBest.pop_back();
+        }
+    }
+    sort(vBest.begin(), vBest.end(), std::greater<ranked>());
+
+    boost::shared_ptr<std::vector<CAdTx> > pList(new std::vector<CAdTx>());
+    BOOST_FOREACH(const ranked& item, vBest)
+        pList->push_back(mapAds[item.second]);
+    boost::unique_lock<boost::mutex> lock(mutexAdList);
+    pAdList = pList;
 }
 
 //
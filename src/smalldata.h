@@ -4,16 +4,27 @@
 #ifndef H_SMALL_DATA_FUSIONCOIN
 #define H_SMALL_DATA_FUSIONCOIN
 
+#include <deque>
+#include <map>
+#include <set>
 #include <string>
 #include <vector>
 
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
 #include <boost/variant.hpp>
 
 #include "keystore.h"
 #include "bignum.h"
 
 class CTransaction;
+class CBlock;
+class CBlockUndo;
+class CBlockIndex;
+class CTxUndo;
 
 enum{
     SMALLDATA_TYPE_NULL,
@@ -23,7 +34,85 @@ enum{
 
 const unsigned char *GetSmallDataHeader(int type);
 
-bool GetTxMessage(CTransaction &tx, std::string &msg, bool &isBroadcast);
+bool GetTxMessage(const CTransaction &tx, std::string &msg, bool &isBroadcast);
+
+/** Key of a smalldata output in the smalldata index. Height and output
+ * number are stored big-endian, so that LevelDB keeps the entries in chain
+ * order and a height range is one contiguous scan. */
+class CSmallDataKey
+{
+public:
+    unsigned int nHeight;
+    unsigned char nType;
+    uint256 txid;
+    unsigned int nOut;
+
+    CSmallDataKey() : nHeight(0), nType(SMALLDATA_TYPE_NULL), nOut(0) {}
+    CSmallDataKey(unsigned int nHeightIn, unsigned char nTypeIn, const uint256& txidIn, unsigned int nOutIn) :
+        nHeight(nHeightIn), nType(nTypeIn), txid(txidIn), nOut(nOutIn) {}
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const {
+        return 4 + 1 + 32 + 4;
+    }
+
+    template<typename Stream>
+    void Serialize(Stream &s, int nSerType, int nVersion) const {
+        WriteBE32(s, nHeight);
+        s.write((const char*)&nType, 1);
+        s.write((const char*)txid.begin(), 32);
+        WriteBE32(s, nOut);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream &s, int nSerType, int nVersion) {
+        nHeight = ReadBE32(s);
+        s.read((char*)&nType, 1);
+        s.read((char*)txid.begin(), 32);
+        nOut = ReadBE32(s);
+    }
+
+private:
+    template<typename Stream>
+    static void WriteBE32(Stream &s, unsigned int n) {
+        unsigned char buf[4] = { (unsigned char)(n >> 24), (unsigned char)(n >> 16), (unsigned char)(n >> 8), (unsigned char)n };
+        s.write((const char*)buf, 4);
+    }
+
+    template<typename Stream>
+    static unsigned int ReadBE32(Stream &s) {
+        unsigned char buf[4];
+        s.read((char*)buf, 4);
+        return ((unsigned int)buf[0] << 24) | ((unsigned int)buf[1] << 16) | ((unsigned int)buf[2] << 8) | buf[3];
+    }
+};
+
+/** Where a smalldata output's payload is: the transaction on disk and the
+ * payload bytes within the serialized transaction */
+class CSmallDataIndexEntry
+{
+public:
+    CDiskTxPos pos;
+    int64 nFee;
+    unsigned int nPayloadOffset;
+    unsigned int nPayloadSize;
+
+    CSmallDataIndexEntry() : nFee(0), nPayloadOffset(0), nPayloadSize(0) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(pos);
+        READWRITE(nFee);
+        READWRITE(VARINT(nPayloadOffset));
+        READWRITE(VARINT(nPayloadSize));
+    )
+
+    // Read the payload from the block file
+    bool ReadPayload(std::string &payload) const;
+};
+
+/** Smalldata index entries for the outputs of a transaction at pos, in a block at nHeight */
+void GetTxSmallDataEntries(const CTransaction &tx, const uint256 &txid, unsigned int nHeight, const CDiskTxPos &pos, int64 nFee,
+                           std::vector<std::pair<CSmallDataKey, CSmallDataIndexEntry> > &vEntries);
 
 class CAdTx : public CTransaction
 {
@@ -46,31 +135,90 @@ public:
     CAdTx();
     CAdTx(const CTransaction& txIn);
     void GetText();
-    void GetFee();
-    int64 GetFeeCur();
+    // Fee from the spent outputs in the transaction's undo data
+    void SetFee(const CTxUndo& txundo);
+    // Fee decayed to the given height, and to the best height
+    int64 GetFeeAt(int nAtHeight) const;
+    int64 GetFeeCur() const;
 };
 
+/** Order of the ads by fee, then newest first. The decayed fee of an ad never
+ * exceeds its fee, so the best ads at a height are found in this order without
+ * decaying every ad. */
+class CAdRank
+{
+public:
+    int64 nFee;
+    int nHeight;
+    uint256 txid;
+
+    CAdRank(const CAdTx& adTx, const uint256& txidIn) : nFee(adTx.nFee), nHeight(adTx.nHeight), txid(txidIn) {}
+
+    friend bool operator<(const CAdRank& a, const CAdRank& b)
+    {
+        if (a.nFee != b.nFee)
+            return a.nFee > b.nFee;
+        if (a.nHeight != b.nHeight)
+            return a.nHeight > b.nHeight;
+        return a.txid < b.txid;
+    }
+};
+
+/** Ranked ads of the main chain, kept in ad.dat as of the block lastBlockHash */
 class CAdManager{
 private:
     mutable CCriticalSection cs;
+    bool fLoaded;
+    std::map<uint256, CAdTx> mapAds;
+    std::set<CAdRank> setRanked;
+    // The best ads at nLastHeight, replaced as a whole so that getAdList only
+    // holds mutexAdList while it copies the pointer, never cs
+    mutable boost::mutex mutexAdList;
+    boost::shared_ptr<const std::vector<CAdTx> > pAdList;
+
+    CBlockIndex* GetLastBlock();
+    void setAds(const std::vector<CAdTx>& vAds);
+    void addAd(const CAdTx& adTx);
+    void removeAds(const uint256& hashBlock, int nAboveHeight);
+    void connectAds(const std::vector<CAdTx>& vAds, const CBlockIndex* pindex);
+    void rankAds();
 public:
     uint256 lastBlockHash;
     int nLastHeight;
-    std::vector<CAdTx> vAdList;
+
+    // memory: whether the ads are up to the best block, so SetBestChain hands
+    // over the ads of new blocks (guarded by cs_main)
+    bool fSynced;
 
     IMPLEMENT_SERIALIZE
     (
+        CAdManager* pthis = const_cast<CAdManager*>(this);
         READWRITE(lastBlockHash);
         READWRITE(nLastHeight);
-        READWRITE(vAdList);
+        std::vector<CAdTx> vAds;
+        if (!fRead)
+        {
+            BOOST_FOREACH(const CAdRank& rank, setRanked)
+                vAds.push_back(pthis->mapAds[rank.txid]);
+        }
+        READWRITE(vAds);
+        if (fRead)
+            pthis->setAds(vAds);
     )
 
     CAdManager();
-    void load();
+    // Read ad.dat; false if ads are disabled, already loaded or the block index is being rebuilt
+    bool load();
     void save();
-    bool getAdList(std::vector<CAdTx> &adTxList, int max = 15);
-    void processBlock(CBlock* pblock, int height = 0);
-    void addToList(CAdTx &adTx);
+    // Replay the blocks from lastBlockHash up to the best block, then mark the ads synced
+    void catchUp();
+    // The best ads, at most max of them. Safe to call from any thread without locks.
+    bool getAdList(std::vector<CAdTx> &adTxList, int max = 15) const;
+    void processBlock(const CBlock& block, const CBlockUndo& blockundo, const CBlockIndex* pindex);
+    // Ads of blocks connected up to pindex, ignored until catchUp has reached the best block
+    void processBlockAds(const std::vector<CAdTx>& vAds, const CBlockIndex* pindex);
+    // Drop the ads of a block disconnected from the main chain
+    void disconnectBlockAds(const CBlockIndex* pindex);
 };
 
 /** Access to the advertise database (ad.dat) */
@@ -84,8 +232,75 @@ public:
     bool Read(CAdManager& addr);
 };
 
+enum{
+    SMALLDATA_EVENT_MEMPOOL,
+    SMALLDATA_EVENT_CONNECT,
+    SMALLDATA_EVENT_DISCONNECT,
+};
+
+/** A smalldata message entering the memory pool, or its block joining or leaving the main chain */
+class CSmallDataEvent
+{
+public:
+    uint64 nSequence;
+    int nKind;
+    uint256 txid;
+    uint256 hashBlock;
+    int nHeight;
+    bool fBroadcast;
+    std::string strMessage;
+
+    CSmallDataEvent()
+    {
+        nSequence = 0;
+        nKind = SMALLDATA_EVENT_MEMPOOL;
+        nHeight = -1;
+        fBroadcast = false;
+    }
+};
+
+/** The latest smalldata events, numbered in order, for subscribers to wait on */
+class CSmallDataEvents
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    std::deque<CSmallDataEvent> deqEvents;
+    uint64 nNextSequence;
+    bool fInterrupted;
+
+public:
+    // Events kept for subscribers that fall behind
+    static const unsigned int MAX_EVENTS = 10000;
+
+    CSmallDataEvents() : nNextSequence(1), fInterrupted(false) {}
+
+    // Number vEvents and wake up the waiting subscribers
+    void Push(std::vector<CSmallDataEvent>& vEvents);
+
+    // Up to nMax events from nSequence on (or from the oldest kept), waiting up to
+    // nTimeout milliseconds for one if there are none yet. Returns the sequence
+    // number to ask for next.
+    uint64 Wait(uint64 nSequence, int64 nTimeout, unsigned int nMax, std::vector<CSmallDataEvent>& vEvents);
+
+    // Release the waiting subscribers, for shutdown
+    void Interrupt();
+};
+
+/** Events for the smalldata messages of a block connected or disconnected at pindex */
+void GetBlockSmallDataEvents(const CBlock& block, const CBlockIndex* pindex, int nKind, std::vector<CSmallDataEvent>& vEvents);
+
+/** Broadcast ads of a connected block, with their fees from its undo data */
+void GetBlockAds(const CBlock& block, const CBlockUndo& blockundo, int height, std::vector<CAdTx>& vAds);
+
+/** Run CAdManager::catchUp for adManager */
+void ThreadAdCatchUp();
+
 extern bool fAdEnabled;
+extern unsigned int nMaxAds;
+extern bool fSmallDataIndex;
 extern CAdManager adManager;
+extern CSmallDataEvents smallDataEvents;
 
 #endif // H_SMALL_DATA_FUSIONCOIN
 
@@ -290,7 +290,8 @@ BOOST_AUTO_TEST_CASE(DoS_checkSig)
     std::swap(tx.vin[0].scriptSig, tx.vin[1].scriptSig);
 
     // Exercise -maxsigcachesize code:
-    mapArgs["-maxsigcachesize"] = "10";
+    mapArgs["-maxsigcachesize"] = "1";
+    InitSignatureCache();
     // Generate a new, different signature for vin[0] to trigger cache clear:
     CScript oldSig = tx.vin[0].scriptSig;
     BOOST_CHECK(SignSignature(keystore, orphans[0], tx, 0));
@@ -298,6 +299,7 @@ BOOST_AUTO_TEST_CASE(DoS_checkSig)
     for (unsigned int j = 0; j < tx.vin.size(); j++)
         BOOST_CHECK(VerifySignature(CCoins(orphans[j], MEMPOOL_HEIGHT), tx, j, flags, SIGHASH_ALL));
     mapArgs.erase("-maxsigcachesize");
+    InitSignatureCache();
 
     LimitOrphanTxSize(0);
 }
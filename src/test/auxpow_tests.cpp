@@ -0,0 +1,132 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "auxpow.h"
+
+BOOST_AUTO_TEST_SUITE(auxpow_tests)
+
+// A parent block whose coinbase commits to tree
+static CBlock ParentBlock(const CAuxMerkleTree& tree)
+{
+    std::vector<unsigned char> vchAux = tree.GetCoinbaseCommitment();
+    CTransaction txCoinbase;
+    txCoinbase.vin.resize(1);
+    txCoinbase.vin[0].prevout.SetNull();
+    txCoinbase.vin[0].scriptSig = MakeCoinbaseWithAux(0x1d00ffff, 1, vchAux);
+    txCoinbase.vout.resize(1);
+
+    CBlock parent;
+    parent.vtx.push_back(txCoinbase);
+    for (int i = 0; i < 3; i++)
+    {
+        CTransaction tx;
+        tx.nLockTime = i;
+        parent.vtx.push_back(tx);
+    }
+    parent.hashMerkleRoot = parent.BuildMerkleTree();
+    return parent;
+}
+
+BOOST_AUTO_TEST_CASE(auxpow_merkle_tree)
+{
+    // Every chain of trees with 1 to 20 chains checks out against CAuxPow::Check
+    for (int nChains = 1; nChains <= 20; nChains++)
+    {
+        std::map<int, uint256> mapChains;
+        for (int i = 0; i < nChains; i++)
+            mapChains[i * 7 + 1] = GetRandHash();
+
+        CAuxMerkleTree tree;
+        BOOST_REQUIRE(tree.Build(mapChains));
+        BOOST_CHECK(tree.nSize >= nChains && tree.nSize < 4 * nChains);
+
+        CBlock parent = ParentBlock(tree);
+        BOOST_FOREACH(const PAIRTYPE(int, uint256)& item, mapChains)
+        {
+            CAuxPow auxpow;
+            auxpow.SetParentBlock(parent);
+            auxpow.vChainMerkleBranch = tree.GetMerkleBranch(item.first);
+            auxpow.nChainIndex = GetAuxChainSlot(item.first, tree.nNonce, tree.nSize);
+            BOOST_CHECK(auxpow.Check(item.second, item.first));
+            BOOST_CHECK(!auxpow.Check(GetRandHash(), item.first));
+        }
+    }
+
+    CAuxMerkleTree tree;
+    BOOST_CHECK(!tree.Build(std::map<int, uint256>()));
+    BOOST_CHECK(tree.IsNull());
+}
+
+BOOST_AUTO_TEST_CASE(auxpow_registry)
+{
+    uint256 hashA = GetRandHash(), hashB = GetRandHash(), hashOwn = GetRandHash();
+    auxChains.SetChain(3, GetRandHash());
+    auxChains.SetChain(3, hashA);
+    auxChains.SetChain(5, hashB);
+    BOOST_CHECK_EQUAL(auxChains.GetChains().size(), 2U);
+
+    // The internal miner adds its own block to the registered chains
+    std::map<int, uint256> mapOwnChain;
+    mapOwnChain[0] = hashOwn;
+    CAuxMerkleTree tree = auxChains.CreateTree(mapOwnChain);
+    BOOST_CHECK_EQUAL(tree.mapChains.size(), 3U);
+
+    CBlock parent = ParentBlock(tree);
+    CAuxPow auxpow;
+    auxpow.SetParentBlock(parent);
+
+    // Proofs are only handed out for trees that went into work
+    BOOST_CHECK(!auxChains.SetChainMerkleBranch(auxpow, 3));
+    auxChains.AddRecentTree(tree);
+    BOOST_CHECK(auxChains.SetChainMerkleBranch(auxpow, 3));
+    BOOST_CHECK(auxpow.Check(hashA, 3));
+    BOOST_CHECK(auxChains.SetChainMerkleBranch(auxpow, 5));
+    BOOST_CHECK(auxpow.Check(hashB, 5));
+    BOOST_CHECK(auxChains.SetChainMerkleBranch(auxpow, 0));
+    BOOST_CHECK(auxpow.Check(hashOwn, 0));
+    BOOST_CHECK(!auxChains.SetChainMerkleBranch(auxpow, 4));
+
+    BOOST_CHECK(auxChains.RemoveChain(3));
+    BOOST_CHECK(!auxChains.RemoveChain(3));
+    BOOST_CHECK(auxChains.RemoveChain(5));
+    BOOST_CHECK(auxChains.IsEmpty());
+}
+
+BOOST_AUTO_TEST_CASE(auxpow_cache)
+{
+    std::map<int, uint256> mapChains;
+    uint256 hashAux = GetRandHash();
+    mapChains[0] = hashAux;
+    mapChains[9] = GetRandHash();
+    CAuxMerkleTree tree;
+    BOOST_REQUIRE(tree.Build(mapChains));
+
+    CAuxPow auxpow;
+    auxpow.SetParentBlock(ParentBlock(tree));
+    auxpow.vChainMerkleBranch = tree.GetMerkleBranch(0);
+    auxpow.nChainIndex = GetAuxChainSlot(0, tree.nNonce, tree.nSize);
+
+    uint64 nHits, nMisses, nEntries, nHits2, nMisses2;
+    GetAuxPowCacheStats(nHits, nMisses, nEntries);
+    BOOST_CHECK(auxpow.Check(hashAux, 0));
+    BOOST_CHECK(auxpow.Check(hashAux, 0));
+    GetAuxPowCacheStats(nHits2, nMisses2, nEntries);
+    BOOST_CHECK_EQUAL(nHits2, nHits + 1);
+    BOOST_CHECK_EQUAL(nMisses2, nMisses + 1);
+
+    // A cached entry doesn't vouch for a proof that differs from it
+    BOOST_CHECK(!auxpow.Check(hashAux, 9));
+    CAuxPow auxpowBadCoinbase(auxpow);
+    auxpowBadCoinbase.mMerkleTx.vout[0].nValue++;
+    BOOST_CHECK(!auxpowBadCoinbase.Check(hashAux, 0));
+    CAuxPow auxpowBadBranch(auxpow);
+    auxpowBadBranch.vChainMerkleBranch[0] = GetRandHash();
+    BOOST_CHECK(!auxpowBadBranch.Check(hashAux, 0));
+    CAuxPow auxpowBadParent(auxpow);
+    auxpowBadParent.mMerkleTx.vMerkleBranch[0] = GetRandHash();
+    BOOST_CHECK(!auxpowBadParent.Check(hashAux, 0));
+    GetAuxPowCacheStats(nHits, nMisses, nEntries);
+    BOOST_CHECK_EQUAL(nHits, nHits2);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,113 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "txdb.h"
+
+BOOST_AUTO_TEST_SUITE(blockindex_tests)
+
+BOOST_AUTO_TEST_CASE(blockindex_prevalgo)
+{
+    // sha256 sha256 scrypt sha256 sha256 sha256
+    const int algos[] = { 0, 0, 1, 0, 0, 0 };
+    const int nBlocks = sizeof(algos) / sizeof(algos[0]);
+    std::vector<uint256> vHashes(nBlocks);
+    std::vector<CBlockIndex> vIndex(nBlocks);
+    for (int i = 0; i < nBlocks; i++)
+    {
+        vHashes[i] = i;
+        vIndex[i].phashBlock = &vHashes[i];
+        vIndex[i].nVersion = CBlockHeader::GetBlockVersion(algos[i]);
+        vIndex[i].nHeight = i;
+        vIndex[i].pprev = i ? &vIndex[i - 1] : NULL;
+        vIndex[i].BuildAlgoChain(vIndex[i].GetBlockWork());
+    }
+
+    const int SHA = CBlockHeader::BLOCK_ALGO_SHA256;
+    const int SCRYPT = CBlockHeader::BLOCK_ALGO_SCRYPT;
+    BOOST_CHECK(vIndex[0].pprevAlgo[SHA] == NULL);
+    BOOST_CHECK(vIndex[0].pprevAlgo[SCRYPT] == NULL);
+    BOOST_CHECK(vIndex[3].pprevAlgo[SHA] == &vIndex[1]);
+    BOOST_CHECK(vIndex[5].pprevAlgo[SHA] == &vIndex[4]);
+    BOOST_CHECK(vIndex[5].pprevAlgo[SCRYPT] == &vIndex[2]);
+    BOOST_CHECK(vIndex[2].pprevAlgo[SCRYPT] == NULL);
+
+    BOOST_CHECK(GetLastBlockIndexForAlgo(&vIndex[5], SHA) == &vIndex[5]);
+    BOOST_CHECK(GetLastBlockIndexForAlgo(&vIndex[5], SCRYPT) == &vIndex[2]);
+    BOOST_CHECK(GetLastBlockIndexForAlgo(&vIndex[2], SCRYPT) == &vIndex[2]);
+    BOOST_CHECK(GetLastBlockIndexForAlgo(&vIndex[1], SCRYPT) == NULL);
+    BOOST_CHECK(GetLastBlockIndexForAlgo(NULL, SHA) == NULL);
+}
+
+BOOST_AUTO_TEST_CASE(blockindex_algochainwork)
+{
+    // Compare the cumulative per-algo figures of a mixed chain against
+    // summing block by block
+    const int algos[] = { 0, 1, 1, 0, 1, 0, 0, 1 };
+    const int nBlocks = sizeof(algos) / sizeof(algos[0]);
+    std::vector<CBlockIndex> vIndex(nBlocks);
+    for (int i = 0; i < nBlocks; i++)
+    {
+        vIndex[i].nVersion = CBlockHeader::GetBlockVersion(algos[i]);
+        vIndex[i].nBits = 0x1d00ffff - i;
+        vIndex[i].pprev = i ? &vIndex[i - 1] : NULL;
+        vIndex[i].BuildAlgoChain(vIndex[i].GetBlockWork());
+    }
+
+    for (int i = 0; i < nBlocks; i++)
+    {
+        uint256 nWork = 0;
+        unsigned int nCount = 0;
+        for (int j = 0; j <= i; j++)
+        {
+            if (algos[j] != algos[i])
+                continue;
+            nWork += vIndex[j].GetBlockWork();
+            nCount++;
+        }
+        BOOST_CHECK(vIndex[i].nAlgoChainWork == nWork);
+        BOOST_CHECK_EQUAL(vIndex[i].nAlgoChainBlocks, nCount);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(blockindex_auxpow)
+{
+    // A merged-mined index entry gets its header, auxpow included, from the
+    // auxpow store without any block data on disk
+    LOCK(cs_main);
+    CAuxPow auxpow;
+    auxpow.vParentBlockHeader.nTime = 1234567890;
+    auxpow.vParentBlockHeader.nNonce = 42;
+    auxpow.vChainMerkleBranch.push_back(7);
+    auxpow.nChainIndex = 1;
+
+    uint256 hash = 1000;
+    CBlockIndex index;
+    index.phashBlock = &hash;
+    index.nVersion = CBlockHeader::VERSION_SHA256 | CBlockHeader::VERSION_AUX;
+    CBlockHeader header;
+    BOOST_CHECK(!ReadBlockHeader(&index, header));
+    BOOST_CHECK(header.auxpow.get() == NULL);
+
+    BOOST_CHECK(pblocktree->WriteAuxPow(hash, auxpow));
+    BOOST_CHECK(ReadBlockHeader(&index, header));
+    BOOST_REQUIRE(header.auxpow.get() != NULL);
+    BOOST_CHECK(header.auxpow->vParentBlockHeader.GetHash() == auxpow.vParentBlockHeader.GetHash());
+    BOOST_CHECK(header.auxpow->vChainMerkleBranch == auxpow.vChainMerkleBranch);
+    BOOST_CHECK_EQUAL(header.auxpow->nChainIndex, 1);
+
+    // The header serializes with its auxpow, as sent in a headers message
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << header;
+    CBlockHeader header2;
+    ss >> header2;
+    BOOST_REQUIRE(header2.auxpow.get() != NULL);
+    BOOST_CHECK(header2.auxpow->vParentBlockHeader.GetHash() == auxpow.vParentBlockHeader.GetHash());
+
+    // GetBlockHeader never reads the store, and plain blocks don't need it
+    BOOST_CHECK(index.GetBlockHeader().auxpow.get() == NULL);
+    index.nVersion = CBlockHeader::VERSION_SHA256;
+    BOOST_CHECK(ReadBlockHeader(&index, header));
+    BOOST_CHECK(header.auxpow.get() == NULL);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
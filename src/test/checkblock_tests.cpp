@@ -63,4 +63,91 @@ BOOST_AUTO_TEST_CASE(May15)
     SetMockTime(0);
 }
 
+// Queue a block as the network thread does and wait for the pipeline to hash it
+static void QueueAndWait(CNode* pfrom, const CBlock& block, bool fRequested = true)
+{
+    if (fRequested)
+        RequestBlockPoW(block.GetHash());
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << block;
+    QueueBlockPoW(pfrom, ss);
+    uint64 nDepth, nHits, nMisses;
+    double dHashesPerSec;
+    for (int i = 0; i < 100; i++)
+    {
+        GetPoWPipelineStats(nDepth, dHashesPerSec, nHits, nMisses);
+        if (nDepth == 0)
+            break;
+        MilliSleep(50);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(pow_pipeline)
+{
+    CBlock block;
+    block.nVersion = CBlockHeader::VERSION_SCRYPT;
+    block.hashPrevBlock = GetRandHash();
+    block.nTime = 1400000000;
+    block.nBits = 0x1e0ffff0;
+
+    CBlock blockAux(block);
+    blockAux.nVersion |= CBlockHeader::VERSION_AUX;
+    blockAux.auxpow.reset(new CAuxPow());
+    blockAux.auxpow->vParentBlockHeader.hashPrevBlock = GetRandHash();
+    blockAux.auxpow->vParentBlockHeader.nTime = 1400000000;
+
+    CBlock blockSHA256(block);
+    blockSHA256.nVersion = CBlockHeader::VERSION_SHA256;
+
+    CAddress addr(CService("10.0.0.1", GetDefaultPort()));
+    CNode dummyNode(INVALID_SOCKET, addr, "", true);
+
+    uint64 nDepth, nHits, nMisses, nHits2, nMisses2;
+    double dHashesPerSec;
+    GetPoWPipelineStats(nDepth, dHashesPerSec, nHits, nMisses);
+
+    // Plain and merge-mined scrypt blocks are picked up from the pipeline
+    QueueAndWait(&dummyNode, block);
+    QueueAndWait(&dummyNode, blockAux);
+    BOOST_CHECK(block.GetPipelinedPoWHash() == block.GetPoWHash());
+    BOOST_CHECK(blockAux.GetPipelinedPoWHash() == blockAux.GetPoWHash());
+    GetPoWPipelineStats(nDepth, dHashesPerSec, nHits2, nMisses2);
+    BOOST_CHECK_EQUAL(nHits2, nHits + 2);
+    BOOST_CHECK_EQUAL(nMisses2, nMisses);
+
+    // Other blocks are hashed inline, and kept for the next CheckBlock
+    block.nNonce++;
+    BOOST_CHECK(block.GetPipelinedPoWHash() == block.GetPoWHash());
+    BOOST_CHECK(block.GetPipelinedPoWHash() == block.GetPoWHash());
+    GetPoWPipelineStats(nDepth, dHashesPerSec, nHits, nMisses);
+    BOOST_CHECK_EQUAL(nHits, nHits2 + 1);
+    BOOST_CHECK_EQUAL(nMisses, nMisses2 + 1);
+
+    // SHA256 blocks don't go through it
+    QueueAndWait(&dummyNode, blockSHA256);
+    BOOST_CHECK(blockSHA256.GetPipelinedPoWHash() == blockSHA256.GetHash());
+    GetPoWPipelineStats(nDepth, dHashesPerSec, nHits2, nMisses2);
+    BOOST_CHECK_EQUAL(nHits2, nHits);
+    BOOST_CHECK_EQUAL(nMisses2, nMisses);
+
+    // Nor do blocks we didn't ask for, blocks with a target above the scrypt
+    // limit, or blocks from a peer that has misbehaved
+    CBlock blockUnrequested(block);
+    blockUnrequested.nNonce++;
+    QueueAndWait(&dummyNode, blockUnrequested, false);
+    CBlock blockEasy(block);
+    blockEasy.nBits = 0x2100ffff;
+    QueueAndWait(&dummyNode, blockEasy);
+    CBlock blockMisbehaving(block);
+    blockMisbehaving.nNonce += 2;
+    dummyNode.Misbehaving(1);
+    QueueAndWait(&dummyNode, blockMisbehaving);
+    BOOST_CHECK(blockUnrequested.GetPipelinedPoWHash() == blockUnrequested.GetPoWHash());
+    BOOST_CHECK(blockEasy.GetPipelinedPoWHash() == blockEasy.GetPoWHash());
+    BOOST_CHECK(blockMisbehaving.GetPipelinedPoWHash() == blockMisbehaving.GetPoWHash());
+    GetPoWPipelineStats(nDepth, dHashesPerSec, nHits, nMisses);
+    BOOST_CHECK_EQUAL(nHits, nHits2);
+    BOOST_CHECK_EQUAL(nMisses, nMisses2 + 3);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,229 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "util.h"
+
+// In-memory coin database, writing back what CCoinsViewDB would
+class CCoinsViewTest : public CCoinsView
+{
+public:
+    std::map<uint256, CCoins> mapCoins;
+    unsigned int nWrites;
+
+    CCoinsViewTest() : nWrites(0) {}
+
+    bool GetCoins(const uint256 &txid, CCoins &coins)
+    {
+        std::map<uint256, CCoins>::const_iterator it = mapCoins.find(txid);
+        if (it == mapCoins.end())
+            return false;
+        coins = it->second;
+        return true;
+    }
+
+    bool HaveCoins(const uint256 &txid)
+    {
+        return mapCoins.count(txid) != 0;
+    }
+
+    bool BatchWrite(const CCoinsMap &mapWrite, CBlockIndex *pindex)
+    {
+        for (CCoinsMap::const_iterator it = mapWrite.begin(); it != mapWrite.end(); it++)
+        {
+            if (!(it->second.nFlags & CCoinsCacheEntry::DIRTY))
+                continue;
+            if ((it->second.nFlags & CCoinsCacheEntry::FRESH) && it->second.coins.IsPruned())
+                continue;
+            if (it->second.coins.IsPruned())
+                mapCoins.erase(it->first);
+            else
+                mapCoins[it->first] = it->second.coins;
+            nWrites++;
+        }
+        return true;
+    }
+};
+
+static CCoins RandomCoins(unsigned int nScriptSize)
+{
+    CCoins coins;
+    coins.nHeight = GetRandInt(1000);
+    coins.vout.resize(1 + GetRandInt(3));
+    BOOST_FOREACH(CTxOut &out, coins.vout)
+    {
+        out.nValue = 1 + GetRandInt(1000);
+        out.scriptPubKey = CScript() << std::vector<unsigned char>(nScriptSize, 1);
+    }
+    return coins;
+}
+
+BOOST_AUTO_TEST_SUITE(coins_tests)
+
+BOOST_AUTO_TEST_CASE(coins_cache_simulation)
+{
+    // Random changes through two stacked caches, flushed now and then,
+    // must match the same changes made to a plain map
+    std::map<uint256, CCoins> mapResult;
+    std::vector<uint256> vTxid;
+    for (int i = 0; i < 200; i++)
+        vTxid.push_back(GetRandHash());
+
+    CCoinsViewTest base;
+    CCoinsViewCache *pcache1 = new CCoinsViewCache(base);
+    CCoinsViewCache *pcache2 = new CCoinsViewCache(*pcache1);
+
+    for (int i = 0; i < 20000; i++)
+    {
+        const uint256 &txid = vTxid[GetRandInt(vTxid.size())];
+        int nOp = GetRandInt(10);
+        if (nOp < 4)
+        {
+            // Create, fresh when nothing unspent exists for it yet
+            CCoins coins = RandomCoins(25);
+            bool fFresh = mapResult.count(txid) == 0 || mapResult[txid].IsPruned();
+            pcache2->SetCoins(txid, coins, fFresh && GetRandInt(2));
+            mapResult[txid] = coins;
+        }
+        else if (nOp < 7)
+        {
+            // Spend an output
+            if (!pcache2->HaveCoins(txid))
+            {
+                BOOST_CHECK(mapResult.count(txid) == 0 || mapResult[txid].IsPruned());
+                continue;
+            }
+            CCoins &coins = pcache2->GetCoins(txid);
+            BOOST_CHECK(coins == mapResult[txid]);
+            if (!coins.vout.empty())
+            {
+                coins.Spend(GetRandInt(coins.vout.size()));
+                mapResult[txid] = coins;
+            }
+        }
+        else if (nOp < 9)
+        {
+            // Read
+            CCoins coins;
+            if (pcache2->GetCoins(txid, coins))
+                BOOST_CHECK(coins == mapResult[txid]);
+            else
+                BOOST_CHECK(mapResult.count(txid) == 0 || mapResult[txid].IsPruned());
+        }
+        else if (GetRandInt(2))
+        {
+            BOOST_CHECK(pcache2->Flush());
+        }
+        else
+        {
+            BOOST_CHECK(pcache2->Flush());
+            BOOST_CHECK(pcache1->Flush());
+        }
+    }
+
+    BOOST_CHECK(pcache2->Flush());
+    BOOST_CHECK(pcache1->Flush());
+    for (std::map<uint256, CCoins>::iterator it = mapResult.begin(); it != mapResult.end(); it++)
+    {
+        CCoins coins;
+        if (it->second.IsPruned())
+            BOOST_CHECK(!base.GetCoins(it->first, coins));
+        else
+            BOOST_CHECK(base.GetCoins(it->first, coins) && coins == it->second);
+    }
+    delete pcache2;
+    delete pcache1;
+}
+
+BOOST_AUTO_TEST_CASE(coins_cache_flags)
+{
+    CCoinsViewTest base;
+    uint256 txidOld = GetRandHash(), txidNew = GetRandHash();
+    base.mapCoins[txidOld] = RandomCoins(25);
+
+    // Entries that were only read are not written back
+    CCoinsViewCache cache(base);
+    BOOST_CHECK(cache.HaveCoins(txidOld));
+    BOOST_CHECK(cache.AccessCoins(txidOld) == base.mapCoins[txidOld]);
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK_EQUAL(base.nWrites, 0U);
+
+    // Coins created and spent between flushes never reach the base
+    CCoins coins = RandomCoins(25);
+    coins.vout.resize(1);
+    cache.SetCoins(txidNew, coins, true);
+    BOOST_CHECK(cache.GetCoins(txidNew).Spend(0));
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK_EQUAL(base.nWrites, 0U);
+    BOOST_CHECK(!base.HaveCoins(txidNew));
+
+    // Spending coins the base has erases them there
+    CCoins &coinsOld = cache.GetCoins(txidOld);
+    while (!coinsOld.vout.empty())
+        coinsOld.Spend(coinsOld.vout.size() - 1);
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK_EQUAL(base.nWrites, 1U);
+    BOOST_CHECK(!base.HaveCoins(txidOld));
+}
+
+BOOST_AUTO_TEST_CASE(coins_cache_usage)
+{
+    CCoinsViewTest base;
+    CCoinsViewCache cache(base);
+    size_t nEmpty = cache.DynamicMemoryUsage();
+
+    uint256 txid = GetRandHash();
+    CCoins coins = RandomCoins(1000);
+    cache.SetCoins(txid, coins);
+    size_t nUsage = cache.DynamicMemoryUsage();
+    BOOST_CHECK(nUsage >= nEmpty + coins.vout.size() * 1000);
+
+    // Changes through a modifiable reference are accounted for on the next call
+    cache.GetCoins(txid).vout[0].scriptPubKey = CScript() << std::vector<unsigned char>(100000, 1);
+    BOOST_CHECK(cache.DynamicMemoryUsage() >= nUsage + 99000);
+
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(cache.DynamicMemoryUsage() < nUsage);
+}
+
+BOOST_AUTO_TEST_CASE(coins_prefetch)
+{
+    LOCK(cs_main);
+
+    // Coins in the coin database, but not in pcoinsTip
+    std::vector<uint256> vTxid;
+    std::vector<CCoins> vCoins;
+    for (int i = 0; i < 20; i++)
+    {
+        vTxid.push_back(GetRandHash());
+        vCoins.push_back(RandomCoins(25));
+        pcoinsTip->SetCoins(vTxid[i], vCoins[i]);
+    }
+    BOOST_CHECK(pcoinsTip->Flush());
+
+    CBlock block;
+    block.vtx.resize(1);
+    block.vtx[0].vin.resize(1);
+    block.vtx[0].vin[0].prevout.SetNull();
+    block.vtx[0].vout.resize(1);
+    CTransaction tx;
+    for (unsigned int i = 0; i < vTxid.size(); i++)
+        tx.vin.push_back(CTxIn(COutPoint(vTxid[i], 0)));
+    uint256 txidMissing = GetRandHash();
+    tx.vin.push_back(CTxIn(COutPoint(txidMissing, 0)));
+    tx.vout.resize(1);
+    block.vtx.push_back(tx);
+    CTransaction txChild;
+    txChild.vin.push_back(CTxIn(COutPoint(tx.GetHash(), 0)));
+    block.vtx.push_back(txChild);
+
+    PrefetchBlockCoins(block);
+    for (unsigned int i = 0; i < vTxid.size(); i++)
+    {
+        BOOST_CHECK(pcoinsTip->HaveCoinsInCache(vTxid[i]));
+        BOOST_CHECK(pcoinsTip->AccessCoins(vTxid[i]) == vCoins[i]);
+    }
+    BOOST_CHECK(!pcoinsTip->HaveCoinsInCache(txidMissing));
+    BOOST_CHECK(!pcoinsTip->HaveCoinsInCache(tx.GetHash()));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
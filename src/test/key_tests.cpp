@@ -5,6 +5,7 @@
 
 #include "key.h"
 #include "base58.h"
+#include "secp256k1.h"
 #include "uint256.h"
 #include "util.h"
 
@@ -52,6 +53,58 @@ void dumpKeyInfo(uint256 privkey)
 #endif
 
 
+// Order of the secp256k1 group, big-endian
+static const unsigned char vchOrder[32] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFE,
+    0xBA, 0xAE, 0xDC, 0xE6, 0xAF, 0x48, 0xA0, 0x3B, 0xBF, 0xD2, 0x5E, 0x8C, 0xD0, 0x36, 0x41, 0x41
+};
+
+// Minimal DER integer
+static void AppendDERInteger(vector<unsigned char>& vch, const unsigned char *p32)
+{
+    int nSkip = 0;
+    while (nSkip < 31 && p32[nSkip] == 0)
+        nSkip++;
+    bool fPad = (p32[nSkip] & 0x80) != 0;
+    vch.push_back(0x02);
+    vch.push_back(32 - nSkip + (fPad ? 1 : 0));
+    if (fPad)
+        vch.push_back(0x00);
+    vch.insert(vch.end(), p32 + nSkip, p32 + 32);
+}
+
+// Re-encode a DER signature from CKey::Sign with s replaced by n - s
+static vector<unsigned char> NegateSignatureS(const vector<unsigned char>& vchSig)
+{
+    unsigned char r[32], s[32];
+    memset(r, 0, sizeof(r));
+    memset(s, 0, sizeof(s));
+    unsigned int nLenR = vchSig[3];
+    unsigned int nLenS = vchSig[5 + nLenR];
+    for (unsigned int i = 0; i < nLenR && i < 32; i++)
+        r[31 - i] = vchSig[3 + nLenR - i];
+    for (unsigned int i = 0; i < nLenS && i < 32; i++)
+        s[31 - i] = vchSig[5 + nLenR + nLenS - i];
+
+    int nBorrow = 0;
+    for (int i = 31; i >= 0; i--)
+    {
+        int d = vchOrder[i] - s[i] - nBorrow;
+        nBorrow = d < 0 ? 1 : 0;
+        s[i] = (unsigned char)(d + (nBorrow << 8));
+    }
+
+    vector<unsigned char> vchBody;
+    AppendDERInteger(vchBody, r);
+    AppendDERInteger(vchBody, s);
+    vector<unsigned char> vchRet;
+    vchRet.push_back(0x30);
+    vchRet.push_back(vchBody.size());
+    vchRet.insert(vchRet.end(), vchBody.begin(), vchBody.end());
+    return vchRet;
+}
+
+
 BOOST_AUTO_TEST_SUITE(key_tests)
 
 BOOST_AUTO_TEST_CASE(key_test1)
@@ -140,4 +193,136 @@ BOOST_AUTO_TEST_CASE(key_test1)
     }
 }
 
+BOOST_AUTO_TEST_CASE(key_verify_crosscheck)
+{
+    // CPubKey::Verify must agree with OpenSSL on valid, corrupted and
+    // unusually encoded signatures and keys
+    for (int i = 0; i < 100; i++)
+    {
+        CKey key;
+        key.MakeNewKey(i % 2 == 1);
+        CPubKey pubkey = key.GetPubKey();
+        uint256 hash = GetRandHash();
+        vector<unsigned char> vchSig;
+        BOOST_CHECK(key.Sign(hash, vchSig));
+        BOOST_CHECK(pubkey.Verify(hash, vchSig));
+        BOOST_CHECK(pubkey.VerifyOpenSSL(hash, vchSig));
+
+        // Another hash
+        uint256 hashOther = hash ^ GetRandHash();
+        BOOST_CHECK(!pubkey.Verify(hashOther, vchSig));
+        BOOST_CHECK(!pubkey.VerifyOpenSSL(hashOther, vchSig));
+
+        // A flipped bit anywhere in the signature
+        vector<unsigned char> vchBadSig = vchSig;
+        vchBadSig[GetRandInt(vchBadSig.size())] ^= 1 << GetRandInt(8);
+        BOOST_CHECK_EQUAL(pubkey.Verify(hash, vchBadSig), pubkey.VerifyOpenSSL(hash, vchBadSig));
+
+        // A flipped bit in the key, after its header byte
+        vector<unsigned char> vchPubKey(pubkey.begin(), pubkey.end());
+        vchPubKey[1 + GetRandInt(vchPubKey.size() - 1)] ^= 1 << GetRandInt(8);
+        CPubKey pubkeyBad(vchPubKey);
+        BOOST_CHECK_EQUAL(pubkeyBad.Verify(hash, vchSig), pubkeyBad.VerifyOpenSSL(hash, vchSig));
+
+        // The high-S twin of the signature is valid too
+        vector<unsigned char> vchSigNeg = NegateSignatureS(vchSig);
+        BOOST_CHECK(pubkey.Verify(hash, vchSigNeg));
+        BOOST_CHECK(pubkey.VerifyOpenSSL(hash, vchSigNeg));
+
+        // Padded r, left to OpenSSL
+        vector<unsigned char> vchSigPad = vchSig;
+        vchSigPad.insert(vchSigPad.begin() + 4, 0x00);
+        vchSigPad[1]++;
+        vchSigPad[3]++;
+        BOOST_CHECK_EQUAL(pubkey.Verify(hash, vchSigPad), pubkey.VerifyOpenSSL(hash, vchSigPad));
+
+        // Hybrid key, left to OpenSSL
+        if (!pubkey.IsCompressed())
+        {
+            vector<unsigned char> vchHybrid(pubkey.begin(), pubkey.end());
+            vchHybrid[0] = 0x06 | (vchHybrid[64] & 1);
+            CPubKey pubkeyHybrid(vchHybrid);
+            BOOST_CHECK_EQUAL(pubkeyHybrid.Verify(hash, vchSig), pubkeyHybrid.VerifyOpenSSL(hash, vchSig));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(key_verify_secp256k1_vectors)
+{
+    // Fixed signatures for the rare paths of the secp256k1 code, which random
+    // keys practically never reach
+    static const char* vectors[][3] = {
+        // R.x is above the group order, so the signature's r is R.x - n
+        { "03ca566d0c631779626c65ccb0c5c564a48cc85fe7ce6661fa28634c3be2e76128",
+          "eeffe4f3f1fa8f29f4fceaf7462a90970362d6d1cedc3beabc9c016e6d66ab8c",
+          "30250201020220043a718774c572bd8a25adbeb1bfcd5c0256ae11cecf9f9c3f925d0e52beaf89" },
+        // Q = G and u1 = u2 = 1, so the first point addition adds G to itself
+        { "0279be667ef9dcbbac55a06295ce870b07029bfcdb2dce28d959f2815b16f81798",
+          "c6047f9441ed7d6d3045406e95c07cd85c778e4b8cef3ca7abac09b95c709ee5",
+          "3046022100c6047f9441ed7d6d3045406e95c07cd85c778e4b8cef3ca7abac09b95c709ee5"
+          "022100c6047f9441ed7d6d3045406e95c07cd85c778e4b8cef3ca7abac09b95c709ee5" },
+    };
+    for (unsigned int i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++)
+    {
+        vector<unsigned char> vchPubKey = ParseHex(vectors[i][0]);
+        vector<unsigned char> vchMsg = ParseHex(vectors[i][1]);
+        vector<unsigned char> vchSig = ParseHex(vectors[i][2]);
+        CPubKey pubkey(vchPubKey);
+        uint256 hash(vchMsg);
+        BOOST_CHECK_EQUAL(secp256k1_ecdsa_verify(&vchMsg[0], &vchSig[0], vchSig.size(), &vchPubKey[0], vchPubKey.size()), 1);
+        BOOST_CHECK(pubkey.VerifyOpenSSL(hash, vchSig));
+
+        vchMsg[31] ^= 1;
+        hash = uint256(vchMsg);
+        BOOST_CHECK_EQUAL(secp256k1_ecdsa_verify(&vchMsg[0], &vchSig[0], vchSig.size(), &vchPubKey[0], vchPubKey.size()), 0);
+        BOOST_CHECK(!pubkey.VerifyOpenSSL(hash, vchSig));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(key_verify_bench)
+{
+    // Verifications per second of a signature by a fixed compressed key,
+    // with the secp256k1 code and with OpenSSL. Each is timed over three
+    // rounds and the fastest round is reported, so a busy machine shifts
+    // the figures less
+    const int nCount = 1000;
+    uint256 secret = Hash(strSecret1C.begin(), strSecret1C.end());
+    CKey key;
+    key.Set(secret.begin(), secret.end(), true);
+    BOOST_CHECK(key.IsValid());
+    CPubKey pubkey = key.GetPubKey();
+    uint256 hash = Hash(strSecret2C.begin(), strSecret2C.end());
+    vector<unsigned char> vchSig;
+    BOOST_CHECK(key.Sign(hash, vchSig));
+
+    int64 nTime = 0, nTimeOpenSSL = 0;
+    for (int nRound = 0; nRound < 3; nRound++)
+    {
+        int nValid = 0;
+        int64 nStart = GetTimeMicros();
+        for (int i = 0; i < nCount; i++)
+            nValid += pubkey.Verify(hash, vchSig);
+        int64 nElapsed = GetTimeMicros() - nStart;
+        if (nRound == 0 || nElapsed < nTime)
+            nTime = nElapsed;
+        BOOST_CHECK_EQUAL(nValid, nCount);
+
+        nValid = 0;
+        nStart = GetTimeMicros();
+        for (int i = 0; i < nCount; i++)
+            nValid += pubkey.VerifyOpenSSL(hash, vchSig);
+        nElapsed = GetTimeMicros() - nStart;
+        if (nRound == 0 || nElapsed < nTimeOpenSSL)
+            nTimeOpenSSL = nElapsed;
+        BOOST_CHECK_EQUAL(nValid, nCount);
+    }
+    if (nTime < 1)
+        nTime = 1;
+    if (nTimeOpenSSL < 1)
+        nTimeOpenSSL = 1;
+
+    BOOST_TEST_MESSAGE(strprintf("verifications per second: secp256k1 %"PRI64d", OpenSSL %"PRI64d,
+                                 nCount * 1000000 / nTime, nCount * 1000000 / nTimeOpenSSL));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
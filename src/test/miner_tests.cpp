@@ -204,6 +204,160 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
 }
 #endif
 
+// Synthetic memory pool of nTx transactions, funded by one confirmed
+// transaction with an anyone-can-spend output for each of them. Every
+// fourth transaction spends its predecessor instead, so there are
+// dependencies to resolve as well. Returns the funding transaction's hash.
+static uint256 FillSyntheticMempool(unsigned int nTx)
+{
+    CTransaction txFund;
+    txFund.vin.resize(1);
+    txFund.vin[0].prevout.hash = 1;
+    txFund.vin[0].prevout.n = 0;
+    txFund.vout.resize(nTx);
+    for (unsigned int i = 0; i < nTx; i++)
+    {
+        txFund.vout[i].nValue = 1000000 + i;
+        txFund.vout[i].scriptPubKey = CScript() << OP_TRUE;
+    }
+    uint256 hashFund = txFund.GetHash();
+    {
+        LOCK(cs_main);
+        pcoinsTip->SetCoins(hashFund, CCoins(txFund, pindexBest->nHeight));
+    }
+
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    uint256 hash;
+    for (unsigned int i = 0; i < nTx; i++)
+    {
+        if (i % 4 == 3)
+        {
+            tx.vin[0].prevout = COutPoint(hash, 0);
+            tx.vout[0].nValue -= (i % 7) * 1000;
+        }
+        else
+        {
+            tx.vin[0].prevout = COutPoint(hashFund, i);
+            tx.vout[0].nValue = txFund.vout[i].nValue - (i % 13) * 1000;
+        }
+        hash = tx.GetHash();
+        mempool.addUnchecked(hash, tx);
+    }
+    return hashFund;
+}
+
+static void ClearSyntheticMempool(const uint256& hashFund)
+{
+    mempool.clear();
+    LOCK(cs_main);
+    pcoinsTip->SetCoins(hashFund, CCoins());
+}
+
+// A block built from the synthetic pool stays within -blockmaxsize and has
+// pool transactions after the pool transactions they spend
+static void CheckSyntheticBlock(const CBlock& block, const uint256& hashFund)
+{
+    BOOST_CHECK(block.vtx.size() > 1);
+    BOOST_CHECK(::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION) <= DEFAULT_BLOCK_MAX_SIZE);
+    std::set<uint256> setInBlock;
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+    {
+        const COutPoint& prevout = block.vtx[i].vin[0].prevout;
+        BOOST_CHECK(prevout.hash == hashFund || setInBlock.count(prevout.hash));
+        setInBlock.insert(block.vtx[i].GetHash());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(CreateNewBlock_mempool_index)
+{
+    const unsigned int nTx = 200;
+    uint256 hashFund = FillSyntheticMempool(nTx);
+
+    // The first call fills the per-transaction cache, the second one finds
+    // it filled; both give the same block
+    CScript scriptPubKey = CScript() << OP_TRUE;
+    CBlockTemplate *pblocktemplate = CreateNewBlock(scriptPubKey, CBlockHeader::BLOCK_ALGO_SHA256);
+    CBlockTemplate *pblocktemplate2 = CreateNewBlock(scriptPubKey, CBlockHeader::BLOCK_ALGO_SHA256);
+
+    BOOST_CHECK(pblocktemplate && pblocktemplate2);
+    if (pblocktemplate && pblocktemplate2)
+    {
+        const CBlock& block = pblocktemplate->block;
+        const CBlock& block2 = pblocktemplate2->block;
+        CheckSyntheticBlock(block, hashFund);
+        BOOST_CHECK_EQUAL(block.vtx.size(), block2.vtx.size());
+        for (unsigned int i = 1; i < block.vtx.size() && i < block2.vtx.size(); i++)
+            BOOST_CHECK(block.vtx[i].GetHash() == block2.vtx[i].GetHash());
+        BOOST_CHECK_EQUAL(pblocktemplate->vTxFees[0], pblocktemplate2->vTxFees[0]);
+    }
+
+    // The indexes hold every pool transaction and follow removals
+    {
+        LOCK(mempool.cs);
+        BOOST_CHECK_EQUAL(mempool.mapByFee.size(), nTx);
+        BOOST_CHECK_EQUAL(mempool.mapByPriority.size(), nTx);
+        CTransaction txRemove = mempool.mapTx.begin()->second;
+        mempool.remove(txRemove, true);
+        BOOST_CHECK_EQUAL(mempool.mapByFee.size(), mempool.mapEntry.size());
+        BOOST_CHECK_EQUAL(mempool.mapByPriority.size(), mempool.mapEntry.size());
+    }
+
+    delete pblocktemplate;
+    delete pblocktemplate2;
+    ClearSyntheticMempool(hashFund);
+    BOOST_CHECK(mempool.mapByFee.empty() && mempool.mapByPriority.empty());
+}
+
+BOOST_AUTO_TEST_CASE(CreateNewBlock_mempool_bench)
+{
+    // Timing over a 20000 transaction pool, more than fits in one block.
+    // Without a priority area the block is filled by fee alone.
+    const unsigned int nTx = 20000;
+    uint256 hashFund = FillSyntheticMempool(nTx);
+    mapArgs["-blockprioritysize"] = "0";
+
+    // The first call fills the per-transaction cache, the second one only
+    // walks the fee and priority indexes
+    CScript scriptPubKey = CScript() << OP_TRUE;
+    int64 nStart = GetTimeMicros();
+    CBlockTemplate *pblocktemplate = CreateNewBlock(scriptPubKey, CBlockHeader::BLOCK_ALGO_SHA256);
+    int64 nColdTime = GetTimeMicros() - nStart;
+    nStart = GetTimeMicros();
+    CBlockTemplate *pblocktemplate2 = CreateNewBlock(scriptPubKey, CBlockHeader::BLOCK_ALGO_SHA256);
+    int64 nWarmTime = GetTimeMicros() - nStart;
+    BOOST_CHECK(pblocktemplate && pblocktemplate2);
+    BOOST_TEST_MESSAGE(strprintf("CreateNewBlock with %u mempool transactions: first call %"PRI64d"us, cached %"PRI64d"us",
+                                 nTx, nColdTime, nWarmTime));
+    mapArgs.erase("-blockprioritysize");
+
+    if (pblocktemplate && pblocktemplate2)
+    {
+        const CBlock& block = pblocktemplate->block;
+        CheckSyntheticBlock(block, hashFund);
+        BOOST_CHECK_EQUAL(block.vtx.size(), pblocktemplate2->block.vtx.size());
+        BOOST_CHECK_EQUAL(pblocktemplate->vTxFees[0], pblocktemplate2->vTxFees[0]);
+
+        // The pool transactions are all the same size, so the ones spending
+        // the funding transaction come in order of their fees
+        int64 nLastFee = -1;
+        for (unsigned int i = 1; i < block.vtx.size(); i++)
+        {
+            if (block.vtx[i].vin[0].prevout.hash != hashFund)
+                continue;
+            if (nLastFee >= 0)
+                BOOST_CHECK(pblocktemplate->vTxFees[i] <= nLastFee);
+            nLastFee = pblocktemplate->vTxFees[i];
+        }
+    }
+
+    delete pblocktemplate;
+    delete pblocktemplate2;
+    ClearSyntheticMempool(hashFund);
+}
+
 BOOST_AUTO_TEST_CASE(sha256transform_equality)
 {
     unsigned int pSHA256InitState[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
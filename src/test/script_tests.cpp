@@ -444,4 +444,199 @@ BOOST_AUTO_TEST_CASE(script_combineSigs)
     BOOST_CHECK(combined == partial3c);
 }
 
+static CScript RandomSigHashScript()
+{
+    static const opcodetype ops[] = { OP_FALSE, OP_1, OP_2, OP_3, OP_CHECKSIG, OP_IF, OP_VERIF, OP_RETURN, OP_CODESEPARATOR };
+    CScript script;
+    int nOps = GetRandInt(10);
+    for (int i = 0; i < nOps; i++)
+    {
+        if (GetRandInt(3) == 0)
+            script << std::vector<unsigned char>(GetRandInt(80), (unsigned char)GetRandInt(256));
+        else
+            script << ops[GetRandInt(sizeof(ops) / sizeof(ops[0]))];
+    }
+    return script;
+}
+
+static void RandomSigHashTransaction(CTransaction& tx, int nInputs, int nOutputs)
+{
+    tx.nVersion = GetRandInt(3);
+    tx.nLockTime = GetRandInt(2) ? GetRandInt(1000000) : 0;
+    tx.vin.resize(nInputs);
+    tx.vout.resize(nOutputs);
+    BOOST_FOREACH(CTxIn& txin, tx.vin)
+    {
+        txin.prevout.hash = GetRandHash();
+        txin.prevout.n = GetRandInt(4);
+        txin.scriptSig = RandomSigHashScript();
+        txin.nSequence = GetRandInt(2) ? std::numeric_limits<unsigned int>::max() : GetRandInt(1000);
+    }
+    BOOST_FOREACH(CTxOut& txout, tx.vout)
+    {
+        txout.nValue = GetRandInt(100000000);
+        txout.scriptPubKey = RandomSigHashScript();
+    }
+}
+
+BOOST_AUTO_TEST_CASE(script_sighash_context)
+{
+    // The precomputed hashes must match SignatureHash for every mode,
+    // including the unknown ones and SIGHASH_SINGLE without a matching output
+    static const int hashTypes[] = { SIGHASH_ALL, SIGHASH_NONE, SIGHASH_SINGLE, 0, 4 };
+    for (int i = 0; i < 200; i++)
+    {
+        CTransaction tx;
+        RandomSigHashTransaction(tx, 1 + GetRandInt(12), GetRandInt(12));
+        CSignatureHashContext context(tx);
+        for (unsigned int nIn = 0; nIn < tx.vin.size(); nIn++)
+        {
+            CScript scriptCode = RandomSigHashScript();
+            BOOST_FOREACH(int nHashType, hashTypes)
+            {
+                BOOST_CHECK(context.SignatureHash(scriptCode, nIn, nHashType) == SignatureHash(scriptCode, tx, nIn, nHashType));
+                nHashType |= SIGHASH_ANYONECANPAY;
+                BOOST_CHECK(context.SignatureHash(scriptCode, nIn, nHashType) == SignatureHash(scriptCode, tx, nIn, nHashType));
+            }
+            int nHashType = (int)GetRand(0x100000000ULL);
+            BOOST_CHECK(context.SignatureHash(scriptCode, nIn, nHashType) == SignatureHash(scriptCode, tx, nIn, nHashType));
+        }
+    }
+
+    CTransaction tx;
+    RandomSigHashTransaction(tx, 2, 1);
+    CSignatureHashContext context(tx);
+    BOOST_CHECK(context.SignatureHash(CScript(), 2, SIGHASH_ALL) == 1);
+}
+
+BOOST_AUTO_TEST_CASE(script_sighash_context_verify)
+{
+    CBasicKeyStore keystore;
+    std::vector<CTransaction> vtxFrom(3);
+    CTransaction txTo;
+    txTo.vout.resize(3);
+    for (unsigned int i = 0; i < vtxFrom.size(); i++)
+    {
+        CKey key;
+        key.MakeNewKey(true);
+        keystore.AddKey(key);
+        vtxFrom[i].vout.resize(1);
+        vtxFrom[i].vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
+        txTo.vin.push_back(CTxIn(COutPoint(vtxFrom[i].GetHash(), 0)));
+        txTo.vout[i].nValue = i + 1;
+    }
+    BOOST_CHECK(SignSignature(keystore, vtxFrom[0], txTo, 0, SIGHASH_ALL));
+    BOOST_CHECK(SignSignature(keystore, vtxFrom[1], txTo, 1, SIGHASH_NONE));
+    BOOST_CHECK(SignSignature(keystore, vtxFrom[2], txTo, 2, SIGHASH_SINGLE | SIGHASH_ANYONECANPAY));
+
+    CSignatureHashContext context(txTo);
+    for (unsigned int i = 0; i < vtxFrom.size(); i++)
+        BOOST_CHECK(VerifyScript(txTo.vin[i].scriptSig, vtxFrom[i].vout[0].scriptPubKey, txTo, i, flags, 0, &context));
+
+    // Changing the outputs only breaks the signatures that cover them
+    txTo.vout[0].nValue = 10;
+    CSignatureHashContext context2(txTo);
+    BOOST_CHECK(!VerifyScript(txTo.vin[0].scriptSig, vtxFrom[0].vout[0].scriptPubKey, txTo, 0, flags, 0, &context2));
+    BOOST_CHECK(VerifyScript(txTo.vin[1].scriptSig, vtxFrom[1].vout[0].scriptPubKey, txTo, 1, flags, 0, &context2));
+    BOOST_CHECK(VerifyScript(txTo.vin[2].scriptSig, vtxFrom[2].vout[0].scriptPubKey, txTo, 2, flags, 0, &context2));
+}
+
+BOOST_AUTO_TEST_CASE(script_sighash_context_bench)
+{
+    // Time the signature hashes of every input of a 500-input transaction,
+    // with a copy of the transaction per input and with the precomputed context
+    CTransaction tx;
+    RandomSigHashTransaction(tx, 500, 2);
+    CScript scriptCode;
+    scriptCode << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, 1) << OP_EQUALVERIFY << OP_CHECKSIG;
+    BOOST_FOREACH(CTxIn& txin, tx.vin)
+        txin.scriptSig = CScript() << std::vector<unsigned char>(72, 1) << std::vector<unsigned char>(33, 2);
+
+    std::vector<uint256> vHashCopy, vHashContext;
+    int64 nStart = GetTimeMicros();
+    for (unsigned int i = 0; i < tx.vin.size(); i++)
+        vHashCopy.push_back(SignatureHash(scriptCode, tx, i, SIGHASH_ALL));
+    int64 nCopyTime = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    CSignatureHashContext context(tx);
+    for (unsigned int i = 0; i < tx.vin.size(); i++)
+        vHashContext.push_back(context.SignatureHash(scriptCode, i, SIGHASH_ALL));
+    int64 nContextTime = GetTimeMicros() - nStart;
+
+    BOOST_CHECK(vHashCopy == vHashContext);
+    BOOST_TEST_MESSAGE(strprintf("SIGHASH_ALL for %"PRIszu" inputs: copy %"PRI64d"us, context %"PRI64d"us",
+                                 tx.vin.size(), nCopyTime, nContextTime));
+}
+
+BOOST_AUTO_TEST_CASE(script_sigcache)
+{
+    CBasicKeyStore keystore;
+    CKey key;
+    key.MakeNewKey(true);
+    keystore.AddKey(key);
+    CTransaction txFrom;
+    txFrom.vout.resize(1);
+    txFrom.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
+    CTransaction txTo;
+    txTo.vin.push_back(CTxIn(COutPoint(txFrom.GetHash(), 0)));
+    txTo.vout.resize(1);
+
+    // SignSignature verifies what it signed, so sign with the cache off to
+    // start from an empty one
+    mapArgs["-maxsigcachesize"] = "0";
+    InitSignatureCache();
+    BOOST_CHECK(SignSignature(keystore, txFrom, txTo, 0));
+    mapArgs.erase("-maxsigcachesize");
+    InitSignatureCache();
+    const CScript& scriptSig = txTo.vin[0].scriptSig;
+    const CScript& scriptPubKey = txFrom.vout[0].scriptPubKey;
+
+    CSignatureCacheStats stats1, stats2, stats3;
+    GetSignatureCacheStats(stats1);
+    BOOST_CHECK_EQUAL(stats1.nEntries, 0U);
+    BOOST_CHECK_EQUAL(stats1.nBytes, GetMaxSignatureCacheSize());
+
+    // Not cached when asked not to, cached the first time otherwise, then found
+    BOOST_CHECK(VerifyScript(scriptSig, scriptPubKey, txTo, 0, flags | SCRIPT_VERIFY_NOCACHE, 0));
+    BOOST_CHECK(VerifyScript(scriptSig, scriptPubKey, txTo, 0, flags, 0));
+    GetSignatureCacheStats(stats2);
+    BOOST_CHECK_EQUAL(stats2.nLookups, stats1.nLookups + 2);
+    BOOST_CHECK_EQUAL(stats2.nHits, stats1.nHits);
+    BOOST_CHECK_EQUAL(stats2.nInserts, stats1.nInserts + 1);
+    BOOST_CHECK(VerifyScript(scriptSig, scriptPubKey, txTo, 0, flags, 0));
+    GetSignatureCacheStats(stats3);
+    BOOST_CHECK_EQUAL(stats3.nLookups, stats2.nLookups + 1);
+    BOOST_CHECK_EQUAL(stats3.nHits, stats2.nHits + 1);
+    BOOST_CHECK_EQUAL(stats3.nInserts, stats2.nInserts);
+
+    // A cached signature does not vouch for another transaction
+    txTo.vout[0].nValue = 2;
+    BOOST_CHECK(!VerifyScript(scriptSig, scriptPubKey, txTo, 0, flags, 0));
+    txTo.vout[0].nValue = -1;
+
+    // Resizing empties the cache, and a zero size disables it
+    mapArgs["-maxsigcachesize"] = "0";
+    InitSignatureCache();
+    GetSignatureCacheStats(stats1);
+    BOOST_CHECK_EQUAL(stats1.nCapacity, 0U);
+    BOOST_CHECK(VerifyScript(scriptSig, scriptPubKey, txTo, 0, flags, 0));
+    BOOST_CHECK(VerifyScript(scriptSig, scriptPubKey, txTo, 0, flags, 0));
+    GetSignatureCacheStats(stats2);
+    BOOST_CHECK_EQUAL(stats2.nHits, stats1.nHits);
+    BOOST_CHECK_EQUAL(stats2.nEntries, 0U);
+    mapArgs.erase("-maxsigcachesize");
+    InitSignatureCache();
+    GetSignatureCacheStats(stats3);
+    BOOST_CHECK_EQUAL(stats3.nBytes, (uint64)DEFAULT_MAX_SIGCACHE_SIZE << 20);
+    BOOST_CHECK_EQUAL(stats3.nEntries, 0U);
+
+    // Sizes above the limit in megabytes count entries, as the option used to
+    mapArgs["-maxsigcachesize"] = "1024";
+    BOOST_CHECK_EQUAL(GetMaxSignatureCacheSize(), (uint64)1024 << 20);
+    mapArgs["-maxsigcachesize"] = "50000";
+    BOOST_CHECK_EQUAL(GetMaxSignatureCacheSize(), (uint64)50000 * 32);
+    mapArgs.erase("-maxsigcachesize");
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -19,6 +19,7 @@ BOOST_AUTO_TEST_CASE(scrypt_hashtest)
 #if defined(USE_SSE2)
         // Test SSE2 scrypt
         scrypt_1024_1_1_256_sp_sse2((const char*)&inputbytes[0], BEGIN(scrypthash), scratchpad);
+        BOOST_CHECK_EQUAL(scrypthash.ToString().c_str(), expected[i]);
 #endif
         // Test generic scrypt
         scrypt_1024_1_1_256_sp_generic((const char*)&inputbytes[0], BEGIN(scrypthash), scratchpad);
@@ -26,4 +27,72 @@ BOOST_AUTO_TEST_CASE(scrypt_hashtest)
     }
 }
 
+static void CheckMultiKernel(void (*kernel)(const char *, char *, char *), unsigned int nWays, const std::vector<char>& inputs, const std::vector<uint256>& expected)
+{
+    std::vector<char> scratchpad(SCRYPT_MULTI_SCRATCHPAD_SIZE);
+    std::vector<uint256> hashes(nWays);
+    for (unsigned int i = 0; i + nWays <= expected.size(); i += nWays) {
+        kernel(&inputs[80 * i], BEGIN(hashes[0]), &scratchpad[0]);
+        for (unsigned int j = 0; j < nWays; j++)
+            BOOST_CHECK_EQUAL(hashes[j].ToString(), expected[i + j].ToString());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(scrypt_multi)
+{
+    // Cross-check every multi-hash kernel against the generic implementation
+    const unsigned int nInputs = 12;
+    std::vector<char> inputs(80 * nInputs);
+    std::vector<uint256> expected(nInputs);
+    char scratchpad[SCRYPT_SCRATCHPAD_SIZE];
+    for (unsigned int i = 0; i < inputs.size(); i++)
+        inputs[i] = (char)(i * 131 + 7);
+    for (unsigned int i = 0; i < nInputs; i++)
+        scrypt_1024_1_1_256_sp_generic(&inputs[80 * i], BEGIN(expected[i]), scratchpad);
+
+#if defined(USE_SSE2)
+    CheckMultiKernel(&scrypt_1024_1_1_256_sp_sse2_2way, 2, inputs, expected);
+    CheckMultiKernel(&scrypt_1024_1_1_256_sp_sse2_3way, 3, inputs, expected);
+    CheckMultiKernel(&scrypt_1024_1_1_256_sp_sse2_4way, 4, inputs, expected);
+#endif
+#if defined(USE_AVX2)
+    if (scrypt_have_avx2()) {
+        CheckMultiKernel(&scrypt_1024_1_1_256_sp_avx2_2way, 2, inputs, expected);
+        CheckMultiKernel(&scrypt_1024_1_1_256_sp_avx2_4way, 4, inputs, expected);
+    }
+#endif
+
+    // Batch sizes that are not a multiple of the selected kernel width
+    for (unsigned int n = 1; n <= nInputs; n++) {
+        std::vector<uint256> hashes(n);
+        scrypt_1024_1_1_256_multi(&inputs[0], BEGIN(hashes[0]), n);
+        for (unsigned int i = 0; i < n; i++)
+            BOOST_CHECK_EQUAL(hashes[i].ToString(), expected[i].ToString());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(scrypt_mining)
+{
+    // One template, varying only the nonce, as the miners hash it
+    const unsigned int nInputs = 9;
+    std::vector<unsigned char> header = ParseHex("020000004c1271c211717198227392b029a64a7971931d351b387bb80db027f270411e398a07046f7d4a08dd815412a8712f874a7ebf0507e3878bd24e20a3b73fd750a667d2f451eac7471b00de6659");
+    std::vector<char> inputs(80 * nInputs);
+    std::vector<char> scratchpad(SCRYPT_MULTI_SCRATCHPAD_SIZE);
+    for (unsigned int i = 0; i < nInputs; i++) {
+        memcpy(&inputs[80 * i], &header[0], 80);
+        inputs[80 * i + 76] += i;
+    }
+
+    scrypt_mining_midstate midstate;
+    scrypt_mining_prepare(&midstate, &inputs[0]);
+    std::vector<uint256> hashes(nInputs);
+    scrypt_1024_1_1_256_multi_mining(&midstate, &inputs[0], BEGIN(hashes[0]), nInputs, &scratchpad[0]);
+    BOOST_CHECK_EQUAL(hashes[0].ToString(), "00000000002bef4107f882f6115e0b01f348d21195dacd3582aa2dabd7985806");
+    for (unsigned int i = 0; i < nInputs; i++) {
+        uint256 expected;
+        scrypt_1024_1_1_256_sp_generic(&inputs[80 * i], BEGIN(expected), &scratchpad[0]);
+        BOOST_CHECK_EQUAL(hashes[i].ToString(), expected.ToString());
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
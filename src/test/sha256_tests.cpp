@@ -0,0 +1,64 @@
+#include <boost/test/unit_test.hpp>
+
+#include "util.h"
+#include "scrypt.h"
+#include "sha256.h"
+
+// In main.cpp
+extern void SHA256Transform(void* pstate, void* pinput, const void* pinit);
+
+BOOST_AUTO_TEST_SUITE(sha256_tests)
+
+static const unsigned int pInitState[8] =
+{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+static void CheckScanKernel(sha256d_scan_kernel kernel, unsigned int nWays)
+{
+    uint32_t midstate[8], data[16], hash1[16], hash[8], hash7[SHA256D_SCAN_MAX_WAYS];
+    for (int i = 0; i < 8; i++)
+        midstate[i] = (uint32_t)GetRand(0x100000000ULL);
+    for (int i = 0; i < 16; i++)
+        data[i] = (uint32_t)GetRand(0x100000000ULL);
+
+    // Second hash input as FormatHashBuffers pads it
+    memset(hash1, 0, sizeof(hash1));
+    hash1[8] = 0x80000000;
+    hash1[15] = 256;
+
+    // Cross-check every lane of the first batches, then only batches with
+    // a candidate until one turns up, about one per 0x10000 nonces
+    bool fCandidate = false;
+    for (int nBatch = 0; nBatch < 0x100000 / (int)nWays && !fCandidate; nBatch++)
+    {
+        unsigned int nMask = kernel(midstate, data, hash7);
+        if (nBatch < 256 || nMask != 0)
+        {
+            for (unsigned int i = 0; i < nWays; i++)
+            {
+                uint32_t block[16];
+                memcpy(block, data, sizeof(block));
+                block[3] += i;
+                SHA256Transform(hash1, block, midstate);
+                SHA256Transform(hash, hash1, pInitState);
+                BOOST_CHECK_EQUAL(hash7[i], hash[7]);
+                BOOST_CHECK_EQUAL((nMask >> i) & 1, (hash[7] & 0xffff) == 0 ? 1U : 0U);
+            }
+        }
+        fCandidate = (nMask != 0);
+        data[3] += nWays;
+    }
+    BOOST_CHECK(fCandidate);
+}
+
+BOOST_AUTO_TEST_CASE(sha256d_scan_kernels)
+{
+#if defined(USE_SSE2)
+    CheckScanKernel(&sha256d_scan_4way_sse2, 4);
+#endif
+#if defined(USE_AVX2)
+    if (scrypt_have_avx2())
+        CheckScanKernel(&sha256d_scan_8way_avx2, 8);
+#endif
+}
+
+BOOST_AUTO_TEST_SUITE_END()
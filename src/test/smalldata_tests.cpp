@@ -0,0 +1,321 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "smalldata.h"
+#include "txdb.h"
+
+BOOST_AUTO_TEST_SUITE(smalldata_tests)
+
+static CTransaction SmallDataTx(int type, int64 nValueOut)
+{
+    // The 4 header bytes the wallet writes, then the payload
+    std::vector<unsigned char> vchData(GetSmallDataHeader(type), GetSmallDataHeader(type) + 4);
+    vchData.push_back('a');
+    vchData.push_back('d');
+
+    CTransaction tx;
+    tx.vin.resize(2);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    tx.vin[1].prevout = COutPoint(GetRandHash(), 1);
+    tx.vout.resize(2);
+    tx.vout[0].nValue = 0;
+    tx.vout[0].scriptPubKey = CScript() << OP_RETURN << vchData;
+    tx.vout[1].nValue = nValueOut;
+    tx.vout[1].scriptPubKey = CScript() << OP_TRUE;
+    return tx;
+}
+
+static CTxUndo SpentOutputs(int64 nValue1, int64 nValue2)
+{
+    CTxUndo txundo;
+    txundo.vprevout.push_back(CTxInUndo(CTxOut(nValue1, CScript() << OP_TRUE)));
+    txundo.vprevout.push_back(CTxInUndo(CTxOut(nValue2, CScript() << OP_TRUE)));
+    return txundo;
+}
+
+static void AdBlock(CBlock& block, CBlockUndo& blockundo)
+{
+    block.vtx.resize(1);
+    block.vtx[0].vin.resize(1);
+    block.vtx[0].vin[0].prevout.SetNull();
+    block.vtx[0].vout.resize(1);
+    block.vtx.push_back(SmallDataTx(SMALLDATA_TYPE_BROADCAST, 3 * COIN));
+    block.vtx.push_back(SmallDataTx(SMALLDATA_TYPE_PLAINTEXT, 3 * COIN));
+    block.vtx.push_back(SmallDataTx(SMALLDATA_TYPE_BROADCAST, 5 * COIN));
+
+    // The undo data skips the coinbase
+    blockundo.vtxundo.push_back(SpentOutputs(2 * COIN, 2 * COIN));
+    blockundo.vtxundo.push_back(SpentOutputs(2 * COIN, 2 * COIN));
+    blockundo.vtxundo.push_back(SpentOutputs(COIN, COIN));
+}
+
+BOOST_AUTO_TEST_CASE(smalldata_block_ads)
+{
+    CBlock block;
+    CBlockUndo blockundo;
+    AdBlock(block, blockundo);
+
+    // Only broadcasts are ads, and fees never go below zero
+    std::vector<CAdTx> vAds;
+    GetBlockAds(block, blockundo, 100, vAds);
+    BOOST_REQUIRE_EQUAL(vAds.size(), 2U);
+    BOOST_CHECK(vAds[0].GetHash() == block.vtx[1].GetHash());
+    BOOST_CHECK_EQUAL(vAds[0].nFee, COIN);
+    BOOST_CHECK_EQUAL(vAds[0].nHeight, 100);
+    BOOST_CHECK(vAds[0].hashBlock == block.GetHash());
+    BOOST_CHECK(vAds[1].GetHash() == block.vtx[3].GetHash());
+    BOOST_CHECK_EQUAL(vAds[1].nFee, 0);
+}
+
+BOOST_AUTO_TEST_CASE(smalldata_ad_catchup)
+{
+    bool fAdEnabledOld = fAdEnabled;
+    fAdEnabled = true;
+
+    CBlock block;
+    CBlockUndo blockundo;
+    AdBlock(block, blockundo);
+    std::vector<CAdTx> vAds;
+    GetBlockAds(block, blockundo, 1, vAds);
+
+    uint256 hash = block.GetHash();
+    CBlockIndex index;
+    index.phashBlock = &hash;
+    index.nHeight = 1;
+    index.pprev = pindexBest;
+
+    // Ads of new blocks wait for the catch-up
+    CAdManager ads;
+    std::vector<CAdTx> vList;
+    ads.processBlockAds(vAds, &index);
+    ads.getAdList(vList);
+    BOOST_CHECK(vList.empty());
+
+    // A new ad.dat starts at the best block here, so the catch-up is done at once
+    ads.catchUp();
+    BOOST_CHECK(ads.fSynced);
+    BOOST_CHECK(ads.lastBlockHash == hashBestChain);
+
+    ads.processBlockAds(vAds, &index);
+    ads.getAdList(vList);
+    BOOST_CHECK_EQUAL(vList.size(), 2U);
+    BOOST_CHECK(ads.lastBlockHash == hash);
+    BOOST_CHECK_EQUAL(ads.nLastHeight, 1);
+
+    // Resuming from a block off the main chain goes back to the fork, without the branch's ads
+    mapBlockIndex[hash] = &index;
+    ads.fSynced = false;
+    ads.catchUp();
+    mapBlockIndex.erase(hash);
+    BOOST_CHECK(ads.fSynced);
+    ads.getAdList(vList);
+    BOOST_CHECK(vList.empty());
+    BOOST_CHECK(ads.lastBlockHash == hashBestChain);
+
+    fAdEnabled = fAdEnabledOld;
+}
+
+static CAdTx Ad(int64 nFee, const CBlockIndex& index)
+{
+    CAdTx adTx(SmallDataTx(SMALLDATA_TYPE_BROADCAST, COIN));
+    adTx.nFee = nFee;
+    adTx.nHeight = index.nHeight;
+    adTx.hashBlock = index.GetBlockHash();
+    return adTx;
+}
+
+BOOST_AUTO_TEST_CASE(smalldata_ad_ranking)
+{
+    bool fAdEnabledOld = fAdEnabled;
+    unsigned int nMaxAdsOld = nMaxAds;
+    fAdEnabled = true;
+    nMaxAds = 2;
+
+    uint256 hash1 = GetRandHash(), hash2 = GetRandHash();
+    CBlockIndex index1, index2;
+    index1.phashBlock = &hash1;
+    index1.nHeight = 1000;
+    index1.pprev = pindexBest;
+    index2.phashBlock = &hash2;
+    index2.nHeight = 6000;
+    index2.pprev = &index1;
+
+    CAdManager ads;
+    ads.fSynced = true;
+    std::vector<CAdTx> vAds, vList;
+    vAds.push_back(Ad(4 * COIN, index1));
+    vAds.push_back(Ad(10 * COIN, index1));
+    ads.processBlockAds(vAds, &index1);
+    ads.getAdList(vList);
+    BOOST_REQUIRE_EQUAL(vList.size(), 2U);
+    BOOST_CHECK(vList[0].GetHash() == vAds[1].GetHash());
+    BOOST_CHECK(vList[1].GetHash() == vAds[0].GetHash());
+
+    // Half decayed 5000 blocks later, the 10 coin ad falls behind a new 6 coin ad,
+    // and only the best two are listed
+    std::vector<CAdTx> vAds2;
+    vAds2.push_back(Ad(6 * COIN, index2));
+    ads.processBlockAds(vAds2, &index2);
+    ads.getAdList(vList);
+    BOOST_REQUIRE_EQUAL(vList.size(), 2U);
+    BOOST_CHECK(vList[0].GetHash() == vAds2[0].GetHash());
+    BOOST_CHECK(vList[1].GetHash() == vAds[1].GetHash());
+    BOOST_CHECK_EQUAL(vList[1].GetFeeAt(index2.nHeight), 5 * COIN);
+    ads.getAdList(vList, 1);
+    BOOST_CHECK_EQUAL(vList.size(), 1U);
+
+    // Disconnecting the block drops its ad and ranks at the previous height again
+    ads.disconnectBlockAds(&index2);
+    ads.getAdList(vList);
+    BOOST_REQUIRE_EQUAL(vList.size(), 2U);
+    BOOST_CHECK(vList[0].GetHash() == vAds[1].GetHash());
+    BOOST_CHECK(vList[1].GetHash() == vAds[0].GetHash());
+    BOOST_CHECK(ads.lastBlockHash == hash1);
+
+    nMaxAds = nMaxAdsOld;
+    fAdEnabled = fAdEnabledOld;
+}
+
+BOOST_AUTO_TEST_CASE(smalldata_mempool_events)
+{
+    // The pool parses the message once, on the way in
+    CTxMemPool pool;
+    CTransaction tx = SmallDataTx(SMALLDATA_TYPE_BROADCAST, COIN);
+    uint256 hash = tx.GetHash();
+    pool.addUnchecked(hash, tx);
+    std::string strMessage;
+    bool fBroadcast = false;
+    BOOST_CHECK(pool.getSmallData(hash, strMessage, fBroadcast));
+    BOOST_CHECK_EQUAL(strMessage, "ad");
+    BOOST_CHECK(fBroadcast);
+    pool.remove(tx);
+    BOOST_CHECK(!pool.getSmallData(hash, strMessage, fBroadcast));
+
+    CSmallDataEvents events;
+    std::vector<CSmallDataEvent> vEvents, vRead;
+    BOOST_CHECK_EQUAL(events.Wait(0, 0, 100, vRead), 0U);
+    BOOST_CHECK(vRead.empty());
+
+    vEvents.resize(3);
+    for (unsigned int i = 0; i < vEvents.size(); i++)
+        vEvents[i].txid = GetRandHash();
+    events.Push(vEvents);
+    BOOST_CHECK_EQUAL(events.Wait(0, 0, 2, vRead), 3U);
+    BOOST_REQUIRE_EQUAL(vRead.size(), 2U);
+    BOOST_CHECK_EQUAL(vRead[0].nSequence, 1U);
+    BOOST_CHECK(vRead[1].txid == vEvents[1].txid);
+    vRead.clear();
+    BOOST_CHECK_EQUAL(events.Wait(3, 0, 100, vRead), 4U);
+    BOOST_REQUIRE_EQUAL(vRead.size(), 1U);
+    BOOST_CHECK(vRead[0].txid == vEvents[2].txid);
+    vRead.clear();
+
+    // Nothing new yet: the same sequence comes back after the timeout
+    BOOST_CHECK_EQUAL(events.Wait(4, 10, 100, vRead), 4U);
+    BOOST_CHECK(vRead.empty());
+
+    // Only the latest events are kept
+    vEvents.resize(CSmallDataEvents::MAX_EVENTS);
+    events.Push(vEvents);
+    BOOST_CHECK_EQUAL(events.Wait(1, 0, 1, vRead), 5U);
+    BOOST_REQUIRE_EQUAL(vRead.size(), 1U);
+    BOOST_CHECK_EQUAL(vRead[0].nSequence, 4U);
+    vRead.clear();
+
+    // Subscribers waiting at shutdown are released
+    events.Interrupt();
+    BOOST_CHECK_EQUAL(events.Wait(100000, 60000, 100, vRead), CSmallDataEvents::MAX_EVENTS + 4);
+}
+
+BOOST_AUTO_TEST_CASE(smalldata_short_output)
+{
+    // OP_RETURN with a single opcode, or with a push shorter than the header,
+    // is standard but holds no smalldata
+    CTransaction tx = SmallDataTx(SMALLDATA_TYPE_BROADCAST, COIN);
+    std::string strMessage;
+    bool isBroadcast;
+    txnouttype whichType;
+    tx.vout[0].scriptPubKey = CScript() << OP_RETURN;
+    BOOST_CHECK(!GetTxMessage(tx, strMessage, isBroadcast));
+    tx.vout[0].scriptPubKey = CScript() << OP_RETURN << OP_1;
+    BOOST_CHECK(IsStandard(tx.vout[0].scriptPubKey, whichType));
+    BOOST_CHECK(!GetTxMessage(tx, strMessage, isBroadcast));
+    tx.vout[0].scriptPubKey = CScript() << OP_RETURN << std::vector<unsigned char>(GetSmallDataHeader(SMALLDATA_TYPE_BROADCAST), GetSmallDataHeader(SMALLDATA_TYPE_BROADCAST) + 2);
+    BOOST_CHECK(!GetTxMessage(tx, strMessage, isBroadcast));
+
+    std::vector<std::pair<CSmallDataKey, CSmallDataIndexEntry> > vEntries;
+    GetTxSmallDataEntries(tx, tx.GetHash(), 1, CDiskTxPos(CDiskBlockPos(1, 100), 50), 0, vEntries);
+    BOOST_CHECK(vEntries.empty());
+}
+
+BOOST_AUTO_TEST_CASE(smalldata_index_entries)
+{
+    CTransaction tx = SmallDataTx(SMALLDATA_TYPE_BROADCAST, COIN);
+    CDiskTxPos pos(CDiskBlockPos(1, 100), 50);
+    std::vector<std::pair<CSmallDataKey, CSmallDataIndexEntry> > vEntries;
+    GetTxSmallDataEntries(tx, tx.GetHash(), 7, pos, COIN / 10, vEntries);
+    BOOST_REQUIRE_EQUAL(vEntries.size(), 1U);
+    BOOST_CHECK_EQUAL(vEntries[0].first.nOut, 0U);
+    BOOST_CHECK_EQUAL(vEntries[0].first.nType, SMALLDATA_TYPE_BROADCAST);
+
+    // The payload offset points into the serialized transaction
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << tx;
+    const CSmallDataIndexEntry& entry = vEntries[0].second;
+    std::string strPayload(ss.begin() + entry.nPayloadOffset, ss.begin() + entry.nPayloadOffset + entry.nPayloadSize);
+    std::string strMessage;
+    bool isBroadcast;
+    BOOST_CHECK(GetTxMessage(tx, strMessage, isBroadcast));
+    BOOST_CHECK_EQUAL(strPayload, strMessage);
+}
+
+BOOST_AUTO_TEST_CASE(smalldata_index_scan)
+{
+    // Keys sort by height first, also across byte boundaries
+    CDataStream ss1(SER_DISK, CLIENT_VERSION), ss2(SER_DISK, CLIENT_VERSION);
+    ss1 << std::make_pair('s', CSmallDataKey(255, SMALLDATA_TYPE_BROADCAST, GetRandHash(), 1000));
+    ss2 << std::make_pair('s', CSmallDataKey(256, SMALLDATA_TYPE_PLAINTEXT, GetRandHash(), 0));
+    BOOST_CHECK(ss1.str() < ss2.str());
+
+    std::vector<std::pair<CSmallDataKey, CSmallDataIndexEntry> > vEntries, vRead;
+    for (unsigned int nHeight = 1000; nHeight < 1010; nHeight++)
+    {
+        vEntries.push_back(std::make_pair(CSmallDataKey(nHeight, SMALLDATA_TYPE_PLAINTEXT, GetRandHash(), 0), CSmallDataIndexEntry()));
+        vEntries.push_back(std::make_pair(CSmallDataKey(nHeight, SMALLDATA_TYPE_BROADCAST, GetRandHash(), 1), CSmallDataIndexEntry()));
+    }
+    BOOST_CHECK(pblocktree->UpdateSmallDataIndex(std::vector<unsigned int>(), vEntries));
+
+    BOOST_CHECK(pblocktree->ReadSmallDataIndex(1002, 1004, SMALLDATA_TYPE_NULL, 0, 100, vRead));
+    BOOST_CHECK_EQUAL(vRead.size(), 6U);
+    vRead.clear();
+
+    // Pages of broadcasts
+    BOOST_CHECK(pblocktree->ReadSmallDataIndex(1000, 1009, SMALLDATA_TYPE_BROADCAST, 3, 4, vRead));
+    BOOST_REQUIRE_EQUAL(vRead.size(), 4U);
+    for (unsigned int i = 0; i < vRead.size(); i++)
+    {
+        BOOST_CHECK_EQUAL(vRead[i].first.nHeight, 1003 + i);
+        BOOST_CHECK_EQUAL(vRead[i].first.nType, SMALLDATA_TYPE_BROADCAST);
+    }
+    vRead.clear();
+
+    BOOST_CHECK(pblocktree->UpdateSmallDataIndex(std::vector<unsigned int>(1, 1005), std::vector<std::pair<CSmallDataKey, CSmallDataIndexEntry> >()));
+    BOOST_CHECK(pblocktree->ReadSmallDataIndex(1004, 1006, SMALLDATA_TYPE_NULL, 0, 100, vRead));
+    BOOST_CHECK_EQUAL(vRead.size(), 4U);
+    for (unsigned int i = 0; i < vRead.size(); i++)
+        BOOST_CHECK(vRead[i].first.nHeight != 1005);
+    vRead.clear();
+
+    // A reorg erases the old branch's entries and writes the new ones together;
+    // an entry of both branches stays
+    std::vector<std::pair<CSmallDataKey, CSmallDataIndexEntry> > vWrite;
+    vWrite.push_back(vEntries[12]);
+    vWrite.push_back(std::make_pair(CSmallDataKey(1006, SMALLDATA_TYPE_PLAINTEXT, GetRandHash(), 0), CSmallDataIndexEntry()));
+    BOOST_CHECK(pblocktree->UpdateSmallDataIndex(std::vector<unsigned int>(1, 1006), vWrite));
+    BOOST_CHECK(pblocktree->ReadSmallDataIndex(1006, 1006, SMALLDATA_TYPE_NULL, 0, 100, vRead));
+    BOOST_REQUIRE_EQUAL(vRead.size(), 2U);
+    BOOST_CHECK(vRead[0].first.txid == vEntries[12].first.txid || vRead[1].first.txid == vEntries[12].first.txid);
+    BOOST_CHECK(vRead[0].first.txid != vEntries[13].first.txid && vRead[1].first.txid != vEntries[13].first.txid);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
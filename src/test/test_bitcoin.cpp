@@ -37,6 +37,11 @@ struct TestingSetup {
         nScriptCheckThreads = 3;
         for (int i=0; i < nScriptCheckThreads-1; i++)
             threadGroup.create_thread(&ThreadScriptCheck);
+        nPoWThreads = 1;
+        threadGroup.create_thread(&ThreadPoWPipeline);
+        nPrefetchThreads = 2;
+        for (int i=0; i < nPrefetchThreads; i++)
+            threadGroup.create_thread(&ThreadCoinsPrefetch);
     }
     ~TestingSetup()
     {
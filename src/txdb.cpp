@@ -6,6 +6,7 @@
 #include "txdb.h"
 #include "main.h"
 #include "hash.h"
+#include "smalldata.h"
 
 using namespace std;
 
@@ -53,15 +54,22 @@ bool CCoinsViewDB::SetBestBlock(CBlockIndex *pindex) {
     return db.WriteBatch(batch);
 }
 
-bool CCoinsViewDB::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) {
-    printf("Committing %u changed transactions to coin database...\n", (unsigned int)mapCoins.size());
-
+bool CCoinsViewDB::BatchWrite(const CCoinsMap &mapCoins, CBlockIndex *pindex) {
     CLevelDBBatch batch;
-    for (std::map<uint256, CCoins>::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++)
-        BatchWriteCoins(batch, it->first, it->second);
+    unsigned int nChanged = 0;
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+        // Unchanged entries, and coins created and spent since the last flush, are left alone
+        if (!(it->second.nFlags & CCoinsCacheEntry::DIRTY))
+            continue;
+        if ((it->second.nFlags & CCoinsCacheEntry::FRESH) && it->second.coins.IsPruned())
+            continue;
+        BatchWriteCoins(batch, it->first, it->second.coins);
+        nChanged++;
+    }
     if (pindex)
         BatchWriteHashBestChain(batch, pindex->GetBlockHash());
 
+    printf("Committing %u changed transactions (out of %u cached) to coin database...\n", nChanged, (unsigned int)mapCoins.size());
     return db.WriteBatch(batch);
 }
 
@@ -73,6 +81,16 @@ bool CBlockTreeDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
     return Write(make_pair('b', blockindex.GetBlockHash()), blockindex);
 }
 
+bool CBlockTreeDB::ReadAuxPow(const uint256 &hash, CAuxPow &auxpow)
+{
+    return Read(make_pair('a', hash), auxpow);
+}
+
+bool CBlockTreeDB::WriteAuxPow(const uint256 &hash, const CAuxPow &auxpow)
+{
+    return Write(make_pair('a', hash), auxpow);
+}
+
 bool CBlockTreeDB::ReadBestInvalidWork(CBigNum& bnBestInvalidWork)
 {
     return Read('I', bnBestInvalidWork);
@@ -173,6 +191,71 @@ bool CBlockTreeDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos>
     return WriteBatch(batch);
 }
 
+bool CBlockTreeDB::UpdateSmallDataIndex(const std::vector<unsigned int> &vEraseHeights, const std::vector<std::pair<CSmallDataKey, CSmallDataIndexEntry> > &vect) {
+    CLevelDBBatch batch;
+    for (std::vector<unsigned int>::const_iterator ith=vEraseHeights.begin(); ith!=vEraseHeights.end(); ith++) {
+        std::vector<std::pair<CSmallDataKey, CSmallDataIndexEntry> > vErase;
+        if (!ReadSmallDataIndex(*ith, *ith, SMALLDATA_TYPE_NULL, 0, std::numeric_limits<unsigned int>::max(), vErase))
+            return false;
+        for (std::vector<std::pair<CSmallDataKey, CSmallDataIndexEntry> >::const_iterator it=vErase.begin(); it!=vErase.end(); it++)
+            batch.Erase(make_pair('s', it->first));
+    }
+    // Writes come after the erases, so an entry written again at the same key stays
+    for (std::vector<std::pair<CSmallDataKey, CSmallDataIndexEntry> >::const_iterator it=vect.begin(); it!=vect.end(); it++)
+        batch.Write(make_pair('s', it->first), it->second);
+    return WriteBatch(batch);
+}
+
+bool CBlockTreeDB::ReadSmallDataIndex(unsigned int nFromHeight, unsigned int nToHeight, int nType, unsigned int nSkip, unsigned int nCount,
+                                      std::vector<std::pair<CSmallDataKey, CSmallDataIndexEntry> > &vect, bool fInterruptible) {
+    leveldb::Iterator *pcursor = NewIterator();
+
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair('s', CSmallDataKey(nFromHeight, SMALLDATA_TYPE_NULL, uint256(0), 0));
+    pcursor->Seek(ssKeySet.str());
+
+    while (pcursor->Valid() && vect.size() < nCount) {
+        if (fInterruptible) {
+            try {
+                boost::this_thread::interruption_point();
+            } catch (boost::thread_interrupted) {
+                delete pcursor;
+                throw;
+            }
+        }
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            ssKey >> chType;
+            if (chType != 's')
+                break;
+            CSmallDataKey key;
+            ssKey >> key;
+            if (key.nHeight > nToHeight)
+                break;
+            if (nType == SMALLDATA_TYPE_NULL || key.nType == nType) {
+                if (nSkip > 0)
+                    nSkip--;
+                else {
+                    leveldb::Slice slValue = pcursor->value();
+                    CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+                    CSmallDataIndexEntry entry;
+                    ssValue >> entry;
+                    vect.push_back(make_pair(key, entry));
+                }
+            }
+            pcursor->Next();
+        } catch (std::exception &e) {
+            delete pcursor;
+            return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+        }
+    }
+    delete pcursor;
+
+    return true;
+}
+
 bool CBlockTreeDB::WriteFlag(const std::string &name, bool fValue) {
     return Write(std::make_pair('F', name), fValue ? '1' : '0');
 }
@@ -8,6 +8,9 @@
 #include "main.h"
 #include "leveldb.h"
 
+class CSmallDataKey;
+class CSmallDataIndexEntry;
+
 /** CCoinsView backed by the LevelDB coin database (chainstate/) */
 class CCoinsViewDB : public CCoinsView
 {
@@ -21,7 +24,7 @@ public:
     bool HaveCoins(const uint256 &txid);
     CBlockIndex *GetBestBlock();
     bool SetBestBlock(CBlockIndex *pindex);
-    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    bool BatchWrite(const CCoinsMap &mapCoins, CBlockIndex *pindex);
     bool GetStats(CCoinsStats &stats);
 };
 
@@ -35,6 +38,8 @@ private:
     void operator=(const CBlockTreeDB&);
 public:
     bool WriteBlockIndex(const CDiskBlockIndex& blockindex);
+    bool ReadAuxPow(const uint256 &hash, CAuxPow &auxpow);
+    bool WriteAuxPow(const uint256 &hash, const CAuxPow &auxpow);
     bool ReadBestInvalidWork(CBigNum& bnBestInvalidWork);
     bool WriteBestInvalidWork(const CBigNum& bnBestInvalidWork);
     bool ReadBlockFileInfo(int nFile, CBlockFileInfo &fileinfo);
@@ -45,6 +50,13 @@ public:
     bool ReadReindexing(bool &fReindex);
     bool ReadTxIndex(const uint256 &txid, CDiskTxPos &pos);
     bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &list);
+    // Erase the entries at the given heights and write the new ones, in one batch
+    bool UpdateSmallDataIndex(const std::vector<unsigned int> &vEraseHeights, const std::vector<std::pair<CSmallDataKey, CSmallDataIndexEntry> > &list);
+    // Entries from nFromHeight to nToHeight in chain order, of type nType (SMALLDATA_TYPE_NULL for all),
+    // skipping the first nSkip matches and returning at most nCount. Only readers outside block
+    // connection (RPC) may pass fInterruptible, UpdateSmallDataIndex must always finish its batch
+    bool ReadSmallDataIndex(unsigned int nFromHeight, unsigned int nToHeight, int nType, unsigned int nSkip, unsigned int nCount,
+                            std::vector<std::pair<CSmallDataKey, CSmallDataIndexEntry> > &list, bool fInterruptible = false);
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
     bool LoadBlockIndexGuts();